@@ -1,8 +1,14 @@
 """Defines the VNS protocol and some associated helper functions."""
 
+import ctypes
+import errno
+import os
+import platform
 import re
+import socket
 from socket import inet_aton, inet_ntoa
 import struct
+import threading
 
 from ltprotocol.ltprotocol import LTMessage, LTProtocol, LTTwistedServer
 
@@ -20,12 +26,13 @@ class VNSOpen(LTMessage):
     def get_type():
         return 1
 
-    def __init__(self, topo_id, virtualHostID, UID, pw):
+    def __init__(self, topo_id, virtualHostID, UID, pw, flags=0):
         LTMessage.__init__(self)
         self.topo_id = int(topo_id)
         self.vhost = str(virtualHostID)
         self.user = str(UID)
         self.pw = str(pw)
+        self.flags = int(flags) # VNS_OPEN_*, 0 from old clients
 
     def length(self):
         return VNSOpen.SIZE
@@ -34,15 +41,15 @@ class VNSOpen(LTMessage):
     SIZE = struct.calcsize(FORMAT)
 
     def pack(self):
-        return struct.pack(VNSOpen.FORMAT, self.topo_id, 0, self.vhost, self.user, self.pw)
+        return struct.pack(VNSOpen.FORMAT, self.topo_id, self.flags, self.vhost, self.user, self.pw)
 
     @staticmethod
     def unpack(body):
-        t = struct.unpack(VNSOpen.FORMAT, body) # t[1] is pad => ignored
+        t = struct.unpack(VNSOpen.FORMAT, body) # t[1] is flags, was pad
         vhost = strip_null_chars(t[2])
         user = strip_null_chars(t[3])
         pw = strip_null_chars(t[4])
-        return VNSOpen(t[0], vhost, user, pw)
+        return VNSOpen(t[0], vhost, user, pw, t[1])
 
     def __str__(self):
         return 'OPEN: topo_id=%u host=%s user=%s' % (self.topo_id, self.vhost, self.user)
@@ -116,6 +123,135 @@ class VNSPacket(LTMessage):
         return 'PACKET: %uB on %s' % (len(self.ethernet_frame), self.intf_name)
 VNS_MESSAGES.append(VNSPacket)
 
+VNS_OPEN_PACKETS = 0x0001    # VNSOpen.flags: the client takes VNSPackets
+VNS_FRAME_TIMESTAMP = 0x01   # a frame's flags: a timestamp follows its header
+VNS_PACKETS_MAX = 10000      # longest VNSPackets message, header included
+
+class VNSPackets(LTMessage):
+    """Several frames in one message.  Each is (intf_index, frame, timestamp)
+    where intf_index is the interface's place in VNSHardwareInfo and
+    timestamp is ns since the epoch, or None.  Only sent to clients which
+    asked with VNS_OPEN_PACKETS, after telling them with a VNSPackets (an
+    empty one will do) ahead of VNSHardwareInfo."""
+    @staticmethod
+    def get_type():
+        return 1024
+
+    def __init__(self, frames):
+        LTMessage.__init__(self)
+        self.frames = list(frames)
+
+    def length(self):
+        return len(self.pack())
+
+    FRAME_FORMAT = '> HBB'
+    FRAME_SIZE = struct.calcsize(FRAME_FORMAT)
+
+    @staticmethod
+    def record_size(frame, timestamp=None):
+        """Bytes a frame takes in the message, padding included."""
+        n = VNSPackets.FRAME_SIZE + len(frame) + (8 if timestamp is not None else 0)
+        return (n + 3) & ~3
+
+    def pack(self):
+        out = []
+        for intf_index, frame, timestamp in self.frames:
+            if timestamp is None:
+                record = struct.pack(VNSPackets.FRAME_FORMAT, len(frame), intf_index, 0)
+            else:
+                record = struct.pack(VNSPackets.FRAME_FORMAT + 'Q', len(frame), intf_index,
+                                     VNS_FRAME_TIMESTAMP, timestamp)
+            record += str(frame)
+            out.append(record + '\0' * (VNSPackets.record_size(frame, timestamp) - len(record)))
+        return ''.join(out)
+
+    @staticmethod
+    def unpack(body):
+        frames = []
+        off = 0
+        while off + VNSPackets.FRAME_SIZE <= len(body):
+            flen, intf_index, flags = struct.unpack(VNSPackets.FRAME_FORMAT, body[off:off + VNSPackets.FRAME_SIZE])
+            start = off + VNSPackets.FRAME_SIZE
+            timestamp = None
+            if flags & VNS_FRAME_TIMESTAMP:
+                timestamp = struct.unpack('> Q', body[start:start + 8])[0]
+                start += 8
+            if start + flen > len(body):
+                raise VNSProtocolException('frame runs past the end of its batch')
+            frames.append((intf_index, body[start:start + flen], timestamp))
+            off += VNSPackets.record_size(frames[-1][1], timestamp)
+        return VNSPackets(frames)
+
+    def __str__(self):
+        return 'PACKETS: %u frames, %uB' % (len(self.frames), sum(len(f[1]) for f in self.frames))
+VNS_MESSAGES.append(VNSPackets)
+
+VNS_OPEN_CREDIT = 0x0002     # VNSOpen.flags: the client grants receive credit
+
+class VNSCredit(LTMessage):
+    """How much a client which asked with VNS_OPEN_CREDIT may be sent.
+    limit is a byte count, mod 2**32, of whole messages from the server's
+    own VNSCredit on (that one included); the server sends one (limit
+    unused) ahead of VNSHardwareInfo to say it will keep to them."""
+    @staticmethod
+    def get_type():
+        return 2048
+
+    def __init__(self, limit):
+        LTMessage.__init__(self)
+        self.limit = int(limit)
+
+    def length(self):
+        return VNSCredit.SIZE
+
+    FORMAT = '> I'
+    SIZE = struct.calcsize(FORMAT)
+
+    def pack(self):
+        return struct.pack(VNSCredit.FORMAT, self.limit & 0xffffffff)
+
+    @staticmethod
+    def unpack(body):
+        return VNSCredit(struct.unpack(VNSCredit.FORMAT, body[:VNSCredit.SIZE])[0])
+
+    def __str__(self):
+        return 'CREDIT: up to %u' % self.limit
+VNS_MESSAGES.append(VNSCredit)
+
+VNS_OPEN_SHM = 0x0004        # VNSOpen.flags: the client can map a file of rings
+VNS_FRAME_WRAP = 0x80        # a record's flags in a ring: go on at its start
+
+class VNSShm(LTMessage):
+    """Tells a client which asked with VNS_OPEN_SHM that frames go through
+    the rings in the file at path (see VNSShmSegment) from now on.  Sent
+    ahead of VNSHardwareInfo."""
+    @staticmethod
+    def get_type():
+        return 4096
+
+    def __init__(self, path, size):
+        LTMessage.__init__(self)
+        self.path = str(path)
+        self.size = int(size)
+
+    def length(self):
+        return VNSShm.SIZE
+
+    FORMAT = '> I 108s'
+    SIZE = struct.calcsize(FORMAT)
+
+    def pack(self):
+        return struct.pack(VNSShm.FORMAT, self.size, self.path)
+
+    @staticmethod
+    def unpack(body):
+        t = struct.unpack(VNSShm.FORMAT, body[:VNSShm.SIZE])
+        return VNSShm(strip_null_chars(t[1]), t[0])
+
+    def __str__(self):
+        return 'SHM: %s, %uB rings' % (self.path, self.size)
+VNS_MESSAGES.append(VNSShm)
+
 class VNSProtocolException(Exception):
     def __init__(self, msg):
         self.msg = msg
@@ -124,11 +260,12 @@ class VNSProtocolException(Exception):
         return self.msg
 
 class VNSInterface:
-    def __init__(self, name, mac, ip, mask):
+    def __init__(self, name, mac, ip, mask, speed=0):
         self.name = str(name)
         self.mac = str(mac)
         self.ip = str(ip)
         self.mask = str(mask)
+        self.speed = int(speed)  # link speed in Mb/s, 0 if unknown
 
         if len(mac) != 6:
             raise VNSProtocolException('MAC address must be 6B')
@@ -152,7 +289,7 @@ class VNSInterface:
     def pack(self):
         return struct.pack(VNSInterface.FORMAT,
                            VNSInterface.HWINTERFACE, self.name,
-                           VNSInterface.HWSPEED, 0, '',
+                           VNSInterface.HWSPEED, self.speed, '',
                            VNSInterface.HWETHER, self.mac,
                            VNSInterface.HWETHIP, self.ip, '',
                            VNSInterface.HWSUBNET, 0, '',
@@ -398,3 +535,256 @@ def create_vns_server(port, recv_callback, new_conn_callback, lost_conn_callback
     server = LTTwistedServer(VNS_PROTOCOL, recv_callback, new_conn_callback, lost_conn_callback, verbose)
     server.listen(port)
     return server
+
+class VNSUnixTransport(object):
+    """The parts of a Twisted transport the VNS handlers use."""
+    class Peer(object):
+        def __init__(self, path):
+            self.host = path
+
+    def __init__(self, conn):
+        self.conn = conn
+
+    def getPeer(self):
+        return VNSUnixTransport.Peer(self.conn.server.path)
+
+    def loseConnection(self):
+        self.conn.close()
+
+class VNSUnixConnection(object):
+    """One sr client on an AF_UNIX SOCK_SEQPACKET socket.  Each record is one
+    whole message, length and type included, so there is nothing to
+    reassemble."""
+    def __init__(self, server, sock):
+        self.server = server
+        self.sock = sock
+        self.transport = VNSUnixTransport(self)
+        self.lock = threading.Lock()
+        self.closed = False
+
+    def send(self, msg):
+        if not isinstance(msg, LTMessage):
+            return # not a VNS message, e.g. the goodbye string
+        body = msg.pack()
+        record = struct.pack('>II', len(body) + 8, msg.get_type()) + body
+        if self.server.verbose:
+            print 'sending %s' % msg
+        with self.lock:
+            if not self.closed:
+                try:
+                    self.sock.send(record)
+                except socket.error:
+                    self.close()
+
+    def close(self):
+        with self.lock:
+            if self.closed:
+                return
+            self.closed = True
+        try:
+            self.sock.shutdown(socket.SHUT_RDWR)
+        except socket.error:
+            pass
+
+    def run(self):
+        """Reads records until the client goes away."""
+        self.server.new_conn_callback(self)
+        while True:
+            try:
+                record = self.sock.recv(VNS_UNIX_MAX_RECORD)
+            except socket.error, e:
+                if e.errno == errno.EINTR:
+                    continue
+                break
+            if len(record) < 8:
+                break
+            length, msg_type = struct.unpack('>II', record[:8])
+            msg = None
+            cls = VNS_MESSAGE_TYPES.get(msg_type)
+            if cls is not None and length == len(record):
+                try:
+                    msg = cls.unpack(record[8:])
+                except (struct.error, VNSProtocolException):
+                    pass
+            self.server.recv_callback(self, msg)
+        self.close()
+        self.sock.close()
+        self.server.lost_conn_callback(self)
+
+VNS_UNIX_MAX_RECORD = 65536
+VNS_MESSAGE_TYPES = dict((cls.get_type(), cls) for cls in VNS_MESSAGES)
+
+class VNSUnixServer(object):
+    """Listens for VNS clients on an AF_UNIX SOCK_SEQPACKET socket, serving
+    each from a thread of its own with the same callbacks as
+    create_vns_server."""
+    def __init__(self, path, recv_callback, new_conn_callback, lost_conn_callback, verbose=True):
+        self.path = path
+        self.recv_callback = recv_callback
+        self.new_conn_callback = new_conn_callback
+        self.lost_conn_callback = lost_conn_callback
+        self.verbose = verbose
+        if os.path.exists(path):
+            os.unlink(path) # left behind by an earlier run
+        self.sock = socket.socket(socket.AF_UNIX, socket.SOCK_SEQPACKET)
+        self.sock.bind(path)
+        self.sock.listen(5)
+        self.thread = threading.Thread(target=self.accept_loop)
+        self.thread.daemon = True
+        self.thread.start()
+
+    def accept_loop(self):
+        while True:
+            try:
+                sock, _ = self.sock.accept()
+            except socket.error, e:
+                if e.errno == errno.EINTR:
+                    continue
+                return
+            conn = VNSUnixConnection(self, sock)
+            t = threading.Thread(target=conn.run)
+            t.daemon = True
+            t.start()
+
+def create_vns_unix_server(path, recv_callback, new_conn_callback, lost_conn_callback, verbose=True):
+    """Starts a server which listens for VNS clients on a local AF_UNIX
+    SOCK_SEQPACKET socket, for an sr started with "-s <path>".
+
+    @param path  the socket's file name; an old one there is removed
+
+    The callbacks are as for create_vns_server, but are called from the
+    server's own threads rather than the Twisted reactor.
+
+    @return returns the new VNSUnixServer
+    """
+    return VNSUnixServer(path, recv_callback, new_conn_callback, lost_conn_callback, verbose)
+
+_libc = ctypes.CDLL(None, use_errno=True)
+_libc.mmap.restype = ctypes.c_void_p
+_libc.mmap.argtypes = [ctypes.c_void_p, ctypes.c_size_t, ctypes.c_int, ctypes.c_int, ctypes.c_int, ctypes.c_long]
+_libc.munmap.argtypes = [ctypes.c_void_p, ctypes.c_size_t]
+_libc.syscall.restype = ctypes.c_long
+_SYS_FUTEX = {'x86_64': 202, 'aarch64': 98, 'i386': 240, 'i686': 240, 'armv7l': 240}.get(platform.machine())
+_FUTEX_WAIT = 0
+_FUTEX_WAKE = 1
+_PROT_READ_WRITE = 3
+_MAP_SHARED = 1
+
+class _Timespec(ctypes.Structure):
+    _fields_ = [('tv_sec', ctypes.c_long), ('tv_nsec', ctypes.c_long)]
+
+def _futex(addr, op, val, timeout=None):
+    ts = None
+    if timeout is not None:
+        ts = ctypes.byref(_Timespec(int(timeout), int((timeout % 1) * 1e9)))
+    _libc.syscall(ctypes.c_long(_SYS_FUTEX), ctypes.c_void_p(addr), ctypes.c_int(op),
+                  ctypes.c_uint(val), ts, ctypes.c_void_p(0), ctypes.c_uint(0))
+
+class VNSShmRing(object):
+    """One direction of a VNSShmSegment: a single-producer single-consumer
+    ring of (c_frame_header, frame) records, as laid out in vnscommand.h.
+    One side only ever calls write() and wake(), the other read() and
+    wait()."""
+    HEADER_SIZE = 192   # sizeof(c_shm_ring)
+
+    def __init__(self, addr, size):
+        self.addr = addr
+        self.data = addr + VNSShmRing.HEADER_SIZE
+        self.size = size
+        self.head = ctypes.c_uint32.from_address(addr)
+        self.tail = ctypes.c_uint32.from_address(addr + 64)
+        self.wake_word = ctypes.c_uint32.from_address(addr + 128)
+        self.sleeping = ctypes.c_uint32.from_address(addr + 132)
+
+    def write(self, intf_index, frame, wake=True):
+        """Queue a frame and, unless told not to, wake the consumer if it
+        sleeps; returns False, writing nothing, if the ring is full.  A
+        writer with more frames coming may leave the wake() to the last."""
+        total = VNSPackets.record_size(frame)
+        head = self.head.value
+        off = head & (self.size - 1)
+        skip = self.size - off if self.size - off < total else 0
+        if ((head - self.tail.value) & 0xffffffff) + skip + total > self.size:
+            return False
+        if skip:
+            ctypes.memmove(self.data + off, struct.pack(VNSPackets.FRAME_FORMAT, 0, 0, VNS_FRAME_WRAP), VNSPackets.FRAME_SIZE)
+            head += skip
+            off = 0
+        record = struct.pack(VNSPackets.FRAME_FORMAT, len(frame), intf_index, 0) + str(frame)
+        ctypes.memmove(self.data + off, record + '\0' * (total - len(record)), total)
+        self.head.value = (head + total) & 0xffffffff
+        if wake:
+            self.wake()
+        return True
+
+    def wake(self):
+        """Wake the consumer if it may be asleep."""
+        if self.sleeping.value:
+            self.wake_word.value = (self.wake_word.value + 1) & 0xffffffff
+            _futex(self.addr + 128, _FUTEX_WAKE, 1)
+
+    def read(self, limit=64):
+        """Take up to limit frames, as (intf_index, frame, timestamp)."""
+        frames = []
+        tail = self.tail.value
+        while len(frames) < limit and self.head.value != tail:
+            off = tail & (self.size - 1)
+            flen, intf_index, flags = struct.unpack(VNSPackets.FRAME_FORMAT, ctypes.string_at(self.data + off, VNSPackets.FRAME_SIZE))
+            if flags & VNS_FRAME_WRAP:
+                tail = (tail + self.size - off) & 0xffffffff
+            else:
+                start = self.data + off + VNSPackets.FRAME_SIZE
+                timestamp = None
+                if flags & VNS_FRAME_TIMESTAMP:
+                    timestamp = struct.unpack('> Q', ctypes.string_at(start, 8))[0]
+                    start += 8
+                if start + flen > self.data + self.size:
+                    raise VNSProtocolException('frame runs past the end of the ring')
+                frames.append((intf_index, ctypes.string_at(start, flen), timestamp))
+                tail = (tail + VNSPackets.record_size(frames[-1][1], timestamp)) & 0xffffffff
+            self.tail.value = tail
+        return frames
+
+    def wait(self, timeout):
+        """Sleep until woken, or for timeout seconds, if the ring is empty.
+        Python cannot order the store to sleeping before the load of head,
+        so a wakeup may be missed; keep timeout short."""
+        wake = self.wake_word.value
+        self.sleeping.value = 1
+        if self.head.value == self.tail.value:
+            _futex(self.addr + 128, _FUTEX_WAIT, wake, timeout)
+        self.sleeping.value = 0
+
+class VNSShmSegment(object):
+    """A file under /dev/shm holding two VNSShmRings of size bytes each:
+    rings[0] to the client and rings[1] from it.  The client removes the
+    file once it has mapped it; close() removes it in case it did not."""
+    def __init__(self, path, size=1 << 20):
+        if _SYS_FUTEX is None:
+            raise VNSProtocolException('no futex syscall number for %s' % platform.machine())
+        self.path = path
+        self.size = size
+        self.length = 2 * (VNSShmRing.HEADER_SIZE + size)
+        fd = os.open(path, os.O_RDWR | os.O_CREAT | os.O_EXCL, 0600)
+        try:
+            os.ftruncate(fd, self.length)
+            self.addr = _libc.mmap(None, self.length, _PROT_READ_WRITE, _MAP_SHARED, fd, 0)
+        finally:
+            os.close(fd)
+        if self.addr in (None, ctypes.c_void_p(-1).value):
+            os.unlink(path)
+            raise OSError(ctypes.get_errno(), 'mmap failed')
+        self.rings = (VNSShmRing(self.addr, size),
+                      VNSShmRing(self.addr + VNSShmRing.HEADER_SIZE + size, size))
+        self.closed = False
+
+    def close(self):
+        """Unmaps the rings; nothing may use them after."""
+        if self.closed:
+            return
+        self.closed = True
+        try:
+            os.unlink(self.path)
+        except OSError:
+            pass
+        _libc.munmap(self.addr, self.length)
@@ -20,9 +20,12 @@ from twisted.python import threadable
 from threading import Thread
 
 from twisted.internet import reactor
-from VNSProtocol import VNS_DEFAULT_PORT, create_vns_server
+from VNSProtocol import VNS_DEFAULT_PORT, create_vns_server, create_vns_unix_server
 from VNSProtocol import VNSOpen, VNSClose, VNSPacket, VNSOpenTemplate, VNSBanner
 from VNSProtocol import VNSRtable, VNSAuthRequest, VNSAuthReply, VNSAuthStatus, VNSInterface, VNSHardwareInfo
+from VNSProtocol import VNSPackets, VNS_OPEN_PACKETS, VNS_PACKETS_MAX
+from VNSProtocol import VNSCredit, VNS_OPEN_CREDIT
+from VNSProtocol import VNSShm, VNSShmSegment, VNS_OPEN_SHM
 
 log = core.getLogger()
 
@@ -40,19 +43,159 @@ def pack_ip(ipaddr):
     ret += chr(int(byte))
   return ret
 
+ETHERTYPE_ARP = '\x08\x06'
+SR_CREDIT_HOLD = 64 * 1024  # bytes of frames held per priority for a client out of credit
+
+class SRClientCredit(object):
+  ''' What a client which grants receive credit (VNS_OPEN_CREDIT) may still
+  be sent, and the frames held until it may.  ARP frames are held apart
+  and go first; frames past SR_CREDIT_HOLD bytes of either kind are
+  dropped, so none waits behind more than that.  Other messages are sent
+  at once but counted, as the client counts them. '''
+  def __init__(self, batch):
+    self.lock = threading.Lock()
+    self.batch = batch      # frames go out as VNSPackets
+    self.sent = 0           # bytes sent since our VNSCredit, mod 2**32
+    self.limit = 0          # the client's last grant
+    self.queues = (collections.deque(), collections.deque()) # ARP, the rest
+    self.held = [0, 0]      # bytes in each
+    self.scheduled = False  # a drain is waiting for the scheduler
+    self.dropped = 0
+
+  def window(self):
+    # none while what was sent ahead of the first grant is not covered
+    window = (self.limit - self.sent) & 0xffffffff
+    return window if window < 0x80000000 else 0
+
+  def send(self, conn, message):
+    with self.lock:
+      self.sent = (self.sent + 8 + message.length()) & 0xffffffff
+      conn.send(message)
+
+  def grant(self, limit):
+    with self.lock:
+      # a grant never takes back one before it
+      if (limit - self.limit) & 0xffffffff < 0x80000000:
+        self.limit = limit
+
+  def hold(self, intf_index, intfname, frame):
+    '''Queue a frame; returns True if a drain must be scheduled.'''
+    prio = 0 if frame[12:14] == ETHERTYPE_ARP else 1
+    with self.lock:
+      if self.held[prio] + len(frame) > SR_CREDIT_HOLD:
+        self.dropped += 1
+        return False
+      self.queues[prio].append((intf_index, intfname, frame))
+      self.held[prio] += len(frame)
+      if self.scheduled:
+        return False
+      self.scheduled = True
+      return True
+
+  def _take(self, prio):
+    intf_index, intfname, frame = self.queues[prio].popleft()
+    self.held[prio] -= len(frame)
+    return intf_index, intfname, frame
+
+  def drain(self, conn):
+    '''Send held frames, ARP first, as far as the credit goes.'''
+    with self.lock:
+      self.scheduled = False
+      while self.queues[0] or self.queues[1]:
+        window = self.window()
+        if self.batch:
+          size = 8
+          frames = []
+          for prio in (0, 1):
+            while self.queues[prio]:
+              n = VNSPackets.record_size(self.queues[prio][0][2])
+              if size + n > min(window, VNS_PACKETS_MAX):
+                break
+              frames.append(self._take(prio)[0::2] + (None,))
+              size += n
+          if not frames:
+            return
+          message = VNSPackets(frames)
+        else:
+          prio = 0 if self.queues[0] else 1
+          size = 8 + VNSPacket.HEADER_SIZE + len(self.queues[prio][0][2])
+          if size > window:
+            return
+          intf_index, intfname, frame = self._take(prio)
+          message = VNSPacket(intfname, frame)
+        self.sent = (self.sent + size) & 0xffffffff
+        conn.send(message)
+
+SR_SHM_RING = 1 << 20       # bytes per ring for a client on shared memory
+SR_SHM_IDLE = 0.01          # longest the ring reader sleeps, in seconds
+
+class SRClientShm(object):
+  ''' The shared-memory rings of a client which asked with VNS_OPEN_SHM,
+  and the thread which takes its frames off them. '''
+  def __init__(self, listener, path):
+    self.listener = listener
+    self.segment = VNSShmSegment(path, SR_SHM_RING)
+    self.stopped = False
+    self.scheduled = False  # a wake() is waiting for the scheduler
+    self.dropped = 0        # frames the client's ring had no room for
+    self.thread = threading.Thread(target=self.run)
+    self.thread.daemon = True
+
+  def send(self, intf_index, frame):
+    # the client is woken once for every frame before the next round of
+    # the scheduler
+    if not self.segment.rings[0].write(intf_index, frame, wake=False):
+      self.dropped += 1
+    if not self.scheduled:
+      self.scheduled = True
+      core.callLater(self.wake)
+
+  def wake(self):
+    self.scheduled = False
+    if not self.stopped:
+      self.segment.rings[0].wake()
+
+  def run(self):
+    ring = self.segment.rings[1]
+    while not self.stopped:
+      frames = ring.read()
+      if not frames:
+        ring.wait(SR_SHM_IDLE)
+      for intf_index, pkt, timestamp in frames:
+        self.listener._packet_out(intf_index, pkt)
+
+  def close(self):
+    self.stopped = True
+    self.thread.join()
+    self.segment.close()
+
 class SRServerListener(EventMixin):
-  ''' TCP Server to handle connection to SR '''
-  def __init__ (self, address=('127.0.0.1', 8888)):
+  ''' TCP (or, given a path, AF_UNIX SOCK_SEQPACKET) Server to handle connection to SR '''
+  def __init__ (self, address=('127.0.0.1', 8888), unix_path=None, shm=False):
     port = address[1]
     self.listenTo(core.cs144_ofhandler)
     self.srclients = []
-    self.listen_port = port
+    self.listen_port = unix_path or port
     self.intfname_to_port = {}
     self.port_to_intfname = {}
-    self.server = create_vns_server(port,
-                                    self._handle_recv_msg,
-                                    self._handle_new_client,
-                                    self._handle_client_disconnected)
+    self.intfname_to_index = {}  # place in VNSHardwareInfo, for VNSPackets
+    self.index_to_intfname = {}
+    self.batch_clients = set()   # clients which take VNSPackets
+    self.batch_pending = []      # frames for them, sent by _flush_batch
+    self.credits = {}            # client -> SRClientCredit, if it grants credit
+    self.shm = bool(shm and unix_path) # offer shared memory, to local clients only
+    self.shm_clients = {}        # client -> SRClientShm
+    self.shm_count = 0
+    if unix_path:
+      self.server = create_vns_unix_server(unix_path,
+                                           self._handle_recv_msg,
+                                           self._handle_new_client,
+                                           self._handle_client_disconnected)
+    else:
+      self.server = create_vns_server(port,
+                                      self._handle_recv_msg,
+                                      self._handle_new_client,
+                                      self._handle_client_disconnected)
     log.info('created server')
     return
 
@@ -60,6 +203,42 @@ class SRServerListener(EventMixin):
     log.debug('Broadcasting message: %s', message)
     for client in self.srclients:
       client.send(message)
+      if client in self.shm_clients:
+        self.shm_clients[client].segment.rings[0].wake()
+
+  def broadcast_frame(self, intfname, frame):
+    # batch clients get every frame that arrives before the next round of
+    # the scheduler in one message
+    batch = False
+    for client in list(self.srclients):
+      credit = self.credits.get(client)
+      if client in self.shm_clients:
+        self.shm_clients[client].send(self.intfname_to_index[intfname], frame)
+      elif credit is not None:
+        if credit.hold(self.intfname_to_index[intfname], intfname, frame):
+          core.callLater(credit.drain, client)
+      elif client in self.batch_clients:
+        batch = True
+      else:
+        client.send(VNSPacket(intfname, frame))
+    if batch:
+      if not self.batch_pending:
+        core.callLater(self._flush_batch)
+      self.batch_pending.append((self.intfname_to_index[intfname], frame, None))
+
+  def _flush_batch(self):
+    frames, self.batch_pending = self.batch_pending, []
+    while frames:
+      size = 8
+      n = 0
+      while n < len(frames) and size + VNSPackets.record_size(frames[n][1]) <= VNS_PACKETS_MAX:
+        size += VNSPackets.record_size(frames[n][1])
+        n += 1
+      message = VNSPackets(frames[:max(n, 1)])
+      frames = frames[max(n, 1):]
+      for client in list(self.batch_clients):
+        if client not in self.credits:
+          client.send(message)
 
   def _handle_SRPacketIn(self, event):
     #log.debug("SRServerListener catch SRPacketIn event, port=%d, pkt=%r" % (event.port, event.pkt))
@@ -69,7 +248,7 @@ class SRServerListener(EventMixin):
         log.debug("Couldn't find interface for portnumber %s" % event.port)
         return
     print "srpacketin, packet=%s" % ethernet(event.pkt)
-    self.broadcast(VNSPacket(intfname, event.pkt))
+    self.broadcast_frame(intfname, event.pkt)
 
   def _handle_RouterInfo(self, event):
     log.debug("SRServerListener catch RouterInfo even, info=%s, rtable=%s", event.info, event.rtable)
@@ -83,6 +262,8 @@ class SRServerListener(EventMixin):
       # Mapping between of-port and intf-name
       self.intfname_to_port[intf] = port
       self.port_to_intfname[port] = intf
+      self.intfname_to_index[intf] = len(interfaces) - 1
+      self.index_to_intfname[len(interfaces) - 1] = intf
     # store the list of interfaces...
     self.interfaces = interfaces
 
@@ -103,6 +284,10 @@ class SRServerListener(EventMixin):
       self._handle_close_msg(conn)
     elif vns_msg.get_type() == VNSPacket.get_type():
       self._handle_packet_msg(conn, vns_msg)
+    elif vns_msg.get_type() == VNSPackets.get_type():
+      self._handle_packets_msg(conn, vns_msg)
+    elif vns_msg.get_type() == VNSCredit.get_type():
+      self._handle_credit_msg(conn, vns_msg)
     elif vns_msg.get_type() == VNSOpenTemplate.get_type():
       # TODO: see if this is needed...
       self._handle_open_template_msg(conn, vns_msg)
@@ -124,14 +309,47 @@ class SRServerListener(EventMixin):
 
   def _handle_client_disconnected(self, conn):
     log.info("disconnected")
+    self.batch_clients.discard(conn)
+    shm = self.shm_clients.pop(conn, None)
+    if shm is not None:
+      shm.close()
+      if shm.dropped:
+        log.info("dropped %u frames with the client's ring full" % shm.dropped)
+    credit = self.credits.pop(conn, None)
+    if credit is not None and credit.dropped:
+      log.info("dropped %u frames the client had no credit for" % credit.dropped)
     conn.transport.loseConnection()
     return
 
   def _handle_open_msg(self, conn, vns_msg):
     # client wants to connect to some topology.
     log.debug("open-msg: %s, %s" % (vns_msg.topo_id, vns_msg.vhost))
+    shm = None
+    if self.shm and vns_msg.flags & VNS_OPEN_SHM:
+      # frames go through the rings; nothing to batch or give credit for
+      self.shm_count += 1
+      shm = SRClientShm(self, '/dev/shm/vns-%d-%d' % (os.getpid(), self.shm_count))
+      conn.send(VNSShm(shm.segment.path, shm.segment.size))
+      self.shm_clients[conn] = shm
+      shm.thread.start()
+    elif vns_msg.flags & VNS_OPEN_PACKETS:
+      # tell the client it may batch, before it learns its interfaces
+      conn.send(VNSPackets([]))
+      self.batch_clients.add(conn)
+    credit = None
+    if shm is None and vns_msg.flags & VNS_OPEN_CREDIT:
+      # from here on the client counts what it is sent; nothing but this
+      # and the hardware info until it grants some
+      credit = SRClientCredit(bool(vns_msg.flags & VNS_OPEN_PACKETS))
+      credit.send(conn, VNSCredit(0))
+      self.credits[conn] = credit
     try:
-      conn.send(VNSHardwareInfo(self.interfaces))
+      if credit is not None:
+        credit.send(conn, VNSHardwareInfo(self.interfaces))
+      else:
+        conn.send(VNSHardwareInfo(self.interfaces))
+      if shm is not None:
+        shm.segment.rings[0].wake()
     except:
       log.debug('interfaces not populated yet')  
     return
@@ -155,6 +373,26 @@ class SRServerListener(EventMixin):
     log.debug('SRServerHandler raise packet out event')
     core.cs144_srhandler.raiseEvent(SRPacketOut(pkt, out_port))
 
+  def _handle_packets_msg(self, conn, vns_msg):
+    for intf_index, pkt, timestamp in vns_msg.frames:
+      self._packet_out(intf_index, pkt)
+
+  def _packet_out(self, intf_index, pkt):
+    try:
+      out_port = self.intfname_to_port[self.index_to_intfname[intf_index]]
+    except KeyError:
+      log.debug('packet-out through wrong interface index %s' % intf_index)
+      return
+    core.cs144_srhandler.raiseEvent(SRPacketOut(pkt, out_port))
+
+  def _handle_credit_msg(self, conn, vns_msg):
+    credit = self.credits.get(conn)
+    if credit is None:
+      log.debug('credit from a client which did not ask for it')
+      return
+    credit.grant(vns_msg.limit)
+    core.callLater(credit.drain, conn)
+
 class SRPacketOut(Event):
   '''Event to raise upon receicing a packet back from SR'''
 
@@ -166,11 +404,11 @@ class SRPacketOut(Event):
 class cs144_srhandler(EventMixin):
   _eventMixin_events = set([SRPacketOut])
 
-  def __init__(self):
+  def __init__(self, unix_path=None, shm=False):
     EventMixin.__init__(self)
     self.listenTo(core)
     #self.listenTo(core.cs144_ofhandler)
-    self.server = SRServerListener()
+    self.server = SRServerListener(unix_path=unix_path, shm=shm)
     log.debug("SRServerListener listening on %s" % self.server.listen_port)
     # self.server_thread = threading.Thread(target=asyncore.loop)
     # use twisted as VNS also used Twisted.
@@ -184,8 +422,12 @@ class cs144_srhandler(EventMixin):
     del self.server
 
 
-def launch (transparent=False):
+def launch (transparent=False, unix=None, shm=False):
   """
   Starts the SR handler application.
+
+  With --unix=<path>, sr connects over a local AF_UNIX socket at <path>
+  (sr -s <path>) instead of TCP.  Adding --shm passes frames to and from
+  it through shared memory rings instead of that socket.
   """
-  core.registerNew(cs144_srhandler)
+  core.registerNew(cs144_srhandler, unix, str_to_bool(shm))
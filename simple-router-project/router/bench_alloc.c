@@ -0,0 +1,303 @@
+/*-----------------------------------------------------------------------------
+ * file:  bench_alloc.c
+ *
+ * Description:
+ *
+ * Zero-allocation check for the packet fast paths (make bench).  A router
+ * instance with three interfaces is set up as sr would be after HWINFO,
+ * with its VNS socket one end of a socketpair, and frames are replayed
+ * through sr_handlepacket_ifindex() the way the receive loop hands them
+ * over: from a ring slot with VNS headroom in front, flushed and drained
+ * every SLOTS frames.  malloc and friends are interposed, and after a
+ * warm-up every heap call made while handling a packet is counted.
+ *
+ * The cases are a forwarded packet whose next hop is in the ARP cache, an
+ * ARP request for a router address (ARP reply), and a ping of a router
+ * address (echo reply).  Exits non-zero if any of them allocates, or if
+ * the router did not send one frame back per frame in.
+ *
+ *   usage: bench_alloc [packets]
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#include "sr_router.h"
+#include "sr_if.h"
+#include "sr_rt.h"
+#include "sr_fib.h"
+#include "sr_protocol.h"
+#include "sr_utils.h"
+#include "sr_pktbuf.h"
+#include "vnscommand.h"
+
+#define SLOTS  32     /* frames handled between flushes */
+#define WARMUP 1000
+
+static struct sr_instance sr;
+static int peer;                        /* the "server" end */
+
+/* sr_vns_comm.o is linked from the router objects, which want this */
+int sr_verify_routing_table(struct sr_instance* sr) { return 0; }
+
+/* -- heap interposition: glibc's allocator under our own names -- */
+
+extern void* __libc_malloc(size_t);
+extern void* __libc_calloc(size_t, size_t);
+extern void* __libc_realloc(void*, size_t);
+extern void  __libc_free(void*);
+
+static __thread int counting;           /* only the packet thread counts */
+static unsigned long heap_calls;
+
+void* malloc(size_t size)
+{
+    if (counting) {
+        heap_calls++;
+    }
+    return __libc_malloc(size);
+}
+
+void* calloc(size_t n, size_t size)
+{
+    if (counting) {
+        heap_calls++;
+    }
+    return __libc_calloc(n, size);
+}
+
+void* realloc(void* p, size_t size)
+{
+    if (counting) {
+        heap_calls++;
+    }
+    return __libc_realloc(p, size);
+}
+
+void free(void* p)
+{
+    if (counting && p) {
+        heap_calls++;
+    }
+    __libc_free(p);
+}
+
+/* -- frames -- */
+
+static const unsigned char router_mac[3][6] = {
+    { 0x0a, 0, 0, 0, 0, 1 }, { 0x0a, 0, 0, 0, 0, 2 }, { 0x0a, 0, 0, 0, 0, 3 } };
+static const unsigned char client_mac[6] = { 0xc0, 0, 0, 0, 1, 0x00 };
+static const unsigned char server_mac[6] = { 0xc0, 0, 0, 0, 2, 0x02 };
+
+static double now_sec(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static unsigned int build_arp(uint8_t* frame, unsigned short op,
+                              const unsigned char* sha, const char* sip,
+                              const unsigned char* dst, const char* tip)
+{
+    sr_ethernet_hdr_t* eth = (sr_ethernet_hdr_t*)frame;
+    sr_arp_hdr_t* arp = (sr_arp_hdr_t*)(frame + sizeof(sr_ethernet_hdr_t));
+
+    memset(frame, 0, 60);
+    if (dst) {
+        memcpy(eth->ether_dhost, dst, ETHER_ADDR_LEN);
+    } else {
+        memset(eth->ether_dhost, 0xff, ETHER_ADDR_LEN);
+    }
+    memcpy(eth->ether_shost, sha, ETHER_ADDR_LEN);
+    eth->ether_type = htons(ethertype_arp);
+    arp->ar_hrd = htons(arp_hrd_ethernet);
+    arp->ar_pro = htons(ethertype_ip);
+    arp->ar_hln = ETHER_ADDR_LEN;
+    arp->ar_pln = 4;
+    arp->ar_op = htons(op);
+    memcpy(arp->ar_sha, sha, ETHER_ADDR_LEN);
+    arp->ar_sip = inet_addr(sip);
+    if (dst) {
+        memcpy(arp->ar_tha, dst, ETHER_ADDR_LEN);
+    }
+    arp->ar_tip = inet_addr(tip);
+    return 60;
+}
+
+static unsigned int build_ip(uint8_t* frame, const char* dst_ip,
+                             uint8_t proto, unsigned int payload)
+{
+    sr_ethernet_hdr_t* eth = (sr_ethernet_hdr_t*)frame;
+    sr_ip_hdr_t* ip = (sr_ip_hdr_t*)(frame + sizeof(sr_ethernet_hdr_t));
+    uint8_t* l4 = (uint8_t*)(ip + 1);
+    unsigned int ip_len = sizeof(sr_ip_hdr_t) + payload;
+
+    memset(frame, 0, sizeof(sr_ethernet_hdr_t) + ip_len);
+    memcpy(eth->ether_dhost, router_mac[2], ETHER_ADDR_LEN);
+    memcpy(eth->ether_shost, client_mac, ETHER_ADDR_LEN);
+    eth->ether_type = htons(ethertype_ip);
+    ip->ip_v = 4;
+    ip->ip_hl = 5;
+    ip->ip_len = htons(ip_len);
+    ip->ip_ttl = 64;
+    ip->ip_p = proto;
+    ip->ip_src = inet_addr("10.0.1.100");
+    ip->ip_dst = inet_addr(dst_ip);
+    ip->ip_sum = cksum(ip, sizeof(sr_ip_hdr_t));
+
+    if (proto == ip_protocol_icmp) {
+        sr_icmp_hdr_t* icmp = (sr_icmp_hdr_t*)l4;
+        icmp->icmp_type = 8;
+        icmp->icmp_sum = cksum(icmp, payload);
+    }
+    return sizeof(sr_ethernet_hdr_t) + ip_len;
+}
+
+/* -- replay -- */
+
+static uint8_t slots[SLOTS][sizeof(c_packet_header) + 1514];
+static uint8_t drain_buf[1 << 16];
+
+/* Read everything the router wrote; returns the byte count. */
+static unsigned long drain(void)
+{
+    unsigned long total = 0;
+    ssize_t n;
+
+    while ((n = recv(peer, drain_buf, sizeof(drain_buf), MSG_DONTWAIT)) > 0) {
+        total += n;
+    }
+    return total;
+}
+
+/* Hand 'count' copies of frame to the router; returns bytes it sent. */
+static unsigned long replay(const uint8_t* frame, unsigned int len,
+                            unsigned int ifindex, unsigned long count)
+{
+    unsigned long i, out = 0;
+
+    for (i = 0; i < count; i++) {
+        uint8_t* f = slots[i % SLOTS] + sizeof(c_packet_header);
+
+        memcpy(f, frame, len);
+        sr.rx_frame = f;
+        sr_handlepacket_ifindex(&sr, f, len, ifindex);
+        sr.rx_frame = 0;
+        if (i % SLOTS == SLOTS - 1) {
+            sr_vns_flush(&sr);
+            out += drain();
+        }
+    }
+    sr_vns_flush(&sr);
+    return out + drain();
+}
+
+static int run(const char* name, const uint8_t* frame, unsigned int len,
+               unsigned int ifindex, unsigned int reply_len,
+               unsigned long count)
+{
+    unsigned long out, calls;
+    double t;
+
+    replay(frame, len, ifindex, WARMUP);
+
+    heap_calls = 0;
+    t = now_sec();
+    counting = 1;
+    out = replay(frame, len, ifindex, count);
+    counting = 0;
+    t = now_sec() - t;
+    calls = heap_calls;
+
+    fprintf(stderr, "%-12s %8lu packets: %6.0f ns/packet, %lu heap calls%s\n",
+            name, count, t * 1e9 / count, calls,
+            out != count * (reply_len + sizeof(c_packet_header)) ?
+            ", WRONG OUTPUT" : "");
+    return calls == 0 && out == count * (reply_len + sizeof(c_packet_header));
+}
+
+static void add_iface(const char* name, int i, const char* ip)
+{
+    sr_add_interface(&sr, name);
+    sr_set_ether_addr(&sr, router_mac[i]);
+    sr_set_ether_ip(&sr, inet_addr(ip));
+    sr_set_ether_speed(&sr, 1000);
+}
+
+static void add_route(const char* dest, const char* mask, const char* iface)
+{
+    struct in_addr d, g, m;
+
+    d.s_addr = inet_addr(dest);
+    g.s_addr = d.s_addr;
+    m.s_addr = inet_addr(mask);
+    sr_add_rt_entry(&sr, d, g, m, (char*)iface);
+}
+
+int main(int argc, char** argv)
+{
+    unsigned long count = argc > 1 ? strtoul(argv[1], 0, 10) : 200000;
+    uint8_t frame[1514];
+    unsigned int len;
+    int sv[2];
+    int ok = 1;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) {
+        perror("socketpair");
+        return 1;
+    }
+    peer = sv[1];
+
+    memset(&sr, 0, sizeof(sr));
+    sr.sockfd = sv[0];
+    pthread_mutex_init(&sr.tx_lock, 0);
+
+    /* -- what HWINFO and the routing table would set up -- */
+    add_iface("eth1", 0, "192.168.2.1");
+    add_iface("eth2", 1, "172.64.3.1");
+    add_iface("eth3", 2, "10.0.1.1");
+    add_route("10.0.1.100", "255.255.255.255", "eth3");
+    add_route("192.168.2.2", "255.255.255.255", "eth1");
+    add_route("172.64.3.10", "255.255.255.255", "eth2");
+    sr_rt_bind_interfaces(&sr, sr.routing_table);
+    sr_init(&sr);
+    sr_rt_install_local(&sr, sr.fib);
+    sr_dst_cache_invalidate(sr.dst_cache);
+
+    /* -- the router's per-packet debug output -- */
+    if (freopen("/dev/null", "w", stdout) == 0) {
+        perror("freopen");
+        return 1;
+    }
+
+    /* -- next hops known: the client, and the server behind eth1 -- */
+    len = build_arp(frame, arp_op_reply, server_mac, "192.168.2.2",
+                    router_mac[0], "192.168.2.1");
+    replay(frame, len, 0, 1);
+    len = build_arp(frame, arp_op_reply, client_mac, "10.0.1.100",
+                    router_mac[2], "10.0.1.1");
+    replay(frame, len, 2, 1);
+
+    len = build_ip(frame, "192.168.2.2", ip_protocol_udp, 8 + 64);
+    ok &= run("forward", frame, len, 2, len, count);
+
+    len = build_arp(frame, arp_op_request, client_mac, "10.0.1.100", 0,
+                    "10.0.1.1");
+    ok &= run("arp reply", frame, len, 2,
+              sizeof(sr_ethernet_hdr_t) + sizeof(sr_arp_hdr_t), count);
+
+    len = build_ip(frame, "10.0.1.1", ip_protocol_icmp, 8 + 56);
+    ok &= run("echo reply", frame, len, 2, len, count);
+
+    fprintf(stderr, "%s\n", ok ? "no allocations on the fast paths" :
+            "FAILED: a fast path allocates or misbehaves");
+    return !ok;
+}
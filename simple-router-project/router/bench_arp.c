@@ -0,0 +1,160 @@
+/*-----------------------------------------------------------------------------
+ * file:  bench_arp.c
+ *
+ * Description:
+ *
+ * ARP cache contention benchmark (make bench).  Reader threads look up
+ * neighbours while writer threads insert ARP replies, which refresh
+ * existing entries and push new ones through CLOCK eviction.  Readers run
+ * once with the lock-free sr_arpcache_lookup_copy and once the way every
+ * lookup used to work (take the cache lock, malloc a copy, free it), and
+ * the lookup rate is reported for both.  Every MAC encodes its IP, so
+ * lock-free readers also check that they never see a torn entry.
+ *
+ *   usage: bench_arp [readers] [writers] [seconds]
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+#include "sr_router.h"
+#include "sr_arpcache.h"
+
+#define BENCH_HOSTS    2000   /* neighbours looked up */
+#define BENCH_CAPACITY 4096
+
+static struct sr_arpcache cache;
+static uint32_t hosts[BENCH_HOSTS];
+static volatile int running;
+static volatile unsigned long torn;   /* lookups that returned a wrong MAC */
+static int locked_readers;
+
+/* sr_arpcache.o is linked from the router objects, which want this */
+int sr_verify_routing_table(struct sr_instance* sr) { return 0; }
+
+static double now_sec(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void* reader(void* arg)
+{
+    unsigned long* ops = (unsigned long*)arg;
+    unsigned long n = 0, found = 0;
+    uint32_t i = 0;
+
+    while (running) {
+        uint32_t ip = hosts[i++ % BENCH_HOSTS];
+
+        if (locked_readers) {
+            struct sr_arpentry* e;
+            pthread_mutex_lock(&cache.lock);
+            e = sr_arpcache_lookup(&cache, ip);
+            pthread_mutex_unlock(&cache.lock);
+            if (e) {
+                found++;
+                free(e);
+            }
+        } else {
+            struct sr_arpentry e;
+            if (sr_arpcache_lookup_copy(&cache, ip, &e)) {
+                found++;
+                if (memcmp(e.mac + 2, &ip, 4) != 0) {
+                    torn++;
+                }
+            }
+        }
+        n++;
+    }
+    *ops = n;
+    return (void*)found;
+}
+
+static void* writer(void* arg)
+{
+    unsigned long* ops = (unsigned long*)arg;
+    unsigned char mac[6] = { 2, 0, 0, 0, 0, 0 };
+    uint32_t seed = (uint32_t)(unsigned long)ops | 1;
+    unsigned long n = 0;
+
+    while (running) {
+        uint32_t ip;
+
+        seed ^= seed << 13; seed ^= seed >> 17; seed ^= seed << 5;
+        /* mostly refreshes, some new neighbours to force evictions */
+        ip = (seed & 7) ? hosts[seed % BENCH_HOSTS] : seed;
+        memcpy(mac + 2, &ip, 4);
+        sr_arpcache_insert(&cache, mac, ip);
+        n++;
+    }
+    *ops = n;
+    return 0;
+}
+
+static void run(int nreaders, int nwriters, double seconds, int locked)
+{
+    pthread_t th[64];
+    unsigned long ops[64];
+    unsigned long rsum = 0, wsum = 0;
+    double t;
+    int i;
+
+    locked_readers = locked;
+    running = 1;
+    t = now_sec();
+    for (i = 0; i < nreaders + nwriters; i++) {
+        pthread_create(&th[i], 0, i < nreaders ? reader : writer, &ops[i]);
+    }
+    usleep((useconds_t)(seconds * 1e6));
+    running = 0;
+    for (i = 0; i < nreaders + nwriters; i++) {
+        pthread_join(th[i], 0);
+        if (i < nreaders) {
+            rsum += ops[i];
+        } else {
+            wsum += ops[i];
+        }
+    }
+    t = now_sec() - t;
+
+    printf("%-10s %d readers %d writers: %8.2f M lookups/s, %6.2f M inserts/s\n",
+           locked ? "locked" : "lock-free", nreaders, nwriters,
+           rsum / t / 1e6, wsum / t / 1e6);
+}
+
+int main(int argc, char** argv)
+{
+    int nreaders = argc > 1 ? atoi(argv[1]) : 4;
+    int nwriters = argc > 2 ? atoi(argv[2]) : 1;
+    double seconds = argc > 3 ? atof(argv[3]) : 1.0;
+    unsigned char mac[6] = { 2, 0, 0, 0, 0, 0 };
+    int i;
+
+    if (nreaders + nwriters > 64) {
+        fprintf(stderr, "at most 64 threads\n");
+        return 1;
+    }
+
+    sr_arpcache_init(&cache, BENCH_CAPACITY);
+    for (i = 0; i < BENCH_HOSTS; i++) {
+        hosts[i] = htonl(0x0a000000u + i);
+        memcpy(mac + 2, &hosts[i], 4);
+        sr_arpcache_insert(&cache, mac, hosts[i]);
+    }
+
+    run(nreaders, 0, seconds, 1);
+    run(nreaders, 0, seconds, 0);
+    run(nreaders, nwriters, seconds, 1);
+    run(nreaders, nwriters, seconds, 0);
+
+    printf("inconsistent lock-free reads: %lu\n", torn);
+    sr_arpcache_print_stats(&cache);
+    return torn != 0;
+}
@@ -0,0 +1,138 @@
+/*-----------------------------------------------------------------------------
+ * file:  bench_rtload.c
+ *
+ * Description:
+ *
+ * Routing table startup benchmark (make bench).  Generates a text routing
+ * table with a large number of random prefixes and times
+ *
+ *   - loading it through sr_load_rt (text parse + FIB build),
+ *   - writing the binary snapshot (sr -F),
+ *   - loading the snapshot through sr_load_rt,
+ *
+ * then checks that the text-built and snapshot-built FIBs agree on a set
+ * of random lookups.
+ *
+ *   usage: bench_rtload [nprefixes] [dir]
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include "sr_router.h"
+#include "sr_rt.h"
+#include "sr_fib.h"
+
+#define BENCH_PREFIXES 1000000
+#define BENCH_LOOKUPS  1000000
+
+static double now_sec(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static uint32_t bench_rand(uint32_t* state)
+{
+    *state ^= *state << 13;
+    *state ^= *state >> 17;
+    *state ^= *state << 5;
+    return *state;
+}
+
+static void bench_init(struct sr_instance* sr)
+{
+    memset(sr, 0, sizeof(*sr));
+    sr->dst_cache = sr_dst_cache_create();
+    assert(sr->dst_cache);
+}
+
+static void bench_write_table(const char* path, unsigned int n)
+{
+    FILE* fp = fopen(path, "w");
+    uint32_t seed = 12345;
+    unsigned int i;
+
+    assert(fp);
+    fprintf(fp, "0.0.0.0 10.0.1.100 0.0.0.0 eth3\n");
+    for (i = 1; i < n; i++) {
+        uint32_t r = bench_rand(&seed);
+        uint32_t depth = 8 + r % 25;     /* /8 .. /32, mostly > /24 */
+        uint32_t mask, dest;
+
+        if (r & 0x100) {
+            depth = 16 + (r >> 9) % 9;   /* half of them /16 .. /24 */
+        }
+        mask = depth == 32 ? 0xffffffffu : ~(0xffffffffu >> depth);
+        dest = bench_rand(&seed) & mask;
+        fprintf(fp, "%u.%u.%u.%u %u.%u.%u.%u %u.%u.%u.%u eth%u\n",
+                dest >> 24, (dest >> 16) & 0xff, (dest >> 8) & 0xff,
+                dest & 0xff, 10u, 0u, 1u + (r >> 20) % 3, 1u,
+                mask >> 24, (mask >> 16) & 0xff, (mask >> 8) & 0xff,
+                mask & 0xff, 1 + (r >> 24) % 3);
+    }
+    fclose(fp);
+}
+
+int main(int argc, char** argv)
+{
+    unsigned int n = argc > 1 ? (unsigned int)atoi(argv[1]) : BENCH_PREFIXES;
+    const char* dir = argc > 2 ? argv[2] : "/tmp";
+    char text[FILENAME_MAX], snap[FILENAME_MAX];
+    struct sr_instance a, b;
+    uint32_t seed = 777;
+    unsigned int i, bad = 0;
+    double t;
+
+    snprintf(text, sizeof(text), "%s/bench_rtable.txt", dir);
+    snprintf(snap, sizeof(snap), "%s/bench_rtable.fib", dir);
+
+    printf("generating %u prefixes in %s\n", n, text);
+    bench_write_table(text, n);
+
+    bench_init(&a);
+    t = now_sec();
+    if (sr_load_rt(&a, text) != 0) {
+        return 1;
+    }
+    printf("text load:     %8.3f s  (%u routes, %u rules)\n",
+           now_sec() - t, a.rt_count, a.fib->nrules);
+
+    t = now_sec();
+    if (sr_fib_snapshot_save(&a, snap) != 0) {
+        return 1;
+    }
+    printf("snapshot save: %8.3f s\n", now_sec() - t);
+
+    bench_init(&b);
+    t = now_sec();
+    if (sr_load_rt(&b, snap) != 0) {
+        return 1;
+    }
+    printf("snapshot load: %8.3f s  (%u routes, %u rules)\n",
+           now_sec() - t, b.rt_count, b.fib->nrules);
+
+    for (i = 0; i < BENCH_LOOKUPS; i++) {
+        uint32_t ip = htonl(bench_rand(&seed));
+        struct sr_rt* ra = sr_fib_lookup(a.fib, ip);
+        struct sr_rt* rb = sr_fib_lookup(b.fib, ip);
+
+        if ((ra == 0) != (rb == 0) ||
+            (ra && (ra->dest.s_addr != rb->dest.s_addr ||
+                    ra->mask.s_addr != rb->mask.s_addr ||
+                    ra->gw.s_addr != rb->gw.s_addr))) {
+            bad++;
+        }
+    }
+    printf("lookup check:  %u mismatches in %u lookups\n", bad, BENCH_LOOKUPS);
+
+    unlink(text);
+    unlink(snap);
+    return bad != 0;
+}
@@ -0,0 +1,234 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_adj.c
+ *
+ * Description:
+ *
+ * Adjacency table: chained hash on (interface, next-hop IP).  See sr_adj.h.
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+
+#include "sr_adj.h"
+#include "sr_if.h"
+
+#define SR_ADJ_MIN_BUCKETS 64
+
+static uint32_t adj_bucket(const struct sr_adj_table* table,
+                           const struct sr_if* iface, uint32_t ip)
+{
+    return (((ip ^ iface->ifindex) * 0x9e3779b1u) >> 16) & table->mask;
+}
+
+static void adj_lock(struct sr_adj_table* table)
+{
+    if (!table->single) {
+        pthread_mutex_lock(&table->lock);
+    }
+}
+
+static void adj_unlock(struct sr_adj_table* table)
+{
+    if (!table->single) {
+        pthread_mutex_unlock(&table->lock);
+    }
+}
+
+struct sr_adj_table* sr_adj_table_create(unsigned int capacity)
+{
+    struct sr_adj_table* table;
+    uint32_t n = SR_ADJ_MIN_BUCKETS;
+
+    table = (struct sr_adj_table*)calloc(1, sizeof(struct sr_adj_table));
+    if (!table) {
+        return 0;
+    }
+    /* about one host per chain when full */
+    while (n < capacity && n < 0x10000) {
+        n <<= 1;
+    }
+    table->buckets = (struct sr_adj**)calloc(n, sizeof(struct sr_adj*));
+    if (!table->buckets) {
+        free(table);
+        return 0;
+    }
+    table->mask = n - 1;
+    table->capacity = capacity;
+    pthread_mutex_init(&table->lock, 0);
+    return table;
+} /* -- sr_adj_table_create -- */
+
+void sr_adj_table_destroy(struct sr_adj_table* table)
+{
+    uint32_t i;
+
+    if (!table) {
+        return;
+    }
+    for (i = 0; i <= table->mask; i++) {
+        struct sr_adj* adj = table->buckets[i];
+        while (adj) {
+            struct sr_adj* next = adj->next;
+            free(adj);
+            adj = next;
+        }
+    }
+    pthread_mutex_destroy(&table->lock);
+    free(table->buckets);
+    free(table);
+} /* -- sr_adj_table_destroy -- */
+
+static struct sr_adj* adj_lookup(struct sr_adj_table* table,
+                                 struct sr_if* iface, uint32_t ip)
+{
+    struct sr_adj* adj;
+
+    for (adj = table->buckets[adj_bucket(table, iface, ip)]; adj;
+         adj = adj->next) {
+        if (adj->ip == ip && adj->iface == iface) {
+            return adj;
+        }
+    }
+    return 0;
+}
+
+/* A new unresolved adjacency with its source MAC and ethertype filled in */
+static struct sr_adj* adj_insert(struct sr_adj_table* table,
+                                 struct sr_if* iface, uint32_t ip)
+{
+    uint32_t b = adj_bucket(table, iface, ip);
+    struct sr_adj* adj;
+
+    adj = (struct sr_adj*)calloc(1, sizeof(struct sr_adj));
+    if (!adj) {
+        return 0;
+    }
+    adj->ip = ip;
+    adj->iface = iface;
+    memcpy(adj->l2hdr.ether_shost, iface->addr, ETHER_ADDR_LEN);
+    adj->l2hdr.ether_type = htons(ethertype_ip);
+
+    adj->next = table->buckets[b];
+    table->buckets[b] = adj;
+    table->count++;
+    return adj;
+}
+
+/* Free the host adjacencies whose ARP entry has expired */
+static void adj_sweep(struct sr_adj_table* table, time_t now)
+{
+    uint32_t i;
+
+    table->swept = now;
+    for (i = 0; i <= table->mask; i++) {
+        struct sr_adj** pp = &table->buckets[i];
+        while (*pp) {
+            struct sr_adj* adj = *pp;
+            if (!adj->pinned && now >= adj->expires) {
+                *pp = adj->next;
+                free(adj);
+                table->count--;
+                table->hosts--;
+                table->reclaimed++;
+            } else {
+                pp = &adj->next;
+            }
+        }
+    }
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_adj_get
+ * Scope:  Global
+ *
+ * Look up or create the adjacency of a gateway on iface and pin it.  A
+ * host adjacency for the same neighbour becomes the gateway's.
+ *
+ *---------------------------------------------------------------------*/
+
+struct sr_adj* sr_adj_get(struct sr_adj_table* table, struct sr_if* iface,
+                          uint32_t ip)
+{
+    struct sr_adj* adj;
+
+    assert(table);
+    assert(iface);
+
+    adj_lock(table);
+    adj = adj_lookup(table, iface, ip);
+    if (adj) {
+        if (!adj->pinned) {
+            adj->pinned = 1;
+            table->hosts--;
+        }
+    } else {
+        adj = adj_insert(table, iface, ip);
+        if (adj) {
+            adj->pinned = 1;
+        }
+    }
+    adj_unlock(table);
+
+    return adj;
+} /* -- sr_adj_get -- */
+
+struct sr_adj* sr_adj_find(struct sr_adj_table* table, struct sr_if* iface,
+                           uint32_t ip)
+{
+    struct sr_adj* adj;
+
+    adj_lock(table);
+    adj = adj_lookup(table, iface, ip);
+    adj_unlock(table);
+    return adj;
+} /* -- sr_adj_find -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_adj_update
+ * Scope:  Global
+ *
+ * Complete (or refresh) the Ethernet header of the adjacency for
+ * (iface, ip), creating it if needed.  Called when an ARP reply arrives
+ * or a sender finds the neighbour in the ARP cache.  A full table is
+ * swept at most once a second; until something expires, new neighbours
+ * go without an adjacency and take the ARP cache path.
+ *
+ *---------------------------------------------------------------------*/
+
+struct sr_adj* sr_adj_update(struct sr_adj_table* table, struct sr_if* iface,
+                             uint32_t ip, const unsigned char* mac,
+                             time_t expires)
+{
+    struct sr_adj* adj;
+
+    if (!table || !iface) {
+        return 0;
+    }
+    adj_lock(table);
+    adj = adj_lookup(table, iface, ip);
+    if (!adj) {
+        time_t now = time(NULL);
+        if (table->hosts >= table->capacity && now != table->swept) {
+            adj_sweep(table, now);
+        }
+        if (table->hosts < table->capacity) {
+            adj = adj_insert(table, iface, ip);
+            if (adj) {
+                table->hosts++;
+            }
+        } else {
+            table->refused++;
+        }
+    }
+    if (adj) {
+        memcpy(adj->l2hdr.ether_dhost, mac, ETHER_ADDR_LEN);
+        adj->expires = expires;
+        adj->resolved = 1;
+    }
+    adj_unlock(table);
+
+    return adj;
+} /* -- sr_adj_update -- */
@@ -0,0 +1,92 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_adj.h
+ *
+ * Description:
+ *
+ * Adjacency (next-hop) table.  An adjacency is one (output interface,
+ * next-hop IP) pair together with the 14-byte Ethernet header every frame
+ * sent to that neighbour carries.  Once the neighbour's MAC is known the
+ * header is complete and forwarding is a single header copy.
+ *
+ * Gateway routes point at their adjacency through sr_rt.adj; these are
+ * pinned and live as long as the table.  Directly connected destinations
+ * get one adjacency per host, reached through the destination cache, but
+ * only once ARP has resolved the host.  Host adjacencies are bounded by
+ * the table's capacity and age with the ARP cache entry they were built
+ * from: when the table is full, expired ones are freed and the caller
+ * must drop every cached pointer to them (see 'reclaimed').
+ *
+ *---------------------------------------------------------------------------*/
+
+#ifndef SR_ADJ_H
+#define SR_ADJ_H
+
+#ifdef _LINUX_
+#include <stdint.h>
+#endif /* _LINUX_ */
+
+#ifdef _DARWIN_
+#include <inttypes.h>
+#endif /* _DARWIN_ */
+
+#include <time.h>
+#include <pthread.h>
+
+#include "sr_protocol.h"
+
+struct sr_if;
+
+struct sr_adj
+{
+    sr_ethernet_hdr_t l2hdr;    /* prebuilt header: dhost valid if resolved */
+    uint32_t ip;                /* next hop, network byte order */
+    int resolved;               /* l2hdr.ether_dhost holds the neighbour MAC */
+    int pinned;                 /* a gateway's, never freed */
+    time_t expires;             /* resolution is stale from this time on */
+    struct sr_if* iface;        /* output interface */
+    struct sr_adj* next;        /* hash chain */
+};
+
+struct sr_adj_table
+{
+    struct sr_adj** buckets;    /* mask + 1 chains */
+    uint32_t mask;
+    unsigned int count;         /* adjacencies of either kind */
+    unsigned int hosts;         /* unpinned ones */
+    unsigned int capacity;      /* most unpinned ones at a time */
+    time_t swept;               /* last time a full table was swept */
+    unsigned long reclaimed;    /* host adjacencies freed, ever */
+    unsigned long refused;      /* not created, table full of live ones */
+    int single;                 /* one thread uses the table: no locking */
+    pthread_mutex_t lock;       /* the reload thread adds gateways */
+};
+
+/* A table for 'capacity' host adjacencies (the ARP cache's). */
+struct sr_adj_table* sr_adj_table_create(unsigned int capacity);
+void sr_adj_table_destroy(struct sr_adj_table* table);
+
+/* Find the gateway adjacency for (iface, ip), creating an unresolved one
+   if it does not exist yet.  It is pinned, so routes may keep the
+   pointer for as long as the table lives. */
+struct sr_adj* sr_adj_get(struct sr_adj_table* table, struct sr_if* iface,
+                          uint32_t ip);
+
+/* The adjacency for (iface, ip), or 0.  Creates nothing. */
+struct sr_adj* sr_adj_find(struct sr_adj_table* table, struct sr_if* iface,
+                           uint32_t ip);
+
+/* ARP resolved ip on iface to mac until 'expires': complete the adjacency
+   for (iface, ip), creating a host adjacency if there is none.  When the
+   table is full, expired host adjacencies are freed first ('reclaimed'
+   goes up); 0 is returned if there is still no room. */
+struct sr_adj* sr_adj_update(struct sr_adj_table* table, struct sr_if* iface,
+                             uint32_t ip, const unsigned char* mac,
+                             time_t expires);
+
+/* True if the prebuilt header can be used as is at time 'now'. */
+static __inline__ int sr_adj_usable(const struct sr_adj* adj, time_t now)
+{
+    return adj->resolved && now < adj->expires;
+}
+
+#endif /* -- SR_ADJ_H -- */
@@ -1,4 +1,5 @@
 #include <netinet/in.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <time.h>
@@ -10,12 +11,12 @@
 #include "sr_router.h"
 #include "sr_if.h"
 #include "sr_rt.h"
+#include "sr_fib.h"
 #include "sr_protocol.h"
 #include "sr_utils.h"
 
 /* Forward declarations for helper functions */
-static void handle_arpreq(struct sr_instance *sr, struct sr_arpreq *req);
-static void send_arp_request_for_req(struct sr_instance *sr, struct sr_arpreq *req);
+static void send_arp_request_for_req(struct sr_instance *sr, struct sr_arpsend *send);
 static void send_icmp_host_unreachable(struct sr_instance *sr, struct sr_arpreq *req);
 
 /* Helper to print IP without newline */
@@ -30,70 +31,75 @@ static void print_ip_addr(uint32_t ip) {
     fprintf(stderr, "%d", octet);
 }
 
-/* 
-  This function gets called every second. For each request sent out, we keep
-  checking whether we should resend an request or destroy the arp request.
-  See the comments in the header file for an idea of what it should look like.
-*/
-void sr_arpcache_sweepreqs(struct sr_instance *sr) { 
-    struct sr_arpreq *req = sr->cache.requests;
-    struct sr_arpreq *next;
-    
-    while (req) {
-        next = req->next;
-        handle_arpreq(sr, req);
-        req = next;
-    }
-}
-
 /*---------------------------------------------------------------------
  * Method: handle_arpreq
  * Scope:  Static helper
  *
- * Handle an ARP request - resend if needed or timeout
+ * Retransmission timer of an ARP request. Runs with the cache lock held,
+ * so it only records the send (or the failure) for the timeout thread.
  *
  *---------------------------------------------------------------------*/
-static void handle_arpreq(struct sr_instance *sr, struct sr_arpreq *req)
+static void handle_arpreq(struct sr_timer *timer, void *arg)
 {
-    time_t now = time(NULL);
+    struct sr_arpcache *cache = arg;
+    struct sr_arpreq *req = (struct sr_arpreq *)
+        ((char *)timer - offsetof(struct sr_arpreq, timer));
+    
+    if (req->times_sent >= SR_ARPREQ_TRIES) {
+        /* Timeout - host unreachable for every waiting packet */
+        struct sr_arpreq **pp = &(cache->requests);
+        while (*pp != req)
+            pp = &((*pp)->next);
+        *pp = req->next;
+        cache->pending_bytes -= req->bytes;
+        req->next = cache->failed;
+        cache->failed = req;
+        return;
+    }
     
-    if (difftime(now, req->sent) >= 1.0) {
-        if (req->times_sent >= 5) {
-            /* Timeout - send ICMP host unreachable to all waiting packets */
-            send_icmp_host_unreachable(sr, req);
-            sr_arpreq_destroy(&sr->cache, req);
-        } else {
-            /* Resend ARP request */
-            send_arp_request_for_req(sr, req);
-            req->sent = now;
-            req->times_sent++;
+    if (req->packets) {
+        if (cache->nsends == cache->sends_cap) {
+            uint32_t cap = cache->sends_cap ? 2 * cache->sends_cap : 16;
+            struct sr_arpsend *sends = (struct sr_arpsend *)
+                realloc(cache->sends, cap * sizeof(struct sr_arpsend));
+            if (!sends) {
+                /* try again on the next tick */
+                sr_timer_add(&(cache->wheel), timer, cache->wheel.now + 1);
+                return;
+            }
+            cache->sends = sends;
+            cache->sends_cap = cap;
         }
+        /* Use the first packet's interface to send the ARP request */
+        cache->sends[cache->nsends].ip = req->ip;
+        cache->sends[cache->nsends].ifindex = req->packets->ifindex;
+        cache->nsends++;
     }
+    
+    req->sent = time(NULL);
+    req->times_sent++;
+    sr_timer_add(&(cache->wheel), timer,
+                 cache->wheel.now + SR_ARPREQ_INTERVAL);
 }
 
 /*---------------------------------------------------------------------
  * Method: send_arp_request_for_req
  * Scope:  Static helper
  *
- * Send ARP request for a queued request
+ * Send an ARP request recorded by handle_arpreq
  *
  *---------------------------------------------------------------------*/
-static void send_arp_request_for_req(struct sr_instance *sr, struct sr_arpreq *req)
+static void send_arp_request_for_req(struct sr_instance *sr, struct sr_arpsend *send)
 {
-    if (!req->packets) {
-        return;
-    }
-    
-    /* Use the first packet's interface to send the ARP request */
-    struct sr_packet *pkt = req->packets;
-    struct sr_if *iface = sr_get_interface(sr, pkt->iface);
+    struct sr_if *iface = sr_get_interface_by_index(sr, send->ifindex);
     
     if (!iface) {
         return;
     }
     
     unsigned int len = sizeof(sr_ethernet_hdr_t) + sizeof(sr_arp_hdr_t);
-    uint8_t *arp_req = (uint8_t *)malloc(len);
+    struct sr_pktbuf *pkt = sr_pktbuf_alloc(len);
+    uint8_t *arp_req = pkt->data;
     
     sr_ethernet_hdr_t *eth_hdr = (sr_ethernet_hdr_t *)arp_req;
     sr_arp_hdr_t *arp_hdr = (sr_arp_hdr_t *)(arp_req + sizeof(sr_ethernet_hdr_t));
@@ -112,10 +118,9 @@ static void send_arp_request_for_req(struct sr_instance *sr, struct sr_arpreq *r
     memcpy(arp_hdr->ar_sha, iface->addr, ETHER_ADDR_LEN);
     arp_hdr->ar_sip = iface->ip;
     memset(arp_hdr->ar_tha, 0x00, ETHER_ADDR_LEN);
-    arp_hdr->ar_tip = req->ip;
+    arp_hdr->ar_tip = send->ip;
     
-    sr_send_packet(sr, arp_req, len, iface->name);
-    free(arp_req);
+    sr_send_pktbuf(sr, pkt, iface->ifindex);
 }
 
 /*---------------------------------------------------------------------
@@ -127,15 +132,16 @@ static void send_arp_request_for_req(struct sr_instance *sr, struct sr_arpreq *r
  *---------------------------------------------------------------------*/
 static void send_icmp_host_unreachable(struct sr_instance *sr, struct sr_arpreq *req)
 {
-    struct sr_packet *pkt = req->packets;
+    struct sr_pktbuf *pkt = req->packets;
     
     while (pkt) {
         /* Extract IP header from queued packet */
-        sr_ip_hdr_t *orig_ip = (sr_ip_hdr_t *)(pkt->buf + sizeof(sr_ethernet_hdr_t));
+        sr_ip_hdr_t *orig_ip = (sr_ip_hdr_t *)(pkt->data + sizeof(sr_ethernet_hdr_t));
         
         /* Build ICMP host unreachable message */
         unsigned int icmp_len = sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t) + sizeof(sr_icmp_t3_hdr_t);
-        uint8_t *icmp_pkt = (uint8_t *)malloc(icmp_len);
+        struct sr_pktbuf *icmp_buf = sr_pktbuf_alloc(icmp_len);
+        uint8_t *icmp_pkt = icmp_buf->data;
         memset(icmp_pkt, 0, icmp_len);
         
         sr_ethernet_hdr_t *eth = (sr_ethernet_hdr_t *)icmp_pkt;
@@ -143,9 +149,9 @@ static void send_icmp_host_unreachable(struct sr_instance *sr, struct sr_arpreq
         sr_icmp_t3_hdr_t *icmp = (sr_icmp_t3_hdr_t *)(icmp_pkt + sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t));
         
         /* Find interface and route back to original sender */
-        struct sr_if *out_iface = sr_get_interface(sr, pkt->iface);
+        struct sr_if *out_iface = sr_get_interface_by_index(sr, pkt->ifindex);
         if (!out_iface) {
-            free(icmp_pkt);
+            sr_pktbuf_free(icmp_buf);
             pkt = pkt->next;
             continue;
         }
@@ -174,30 +180,17 @@ static void send_icmp_host_unreachable(struct sr_instance *sr, struct sr_arpreq
         icmp->icmp_sum = cksum(icmp, sizeof(sr_icmp_t3_hdr_t));
         
         /* Look up how to reach the original sender */
-        struct sr_rt *rt = sr->routing_table;
-        struct sr_rt *best = NULL;
-        uint32_t best_mask = 0;
-        
-        while (rt) {
-            uint32_t mask = rt->mask.s_addr;
-            if ((orig_ip->ip_src & mask) == (rt->dest.s_addr & mask)) {
-                if (ntohl(mask) > ntohl(best_mask)) {
-                    best = rt;
-                    best_mask = mask;
-                }
-            }
-            rt = rt->next;
-        }
+        struct sr_rt *best = sr_fib_lookup(sr->fib, orig_ip->ip_src);
         
         if (!best) {
-            free(icmp_pkt);
+            sr_pktbuf_free(icmp_buf);
             pkt = pkt->next;
             continue;
         }
         
-        struct sr_if *send_iface = sr_get_interface(sr, best->interface);
+        struct sr_if *send_iface = sr_get_interface_by_index(sr, best->ifindex);
         if (!send_iface) {
-            free(icmp_pkt);
+            sr_pktbuf_free(icmp_buf);
             pkt = pkt->next;
             continue;
         }
@@ -206,19 +199,17 @@ static void send_icmp_host_unreachable(struct sr_instance *sr, struct sr_arpreq
         uint32_t next_hop = (best->gw.s_addr) ? best->gw.s_addr : orig_ip->ip_src;
         
         /* Check ARP cache */
-        struct sr_arpentry *arp_entry = sr_arpcache_lookup(&sr->cache, next_hop);
+        struct sr_arpentry arp_entry;
         
-        if (arp_entry) {
-            memcpy(eth->ether_dhost, arp_entry->mac, ETHER_ADDR_LEN);
+        if (sr_arpcache_lookup_copy(&sr->cache, next_hop, &arp_entry)) {
+            memcpy(eth->ether_dhost, arp_entry.mac, ETHER_ADDR_LEN);
             memcpy(eth->ether_shost, send_iface->addr, ETHER_ADDR_LEN);
             eth->ether_type = htons(ethertype_ip);
             
-            sr_send_packet(sr, icmp_pkt, icmp_len, send_iface->name);
-            free(arp_entry);
-            free(icmp_pkt);
+            sr_send_pktbuf(sr, icmp_buf, send_iface->ifindex);
         } else {
             /* Queue it - but don't create infinite loop */
-            free(icmp_pkt);
+            sr_pktbuf_free(icmp_buf);
         }
         
         pkt = pkt->next;
@@ -227,45 +218,204 @@ static void send_icmp_host_unreachable(struct sr_instance *sr, struct sr_arpreq
 
 /* You should not need to touch the rest of this code. */
 
-/* Checks if an IP->MAC mapping is in the cache. IP is in network byte order.
-   You must free the returned structure if it is not NULL. */
-struct sr_arpentry *sr_arpcache_lookup(struct sr_arpcache *cache, uint32_t ip) {
-    pthread_mutex_lock(&(cache->lock));
+/* Seqlock write section around a change to the slot array. Caller holds
+   the lock. */
+static void arpcache_write_begin(struct sr_arpcache *cache) {
+    cache->seq++;
+    __sync_synchronize();
+}
+
+static void arpcache_write_end(struct sr_arpcache *cache) {
+    __sync_synchronize();
+    cache->seq++;
+}
+
+/* The cache lock, unless one thread owns the cache (cache->single). */
+static void arpcache_lock(struct sr_arpcache *cache) {
+    if (!cache->single)
+        pthread_mutex_lock(&(cache->lock));
+}
+
+static void arpcache_unlock(struct sr_arpcache *cache) {
+    if (!cache->single)
+        pthread_mutex_unlock(&(cache->lock));
+}
+
+/* Arm timer for 'expires' (ms) from outside the timeout thread, waking the
+   thread if it would otherwise sleep past it. Caller holds the lock. */
+static void arpcache_timer_add(struct sr_arpcache *cache,
+                               struct sr_timer *timer, uint64_t expires) {
+    /* An idle wheel has not been advanced since it emptied; catch it up
+       first so the timer is filed relative to the current time */
+    if (cache->wheel.count == 0)
+        sr_timer_wheel_advance(&(cache->wheel), sr_timer_now());
+    
+    sr_timer_add(&(cache->wheel), timer, expires);
+    if (!cache->single &&
+        (cache->sleep_until == 0 || expires < cache->sleep_until))
+        pthread_cond_signal(&(cache->cond));
+}
+
+/* Home slot of ip: multiplicative hash, top bits. */
+static uint32_t arpcache_home(const struct sr_arpcache *cache, uint32_t ip) {
+    return (uint32_t)(ip * 0x9e3779b1u) >> cache->shift;
+}
+
+/* Slot holding ip, or -1. Caller holds the lock. */
+static long arpcache_find(const struct sr_arpcache *cache, uint32_t ip) {
+    uint32_t mask = cache->size - 1;
+    uint32_t i = arpcache_home(cache, ip);
+    
+    while (cache->entries[i].valid) {
+        if (cache->entries[i].ip == ip) {
+            return i;
+        }
+        i = (i + 1) & mask;
+    }
+    return -1;
+}
+
+/* Empty slot i, shifting later members of its probe run back so that
+   lookups never need tombstones. Caller holds the lock. */
+static void arpcache_remove(struct sr_arpcache *cache, uint32_t i) {
+    uint32_t mask = cache->size - 1;
+    uint32_t j = i;
+    struct sr_arptimer *t = &(cache->timers[cache->entries[i].timer]);
     
-    struct sr_arpentry *entry = NULL, *copy = NULL;
+    sr_timer_cancel(&(cache->wheel), &(t->timer));
+    t->timer.next = &(cache->timers_free->timer);
+    cache->timers_free = t;
     
-    int i;
-    for (i = 0; i < SR_ARPCACHE_SZ; i++) {
-        if ((cache->entries[i].valid) && (cache->entries[i].ip == ip)) {
-            entry = &(cache->entries[i]);
+    while (1) {
+        j = (j + 1) & mask;
+        if (!cache->entries[j].valid) {
+            break;
+        }
+        /* Entry j may fill the hole at i if its home is not in (i, j] */
+        uint32_t home = arpcache_home(cache, cache->entries[j].ip);
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            cache->entries[i] = cache->entries[j];
+            i = j;
         }
     }
+    cache->entries[i].valid = 0;
+    cache->entries[i].ref = 0;
+    cache->count--;
+}
+
+/* Expiry timer of a cache entry. Runs on the timeout thread with the
+   lock held. */
+static void arpcache_expire(struct sr_timer *timer, void *arg) {
+    struct sr_arpcache *cache = arg;
+    long i = arpcache_find(cache, ((struct sr_arptimer *)timer)->ip);
+    
+    if (i >= 0) {
+        arpcache_write_begin(cache);
+        arpcache_remove(cache, i);
+        arpcache_write_end(cache);
+        cache->expirations++;
+    }
+}
+
+/* Make room for one entry by advancing the CLOCK hand. Expired entries
+   are taken as soon as the hand reaches them; others get a second chance
+   if they were used since the last pass. Caller holds the lock. */
+static void arpcache_evict(struct sr_arpcache *cache, time_t now) {
+    uint32_t mask = cache->size - 1;
     
-    /* Must return a copy b/c another thread could jump in and modify
-       table after we return. */
-    if (entry) {
-        copy = (struct sr_arpentry *) malloc(sizeof(struct sr_arpentry));
-        memcpy(copy, entry, sizeof(struct sr_arpentry));
+    while (1) {
+        struct sr_arpslot *e = &(cache->entries[cache->hand]);
+        
+        if (e->valid) {
+            if (difftime(now, e->added) > SR_ARPCACHE_TO) {
+                arpcache_remove(cache, cache->hand);
+                cache->expirations++;
+                return;
+            }
+            if (!e->ref) {
+                arpcache_remove(cache, cache->hand);
+                cache->evictions++;
+                return;
+            }
+            e->ref = 0;
+        }
+        cache->hand = (cache->hand + 1) & mask;
     }
+}
+
+/* Lock-free lookup, see sr_arpcache.h. The probe reads slots that a
+   writer may be moving; the copy is only returned if seq shows that no
+   write section overlapped it. */
+int sr_arpcache_lookup_copy(struct sr_arpcache *cache, uint32_t ip,
+                            struct sr_arpentry *entry) {
+    volatile struct sr_arpslot *slots = cache->entries;
+    uint32_t mask = cache->size - 1;
+    uint32_t seq, i, n;
+    int found;
+    
+    do {
+        /* A single slot update is in progress; if it takes long the writer
+           has been preempted, so give it the CPU */
+        for (n = 0; (seq = cache->seq) & 1; n++) {
+            if (n >= 64)
+                sched_yield();
+        }
+        __sync_synchronize();
         
-    pthread_mutex_unlock(&(cache->lock));
+        found = 0;
+        i = arpcache_home(cache, ip);
+        for (n = 0; n <= mask && slots[i].valid; n++) {
+            if (slots[i].ip == ip) {
+                memcpy(entry->mac, (const void *)slots[i].mac, 6);
+                entry->ip = ip;
+                entry->added = slots[i].added;
+                entry->valid = 1;
+                found = 1;
+                break;
+            }
+            i = (i + 1) & mask;
+        }
+        
+        __sync_synchronize();
+    } while (cache->seq != seq);
+    
+    /* CLOCK reference bit; a lost update only costs a second chance */
+    if (found && !slots[i].ref)
+        slots[i].ref = 1;
+    
+    return found;
+}
+
+/* Checks if an IP->MAC mapping is in the cache. IP is in network byte order.
+   You must free the returned structure if it is not NULL. */
+struct sr_arpentry *sr_arpcache_lookup(struct sr_arpcache *cache, uint32_t ip) {
+    struct sr_arpentry entry, *copy = NULL;
+    
+    if (sr_arpcache_lookup_copy(cache, ip, &entry)) {
+        copy = (struct sr_arpentry *) malloc(sizeof(struct sr_arpentry));
+        memcpy(copy, &entry, sizeof(struct sr_arpentry));
+    }
     
     return copy;
 }
 
 /* Adds an ARP request to the ARP request queue. If the request is already on
-   the queue, adds the packet to the linked list of packets for this sr_arpreq
-   that corresponds to this ARP request. You should free the passed *packet.
+   the queue, appends the packet to the list of packets for this sr_arpreq
+   that corresponds to this ARP request. Takes ownership of the packet
+   buffer, which is linked in as it is, or freed if it does not fit under
+   the queue limits.
    
-   A pointer to the ARP request is returned; it should not be freed. The caller
-   can remove the ARP request from the queue by calling sr_arpreq_destroy. */
+   A pointer to the ARP request is returned, or NULL if the packet was
+   dropped; it should not be freed. The caller can remove the ARP request
+   from the queue by calling sr_arpreq_destroy. */
 struct sr_arpreq *sr_arpcache_queuereq(struct sr_arpcache *cache,
                                        uint32_t ip,
-                                       uint8_t *packet,           /* borrowed */
-                                       unsigned int packet_len,
-                                       char *iface)
+                                       struct sr_pktbuf *packet,  /* owned */
+                                       unsigned int ifindex)
 {
-    pthread_mutex_lock(&(cache->lock));
+    unsigned int packet_len = packet ? packet->len : 0;
+    
+    arpcache_lock(cache);
     
     struct sr_arpreq *req;
     for (req = cache->requests; req != NULL; req = req->next) {
@@ -274,28 +424,51 @@ struct sr_arpreq *sr_arpcache_queuereq(struct sr_arpcache *cache,
         }
     }
     
+    /* Tail drop once the destination or the cache as a whole holds too
+       much; the packets already queued keep their place */
+    if (packet) {
+        uint32_t held = req ? req->bytes : 0;
+        
+        if (held + packet_len > SR_ARPREQ_MAX_BYTES) {
+            cache->queue_drops++;
+            packet_len = 0;
+        } else if (cache->pending_bytes + packet_len > SR_ARPCACHE_MAX_PENDING) {
+            cache->pending_drops++;
+            packet_len = 0;
+        }
+        if (packet_len == 0) {
+            arpcache_unlock(cache);
+            sr_pktbuf_free(packet);
+            return NULL;
+        }
+    }
+    
     /* If the IP wasn't found, add it */
     if (!req) {
         req = (struct sr_arpreq *) calloc(1, sizeof(struct sr_arpreq));
         req->ip = ip;
         req->next = cache->requests;
         cache->requests = req;
+        
+        /* First ARP request goes out as soon as the timeout thread runs */
+        sr_timer_init(&(req->timer), handle_arpreq, cache);
+        arpcache_timer_add(cache, &(req->timer), sr_timer_now());
     }
     
-    /* Add the packet to the list of packets for this request */
-    if (packet && packet_len && iface) {
-        struct sr_packet *new_pkt = (struct sr_packet *)malloc(sizeof(struct sr_packet));
-        
-        new_pkt->buf = (uint8_t *)malloc(packet_len);
-        memcpy(new_pkt->buf, packet, packet_len);
-        new_pkt->len = packet_len;
-		new_pkt->iface = (char *)malloc(sr_IFACE_NAMELEN);
-        strncpy(new_pkt->iface, iface, sr_IFACE_NAMELEN);
-        new_pkt->next = req->packets;
-        req->packets = new_pkt;
+    /* Append the packet, so that held packets leave in arrival order */
+    if (packet) {
+        packet->ifindex = ifindex;
+        packet->next = NULL;
+        if (req->tail)
+            req->tail->next = packet;
+        else
+            req->packets = packet;
+        req->tail = packet;
+        req->bytes += packet_len;
+        cache->pending_bytes += packet_len;
     }
     
-    pthread_mutex_unlock(&(cache->lock));
+    arpcache_unlock(cache);
     
     return req;
 }
@@ -308,7 +481,7 @@ struct sr_arpreq *sr_arpcache_insert(struct sr_arpcache *cache,
                                      unsigned char *mac,
                                      uint32_t ip)
 {
-    pthread_mutex_lock(&(cache->lock));
+    arpcache_lock(cache);
     
     struct sr_arpreq *req, *prev = NULL, *next = NULL; 
     for (req = cache->requests; req != NULL; req = req->next) {
@@ -321,34 +494,68 @@ struct sr_arpreq *sr_arpcache_insert(struct sr_arpcache *cache,
                 next = req->next;
                 cache->requests = next;
             }
+            sr_timer_cancel(&(cache->wheel), &(req->timer));
+            cache->pending_bytes -= req->bytes;
             
             break;
         }
         prev = req;
     }
     
-    int i;
-    for (i = 0; i < SR_ARPCACHE_SZ; i++) {
-        if (!(cache->entries[i].valid))
-            break;
-    }
+    time_t now = time(NULL);
+    long i = arpcache_find(cache, ip);
+    struct sr_arptimer *t;
     
-    if (i != SR_ARPCACHE_SZ) {
-        memcpy(cache->entries[i].mac, mac, 6);
+    arpcache_write_begin(cache);
+    if (i < 0) {
+        if (cache->count >= cache->capacity) {
+            arpcache_evict(cache, now);
+        }
+        i = arpcache_home(cache, ip);
+        while (cache->entries[i].valid) {
+            i = (i + 1) & (cache->size - 1);
+        }
+        t = cache->timers_free;
+        cache->timers_free = (struct sr_arptimer *) t->timer.next;
+        sr_timer_init(&(t->timer), arpcache_expire, cache);
+        t->ip = ip;
         cache->entries[i].ip = ip;
-        cache->entries[i].added = time(NULL);
+        cache->entries[i].timer = t - cache->timers;
         cache->entries[i].valid = 1;
+        cache->count++;
     }
     
-    pthread_mutex_unlock(&(cache->lock));
+    memcpy(cache->entries[i].mac, mac, 6);
+    cache->entries[i].added = now;
+    cache->entries[i].ref = 1;
+    arpcache_write_end(cache);
+    cache->inserts++;
+    
+    t = &(cache->timers[cache->entries[i].timer]);
+    arpcache_timer_add(cache, &(t->timer),
+                       sr_timer_now() + (uint64_t)(SR_ARPCACHE_TO * 1000));
+    
+    arpcache_unlock(cache);
     
     return req;
 }
 
+/* Frees a request and the packets waiting on it. */
+static void arpreq_free(struct sr_arpreq *entry) {
+    struct sr_pktbuf *pkt, *nxt;
+    
+    for (pkt = entry->packets; pkt; pkt = nxt) {
+        nxt = pkt->next;
+        sr_pktbuf_free(pkt);
+    }
+    
+    free(entry);
+}
+
 /* Frees all memory associated with this arp request entry. If this arp request
    entry is on the arp request queue, it is removed from the queue. */
 void sr_arpreq_destroy(struct sr_arpcache *cache, struct sr_arpreq *entry) {
-    pthread_mutex_lock(&(cache->lock));
+    arpcache_lock(cache);
     
     if (entry) {
         struct sr_arpreq *req, *prev = NULL, *next = NULL; 
@@ -362,27 +569,18 @@ void sr_arpreq_destroy(struct sr_arpcache *cache, struct sr_arpreq *entry) {
                     next = req->next;
                     cache->requests = next;
                 }
+                cache->pending_bytes -= req->bytes;
                 
                 break;
             }
             prev = req;
         }
         
-        struct sr_packet *pkt, *nxt;
-        
-        for (pkt = entry->packets; pkt; pkt = nxt) {
-            nxt = pkt->next;
-            if (pkt->buf)
-                free(pkt->buf);
-            if (pkt->iface)
-                free(pkt->iface);
-            free(pkt);
-        }
-        
-        free(entry);
+        sr_timer_cancel(&(cache->wheel), &(entry->timer));
+        arpreq_free(entry);
     }
     
-    pthread_mutex_unlock(&(cache->lock));
+    arpcache_unlock(cache);
 }
 
 /* Prints out the ARP table. */
@@ -390,25 +588,82 @@ void sr_arpcache_dump(struct sr_arpcache *cache) {
     fprintf(stderr, "\nMAC            IP         ADDED                      VALID\n");
     fprintf(stderr, "-----------------------------------------------------------\n");
     
-    int i;
-    for (i = 0; i < SR_ARPCACHE_SZ; i++) {
-        struct sr_arpentry *cur = &(cache->entries[i]);
+    uint32_t i;
+    for (i = 0; i < cache->size; i++) {
+        struct sr_arpslot *cur = &(cache->entries[i]);
         unsigned char *mac = cur->mac;
+        if (!cur->valid)
+            continue;
         fprintf(stderr, "%.1x%.1x%.1x%.1x%.1x%.1x   %.8x   %.24s   %d\n", mac[0], mac[1], mac[2], mac[3], mac[4], mac[5], ntohl(cur->ip), ctime(&(cur->added)), cur->valid);
     }
     
     fprintf(stderr, "\n");
 }
 
+/* Prints occupancy and eviction counters. */
+void sr_arpcache_print_stats(struct sr_arpcache *cache) {
+    arpcache_lock(cache);
+    fprintf(stderr, "ARP cache: %u/%u entries (%u slots), %lu inserts, "
+            "%lu evictions, %lu expirations\n", cache->count, cache->capacity,
+            cache->size, cache->inserts, cache->evictions, cache->expirations);
+    fprintf(stderr, "ARP queue: %u bytes held, %lu drops at the per-host "
+            "limit, %lu at the total limit\n", cache->pending_bytes,
+            cache->queue_drops, cache->pending_drops);
+    arpcache_unlock(cache);
+}
+
 /* Initialize table + table lock. Returns 0 on success. */
-int sr_arpcache_init(struct sr_arpcache *cache) {  
-    /* Seed RNG to kick out a random entry if all entries full. */
-    srand(time(NULL));
+int sr_arpcache_init(struct sr_arpcache *cache, unsigned int capacity) {  
+    if (capacity == 0)
+        capacity = SR_ARPCACHE_SZ;
+    
+    /* Table at most 3/4 full */
+    cache->size = 16;
+    cache->shift = 28;
+    while (cache->size < capacity + capacity / 3 + 1) {
+        cache->size <<= 1;
+        cache->shift--;
+    }
+    cache->capacity = capacity;
+    cache->count = 0;
+    cache->hand = 0;
+    cache->inserts = cache->evictions = cache->expirations = 0;
+    cache->pending_bytes = 0;
+    cache->queue_drops = cache->pending_drops = 0;
+    cache->seq = 0;
     
     /* Invalidate all entries */
-    memset(cache->entries, 0, sizeof(cache->entries));
+    cache->entries = (struct sr_arpslot *) calloc(cache->size, sizeof(struct sr_arpslot));
+    if (!cache->entries)
+        return -1;
     cache->requests = NULL;
     
+    /* One expiry timer per entry, all on the free list */
+    cache->timers = (struct sr_arptimer *) calloc(capacity, sizeof(struct sr_arptimer));
+    if (!cache->timers)
+        return -1;
+    cache->timers_free = NULL;
+    uint32_t i;
+    for (i = capacity; i > 0; i--) {
+        cache->timers[i - 1].timer.next = &(cache->timers_free->timer);
+        cache->timers_free = &(cache->timers[i - 1]);
+    }
+    sr_timer_wheel_init(&(cache->wheel), sr_timer_now());
+    cache->sends = NULL;
+    cache->nsends = cache->sends_cap = 0;
+    cache->spare = NULL;
+    cache->spare_cap = 0;
+    cache->failed = NULL;
+    cache->sleep_until = 0;
+    cache->single = 0;
+    
+    /* Timed waits are against the same clock as the wheel */
+    pthread_condattr_t cattr;
+    pthread_condattr_init(&cattr);
+    pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC);
+    pthread_cond_init(&(cache->cond), &cattr);
+    pthread_condattr_destroy(&cattr);
+    
     /* Acquire mutex lock */
     pthread_mutexattr_init(&(cache->attr));
     pthread_mutexattr_settype(&(cache->attr), PTHREAD_MUTEX_RECURSIVE);
@@ -419,34 +674,96 @@ int sr_arpcache_init(struct sr_arpcache *cache) {
 
 /* Destroys table + table lock. Returns 0 on success. */
 int sr_arpcache_destroy(struct sr_arpcache *cache) {
+    free(cache->entries);
+    cache->entries = NULL;
+    free(cache->timers);
+    cache->timers = NULL;
+    free(cache->sends);
+    cache->sends = NULL;
+    free(cache->spare);
+    cache->spare = NULL;
+    cache->failed = NULL;
+    pthread_cond_destroy(&(cache->cond));
     return pthread_mutex_destroy(&(cache->lock)) && pthread_mutexattr_destroy(&(cache->attr));
 }
 
-/* Thread which sweeps through the cache and invalidates entries that were added
-   more than SR_ARPCACHE_TO seconds ago. */
-void *sr_arpcache_timeout(void *sr_ptr) {
-    struct sr_instance *sr = sr_ptr;
+/* Runs the cache's due timers: ages out entries and retransmits or gives
+   up on ARP requests. Called with the lock held; sends happen with it
+   dropped. Returns when the next timer is due (ms), 0 if none is set. */
+static uint64_t arpcache_run(struct sr_instance *sr) {
     struct sr_arpcache *cache = &(sr->cache);
     
     while (1) {
-        sleep(1.0);
+        sr_timer_wheel_advance(&(cache->wheel), sr_timer_now());
         
-        pthread_mutex_lock(&(cache->lock));
-    
-        time_t curtime = time(NULL);
+        /* Take the work the timers recorded; swap buffers so the next
+           round can record into ours */
+        struct sr_arpsend *sends = cache->sends;
+        uint32_t sends_cap = cache->sends_cap;
+        uint32_t nsends = cache->nsends;
+        struct sr_arpreq *failed = cache->failed;
+        if (!nsends && !failed)
+            return sr_timer_wheel_next(&(cache->wheel));
+        cache->sends = cache->spare;
+        cache->sends_cap = cache->spare_cap;
+        cache->nsends = 0;
+        cache->failed = NULL;
+        cache->spare = sends;
+        cache->spare_cap = sends_cap;
         
-        int i;    
-        for (i = 0; i < SR_ARPCACHE_SZ; i++) {
-            if ((cache->entries[i].valid) && (difftime(curtime,cache->entries[i].added) > SR_ARPCACHE_TO)) {
-                cache->entries[i].valid = 0;
-            }
+        arpcache_unlock(cache);
+        
+        /* Odd while the FIB may be in use here, see sr_reload.c */
+        sr->arp_epoch++;
+        __sync_synchronize();
+        
+        uint32_t i;
+        for (i = 0; i < nsends; i++)
+            send_arp_request_for_req(sr, &(sends[i]));
+        while (failed) {
+            struct sr_arpreq *next = failed->next;
+            send_icmp_host_unreachable(sr, failed);
+            arpreq_free(failed);
+            failed = next;
         }
+        sr_vns_flush(sr);
         
-        sr_arpcache_sweepreqs(sr);
+        __sync_synchronize();
+        sr->arp_epoch++;
+        
+        arpcache_lock(cache);
+    }
+}
 
-        pthread_mutex_unlock(&(cache->lock));
+/* Runs the timers that are due, for an event loop which does the timeout
+   thread's work itself. Returns when to call again (ms), 0 for never. */
+uint64_t sr_arpcache_run_timers(struct sr_instance *sr) {
+    arpcache_lock(&(sr->cache));
+    uint64_t next = arpcache_run(sr);
+    arpcache_unlock(&(sr->cache));
+    return next;
+}
+
+/* Thread which runs the cache's timers, only waking when one is due. */
+void *sr_arpcache_timeout(void *sr_ptr) {
+    struct sr_instance *sr = sr_ptr;
+    struct sr_arpcache *cache = &(sr->cache);
+    
+    arpcache_lock(cache);
+    
+    while (1) {
+        uint64_t next = arpcache_run(sr);
+        cache->sleep_until = next;
+        if (next == 0) {
+            pthread_cond_wait(&(cache->cond), &(cache->lock));
+        } else {
+            struct timespec ts;
+            ts.tv_sec = next / 1000;
+            ts.tv_nsec = (next % 1000) * 1000000;
+            pthread_cond_timedwait(&(cache->cond), &(cache->lock), &ts);
+        }
+        cache->sleep_until = 0;
     }
     
     return NULL;
 }
-
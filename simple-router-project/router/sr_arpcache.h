@@ -50,17 +50,22 @@
 
    To meet the guidelines in the assignment (ARP requests are sent every second
    until we send 5 ARP requests, then we send ICMP host unreachable back to
-   all packets waiting on this ARP request), you must fill out the following
-   function that is called every second and is defined in sr_arpcache.c:
-
-   void sr_arpcache_sweepreqs(struct sr_instance *sr) {
-       for each request on sr->cache.requests:
-           handle_arpreq(request)
-   }
-
-   Since handle_arpreq as defined in the comments above could destroy your
-   current request, make sure to save the next pointer before calling
-   handle_arpreq when traversing through the ARP requests linked list.
+   all packets waiting on this ARP request), every request carries a timer
+   on the cache's timer wheel (see sr_timer.h). Queuing a new request arms
+   it to fire at once; each expiry sends one ARP request and re-arms it
+   SR_ARPREQ_INTERVAL ms later, and the expiry after the fifth send gives
+   up on the request. Cache entries age out the same way, each on its own
+   timer SR_ARPCACHE_TO seconds after it was last inserted.
+
+   The timers run on the timeout thread with the cache lock held, so they
+   only record what has to be done. The thread sends the ARP requests and
+   the ICMP host unreachable messages after dropping the lock, and sleeps
+   until the next timer is due -- indefinitely when there is nothing left
+   to time.
+
+   With one thread doing everything (sr -E), there is no timeout thread:
+   the event loop runs the timers between messages through
+   sr_arpcache_run_timers, and the cache is never locked.
  */
 
 #ifndef SR_ARPCACHE_H
@@ -70,16 +75,15 @@
 #include <time.h>
 #include <pthread.h>
 #include "sr_if.h"
+#include "sr_timer.h"
+#include "sr_pktbuf.h"
 
-#define SR_ARPCACHE_SZ    100  
+#define SR_ARPCACHE_SZ    4096 /* default capacity (entries), see -A */
 #define SR_ARPCACHE_TO    15.0
-
-struct sr_packet {
-    uint8_t *buf;               /* A raw Ethernet frame, presumably with the dest MAC empty */
-    unsigned int len;           /* Length of raw Ethernet frame */
-    char *iface;                /* The outgoing interface */
-    struct sr_packet *next;
-};
+#define SR_ARPREQ_INTERVAL 1000 /* ms between ARP request retransmissions */
+#define SR_ARPREQ_TRIES   5
+#define SR_ARPREQ_MAX_BYTES (64 * 1024)    /* held per destination */
+#define SR_ARPCACHE_MAX_PENDING (4 * 1024 * 1024) /* held in total */
 
 struct sr_arpentry {
     unsigned char mac[6]; 
@@ -95,13 +99,77 @@ struct sr_arpreq {
                                    never sent, will be 0. */
     uint32_t times_sent;        /* Number of times this request was sent. You 
                                    should update this. */
-    struct sr_packet *packets;  /* List of pkts waiting on this req to finish */
+    struct sr_pktbuf *packets;  /* List of pkts waiting on this req to finish,
+                                   oldest first; each a raw Ethernet frame
+                                   with the dest MAC empty, its ifindex
+                                   the outgoing interface */
+    struct sr_pktbuf *tail;     /* Last of them, new packets go after it */
+    uint32_t bytes;             /* Total length of the waiting pkts */
+    struct sr_timer timer;      /* next retransmission */
     struct sr_arpreq *next;
 };
 
+/* One slot of the neighbour table.  24 bytes, so a probe sequence stays
+   within one or two cache lines. */
+struct sr_arpslot {
+    uint32_t ip;                /* IP addr in network byte order */
+    unsigned char mac[6];
+    uint8_t valid;
+    uint8_t ref;                /* CLOCK reference bit, set on lookup */
+    uint32_t timer;             /* index of its expiry timer in 'timers' */
+    time_t added;
+};
+
+/* Expiry timer of one neighbour table entry. */
+struct sr_arptimer {
+    struct sr_timer timer;
+    uint32_t ip;
+};
+
+/* An ARP request to be sent once the cache lock is dropped. */
+struct sr_arpsend {
+    uint32_t ip;
+    unsigned int ifindex;
+};
+
+/* The neighbour table is an open-addressing hash on IP (linear probing,
+   backward-shift deletion), sized at init for 'capacity' entries at no
+   more than 75% load.  When it is full an insert evicts an entry chosen
+   by the CLOCK hand: expired entries go first, then entries not looked
+   up since the hand last passed them.
+
+   Writers hold 'lock'.  Readers need no lock: every change to the slot
+   array is bracketed by two increments of 'seq' (odd while a change is
+   in progress) and sr_arpcache_lookup_copy retries if seq moved while it
+   probed.  A write section covers one insert or one removal, never a
+   whole sweep, so a reader waits at most for a single slot update. */
 struct sr_arpcache {
-    struct sr_arpentry entries[SR_ARPCACHE_SZ];
+    struct sr_arpslot *entries; /* 'size' slots */
+    uint32_t size;              /* power of 2 */
+    uint32_t shift;             /* 32 - log2(size), for the hash */
+    uint32_t capacity;          /* maximum live entries */
+    uint32_t count;             /* live entries */
+    uint32_t hand;              /* CLOCK hand, a slot index */
+    unsigned long inserts;
+    unsigned long evictions;    /* live entries pushed out when full */
+    unsigned long expirations;  /* entries aged out by the timeout thread */
+    uint32_t pending_bytes;     /* held on all requests */
+    unsigned long queue_drops;  /* pkts refused, SR_ARPREQ_MAX_BYTES */
+    unsigned long pending_drops; /* pkts refused, SR_ARPCACHE_MAX_PENDING */
+    volatile uint32_t seq;      /* seqlock over entries[] */
     struct sr_arpreq *requests;
+    struct sr_timer_wheel wheel;
+    struct sr_arptimer *timers; /* 'capacity' expiry timers */
+    struct sr_arptimer *timers_free;
+    struct sr_arpsend *sends;   /* ARP requests due, see sr_arpcache_timeout */
+    uint32_t nsends;
+    uint32_t sends_cap;
+    struct sr_arpsend *spare;   /* the other buffer, being sent from */
+    uint32_t spare_cap;
+    struct sr_arpreq *failed;   /* requests that ran out of retries */
+    uint64_t sleep_until;       /* timeout thread wakes by then, 0 = never */
+    pthread_cond_t cond;        /* wakes the timeout thread */
+    int single;                 /* one thread owns the cache: no locking */
     pthread_mutex_t lock;
     pthread_mutexattr_t attr;
 };
@@ -110,18 +178,28 @@ struct sr_arpcache {
    You must free the returned structure if it is not NULL. */
 struct sr_arpentry *sr_arpcache_lookup(struct sr_arpcache *cache, uint32_t ip);
 
-/* Adds an ARP request to the ARP request queue. If the request is already on
-   the queue, adds the packet to the linked list of packets for this sr_arpreq
-   that corresponds to this ARP request. The packet argument should not be
-   freed by the caller.
+/* Lock-free, allocation-free lookup: copies the mapping for ip into *entry
+   and returns 1, or returns 0 if ip is not cached. Safe to call without
+   holding the cache lock, concurrently with inserts and the timeout
+   thread. */
+int sr_arpcache_lookup_copy(struct sr_arpcache *cache, uint32_t ip,
+                            struct sr_arpentry *entry);
 
-   A pointer to the ARP request is returned; it should be freed. The caller
-   can remove the ARP request from the queue by calling sr_arpreq_destroy. */
+/* Adds an ARP request to the ARP request queue. If the request is already on
+   the queue, appends the packet to the list of packets for this sr_arpreq
+   that corresponds to this ARP request. The packet buffer is linked into
+   the queue as it is and belongs to the cache from here on; the caller
+   must not touch it again.
+
+   The packet is tail-dropped (freed) if it would take the packets held for
+   ip past SR_ARPREQ_MAX_BYTES or those held in total past
+   SR_ARPCACHE_MAX_PENDING, and NULL is returned. Otherwise a pointer to the
+   ARP request is returned; it should not be freed. The caller can remove
+   the ARP request from the queue by calling sr_arpreq_destroy. */
 struct sr_arpreq *sr_arpcache_queuereq(struct sr_arpcache *cache,
                          uint32_t ip,
-                         uint8_t *packet,               /* borrowed */
-                         unsigned int packet_len,
-                         char *iface);
+                         struct sr_pktbuf *packet,      /* owned */
+                         unsigned int ifindex);
 
 /* This method performs two functions:
    1) Looks up this IP in the request queue. If it is found, returns a pointer
@@ -138,13 +216,22 @@ void sr_arpreq_destroy(struct sr_arpcache *cache, struct sr_arpreq *entry);
 /* Prints out the ARP table. */
 void sr_arpcache_dump(struct sr_arpcache *cache);
 
+/* Prints occupancy and eviction counters. */
+void sr_arpcache_print_stats(struct sr_arpcache *cache);
+
 /* You shouldn't have to call these methods--they're already called in the
    starter code for you. The init call is a constructor, the destroy call is
-   a destructor, and a cleanup thread times out cache entries every 15
-   seconds. */
+   a destructor, and the timeout thread runs the cache's timers. capacity
+   is the number of entries to size the table for, 0 for SR_ARPCACHE_SZ. */
 
-int   sr_arpcache_init(struct sr_arpcache *cache);
+int   sr_arpcache_init(struct sr_arpcache *cache, unsigned int capacity);
 int   sr_arpcache_destroy(struct sr_arpcache *cache);
 void *sr_arpcache_timeout(void *cache_ptr);
 
+/* Runs the due timers in the caller's thread, for an event loop that does
+   the timeout thread's work (see sr_vns_uring_run, sr_vns_epoll_run).
+   Returns when the next timer is due in sr_timer_now() ms, 0 if none is
+   set. */
+uint64_t sr_arpcache_run_timers(struct sr_instance *sr);
+
 #endif
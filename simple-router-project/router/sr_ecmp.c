@@ -0,0 +1,174 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_ecmp.c
+ *
+ * Description:
+ *
+ * ECMP groups and flow hashing.  See sr_ecmp.h.
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+
+#include "sr_ecmp.h"
+#include "sr_rt.h"
+#include "sr_if.h"
+#include "sr_adj.h"
+#include "sr_router.h"
+
+#define SR_ECMP_WEIGHT_MAX 64 /* weight of the fastest member */
+
+/*---------------------------------------------------------------------
+ * Method: sr_ecmp_add
+ * Scope:  Global
+ *
+ *---------------------------------------------------------------------*/
+
+int sr_ecmp_add(struct sr_rt* head, struct sr_rt* rt)
+{
+    struct sr_ecmp* group = head->ecmp;
+    unsigned int i;
+
+    assert(head);
+    assert(rt);
+
+    if (!group) {
+        if (head->gw.s_addr == rt->gw.s_addr &&
+            strncmp(head->interface, rt->interface, sr_IFACE_NAMELEN) == 0) {
+            return 1;
+        }
+        group = (struct sr_ecmp*)calloc(1, sizeof(struct sr_ecmp));
+        if (!group) {
+            return -1;
+        }
+        group->members[0].rt = head;
+        group->nmembers = 1;
+        head->ecmp = group;
+    }
+
+    for (i = 0; i < group->nmembers; i++) {
+        struct sr_rt* m = group->members[i].rt;
+        if (m->gw.s_addr == rt->gw.s_addr &&
+            strncmp(m->interface, rt->interface, sr_IFACE_NAMELEN) == 0) {
+            return 1;
+        }
+    }
+    if (group->nmembers == SR_ECMP_MAX) {
+        return -1;
+    }
+
+    group->members[group->nmembers++].rt = rt;
+    group->built = 0;
+    return 0;
+} /* -- sr_ecmp_add -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_ecmp_build
+ * Scope:  Global
+ *
+ * Resolve member interfaces and spread the SR_ECMP_SLOTS buckets over the
+ * members in proportion to interface speed (an unknown speed counts as
+ * the slowest known link).  Smooth weighted round robin interleaves the
+ * members so that neighbouring buckets go to different next hops.
+ *
+ *---------------------------------------------------------------------*/
+
+void sr_ecmp_build(struct sr_instance* sr, struct sr_ecmp* group)
+{
+    uint32_t weight[SR_ECMP_MAX];
+    int32_t current[SR_ECMP_MAX];
+    uint32_t min_speed = 0, max_speed = 0, total = 0;
+    unsigned int i, s;
+
+    assert(sr);
+    assert(group);
+
+    for (i = 0; i < group->nmembers; i++) {
+        struct sr_ecmp_member* m = &group->members[i];
+
+        m->iface = sr_get_interface_by_index(sr, m->rt->ifindex);
+        m->adj = 0;
+        if (m->iface && m->rt->gw.s_addr && sr->adj_table) {
+            m->adj = sr_adj_get(sr->adj_table, m->iface, m->rt->gw.s_addr);
+        }
+        if (m->iface && m->iface->speed) {
+            if (min_speed == 0 || m->iface->speed < min_speed) {
+                min_speed = m->iface->speed;
+            }
+            if (m->iface->speed > max_speed) {
+                max_speed = m->iface->speed;
+            }
+        }
+    }
+    if (min_speed == 0) {
+        min_speed = max_speed = 1;
+    }
+
+    /* -- weights 1..SR_ECMP_WEIGHT_MAX, relative to the fastest link -- */
+    for (i = 0; i < group->nmembers; i++) {
+        const struct sr_if* iface = group->members[i].iface;
+
+        weight[i] = 0;
+        if (iface) {
+            double speed = iface->speed ? iface->speed : min_speed;
+            weight[i] = (uint32_t)(SR_ECMP_WEIGHT_MAX * speed / max_speed
+                                   + 0.5);
+            if (weight[i] == 0) {
+                weight[i] = 1;
+            }
+        }
+        current[i] = 0;
+        total += weight[i];
+    }
+
+    memset(group->slots, 0, sizeof(group->slots));
+    if (total > 0) {
+        for (s = 0; s < SR_ECMP_SLOTS; s++) {
+            unsigned int best = 0;
+
+            for (i = 0; i < group->nmembers; i++) {
+                current[i] += weight[i];
+                if (weight[i] && (weight[best] == 0 ||
+                                  current[i] > current[best])) {
+                    best = i;
+                }
+            }
+            current[best] -= total;
+            group->slots[s] = best;
+        }
+    }
+    group->built = 1;
+} /* -- sr_ecmp_build -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_flow_hash
+ * Scope:  Global
+ *
+ * len is the number of bytes available from ip_hdr on.
+ *
+ *---------------------------------------------------------------------*/
+
+uint32_t sr_flow_hash(const sr_ip_hdr_t* ip_hdr, unsigned int len)
+{
+    unsigned int hl = ip_hdr->ip_hl * 4;
+    uint32_t h = ip_hdr->ip_src * 0x9e3779b1u;
+
+    h ^= ip_hdr->ip_dst;
+    h *= 0x85ebca6bu;
+    h ^= ip_hdr->ip_p;
+
+    if ((ip_hdr->ip_p == ip_protocol_tcp || ip_hdr->ip_p == ip_protocol_udp)
+        && !(ntohs(ip_hdr->ip_off) & (IP_MF | IP_OFFMASK)) && len >= hl + 4) {
+        uint32_t ports;
+        memcpy(&ports, (const uint8_t*)ip_hdr + hl, sizeof(ports));
+        h ^= ports;
+        h *= 0xc2b2ae35u;
+    }
+
+    h ^= h >> 16;
+    h *= 0x7feb352du;
+    h ^= h >> 15;
+    return h;
+} /* -- sr_flow_hash -- */
@@ -0,0 +1,88 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_ecmp.h
+ *
+ * Description:
+ *
+ * Equal-cost multipath.  Routing table lines with the same destination
+ * and mask but a different gateway or interface form one ECMP group.
+ * The first such route is the one installed in the FIB; it carries the
+ * group in sr_rt.ecmp and every member (itself included) is listed there.
+ *
+ * A packet picks its member from a hash of its 5-tuple, so all packets of
+ * a flow leave through the same next hop and are never reordered.
+ * Members are weighted by the link speed of their output interface
+ * (sr_if.speed, from HWSPEED): the group owns SR_ECMP_SLOTS hash buckets
+ * and each member gets a share of them proportional to its speed.  The
+ * buckets are built on first use, once the interface list is known.
+ *
+ *---------------------------------------------------------------------------*/
+
+#ifndef SR_ECMP_H
+#define SR_ECMP_H
+
+#ifdef _LINUX_
+#include <stdint.h>
+#endif /* _LINUX_ */
+
+#ifdef _DARWIN_
+#include <inttypes.h>
+#endif /* _DARWIN_ */
+
+#include "sr_protocol.h"
+
+struct sr_rt;
+struct sr_if;
+struct sr_adj;
+struct sr_instance;
+
+#define SR_ECMP_MAX   16   /* members per group */
+#define SR_ECMP_SLOTS 256  /* hash buckets per group, power of 2 */
+
+struct sr_ecmp_member
+{
+    struct sr_rt* rt;
+    struct sr_if* iface;        /* output interface, set when built */
+    struct sr_adj* adj;         /* gateway adjacency, NULL if direct */
+};
+
+struct sr_ecmp
+{
+    struct sr_ecmp_member members[SR_ECMP_MAX];
+    unsigned int nmembers;
+    int built;                  /* slots[] and member ifaces are valid */
+    uint8_t slots[SR_ECMP_SLOTS]; /* bucket -> member index */
+};
+
+/* Add rt to the group of head, the route installed for the same prefix.
+   Returns 0 if added, 1 if rt duplicates a member (ignored, first match
+   wins as before) and -1 if the group is full or out of memory. */
+int sr_ecmp_add(struct sr_rt* head, struct sr_rt* rt);
+
+/* Fill in member interfaces and adjacencies and lay out the weighted
+   buckets.  Called on first use from the packet path. */
+void sr_ecmp_build(struct sr_instance* sr, struct sr_ecmp* group);
+
+/* Hash of the IP 5-tuple (ports only for unfragmented TCP and UDP). */
+uint32_t sr_flow_hash(const sr_ip_hdr_t* ip_hdr, unsigned int len);
+
+/*---------------------------------------------------------------------
+ * Method: sr_ecmp_pick
+ *
+ * Member of group for a flow with hash 'hash'.  Returns NULL if the group
+ * has no usable member (no output interface exists).
+ *
+ *---------------------------------------------------------------------*/
+
+static __inline__ struct sr_ecmp_member* sr_ecmp_pick(
+        struct sr_instance* sr, struct sr_ecmp* group, uint32_t hash)
+{
+    struct sr_ecmp_member* m;
+
+    if (!group->built) {
+        sr_ecmp_build(sr, group);
+    }
+    m = &group->members[group->slots[hash & (SR_ECMP_SLOTS - 1)]];
+    return m->iface ? m : 0;
+}
+
+#endif /* -- SR_ECMP_H -- */
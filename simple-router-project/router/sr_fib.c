@@ -0,0 +1,1254 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_fib.c
+ *
+ * Description:
+ *
+ * DIR-24-8 forwarding table.  See sr_fib.h for the entry layout.
+ *
+ * Rules are kept in an array indexed by the INDEX field of the table
+ * entries, with a (prefix,depth) hash on the side so that a delete can
+ * find the next shorter covering prefix without walking the routing
+ * table.  Inserts and deletes only rewrite the tbl24/tbl8 entries covered
+ * by the prefix being changed.
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "sr_fib.h"
+#include "sr_rt.h"
+#include "sr_if.h"
+#include "sr_adj.h"
+#include "sr_router.h"
+
+#define SR_FIB_HASH_INIT   1024
+#define SR_FIB_RULES_INIT  256
+#define SR_FIB_TBL8_INIT   64
+
+static uint32_t fib_depth_mask(uint32_t depth)
+{
+    return depth ? (0xffffffffu << (32 - depth)) : 0;
+}
+
+static uint32_t fib_entry(uint32_t index, uint32_t depth)
+{
+    return SR_FIB_VALID | (depth << SR_FIB_DEPTH_SHIFT) | index;
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_mask_depth
+ * Scope:  Global
+ *
+ * Count the leading ones of a (network byte order) netmask.
+ *
+ *---------------------------------------------------------------------*/
+
+uint32_t sr_fib_mask_depth(struct in_addr mask)
+{
+    uint32_t m = ntohl(mask.s_addr);
+    uint32_t depth = 0;
+
+    while (depth < 32 && (m & 0x80000000u)) {
+        m <<= 1;
+        depth++;
+    }
+    return depth;
+}
+
+/*---------------------------------------------------------------------
+ * Rule hash: open addressing, linear probing, backward-shift delete.
+ * Slots hold rule index + 1 so that 0 means empty.
+ *---------------------------------------------------------------------*/
+
+static uint32_t fib_hash_key(uint32_t prefix, uint32_t depth)
+{
+    uint32_t h = prefix ^ (depth * 0x9e3779b9u);
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    return h;
+}
+
+static int fib_hash_find(const struct sr_fib* fib, uint32_t prefix,
+                         uint32_t depth, uint32_t* index)
+{
+    uint32_t i = fib_hash_key(prefix, depth) & fib->hash_mask;
+
+    while (fib->hash[i]) {
+        const struct sr_fib_rule* r = &fib->rules[fib->hash[i] - 1];
+        if (r->prefix == prefix && r->depth == depth) {
+            *index = fib->hash[i] - 1;
+            return 1;
+        }
+        i = (i + 1) & fib->hash_mask;
+    }
+    return 0;
+}
+
+static void fib_hash_put(struct sr_fib* fib, uint32_t index)
+{
+    const struct sr_fib_rule* r = &fib->rules[index];
+    uint32_t i = fib_hash_key(r->prefix, r->depth) & fib->hash_mask;
+
+    while (fib->hash[i]) {
+        i = (i + 1) & fib->hash_mask;
+    }
+    fib->hash[i] = index + 1;
+}
+
+static int fib_hash_grow(struct sr_fib* fib)
+{
+    uint32_t* old = fib->hash;
+    uint32_t old_sz = fib->hash_mask + 1;
+    uint32_t i;
+
+    fib->hash = (uint32_t*)calloc(old_sz * 2, sizeof(uint32_t));
+    if (!fib->hash) {
+        fib->hash = old;
+        return -1;
+    }
+    fib->hash_mask = old_sz * 2 - 1;
+    for (i = 0; i < old_sz; i++) {
+        if (old[i]) {
+            fib_hash_put(fib, old[i] - 1);
+        }
+    }
+    free(old);
+    return 0;
+}
+
+static void fib_hash_remove(struct sr_fib* fib, uint32_t index)
+{
+    const struct sr_fib_rule* r = &fib->rules[index];
+    uint32_t i = fib_hash_key(r->prefix, r->depth) & fib->hash_mask;
+    uint32_t j;
+
+    while (fib->hash[i] != index + 1) {
+        assert(fib->hash[i]);
+        i = (i + 1) & fib->hash_mask;
+    }
+
+    /* backward shift so probe sequences stay unbroken */
+    j = i;
+    for (;;) {
+        uint32_t home;
+        const struct sr_fib_rule* m;
+
+        j = (j + 1) & fib->hash_mask;
+        if (!fib->hash[j]) {
+            break;
+        }
+        m = &fib->rules[fib->hash[j] - 1];
+        home = fib_hash_key(m->prefix, m->depth) & fib->hash_mask;
+        if (((j - home) & fib->hash_mask) >= ((j - i) & fib->hash_mask)) {
+            fib->hash[i] = fib->hash[j];
+            i = j;
+        }
+    }
+    fib->hash[i] = 0;
+}
+
+/*---------------------------------------------------------------------
+ * Rule and tbl8 group allocation
+ *---------------------------------------------------------------------*/
+
+static int fib_rule_alloc(struct sr_fib* fib, uint32_t* index)
+{
+    if (fib->rules_nfree) {
+        *index = fib->rules_free[--fib->rules_nfree];
+        return 0;
+    }
+    if (fib->rules_used == fib->rules_cap) {
+        uint32_t cap = fib->rules_cap * 2;
+        struct sr_fib_rule* rules;
+        uint32_t* rfree;
+
+        if (fib->rules_cap >= SR_FIB_MAX_RULES) {
+            return -1;
+        }
+        rules = (struct sr_fib_rule*)realloc(fib->rules,
+                                             cap * sizeof(*rules));
+        if (!rules) {
+            return -1;
+        }
+        fib->rules = rules;
+        rfree = (uint32_t*)realloc(fib->rules_free, cap * sizeof(uint32_t));
+        if (!rfree) {
+            return -1;
+        }
+        fib->rules_free = rfree;
+        fib->rules_cap = cap;
+    }
+    *index = fib->rules_used++;
+    return 0;
+}
+
+static int fib_tbl8_alloc(struct sr_fib* fib, uint32_t fill, uint32_t* group)
+{
+    uint32_t* e;
+    int i;
+
+    if (fib->tbl8_nfree) {
+        *group = fib->tbl8_free[--fib->tbl8_nfree];
+    } else {
+        if (fib->tbl8_used == fib->tbl8_groups) {
+            uint32_t groups = fib->tbl8_groups ? fib->tbl8_groups * 2
+                                               : SR_FIB_TBL8_INIT;
+            size_t bytes = (size_t)groups * SR_FIB_TBL8_GROUP *
+                           sizeof(uint32_t);
+            uint32_t* tbl8;
+            uint32_t* gfree;
+
+            if (groups > SR_FIB_INDEX_MASK + 1) {
+                return -1;
+            }
+            if (fib->tbl8_mapped) {
+                /* groups loaded from a snapshot: move them to the heap */
+                tbl8 = (uint32_t*)malloc(bytes);
+                if (tbl8) {
+                    memcpy(tbl8, fib->tbl8, (size_t)fib->tbl8_groups *
+                           SR_FIB_TBL8_GROUP * sizeof(uint32_t));
+                    fib->tbl8_mapped = 0;
+                }
+            } else {
+                tbl8 = (uint32_t*)realloc(fib->tbl8, bytes);
+            }
+            if (!tbl8) {
+                return -1;
+            }
+            fib->tbl8 = tbl8;
+            gfree = (uint32_t*)realloc(fib->tbl8_free,
+                                       groups * sizeof(uint32_t));
+            if (!gfree) {
+                return -1;
+            }
+            fib->tbl8_free = gfree;
+            fib->tbl8_groups = groups;
+        }
+        *group = fib->tbl8_used++;
+    }
+
+    e = &fib->tbl8[(size_t)*group * SR_FIB_TBL8_GROUP];
+    for (i = 0; i < SR_FIB_TBL8_GROUP; i++) {
+        e[i] = fill;
+    }
+    return 0;
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_create
+ * Scope:  Global
+ *
+ * Allocate an empty FIB.  tbl24 is calloc'ed so untouched ranges stay
+ * unbacked zero pages.
+ *
+ *---------------------------------------------------------------------*/
+
+struct sr_fib* sr_fib_create(void)
+{
+    struct sr_fib* fib = (struct sr_fib*)calloc(1, sizeof(struct sr_fib));
+
+    if (!fib) {
+        return 0;
+    }
+
+    fib->tbl24 = (uint32_t*)calloc(SR_FIB_TBL24_SZ, sizeof(uint32_t));
+    fib->tbl8_groups = SR_FIB_TBL8_INIT;
+    fib->tbl8 = (uint32_t*)malloc((size_t)fib->tbl8_groups *
+                                  SR_FIB_TBL8_GROUP * sizeof(uint32_t));
+    fib->tbl8_free = (uint32_t*)malloc(fib->tbl8_groups * sizeof(uint32_t));
+    fib->rules_cap = SR_FIB_RULES_INIT;
+    fib->rules = (struct sr_fib_rule*)malloc(fib->rules_cap *
+                                             sizeof(struct sr_fib_rule));
+    fib->rules_free = (uint32_t*)malloc(fib->rules_cap * sizeof(uint32_t));
+    fib->hash = (uint32_t*)calloc(SR_FIB_HASH_INIT, sizeof(uint32_t));
+    fib->hash_mask = SR_FIB_HASH_INIT - 1;
+
+    if (!fib->tbl24 || !fib->tbl8 || !fib->tbl8_free || !fib->rules ||
+        !fib->rules_free || !fib->hash) {
+        sr_fib_destroy(fib);
+        return 0;
+    }
+    return fib;
+} /* -- sr_fib_create -- */
+
+void sr_fib_destroy(struct sr_fib* fib)
+{
+    if (!fib) {
+        return;
+    }
+    if (fib->map) {
+        munmap(fib->map, fib->map_len);
+    } else {
+        free(fib->tbl24);
+    }
+    if (!fib->tbl8_mapped) {
+        free(fib->tbl8);
+    }
+    free(fib->tbl8_free);
+    free(fib->rules);
+    free(fib->rules_free);
+    free(fib->hash);
+    free(fib);
+} /* -- sr_fib_destroy -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_flush
+ * Scope:  Global
+ *
+ * Drop every rule.  tbl24 is reallocated rather than cleared so that the
+ * kernel hands back zero pages instead of us touching 64MB.
+ *
+ *---------------------------------------------------------------------*/
+
+void sr_fib_flush(struct sr_fib* fib)
+{
+    assert(fib);
+
+    if (fib->tbl8_mapped) {
+        uint32_t* tbl8 = (uint32_t*)malloc((size_t)SR_FIB_TBL8_INIT *
+                                           SR_FIB_TBL8_GROUP *
+                                           sizeof(uint32_t));
+        uint32_t* gfree = (uint32_t*)realloc(fib->tbl8_free,
+                                             SR_FIB_TBL8_INIT *
+                                             sizeof(uint32_t));
+        assert(tbl8 && gfree);
+        fib->tbl8 = tbl8;
+        fib->tbl8_free = gfree;
+        fib->tbl8_groups = SR_FIB_TBL8_INIT;
+        fib->tbl8_mapped = 0;
+    }
+    if (fib->map) {
+        munmap(fib->map, fib->map_len);
+        fib->map = 0;
+        fib->map_len = 0;
+        fib->tbl24 = (uint32_t*)calloc(SR_FIB_TBL24_SZ, sizeof(uint32_t));
+        assert(fib->tbl24);
+    } else if (fib->rules_used) {
+        uint32_t* tbl24 = (uint32_t*)calloc(SR_FIB_TBL24_SZ,
+                                            sizeof(uint32_t));
+        if (tbl24) {
+            free(fib->tbl24);
+            fib->tbl24 = tbl24;
+        } else {
+            memset(fib->tbl24, 0, SR_FIB_TBL24_SZ * sizeof(uint32_t));
+        }
+    }
+    memset(fib->hash, 0, (fib->hash_mask + 1) * sizeof(uint32_t));
+    fib->tbl8_used = 0;
+    fib->tbl8_nfree = 0;
+    fib->rules_used = 0;
+    fib->rules_nfree = 0;
+    fib->nrules = 0;
+    fib->default_rt = 0;
+} /* -- sr_fib_flush -- */
+
+/*---------------------------------------------------------------------
+ * Method: fib_write_range
+ * Scope:  Local
+ *
+ * Install entry 'e' (depth 'depth') over the tbl24 range [first, first +
+ * count), descending into tbl8 groups where present.  Only entries
+ * currently holding a shorter (or no) prefix are overwritten.
+ *
+ *---------------------------------------------------------------------*/
+
+static void fib_write_range(struct sr_fib* fib, uint32_t first,
+                            uint32_t count, uint32_t e, uint32_t depth)
+{
+    uint32_t i;
+    int j;
+
+    for (i = first; i < first + count; i++) {
+        uint32_t cur = fib->tbl24[i];
+
+        if (cur & SR_FIB_EXT) {
+            uint32_t* g = &fib->tbl8[(size_t)SR_FIB_INDEX(cur) *
+                                     SR_FIB_TBL8_GROUP];
+            for (j = 0; j < SR_FIB_TBL8_GROUP; j++) {
+                if (!(g[j] & SR_FIB_VALID) || SR_FIB_DEPTH(g[j]) <= depth) {
+                    g[j] = e;
+                }
+            }
+        } else if (!(cur & SR_FIB_VALID) || SR_FIB_DEPTH(cur) <= depth) {
+            fib->tbl24[i] = e;
+        }
+    }
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_insert
+ * Scope:  Global
+ *
+ * Add the route's prefix to the FIB.
+ *
+ *---------------------------------------------------------------------*/
+
+int sr_fib_insert(struct sr_fib* fib, struct sr_rt* rt)
+{
+    uint32_t depth, prefix, index, e;
+
+    assert(fib);
+    assert(rt);
+
+    depth = sr_fib_mask_depth(rt->mask);
+    prefix = ntohl(rt->dest.s_addr) & fib_depth_mask(depth);
+
+    if (fib_hash_find(fib, prefix, depth, &index)) {
+        return 1;
+    }
+
+    if ((fib->nrules + 1) * 2 > fib->hash_mask + 1) {
+        if (fib_hash_grow(fib) != 0) {
+            return -1;
+        }
+    }
+    if (fib_rule_alloc(fib, &index) != 0) {
+        return -1;
+    }
+
+    fib->rules[index].prefix = prefix;
+    fib->rules[index].depth = depth;
+    fib->rules[index].rt = rt;
+    fib_hash_put(fib, index);
+    fib->nrules++;
+
+    if (depth == 0) {
+        fib->default_rt = rt;
+        return 0;
+    }
+
+    e = fib_entry(index, depth);
+
+    if (depth <= 24) {
+        fib_write_range(fib, prefix >> 8, 1u << (24 - depth), e, depth);
+    } else {
+        uint32_t i24 = prefix >> 8;
+        uint32_t cur = fib->tbl24[i24];
+        uint32_t group, j, first, count;
+        uint32_t* g;
+
+        if (!(cur & SR_FIB_EXT)) {
+            if (fib_tbl8_alloc(fib, cur, &group) != 0) {
+                fib_hash_remove(fib, index);
+                fib->rules_free[fib->rules_nfree++] = index;
+                fib->nrules--;
+                return -1;
+            }
+            fib->tbl24[i24] = SR_FIB_EXT | group;
+        } else {
+            group = SR_FIB_INDEX(cur);
+        }
+
+        g = &fib->tbl8[(size_t)group * SR_FIB_TBL8_GROUP];
+        first = prefix & 0xff;
+        count = 1u << (32 - depth);
+        for (j = first; j < first + count; j++) {
+            if (!(g[j] & SR_FIB_VALID) || SR_FIB_DEPTH(g[j]) <= depth) {
+                g[j] = e;
+            }
+        }
+    }
+
+    return 0;
+} /* -- sr_fib_insert -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_delete
+ * Scope:  Global
+ *
+ * Remove a prefix.  Entries that pointed at it are rewritten to the next
+ * shorter covering prefix (found through the rule hash), and a tbl8 group
+ * that no longer holds anything longer than /24 is folded back into tbl24.
+ *
+ *---------------------------------------------------------------------*/
+
+int sr_fib_delete(struct sr_fib* fib, struct in_addr dest,
+                  struct in_addr mask)
+{
+    uint32_t depth, prefix, index, repl = 0, d, i, j;
+
+    assert(fib);
+
+    depth = sr_fib_mask_depth(mask);
+    prefix = ntohl(dest.s_addr) & fib_depth_mask(depth);
+
+    if (!fib_hash_find(fib, prefix, depth, &index)) {
+        return -1;
+    }
+
+    fib_hash_remove(fib, index);
+    fib->rules_free[fib->rules_nfree++] = index;
+    fib->nrules--;
+
+    if (depth == 0) {
+        fib->default_rt = 0;
+        return 0;
+    }
+
+    for (d = depth - 1; d > 0; d--) {
+        uint32_t parent;
+        if (fib_hash_find(fib, prefix & fib_depth_mask(d), d, &parent)) {
+            repl = fib_entry(parent, d);
+            break;
+        }
+    }
+
+    if (depth <= 24) {
+        uint32_t first = prefix >> 8, count = 1u << (24 - depth);
+
+        for (i = first; i < first + count; i++) {
+            uint32_t cur = fib->tbl24[i];
+
+            if (cur & SR_FIB_EXT) {
+                uint32_t* g = &fib->tbl8[(size_t)SR_FIB_INDEX(cur) *
+                                         SR_FIB_TBL8_GROUP];
+                for (j = 0; j < SR_FIB_TBL8_GROUP; j++) {
+                    if ((g[j] & SR_FIB_VALID) && SR_FIB_INDEX(g[j]) == index) {
+                        g[j] = repl;
+                    }
+                }
+            } else if ((cur & SR_FIB_VALID) && SR_FIB_INDEX(cur) == index) {
+                fib->tbl24[i] = repl;
+            }
+        }
+    } else {
+        uint32_t i24 = prefix >> 8;
+        uint32_t group = SR_FIB_INDEX(fib->tbl24[i24]);
+        uint32_t* g = &fib->tbl8[(size_t)group * SR_FIB_TBL8_GROUP];
+        uint32_t first = prefix & 0xff, count = 1u << (32 - depth);
+        int collapse = 1;
+
+        assert(fib->tbl24[i24] & SR_FIB_EXT);
+
+        for (j = first; j < first + count; j++) {
+            if ((g[j] & SR_FIB_VALID) && SR_FIB_INDEX(g[j]) == index) {
+                g[j] = repl;
+            }
+        }
+
+        /* everything left is the same <= /24 prefix (or nothing) */
+        for (j = 0; j < SR_FIB_TBL8_GROUP; j++) {
+            if ((g[j] & SR_FIB_VALID) && SR_FIB_DEPTH(g[j]) > 24) {
+                collapse = 0;
+                break;
+            }
+        }
+        if (collapse) {
+            fib->tbl24[i24] = g[0];
+            fib->tbl8_free[fib->tbl8_nfree++] = group;
+        }
+    }
+
+    return 0;
+} /* -- sr_fib_delete -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_dst_cache_create
+ * Scope:  Global
+ *
+ * Allocate an empty destination cache.  Generation 0 is never current, so
+ * the zeroed slots all read as misses.
+ *
+ *---------------------------------------------------------------------*/
+
+struct sr_dst_cache* sr_dst_cache_create(void)
+{
+    struct sr_dst_cache* cache =
+        (struct sr_dst_cache*)calloc(1, sizeof(struct sr_dst_cache));
+
+    if (cache) {
+        cache->gen = 1;
+    }
+    return cache;
+} /* -- sr_dst_cache_create -- */
+
+void sr_dst_cache_destroy(struct sr_dst_cache* cache)
+{
+    free(cache);
+} /* -- sr_dst_cache_destroy -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_dst_cache_invalidate
+ * Scope:  Global
+ *
+ * Drop every cached decision by moving to a new generation.
+ *
+ *---------------------------------------------------------------------*/
+
+void sr_dst_cache_invalidate(struct sr_dst_cache* cache)
+{
+    if (!cache) {
+        return;
+    }
+    if (++cache->gen == 0) {
+        /* wrapped: clear stale tags so no old slot can match again */
+        memset(cache->entries, 0, sizeof(cache->entries));
+        cache->gen = 1;
+    }
+} /* -- sr_dst_cache_invalidate -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_dst_cache_fill
+ * Scope:  Global
+ *
+ * Slow path: FIB lookup plus interface resolution, stored in the slot for
+ * ip.
+ *
+ *---------------------------------------------------------------------*/
+
+struct sr_dst_entry* sr_dst_cache_fill(struct sr_instance* sr, uint32_t ip)
+{
+    struct sr_dst_cache* cache = sr->dst_cache;
+    struct sr_dst_entry* e = &cache->entries[sr_dst_cache_slot(ip)];
+    struct sr_rt* rt = sr_fib_lookup(sr->fib, ip);
+
+    cache->misses++;
+
+    e->ip = ip;
+    e->gen = cache->gen;
+    e->rt = rt;
+    e->iface = rt ? sr_get_interface_by_index(sr, rt->ifindex) : 0;
+    e->next_hop = (rt && rt->gw.s_addr) ? rt->gw.s_addr : ip;
+    e->adj = 0;
+
+    if (e->iface && sr->adj_table && !rt->local) {
+        if (rt->gw.s_addr) {
+            /* gateway routes share one adjacency */
+            if (!rt->adj) {
+                rt->adj = sr_adj_get(sr->adj_table, e->iface, e->next_hop);
+            }
+            e->adj = rt->adj;
+        } else {
+            /* only a host ARP has resolved has one */
+            e->adj = sr_adj_find(sr->adj_table, e->iface, e->next_hop);
+        }
+    }
+
+    return e;
+} /* -- sr_dst_cache_fill -- */
+
+void sr_dst_cache_print_stats(struct sr_dst_cache* cache)
+{
+    unsigned long total;
+
+    if (!cache) {
+        return;
+    }
+    total = cache->hits + cache->misses;
+    printf("Destination cache: %lu hits, %lu misses (%.1f%% hit rate)\n",
+           cache->hits, cache->misses,
+           total ? 100.0 * cache->hits / total : 0.0);
+} /* -- sr_dst_cache_print_stats -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_find
+ * Scope:  Global
+ *
+ * Exact match lookup of the prefix dest/mask through the rule hash.
+ *
+ *---------------------------------------------------------------------*/
+
+struct sr_rt* sr_fib_find(const struct sr_fib* fib, struct in_addr dest,
+                          struct in_addr mask)
+{
+    uint32_t depth = sr_fib_mask_depth(mask);
+    uint32_t prefix = ntohl(dest.s_addr) & fib_depth_mask(depth);
+    uint32_t index;
+
+    if (!fib || !fib_hash_find(fib, prefix, depth, &index)) {
+        return 0;
+    }
+    return fib->rules[index].rt;
+} /* -- sr_fib_find -- */
+
+/*---------------------------------------------------------------------
+ * FIB snapshot
+ *
+ * Layout (all offsets from the start of the file):
+ *
+ *   header      including the path of the text table it was saved from
+ *   routes      nroutes x struct fib_snap_route, in routing table order
+ *   rules       rules_used x struct fib_snap_rule (route == ~0 if free)
+ *   rules_free  rules_nfree x uint32_t
+ *   tbl8_free   tbl8_nfree x uint32_t
+ *   tbl8        tbl8_used groups, page aligned
+ *   tbl24       SR_FIB_TBL24_SZ entries, page aligned, zero pages sparse
+ *
+ * Rule indices are preserved, so the tables need no rewriting on load.
+ *---------------------------------------------------------------------*/
+
+#define FIB_SNAP_NO_ROUTE 0xffffffffu
+#define FIB_SNAP_PAGE     4096
+
+struct fib_snap_hdr
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t nroutes;
+    uint32_t rules_used;
+    uint32_t rules_nfree;
+    uint32_t tbl8_used;
+    uint32_t tbl8_nfree;
+    uint32_t pad;
+    uint64_t routes_off;
+    uint64_t rules_off;
+    uint64_t rules_free_off;
+    uint64_t tbl8_free_off;
+    uint64_t tbl8_off;
+    uint64_t tbl24_off;
+    uint64_t file_len;
+    char     source[SR_FIB_SNAP_SRC_LEN]; /* text table, or "" */
+};
+
+struct fib_snap_route
+{
+    uint32_t dest;
+    uint32_t gw;
+    uint32_t mask;
+    char     interface[sr_IFACE_NAMELEN];
+};
+
+struct fib_snap_rule
+{
+    uint32_t prefix;
+    uint32_t depth;
+    uint32_t route;
+};
+
+static uint64_t fib_snap_align(uint64_t off, uint64_t align)
+{
+    return (off + align - 1) & ~(align - 1);
+}
+
+static int fib_snap_write(int fd, const void* buf, size_t len)
+{
+    const char* p = (const char*)buf;
+
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0) {
+            perror("write(..):sr_fib.c::sr_fib_snapshot_save");
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int fib_snap_write_at(int fd, uint64_t off, const void* buf,
+                             size_t len)
+{
+    if (lseek(fd, (off_t)off, SEEK_SET) == (off_t)-1) {
+        perror("lseek(..):sr_fib.c::sr_fib_snapshot_save");
+        return -1;
+    }
+    return fib_snap_write(fd, buf, len);
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_snapshot_check
+ * Scope:  Global
+ *
+ * Returns 1 if filename starts with the snapshot magic, 0 otherwise.
+ *
+ *---------------------------------------------------------------------*/
+
+int sr_fib_snapshot_check(const char* filename)
+{
+    uint32_t magic = 0;
+    int fd = open(filename, O_RDONLY);
+    int ret = 0;
+
+    if (fd < 0) {
+        return 0;
+    }
+    if (read(fd, &magic, sizeof(magic)) == sizeof(magic) &&
+        magic == SR_FIB_SNAP_MAGIC) {
+        ret = 1;
+    }
+    close(fd);
+    return ret;
+} /* -- sr_fib_snapshot_check -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_snapshot_save
+ * Scope:  Global
+ *
+ * Write sr's routing table and FIB to filename (through a temporary file
+ * and rename, so a reader never sees a partial snapshot).  Returns 0 on
+ * success.
+ *
+ *---------------------------------------------------------------------*/
+
+int sr_fib_snapshot_save(struct sr_instance* sr, const char* filename)
+{
+    struct sr_fib* fib = sr->fib;
+    struct fib_snap_hdr hdr;
+    struct fib_snap_route* routes = 0;
+    struct fib_snap_rule* rules = 0;
+    struct sr_rt* rt;
+    char tmp[FILENAME_MAX];
+    char src[PATH_MAX] = "";
+    uint32_t n, i;
+    uint64_t off;
+    int fd = -1, ret = -1;
+
+    assert(sr);
+    if (!fib) {
+        fprintf(stderr, "No routing table to save\n");
+        return -1;
+    }
+
+    n = sr->rt_count;
+    routes = (struct fib_snap_route*)calloc(n ? n : 1, sizeof(*routes));
+    rules = (struct fib_snap_rule*)malloc((fib->rules_used ? fib->rules_used
+                                           : 1) * sizeof(*rules));
+    if (!routes || !rules) {
+        fprintf(stderr, "Error: out of memory (sr_fib_snapshot_save)\n");
+        goto out;
+    }
+
+    for (i = 0; i < fib->rules_used; i++) {
+        rules[i].prefix = fib->rules[i].prefix;
+        rules[i].depth = fib->rules[i].depth;
+        rules[i].route = FIB_SNAP_NO_ROUTE;
+    }
+
+    /* routes in list order; each live rule records the route it holds */
+    for (rt = sr->routing_table, i = 0; rt && i < n; rt = rt->next, i++) {
+        uint32_t depth = sr_fib_mask_depth(rt->mask);
+        uint32_t prefix = ntohl(rt->dest.s_addr) & fib_depth_mask(depth);
+        uint32_t index;
+
+        routes[i].dest = rt->dest.s_addr;
+        routes[i].gw = rt->gw.s_addr;
+        routes[i].mask = rt->mask.s_addr;
+        strncpy(routes[i].interface, rt->interface, sr_IFACE_NAMELEN);
+
+        if (fib_hash_find(fib, prefix, depth, &index) &&
+            fib->rules[index].rt == rt) {
+            rules[index].route = i;
+        }
+    }
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = SR_FIB_SNAP_MAGIC;
+    hdr.version = SR_FIB_SNAP_VERSION;
+    hdr.nroutes = n;
+    hdr.rules_used = fib->rules_used;
+    hdr.rules_nfree = fib->rules_nfree;
+    hdr.tbl8_used = fib->tbl8_used;
+    hdr.tbl8_nfree = fib->tbl8_nfree;
+    if (sr->rtable && !sr_fib_snapshot_check(sr->rtable) &&
+        !realpath(sr->rtable, src)) {
+        src[0] = '\0';
+    }
+    if (strlen(src) < sizeof(hdr.source)) {
+        strcpy(hdr.source, src);
+    }
+
+    off = fib_snap_align(sizeof(hdr), 8);
+    hdr.routes_off = off;
+    off = fib_snap_align(off + (uint64_t)n * sizeof(*routes), 8);
+    hdr.rules_off = off;
+    off = fib_snap_align(off + (uint64_t)fib->rules_used * sizeof(*rules), 8);
+    hdr.rules_free_off = off;
+    off = fib_snap_align(off + (uint64_t)fib->rules_nfree * 4, 8);
+    hdr.tbl8_free_off = off;
+    off = fib_snap_align(off + (uint64_t)fib->tbl8_nfree * 4, FIB_SNAP_PAGE);
+    hdr.tbl8_off = off;
+    off = fib_snap_align(off + (uint64_t)fib->tbl8_used *
+                         SR_FIB_TBL8_GROUP * 4, FIB_SNAP_PAGE);
+    hdr.tbl24_off = off;
+    hdr.file_len = off + (uint64_t)SR_FIB_TBL24_SZ * 4;
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", filename);
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror("open(..):sr_fib.c::sr_fib_snapshot_save");
+        goto out;
+    }
+
+    if (fib_snap_write_at(fd, 0, &hdr, sizeof(hdr)) ||
+        fib_snap_write_at(fd, hdr.routes_off, routes,
+                          (size_t)n * sizeof(*routes)) ||
+        fib_snap_write_at(fd, hdr.rules_off, rules,
+                          (size_t)fib->rules_used * sizeof(*rules)) ||
+        fib_snap_write_at(fd, hdr.rules_free_off, fib->rules_free,
+                          (size_t)fib->rules_nfree * 4) ||
+        fib_snap_write_at(fd, hdr.tbl8_free_off, fib->tbl8_free,
+                          (size_t)fib->tbl8_nfree * 4) ||
+        fib_snap_write_at(fd, hdr.tbl8_off, fib->tbl8,
+                          (size_t)fib->tbl8_used * SR_FIB_TBL8_GROUP * 4)) {
+        goto out;
+    }
+
+    /* tbl24: skip all-zero pages, leaving holes in the file */
+    for (i = 0; i < SR_FIB_TBL24_SZ; i += FIB_SNAP_PAGE / 4) {
+        const uint32_t* page = &fib->tbl24[i];
+        uint32_t j;
+
+        for (j = 0; j < FIB_SNAP_PAGE / 4; j++) {
+            if (page[j]) {
+                break;
+            }
+        }
+        if (j < FIB_SNAP_PAGE / 4 &&
+            fib_snap_write_at(fd, hdr.tbl24_off + (uint64_t)i * 4, page,
+                              FIB_SNAP_PAGE)) {
+            goto out;
+        }
+    }
+
+    if (ftruncate(fd, (off_t)hdr.file_len) != 0) {
+        perror("ftruncate(..):sr_fib.c::sr_fib_snapshot_save");
+        goto out;
+    }
+    if (close(fd) != 0) {
+        fd = -1;
+        perror("close(..):sr_fib.c::sr_fib_snapshot_save");
+        goto out;
+    }
+    fd = -1;
+    if (rename(tmp, filename) != 0) {
+        perror("rename(..):sr_fib.c::sr_fib_snapshot_save");
+        goto out;
+    }
+    ret = 0;
+
+out:
+    if (fd >= 0) {
+        close(fd);
+        unlink(tmp);
+    }
+    free(routes);
+    free(rules);
+    return ret;
+} /* -- sr_fib_snapshot_save -- */
+
+/*---------------------------------------------------------------------
+ * Method: fib_snap_valid
+ * Scope:  Local
+ *
+ * Sanity check a mapped snapshot header against the file size.
+ *
+ *---------------------------------------------------------------------*/
+
+static int fib_snap_valid(const struct fib_snap_hdr* hdr, uint64_t len)
+{
+    if (len < sizeof(*hdr) || hdr->magic != SR_FIB_SNAP_MAGIC ||
+        hdr->version != SR_FIB_SNAP_VERSION || hdr->file_len != len) {
+        return 0;
+    }
+    if (hdr->rules_used > SR_FIB_MAX_RULES ||
+        hdr->rules_nfree > hdr->rules_used ||
+        hdr->tbl8_used > SR_FIB_INDEX_MASK + 1 ||
+        hdr->tbl8_nfree > hdr->tbl8_used) {
+        return 0;
+    }
+    if (hdr->routes_off + (uint64_t)hdr->nroutes *
+            sizeof(struct fib_snap_route) > hdr->rules_off ||
+        hdr->rules_off + (uint64_t)hdr->rules_used *
+            sizeof(struct fib_snap_rule) > hdr->rules_free_off ||
+        hdr->rules_free_off + (uint64_t)hdr->rules_nfree * 4 >
+            hdr->tbl8_free_off ||
+        hdr->tbl8_free_off + (uint64_t)hdr->tbl8_nfree * 4 > hdr->tbl8_off ||
+        hdr->tbl8_off + (uint64_t)hdr->tbl8_used * SR_FIB_TBL8_GROUP * 4 >
+            hdr->tbl24_off ||
+        hdr->tbl24_off + (uint64_t)SR_FIB_TBL24_SZ * 4 != len ||
+        hdr->tbl8_off % FIB_SNAP_PAGE || hdr->tbl24_off % FIB_SNAP_PAGE) {
+        return 0;
+    }
+    return 1;
+}
+
+/*---------------------------------------------------------------------
+ * Method: fib_snap_check_tables
+ * Scope:  Local
+ *
+ * Check everything a lookup or a later insert would index with: the free
+ * stacks name distinct unused slots, every rule is a masked prefix of at
+ * most 32 bits holding a route in the file (or is free), and every tbl24
+ * and tbl8 entry points at a live rule of its depth or an allocated group.
+ *
+ *---------------------------------------------------------------------*/
+
+static int fib_snap_check_tables(const struct fib_snap_hdr* hdr,
+                                 const char* map)
+{
+    const struct fib_snap_rule* rules =
+        (const struct fib_snap_rule*)(map + hdr->rules_off);
+    const uint32_t* rules_free = (const uint32_t*)(map + hdr->rules_free_off);
+    const uint32_t* tbl8_free = (const uint32_t*)(map + hdr->tbl8_free_off);
+    const uint32_t* tbl8 = (const uint32_t*)(map + hdr->tbl8_off);
+    const uint32_t* tbl24 = (const uint32_t*)(map + hdr->tbl24_off);
+    unsigned char* free_group;
+    uint32_t i, e, nfree = 0;
+    int ok = 0;
+
+    free_group = (unsigned char*)calloc(hdr->tbl8_used ? hdr->tbl8_used : 1,
+                                        1);
+    if (!free_group) {
+        return 0;
+    }
+
+    for (i = 0; i < hdr->rules_used; i++) {
+        if (rules[i].route == FIB_SNAP_NO_ROUTE) {
+            nfree++;
+            continue;
+        }
+        if (rules[i].route >= hdr->nroutes || rules[i].depth > 32 ||
+            (rules[i].prefix & ~fib_depth_mask(rules[i].depth))) {
+            goto out;
+        }
+    }
+    /* each free rule is on the stack once: distinct, free, as many */
+    if (nfree != hdr->rules_nfree) {
+        goto out;
+    }
+    for (i = 0; i < hdr->rules_nfree; i++) {
+        if (rules_free[i] >= hdr->rules_used ||
+            rules[rules_free[i]].route != FIB_SNAP_NO_ROUTE) {
+            goto out;
+        }
+    }
+    for (i = 0; i < hdr->tbl8_nfree; i++) {
+        if (tbl8_free[i] >= hdr->tbl8_used || free_group[tbl8_free[i]]) {
+            goto out;
+        }
+        free_group[tbl8_free[i]] = 1;
+    }
+
+    for (i = 0; i < (uint32_t)SR_FIB_TBL24_SZ; i++) {
+        e = tbl24[i];
+        if (e & SR_FIB_EXT) {
+            if ((e & ~(SR_FIB_EXT | SR_FIB_INDEX_MASK)) ||
+                SR_FIB_INDEX(e) >= hdr->tbl8_used ||
+                free_group[SR_FIB_INDEX(e)]) {
+                goto out;
+            }
+        } else if ((e & SR_FIB_VALID) &&
+                   (SR_FIB_INDEX(e) >= hdr->rules_used ||
+                    SR_FIB_DEPTH(e) > 24 ||
+                    rules[SR_FIB_INDEX(e)].route == FIB_SNAP_NO_ROUTE ||
+                    rules[SR_FIB_INDEX(e)].depth != SR_FIB_DEPTH(e))) {
+            goto out;
+        }
+    }
+    for (i = 0; i < hdr->tbl8_used * SR_FIB_TBL8_GROUP; i++) {
+        e = tbl8[i];
+        if (free_group[i / SR_FIB_TBL8_GROUP] || !(e & SR_FIB_VALID)) {
+            continue;
+        }
+        if ((e & SR_FIB_EXT) || SR_FIB_INDEX(e) >= hdr->rules_used ||
+            rules[SR_FIB_INDEX(e)].route == FIB_SNAP_NO_ROUTE ||
+            rules[SR_FIB_INDEX(e)].depth != SR_FIB_DEPTH(e)) {
+            goto out;
+        }
+    }
+    ok = 1;
+out:
+    free(free_group);
+    return ok;
+}
+
+/*---------------------------------------------------------------------
+ * Method: fib_snap_fallback
+ * Scope:  Local
+ *
+ * The snapshot could not be used: load the text table it was saved from,
+ * if the header names one.
+ *
+ *---------------------------------------------------------------------*/
+
+static int fib_snap_fallback(struct sr_instance* sr, const char* filename,
+                             const char* source)
+{
+    if (!source[0] || access(source, R_OK) != 0 ||
+        sr_fib_snapshot_check(source)) {
+        return -1;
+    }
+    fprintf(stderr, "Loading %s, the text routing table snapshot %s was "
+            "saved from\n", source, filename);
+    return sr_load_rt(sr, source);
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_snapshot_load
+ * Scope:  Global
+ *
+ * Replace sr's routing table with the one in snapshot 'filename'.  The
+ * file is mapped privately; tbl24 and tbl8 are used straight from the
+ * mapping and only the route list, rule array and rule hash are built.
+ * A snapshot that fails any check is not installed; the text table it
+ * was saved from is loaded instead when there is one.  Returns 0 on
+ * success, -1 (leaving the current table alone) on error.
+ *
+ *---------------------------------------------------------------------*/
+
+int sr_fib_snapshot_load(struct sr_instance* sr, const char* filename)
+{
+    const struct fib_snap_hdr* hdr;
+    const struct fib_snap_route* routes;
+    const struct fib_snap_rule* rules;
+    struct sr_rt** by_index = 0;
+    struct sr_fib* fib = 0;
+    struct stat st;
+    char source[SR_FIB_SNAP_SRC_LEN] = "";
+    uint32_t i, index, hash_sz;
+    void* map;
+    int fd;
+
+    assert(sr);
+    assert(filename);
+
+    fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        perror("open(..):sr_fib.c::sr_fib_snapshot_load");
+        return -1;
+    }
+    if (fstat(fd, &st) != 0) {
+        perror("fstat(..):sr_fib.c::sr_fib_snapshot_load");
+        close(fd);
+        return -1;
+    }
+    map = mmap(0, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror("mmap(..):sr_fib.c::sr_fib_snapshot_load");
+        return -1;
+    }
+
+    hdr = (const struct fib_snap_hdr*)map;
+    if ((uint64_t)st.st_size >= sizeof(*hdr) &&
+        hdr->magic == SR_FIB_SNAP_MAGIC &&
+        hdr->version == SR_FIB_SNAP_VERSION) {
+        memcpy(source, hdr->source, sizeof(source));
+        source[sizeof(source) - 1] = '\0';
+    }
+    if (!fib_snap_valid(hdr, (uint64_t)st.st_size) ||
+        !fib_snap_check_tables(hdr, (const char*)map)) {
+        goto bad;
+    }
+    routes = (const struct fib_snap_route*)((char*)map + hdr->routes_off);
+    rules = (const struct fib_snap_rule*)((char*)map + hdr->rules_off);
+
+    fib = (struct sr_fib*)calloc(1, sizeof(struct sr_fib));
+    by_index = (struct sr_rt**)malloc((hdr->nroutes ? hdr->nroutes : 1) *
+                                      sizeof(struct sr_rt*));
+    if (!fib || !by_index) {
+        goto fail;
+    }
+
+    fib->map = map;
+    fib->map_len = st.st_size;
+    fib->tbl24 = (uint32_t*)((char*)map + hdr->tbl24_off);
+    fib->tbl8 = (uint32_t*)((char*)map + hdr->tbl8_off);
+    fib->tbl8_mapped = 1;
+    fib->tbl8_groups = hdr->tbl8_used;
+    fib->tbl8_used = hdr->tbl8_used;
+    fib->tbl8_nfree = hdr->tbl8_nfree;
+    fib->tbl8_free = (uint32_t*)malloc((hdr->tbl8_used ? hdr->tbl8_used : 1)
+                                       * sizeof(uint32_t));
+    fib->rules_cap = hdr->rules_used > SR_FIB_RULES_INIT ? hdr->rules_used
+                                                         : SR_FIB_RULES_INIT;
+    fib->rules_used = hdr->rules_used;
+    fib->rules_nfree = hdr->rules_nfree;
+    fib->rules = (struct sr_fib_rule*)malloc(fib->rules_cap *
+                                             sizeof(struct sr_fib_rule));
+    fib->rules_free = (uint32_t*)malloc(fib->rules_cap * sizeof(uint32_t));
+    for (hash_sz = SR_FIB_HASH_INIT; hash_sz < hdr->rules_used * 2;
+         hash_sz *= 2)
+        ;
+    fib->hash = (uint32_t*)calloc(hash_sz, sizeof(uint32_t));
+    fib->hash_mask = hash_sz - 1;
+    if (!fib->tbl8_free || !fib->rules || !fib->rules_free || !fib->hash) {
+        goto fail;
+    }
+    memcpy(fib->tbl8_free, (char*)map + hdr->tbl8_free_off,
+           (size_t)hdr->tbl8_nfree * 4);
+    memcpy(fib->rules_free, (char*)map + hdr->rules_free_off,
+           (size_t)hdr->rules_nfree * 4);
+
+    /* -- rules and their hash; a prefix held twice is corruption too -- */
+    for (i = 0; i < hdr->rules_used; i++) {
+        fib->rules[i].prefix = rules[i].prefix;
+        fib->rules[i].depth = rules[i].depth;
+        fib->rules[i].rt = 0;
+        if (rules[i].route == FIB_SNAP_NO_ROUTE) {
+            continue;
+        }
+        if (fib_hash_find(fib, rules[i].prefix, rules[i].depth, &index)) {
+            goto bad;
+        }
+        fib_hash_put(fib, i);
+        fib->nrules++;
+    }
+
+    /* -- point of no return: swap in the new routing table -- */
+    printf("Loading routing table from server, clear local routing table.\n");
+    sr_flush_rt(sr);
+    for (i = 0; i < hdr->nroutes; i++) {
+        struct in_addr dest, gw, mask;
+        char iface[sr_IFACE_NAMELEN];
+
+        dest.s_addr = routes[i].dest;
+        gw.s_addr = routes[i].gw;
+        mask.s_addr = routes[i].mask;
+        memcpy(iface, routes[i].interface, sr_IFACE_NAMELEN);
+        iface[sr_IFACE_NAMELEN - 1] = '\0';
+        by_index[i] = sr_append_rt_entry(sr, dest, gw, mask, iface);
+    }
+
+    for (i = 0; i < hdr->rules_used; i++) {
+        if (rules[i].route == FIB_SNAP_NO_ROUTE) {
+            continue;
+        }
+        fib->rules[i].rt = by_index[rules[i].route];
+        if (rules[i].depth == 0) {
+            fib->default_rt = fib->rules[i].rt;
+        }
+    }
+
+    /* -- routes not installed for their prefix are multipath members -- */
+    for (i = 0; i < hdr->nroutes; i++) {
+        if (sr_fib_find(fib, by_index[i]->dest, by_index[i]->mask) !=
+            by_index[i]) {
+            sr_rt_join_ecmp(fib, by_index[i]);
+        }
+    }
+
+    sr_fib_destroy(sr->fib);
+    sr->fib = fib;
+    sr_dst_cache_invalidate(sr->dst_cache);
+
+    free(by_index);
+    return 0;
+
+bad:
+    fprintf(stderr, "Error loading routing table, %s is not a valid "
+            "FIB snapshot\n", filename);
+    goto out;
+fail:
+    fprintf(stderr, "Error: out of memory (sr_fib_snapshot_load)\n");
+out:
+    if (fib) {
+        fib->map = 0;
+        fib->tbl24 = 0;
+        fib->tbl8_mapped = 1;
+        sr_fib_destroy(fib);
+    }
+    free(by_index);
+    munmap(map, st.st_size);
+    return fib_snap_fallback(sr, filename, source);
+} /* -- sr_fib_snapshot_load -- */
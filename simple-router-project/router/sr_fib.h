@@ -0,0 +1,222 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_fib.h
+ *
+ * Description:
+ *
+ * Forwarding information base (FIB) built from the routing table.  The
+ * FIB is a DIR-24-8 table: a flat 2^24 entry array indexed by the top 24
+ * bits of the destination, plus 256-entry extension groups for prefixes
+ * longer than /24.  A lookup is one tbl24 read, at most one tbl8 read and
+ * one read of the rule array, regardless of the number of routes.
+ *
+ * Each table entry is a 32-bit word:
+ *
+ *   bit 31      VALID  - entry holds a rule
+ *   bit 30      EXT    - (tbl24 only) entry points at a tbl8 group
+ *   bits 24-29  DEPTH  - prefix length of the rule stored in the entry
+ *   bits 0-23   INDEX  - rule index, or tbl8 group index when EXT is set
+ *
+ * The default route (depth 0) is never written into the tables; a miss
+ * falls back to it instead, so a 0.0.0.0/0 entry costs nothing to install.
+ *
+ *---------------------------------------------------------------------------*/
+
+#ifndef SR_FIB_H
+#define SR_FIB_H
+
+#ifdef _LINUX_
+#include <stdint.h>
+#endif /* _LINUX_ */
+
+#ifdef _DARWIN_
+#include <inttypes.h>
+#endif /* _DARWIN_ */
+
+#include <netinet/in.h>
+
+struct sr_rt;
+struct sr_if;
+struct sr_adj;
+struct sr_instance;
+
+#define SR_FIB_TBL24_SZ    (1 << 24)
+#define SR_FIB_TBL8_GROUP  256
+#define SR_FIB_MAX_RULES   (1 << 24)
+
+#define SR_FIB_VALID       0x80000000u
+#define SR_FIB_EXT         0x40000000u
+#define SR_FIB_DEPTH_SHIFT 24
+#define SR_FIB_DEPTH_MASK  0x3f
+#define SR_FIB_INDEX_MASK  0x00ffffffu
+
+#define SR_FIB_DEPTH(e)    (((e) >> SR_FIB_DEPTH_SHIFT) & SR_FIB_DEPTH_MASK)
+#define SR_FIB_INDEX(e)    ((e) & SR_FIB_INDEX_MASK)
+
+/* A prefix installed in the FIB.  'prefix' is in host byte order and
+   already masked to 'depth' bits. */
+struct sr_fib_rule
+{
+    uint32_t prefix;
+    uint32_t depth;
+    struct sr_rt* rt;
+};
+
+struct sr_fib
+{
+    uint32_t* tbl24;                 /* SR_FIB_TBL24_SZ entries */
+    uint32_t* tbl8;                  /* tbl8_groups * SR_FIB_TBL8_GROUP */
+    uint32_t  tbl8_groups;           /* allocated groups */
+    uint32_t  tbl8_used;             /* groups handed out (high water) */
+    uint32_t* tbl8_free;             /* stack of recycled group indices */
+    uint32_t  tbl8_nfree;
+
+    struct sr_fib_rule* rules;       /* indexed by entry INDEX */
+    uint32_t  rules_cap;
+    uint32_t  rules_used;            /* high water */
+    uint32_t* rules_free;            /* stack of recycled rule indices */
+    uint32_t  rules_nfree;
+    uint32_t  nrules;                /* live rules, default included */
+
+    uint32_t* hash;                  /* (prefix,depth) -> rule index + 1 */
+    uint32_t  hash_mask;
+
+    struct sr_rt* default_rt;        /* 0.0.0.0/0, or NULL */
+
+    void*     map;                   /* snapshot mapping holding tbl24 */
+    size_t    map_len;
+    int       tbl8_mapped;           /* tbl8 also points into map */
+};
+
+struct sr_fib* sr_fib_create(void);
+void sr_fib_destroy(struct sr_fib* fib);
+void sr_fib_flush(struct sr_fib* fib);
+
+/* Install a route.  Returns 0 when the prefix was added, 1 when the prefix
+   is already present (the existing route keeps precedence, as with the
+   first-match-wins linear scan) and -1 on allocation failure. */
+int  sr_fib_insert(struct sr_fib* fib, struct sr_rt* rt);
+
+/* Remove the prefix dest/mask.  Returns 0 on success, -1 if not present. */
+int  sr_fib_delete(struct sr_fib* fib, struct in_addr dest,
+                   struct in_addr mask);
+
+/* Exact match: the route installed for dest/mask, or NULL. */
+struct sr_rt* sr_fib_find(const struct sr_fib* fib, struct in_addr dest,
+                          struct in_addr mask);
+
+/* Number of leading one bits in a network byte order mask. */
+uint32_t sr_fib_mask_depth(struct in_addr mask);
+
+/* Binary snapshot of the routing table and its FIB.  The tables are stored
+   page aligned (tbl24 sparse) so that loading is an mmap plus an O(n) pass
+   over the routes; the lookup tables themselves are used in place and
+   copied on write.  The format is host byte order.  Every table index is
+   checked before a snapshot is installed; one that fails is not used, and
+   the text table it was saved from (recorded in the header) is loaded
+   instead if it is still there. */
+#define SR_FIB_SNAP_MAGIC   0x42494653 /* "SFIB" */
+#define SR_FIB_SNAP_VERSION 2
+#define SR_FIB_SNAP_SRC_LEN 256
+
+int sr_fib_snapshot_check(const char* filename);
+int sr_fib_snapshot_save(struct sr_instance* sr, const char* filename);
+int sr_fib_snapshot_load(struct sr_instance* sr, const char* filename);
+
+/*---------------------------------------------------------------------
+ * Method: sr_fib_lookup
+ *
+ * Longest prefix match for dst_ip (network byte order).  Returns the
+ * matching routing table entry or NULL.
+ *
+ *---------------------------------------------------------------------*/
+
+static __inline__ struct sr_rt* sr_fib_lookup(const struct sr_fib* fib,
+                                              uint32_t dst_ip)
+{
+    uint32_t addr = ntohl(dst_ip);
+    uint32_t e;
+
+    if (!fib) {
+        return 0;
+    }
+
+    e = fib->tbl24[addr >> 8];
+    if (e & SR_FIB_EXT) {
+        e = fib->tbl8[(SR_FIB_INDEX(e) << 8) | (addr & 0xff)];
+    }
+    if (e & SR_FIB_VALID) {
+        return fib->rules[SR_FIB_INDEX(e)].rt;
+    }
+    return fib->default_rt;
+}
+
+/* ----------------------------------------------------------------------------
+ * Destination cache
+ *
+ * Direct-mapped cache in front of the FIB keyed by destination address.
+ * A slot holds the full forwarding decision (route, output interface,
+ * next hop and its adjacency) so a hit skips both the FIB and the
+ * interface lookup by name.
+ * Negative results (no route) are cached as well, with rt == NULL.
+ *
+ * Slots are tagged with the cache generation; bumping the generation
+ * invalidates every slot at once whenever the routing table changes.
+ * -------------------------------------------------------------------------- */
+
+#define SR_DST_CACHE_SZ 4096 /* must be a power of 2 */
+
+struct sr_dst_entry
+{
+    uint32_t ip;                /* destination, network byte order */
+    uint32_t gen;               /* generation the slot was filled in */
+    struct sr_rt* rt;           /* matching route or NULL */
+    struct sr_if* iface;        /* output interface or NULL */
+    uint32_t next_hop;          /* gateway, or ip for direct routes */
+    struct sr_adj* adj;         /* adjacency for (iface, next_hop) */
+};
+
+struct sr_dst_cache
+{
+    struct sr_dst_entry entries[SR_DST_CACHE_SZ];
+    uint32_t gen;
+    uint32_t fib_version;       /* sr->fib_version the slots were built on */
+    unsigned long hits;
+    unsigned long misses;
+};
+
+struct sr_dst_cache* sr_dst_cache_create(void);
+void sr_dst_cache_destroy(struct sr_dst_cache* cache);
+void sr_dst_cache_invalidate(struct sr_dst_cache* cache);
+void sr_dst_cache_print_stats(struct sr_dst_cache* cache);
+
+/* Resolve ip through the FIB and store the result in its slot.  The
+   returned slot is only valid until the next lookup. */
+struct sr_dst_entry* sr_dst_cache_fill(struct sr_instance* sr, uint32_t ip);
+
+static __inline__ uint32_t sr_dst_cache_slot(uint32_t ip)
+{
+    uint32_t h = ip * 0x9e3779b1u;
+    return (h >> 16) & (SR_DST_CACHE_SZ - 1);
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_dst_cache_lookup
+ *
+ * Return the cached forwarding decision for ip (network byte order), or
+ * NULL on a miss, in which case the caller goes to sr_dst_cache_fill().
+ *
+ *---------------------------------------------------------------------*/
+
+static __inline__ struct sr_dst_entry* sr_dst_cache_lookup(
+        struct sr_dst_cache* cache, uint32_t ip)
+{
+    struct sr_dst_entry* e = &cache->entries[sr_dst_cache_slot(ip)];
+
+    if (e->gen == cache->gen && e->ip == ip) {
+        cache->hits++;
+        return e;
+    }
+    return 0;
+}
+
+#endif /* -- SR_FIB_H -- */
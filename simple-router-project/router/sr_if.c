@@ -70,13 +70,21 @@ void sr_add_interface(struct sr_instance* sr, const char* name)
     assert(name);
     assert(sr);
 
+    /* -- index table grows with the list -- */
+    sr->if_table = (struct sr_if**)realloc(sr->if_table,
+                       (sr->if_count + 1) * sizeof(struct sr_if*));
+    assert(sr->if_table);
+
     /* -- empty list special case -- */
     if(sr->if_list == 0)
     {
         sr->if_list = (struct sr_if*)malloc(sizeof(struct sr_if));
         assert(sr->if_list);
         sr->if_list->next = 0;
+        sr->if_list->speed = 0;
+        sr->if_list->ifindex = sr->if_count;
         strncpy(sr->if_list->name,name,sr_IFACE_NAMELEN);
+        sr->if_table[sr->if_count++] = sr->if_list;
         return;
     }
 
@@ -89,7 +97,10 @@ void sr_add_interface(struct sr_instance* sr, const char* name)
     assert(if_walker->next);
     if_walker = if_walker->next;
     strncpy(if_walker->name,name,sr_IFACE_NAMELEN);
+    if_walker->speed = 0;
+    if_walker->ifindex = sr->if_count;
     if_walker->next = 0;
+    sr->if_table[sr->if_count++] = if_walker;
 } /* -- sr_add_interface -- */ 
 
 /*--------------------------------------------------------------------- 
@@ -140,6 +151,30 @@ void sr_set_ether_ip(struct sr_instance* sr, uint32_t ip_nbo)
 
 } /* -- sr_set_ether_ip -- */
 
+/*--------------------------------------------------------------------- 
+ * Method: sr_set_ether_speed(..)
+ * Scope: Global
+ *
+ * set the link speed (HWSPEED, host byte order) of the last interface
+ * in the list
+ *
+ *---------------------------------------------------------------------*/
+
+void sr_set_ether_speed(struct sr_instance* sr, uint32_t speed)
+{
+    struct sr_if* if_walker = 0;
+
+    /* -- REQUIRES -- */
+    assert(sr->if_list);
+
+    if_walker = sr->if_list;
+    while(if_walker->next)
+    {if_walker = if_walker->next; }
+
+    if_walker->speed = speed;
+
+} /* -- sr_set_ether_speed -- */
+
 /*--------------------------------------------------------------------- 
  * Method: sr_print_if_list(..)
  * Scope: Global
@@ -191,4 +226,6 @@ void sr_print_if(struct sr_if* iface)
     DebugMAC(iface->addr);
     Debug("\n");
     Debug("\tinet addr %s\n",inet_ntoa(ip_addr));
+    if(iface->speed)
+    { Debug("\tspeed %u\n",iface->speed); }
 } /* -- sr_print_if -- */
@@ -0,0 +1,137 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_link.c
+ *
+ * Description:
+ *
+ * Link list, binding and shutdown shared by the AF_PACKET and TAP data
+ * planes.  See sr_link.h.
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <signal.h>
+#include <pthread.h>
+
+#include "sr_link.h"
+#include "sr_router.h"
+
+static volatile sig_atomic_t link_stop;
+
+static void link_on_signal(int sig)
+{
+    link_stop = 1;
+}
+
+void* sr_link_open_all(const char* links, size_t size, unsigned int* n,
+                       sr_link_open_fn open_link, sr_link_close_fn close_link,
+                       void* arg)
+{
+    void* array = 0;
+    char* list;
+    char* save = 0;
+    char* tok;
+    char* dev;
+    unsigned int i;
+
+    assert(links);
+    assert(size >= sizeof(struct sr_link));
+
+    *n = 0;
+    list = strdup(links);
+    assert(list);
+    for (tok = strtok_r(list, ",", &save); tok; tok = strtok_r(0, ",", &save)) {
+        struct sr_link* link;
+
+        array = realloc(array, (*n + 1) * size);
+        assert(array);
+        link = SR_LINK_AT(array, size, (*n)++);
+        memset(link, 0, size);
+
+        if ((dev = strchr(tok, '=')) != 0) {
+            *dev++ = 0;
+        } else {
+            dev = tok;
+        }
+        strncpy(link->name, tok, sr_IFACE_NAMELEN - 1);
+        strncpy(link->dev, dev, IFNAMSIZ - 1);
+
+        if (open_link(link, arg) != 0) {
+            for (i = 0; i < *n; i++) {
+                close_link(SR_LINK_AT(array, size, i));
+            }
+            free(array);
+            free(list);
+            *n = 0;
+            return 0;
+        }
+    }
+    free(list);
+    return array;
+}
+
+struct sr_link** sr_link_bind(struct sr_instance* sr, void* links, size_t size,
+                              unsigned int n, const char* what)
+{
+    struct sr_link** by_ifindex;
+    struct sr_if* iface;
+    unsigned int i;
+
+    by_ifindex = (struct sr_link**)calloc(sr->if_count + 1,
+                                          sizeof(struct sr_link*));
+    assert(by_ifindex);
+    for (i = 0; i < n; i++) {
+        struct sr_link* link = SR_LINK_AT(links, size, i);
+
+        if ((iface = sr_get_interface(sr, link->name)) == 0) {
+            fprintf(stderr, "%s: no router interface %s\n", link->dev,
+                    link->name);
+            free(by_ifindex);
+            return 0;
+        }
+        link->iface = iface;
+        by_ifindex[iface->ifindex] = link;
+    }
+    for (iface = sr->if_list; iface; iface = iface->next) {
+        if (by_ifindex[iface->ifindex] == 0) {
+            fprintf(stderr, "Router interface %s has no %s\n", iface->name,
+                    what);
+            free(by_ifindex);
+            return 0;
+        }
+    }
+    return by_ifindex;
+}
+
+void sr_link_catch_signals(void)
+{
+    struct sigaction sa;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = link_on_signal;
+    sigaction(SIGINT, &sa, 0);
+    sigaction(SIGTERM, &sa, 0);
+}
+
+int sr_link_stopping(void)
+{
+    return link_stop;
+}
+
+void sr_link_close_all(struct sr_instance* sr, void* links, size_t size,
+                       unsigned int n, struct sr_link** by_ifindex,
+                       sr_link_close_fn close_link)
+{
+    unsigned int i;
+
+    pthread_mutex_lock(&(sr->tx_lock));
+    for (i = 0; by_ifindex && i < sr->if_count; i++) {
+        by_ifindex[i] = 0;
+    }
+    for (i = 0; i < n; i++) {
+        close_link(SR_LINK_AT(links, size, i));
+    }
+    pthread_mutex_unlock(&(sr->tx_lock));
+}
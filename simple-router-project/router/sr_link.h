@@ -0,0 +1,68 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_link.h
+ *
+ * Description:
+ *
+ * What the data planes that bind router interfaces straight to Linux
+ * devices (AF_PACKET, -D, and TAP, -X) have in common: the link list
+ * they are given, binding each link to its router interface, stopping on
+ * SIGINT or SIGTERM, and closing the links on the way out.
+ *
+ * A backend's link struct starts with a struct sr_link; the functions
+ * below take an array of them with the backend's element size, and the
+ * backend opens and closes its own devices through the callbacks.
+ *
+ *---------------------------------------------------------------------------*/
+
+#ifndef SR_LINK_H
+#define SR_LINK_H
+
+#include <stddef.h>
+#include <net/if.h>
+
+#include "sr_if.h"
+
+struct sr_instance;
+
+struct sr_link
+{
+    char name[sr_IFACE_NAMELEN];    /* router interface */
+    char dev[IFNAMSIZ];             /* Linux device */
+    struct sr_if* iface;            /* set by sr_link_bind() */
+};
+
+/* Open or close the device of one link.  Open starts from a zeroed link
+   with name and dev set; close must cope with a link whose open failed
+   part way. */
+typedef int (*sr_link_open_fn)(struct sr_link* link, void* arg);
+typedef void (*sr_link_close_fn)(struct sr_link* link);
+
+/* The link at index i of an array of 'size' byte elements. */
+#define SR_LINK_AT(links, size, i) \
+    ((struct sr_link*)((char*)(links) + (size_t)(i) * (size)))
+
+/* Parse 'links', a comma separated list of "router interface=device" (or
+   just "device" for the same name), into an array of links of 'size'
+   bytes each, opening every one.  Returns the array and sets *n, or 0
+   with every link opened so far closed again. */
+void* sr_link_open_all(const char* links, size_t size, unsigned int* n,
+                       sr_link_open_fn open_link, sr_link_close_fn close_link,
+                       void* arg);
+
+/* Bind every link to its router interface and return an array indexed by
+   ifindex.  Every router interface needs a link ('what' names one in the
+   message), every link an interface.  Returns 0 on a mismatch. */
+struct sr_link** sr_link_bind(struct sr_instance* sr, void* links, size_t size,
+                              unsigned int n, const char* what);
+
+/* Catch SIGINT and SIGTERM; sr_link_stopping() is true after either. */
+void sr_link_catch_signals(void);
+int sr_link_stopping(void);
+
+/* Stop sending (the ARP thread may still try: by_ifindex is emptied, not
+   freed, under the transmit lock) and close every link. */
+void sr_link_close_all(struct sr_instance* sr, void* links, size_t size,
+                       unsigned int n, struct sr_link** by_ifindex,
+                       sr_link_close_fn close_link);
+
+#endif /* -- SR_LINK_H -- */
@@ -24,6 +24,7 @@
 #include <unistd.h>
 #include <pwd.h>
 #include <sys/types.h>
+#include <sys/mman.h>
 
 #ifdef _LINUX_
 #include <getopt.h>
@@ -32,6 +33,11 @@
 #include "sr_dumper.h"
 #include "sr_router.h"
 #include "sr_rt.h"
+#include "sr_fib.h"
+#include "sr_pktbuf.h"
+#include "sr_pcap.h"
+#include "sr_packet.h"
+#include "sr_tap.h"
 
 extern char* optarg;
 
@@ -44,6 +50,8 @@ extern char* optarg;
 #define DEFAULT_SERVER "localhost"
 #define DEFAULT_RTABLE "rtable"
 #define DEFAULT_TOPO 0
+#define DEFAULT_IFCONFIG "IP_CONFIG"
+#define RT_PRINT_MAX 64 /* larger tables are summarised, not printed */
 
 static void usage(char* );
 static void sr_init_instance(struct sr_instance* );
@@ -65,11 +73,25 @@ int main(int argc, char **argv)
     unsigned int port = DEFAULT_PORT;
     unsigned int topo = DEFAULT_TOPO;
     char *logfile = 0;
+    char *snapshot = 0;
+    unsigned int arp_capacity = 0;
+    unsigned int pktbuf_count = 0;
+    int pktbuf_hugepages = 0;
+    char *replay = 0;
+    char *replay_out = 0;
+    char *ifconfig = DEFAULT_IFCONFIG;
+    char *links = 0;
+    char *taps = 0;
+    unsigned int tap_queues = 1;
+    unsigned long replay_rate = 0;
+    unsigned int replay_loops = 1;
+    int one_thread = 0;
+    int ret = 0;
     struct sr_instance sr;
 
     printf("Using %s\n", VERSION_INFO);
 
-    while ((c = getopt(argc, argv, "hs:v:p:u:t:r:l:T:")) != EOF)
+    while ((c = getopt(argc, argv, "hs:v:p:u:t:r:l:T:F:A:B:HR:W:I:P:N:D:X:Q:E")) != EOF)
     {
         switch (c)
         {
@@ -101,9 +123,56 @@ int main(int argc, char **argv)
             case 'T':
                 template = optarg;
                 break;
+            case 'F':
+                snapshot = optarg;
+                break;
+            case 'A':
+                arp_capacity = atoi((char *) optarg);
+                break;
+            case 'B':
+                pktbuf_count = atoi((char *) optarg);
+                break;
+            case 'H':
+                pktbuf_hugepages = 1;
+                break;
+            case 'R':
+                replay = optarg;
+                break;
+            case 'W':
+                replay_out = optarg;
+                break;
+            case 'I':
+                ifconfig = optarg;
+                break;
+            case 'P':
+                replay_rate = strtoul(optarg, 0, 10);
+                break;
+            case 'N':
+                replay_loops = atoi((char *) optarg);
+                break;
+            case 'D':
+                links = optarg;
+                break;
+            case 'X':
+                taps = optarg;
+                break;
+            case 'Q':
+                tap_queues = atoi((char *) optarg);
+                break;
+            case 'E':
+                one_thread = 1;
+                break;
         } /* switch */
     } /* -- while -- */
 
+    /* -- -E runs the VNS session; -R, -D and -X have loops of their own -- */
+    if(one_thread && (replay != 0 || links != 0 || taps != 0))
+    {
+        fprintf(stderr,"Error: -E is for a VNS session, not with -R, -D "
+                "or -X\n");
+        exit(1);
+    }
+
     /* -- zero out sr instance -- */
     sr_init_instance(&sr);
 
@@ -115,7 +184,23 @@ int main(int argc, char **argv)
     else
         strncpy(sr.template, template, 30);
 
+    /* -- -F: write a binary snapshot that later runs can load with -r -- */
+    if(snapshot != 0 && template == NULL)
+    {
+        if(sr_fib_snapshot_save(&sr, snapshot) != 0)
+        {
+            fprintf(stderr,"Error writing routing table snapshot %s\n",
+                    snapshot);
+            exit(1);
+        }
+        printf("Wrote routing table snapshot %s (%u routes)\n",
+               snapshot, sr.rt_count);
+    }
+
     sr.topo_id = topo;
+    sr.arp_capacity = arp_capacity;
+    sr.pktbuf_count = pktbuf_count;
+    sr.pktbuf_hugepages = pktbuf_hugepages;
     strncpy(sr.host,host,32);
 
     if(! user )
@@ -135,12 +220,62 @@ int main(int argc, char **argv)
         }
     }
 
+    /* -- -R: frames come from a capture, interfaces from a file -- */
+    if(replay != 0)
+    {
+        if(sr_load_hwinfo(&sr, ifconfig) != 0)
+        { exit(1); }
+        sr_init(&sr);
+        if(sr_pcap_replay(&sr, replay, replay_out, replay_rate,
+                          replay_loops) != 0)
+        { ret = 1; }
+        sr_destroy_instance(&sr);
+        return ret;
+    }
+
+    /* -- -D: frames go straight to Linux interfaces through AF_PACKET -- */
+    if(links != 0)
+    {
+        if(sr_packet_open(&sr, links) != 0 ||
+           sr_load_hwinfo(&sr, ifconfig) != 0)
+        { exit(1); }
+        sr_init(&sr);
+        if(sr_packet_run(&sr) != 0)
+        { ret = 1; }
+        sr_destroy_instance(&sr);
+        return ret;
+    }
+
+    /* -- -X: the router owns TAP devices and is the far end of each -- */
+    if(taps != 0)
+    {
+        if(sr_tap_open(&sr, taps, tap_queues) != 0 ||
+           sr_load_hwinfo(&sr, ifconfig) != 0)
+        { exit(1); }
+        sr_init(&sr);
+        if(sr_tap_run(&sr) != 0)
+        { ret = 1; }
+        sr_destroy_instance(&sr);
+        return ret;
+    }
+
     Debug("Client %s connecting to Server %s:%d\n", sr.user, server, port);
     if(template)
         Debug("Requesting topology template %s\n", template);
     else
         Debug("Requesting topology %d\n", topo);
 
+    /* -- -E: one thread, one epoll loop, no locks; set before the session
+          so that it is negotiated for -- */
+    sr.one_thread = one_thread;
+
+#ifdef SR_IO_URING
+    /* -- VNS I/O and the ARP timers on one io_uring if the kernel has it,
+          set up before the session so that it is negotiated for -- */
+    if(!sr.one_thread && sr_vns_uring_open(&sr) != 0)
+    { perror("io_uring unavailable, using recv()"); }
+#endif
+
     /* connect to server and negotiate session */
     if(sr_connect_to_server(&sr,port,server) == -1)
     {
@@ -151,7 +286,7 @@ int main(int argc, char **argv)
         Debug("Connected to new instantiation of topology template %s\n", template);
         sr_load_rt_wrap(&sr, "rtable.vrhost");
     }
-    else {
+    else if(template != NULL) {
       /* Read from specified routing table */
       sr_load_rt_wrap(&sr, rtable);
     }
@@ -160,7 +295,14 @@ int main(int argc, char **argv)
     sr_init(&sr);
 
     /* -- whizbang main loop ;-) */
-    while( sr_read_from_server(&sr) == 1);
+    if(sr.one_thread)
+    { sr_vns_epoll_run(&sr); }
+#ifdef SR_IO_URING
+    else if(sr.uring)
+    { sr_vns_uring_run(&sr); }
+#endif
+    else
+    { while( sr_read_from_server(&sr) == 1); }
 
     sr_destroy_instance(&sr);
 
@@ -178,7 +320,14 @@ static void usage(char* argv0)
     printf("Format: %s [-h] [-v host] [-s server] [-p port] \n",argv0);
     printf("           [-T template_name] [-u username] \n");
     printf("           [-t topo id] [-r routing table] \n");
-    printf("           [-l log file] \n");
+    printf("           [-l log file] [-F snapshot file] \n");
+    printf("           [-A arp cache entries] \n");
+    printf("           [-B packet buffers] [-H (hugepages)] \n");
+    printf("           [-R replay.pcap [-W out.pcap] [-I interface file] \n");
+    printf("            [-P packets/s] [-N loops]] \n");
+    printf("           [-D eth1=dev,eth2=dev,... [-I interface file]] \n");
+    printf("           [-X eth1=tap,eth2=tap,... [-Q queues] [-I interface file]] \n");
+    printf("           [-E (VNS only, one thread: epoll loop, no ARP thread)] \n");
     printf("   defaults server=%s port=%d host=%s  \n",
             DEFAULT_SERVER, DEFAULT_PORT, DEFAULT_HOST );
 } /* -- usage -- */
@@ -225,6 +374,52 @@ static void sr_destroy_instance(struct sr_instance* sr)
         sr_dump_close(sr->logfile);
     }
 
+    sr_dst_cache_print_stats(sr->dst_cache);
+    if(sr->cache.entries)
+    { sr_arpcache_print_stats(&(sr->cache)); }
+    if(sr->rx_reads)
+    {
+        fprintf(stderr, "VNS rx: %lu messages in %lu reads "
+                "(%.3f recv/message), %lu frames in batches, "
+                "%lu short records dropped\n",
+                sr->rx_msgs, sr->rx_reads,
+                sr->rx_msgs ? (double)sr->rx_reads / sr->rx_msgs : 0.0,
+                sr->rx_batched, sr->rx_short);
+    }
+    if(sr->vns_credit)
+    {
+        fprintf(stderr, "VNS credit: %lu grants\n", sr->rx_grants);
+    }
+    if(sr->shm)
+    {
+        fprintf(stderr, "VNS shm: %lu frames in, %lu out, %lu waits for "
+                "input, %lu for room\n", sr->shm_rx_frames, sr->tx_frames,
+                sr->shm_sleeps, sr->shm_full);
+        munmap(sr->shm, sr->shm_len);
+        sr->shm = 0;
+    }
+    if(sr->tx_writes)
+    {
+        fprintf(stderr, "VNS tx: %lu frames in %lu writes "
+                "(%.3f sendmsg/frame), socket full %lu times\n",
+                sr->tx_frames, sr->tx_writes,
+                sr->tx_frames ? (double)sr->tx_writes / sr->tx_frames : 0.0,
+                sr->tx_stalls);
+    }
+    free(sr->rx_buf);
+    sr->rx_buf = 0;
+    free(sr->tx_buf);
+    free(sr->tx_iov);
+    free(sr->tx_owner);
+    free(sr->tx_start);
+    free(sr->tx_msgs);
+    sr->tx_buf = 0;
+    sr->tx_iov = 0;
+    sr->tx_owner = 0;
+    sr->tx_start = 0;
+    sr->tx_msgs = 0;
+    sr_pktbuf_print_stats();
+
     /*
     fprintf(stderr,"sr_destroy_instance leaking memory\n");
     */
@@ -243,11 +438,70 @@ static void sr_init_instance(struct sr_instance* sr)
     assert(sr);
 
     sr->sockfd = -1;
+    sr->seqpacket = 0;
+    sr->vns_batch = 0;
+    sr->vns_credit = 0;
+    sr->rx_buf = 0;
+    sr->rx_head = 0;
+    sr->rx_tail = 0;
+    sr->rx_reads = 0;
+    sr->rx_msgs = 0;
+    sr->rx_batched = 0;
+    sr->rx_short = 0;
+    sr->rx_credit_used = 0;
+    sr->rx_credit_limit = 0;
+    sr->rx_grants = 0;
+    sr->rx_frame = 0;
+    sr->rx_frame_room = 0;
+    sr->shm = 0;
+    sr->shm_len = 0;
+    sr->shm_size = 0;
+    sr->shm_rx = 0;
+    sr->shm_tx = 0;
+    sr->shm_tx_head = 0;
+    sr->shm_rx_frames = 0;
+    sr->shm_sleeps = 0;
+    sr->shm_full = 0;
+    sr->tx_buf = 0;
+    sr->tx_used = 0;
+    sr->tx_iov = 0;
+    sr->tx_owner = 0;
+    sr->tx_start = 0;
+    sr->tx_msgs = 0;
+    sr->tx_batch = 0;
+    sr->tx_batch_len = 0;
+    sr->tx_niov = 0;
+    sr->tx_first = 0;
+    sr->tx_pending = 0;
+    sr->tx_ring = 0;
+    sr->tx_frames = 0;
+    sr->tx_writes = 0;
+    sr->tx_stalls = 0;
+    pthread_mutex_init(&(sr->tx_lock), 0);
+    sr->one_thread = 0;
+    sr->io = 0;
+    sr->uring = 0;
     sr->user[0] = 0;
     sr->host[0] = 0;
     sr->topo_id = 0;
     sr->if_list = 0;
+    sr->if_table = 0;
+    sr->if_count = 0;
     sr->routing_table = 0;
+    sr->rt_tail = 0;
+    sr->rt_count = 0;
+    sr->rtable = 0;
+    sr->fib = 0;
+    sr->local_rt = 0;
+    sr->fib_version = 0;
+    sr->pkt_epoch = 0;
+    sr->arp_epoch = 0;
+    sr->dst_cache = 0;
+    sr->adj_table = 0;
+    sr->cache.entries = 0;
+    sr->arp_capacity = 0;
+    sr->pktbuf_count = 0;
+    sr->pktbuf_hugepages = 0;
     sr->logfile = 0;
 } /* -- sr_init_instance -- */
 
@@ -268,10 +522,6 @@ static void sr_init_instance(struct sr_instance* sr)
 
 int sr_verify_routing_table(struct sr_instance* sr)
 {
-    struct sr_rt* rt_walker = 0;
-    struct sr_if* if_walker = 0;
-    int ret = 0;
-
     /* -- REQUIRES --*/
     assert(sr);
 
@@ -280,26 +530,9 @@ int sr_verify_routing_table(struct sr_instance* sr)
         return 999; /* doh! */
     }
 
-    rt_walker = sr->routing_table;
-
-    while(rt_walker)
-    {
-        /* -- check to see if interface exists -- */
-        if_walker = sr->if_list;
-        while(if_walker)
-        {
-            if( strncmp(if_walker->name,rt_walker->interface,sr_IFACE_NAMELEN)
-                    == 0)
-            { break; }
-            if_walker = if_walker->next;
-        }
-        if(if_walker == 0)
-        { ret++; } /* -- interface not found! -- */
-
-        rt_walker = rt_walker->next;
-    } /* -- while -- */
-
-    return ret;
+    /* -- binding each route to its interface's ifindex checks that the
+          interface exists -- */
+    return sr_rt_bind_interfaces(sr, sr->routing_table);
 } /* -- sr_verify_routing_table -- */
 
 static void sr_load_rt_wrap(struct sr_instance* sr, char* rtable) {
@@ -308,10 +541,14 @@ static void sr_load_rt_wrap(struct sr_instance* sr, char* rtable) {
                 rtable);
         exit(1);
     }
+    sr->rtable = rtable; /* -- kill -HUP re-reads it -- */
 
 
     printf("Loading routing table\n");
     printf("---------------------------------------------\n");
-    sr_print_routing_table(sr);
+    if(sr->rt_count <= RT_PRINT_MAX)
+    { sr_print_routing_table(sr); }
+    else
+    { printf(" %u routes\n", sr->rt_count); }
     printf("---------------------------------------------\n");
 }
@@ -0,0 +1,448 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_packet.c
+ *
+ * Description:
+ *
+ * AF_PACKET TPACKET_V3 data plane.  See sr_packet.h.
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <linux/if_packet.h>
+#include <linux/if_ether.h>
+
+#include "sr_packet.h"
+#include "sr_link.h"
+#include "sr_router.h"
+#include "sr_reload.h"
+#include "sr_if.h"
+#include "sr_protocol.h"
+
+/* Where a transmit slot's frame starts. */
+#define TX_DATA_OFF (TPACKET3_HDRLEN - sizeof(struct sockaddr_ll))
+
+struct packet_link
+{
+    struct sr_link l;               /* router and Linux interface */
+    int fd;
+    int devindex;
+    unsigned char hwaddr[ETHER_ADDR_LEN];   /* the device's */
+    uint8_t* rx_ring;               /* mapping: receive blocks ... */
+    uint8_t* tx_ring;               /* ... then transmit slots */
+    size_t map_size;
+    unsigned int rx_block;          /* next block to look at */
+    unsigned int tx_slot;           /* next slot to fill */
+    unsigned int tx_queued;         /* slots filled since the last kick */
+};
+
+static struct
+{
+    struct sr_io io;
+    struct packet_link* links;
+    unsigned int nlinks;
+    struct sr_link** by_ifindex;    /* struct packet_link */
+    unsigned long rx_frames;
+    unsigned long rx_blocks;
+    unsigned long rx_polls;
+    unsigned long rx_other;         /* not for the router's MAC */
+    unsigned long tx_frames;
+    unsigned long tx_kicks;
+    unsigned long tx_full;          /* dropped, transmit ring full */
+    unsigned long tx_oversize;
+} pk;
+
+static void packet_close(struct sr_link* l)
+{
+    struct packet_link* link = (struct packet_link*)l;
+
+    if (link->rx_ring) {
+        munmap(link->rx_ring, link->map_size);
+    }
+    if (link->fd >= 0) {
+        close(link->fd);
+    }
+    link->rx_ring = link->tx_ring = 0;
+    link->fd = -1;
+}
+
+/* Socket, rings and binding for one link. */
+static int packet_open_link(struct sr_link* l, void* arg)
+{
+    struct packet_link* link = (struct packet_link*)l;
+    struct tpacket_req3 req;
+    struct sockaddr_ll sll;
+    struct ifreq ifr;
+    size_t rx_size, tx_size;
+    int v;
+
+    if ((link->fd = socket(AF_PACKET, SOCK_RAW, 0)) < 0) {
+        perror("socket(..):sr_packet.c::packet_open_link");
+        return -1;
+    }
+
+    memset(&ifr, 0, sizeof(ifr));
+    strncpy(ifr.ifr_name, link->l.dev, IFNAMSIZ - 1);
+    if (ioctl(link->fd, SIOCGIFINDEX, &ifr) != 0) {
+        fprintf(stderr, "%s: no such interface\n", link->l.dev);
+        return -1;
+    }
+    link->devindex = ifr.ifr_ifindex;
+    if (ioctl(link->fd, SIOCGIFHWADDR, &ifr) != 0) {
+        perror("ioctl(SIOCGIFHWADDR):sr_packet.c::packet_open_link");
+        return -1;
+    }
+    memcpy(link->hwaddr, ifr.ifr_hwaddr.sa_data, ETHER_ADDR_LEN);
+
+    v = TPACKET_V3;
+    if (setsockopt(link->fd, SOL_PACKET, PACKET_VERSION, &v, sizeof(v)) != 0) {
+        perror("setsockopt(PACKET_VERSION):sr_packet.c::packet_open_link");
+        return -1;
+    }
+    /* -- a frame the device refuses is skipped, not a stuck ring -- */
+    v = 1;
+    setsockopt(link->fd, SOL_PACKET, PACKET_LOSS, &v, sizeof(v));
+
+    memset(&req, 0, sizeof(req));
+    req.tp_block_size = SR_PACKET_BLOCK;
+    req.tp_block_nr = SR_PACKET_RX_BLOCKS;
+    req.tp_frame_size = SR_PACKET_FRAME;
+    req.tp_frame_nr = SR_PACKET_BLOCK / SR_PACKET_FRAME * SR_PACKET_RX_BLOCKS;
+    req.tp_retire_blk_tov = SR_PACKET_BLOCK_TOV;
+    if (setsockopt(link->fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) != 0) {
+        perror("setsockopt(PACKET_RX_RING):sr_packet.c::packet_open_link");
+        return -1;
+    }
+    rx_size = (size_t)req.tp_block_size * req.tp_block_nr;
+
+    /* -- transmit slots are fixed size, several to a block -- */
+    memset(&req, 0, sizeof(req));
+    req.tp_block_size = SR_PACKET_BLOCK;
+    req.tp_frame_size = SR_PACKET_FRAME;
+    req.tp_frame_nr = SR_PACKET_TX_FRAMES;
+    req.tp_block_nr = SR_PACKET_TX_FRAMES / (SR_PACKET_BLOCK / SR_PACKET_FRAME);
+    if (setsockopt(link->fd, SOL_PACKET, PACKET_TX_RING, &req, sizeof(req)) != 0) {
+        perror("setsockopt(PACKET_TX_RING):sr_packet.c::packet_open_link");
+        return -1;
+    }
+    tx_size = (size_t)req.tp_block_size * req.tp_block_nr;
+
+    link->map_size = rx_size + tx_size;
+    link->rx_ring = (uint8_t*)mmap(0, link->map_size, PROT_READ | PROT_WRITE,
+                                   MAP_SHARED | MAP_LOCKED, link->fd, 0);
+    if (link->rx_ring == MAP_FAILED) {
+        link->rx_ring = (uint8_t*)mmap(0, link->map_size, PROT_READ | PROT_WRITE,
+                                       MAP_SHARED, link->fd, 0);
+    }
+    if (link->rx_ring == MAP_FAILED) {
+        link->rx_ring = 0;
+        perror("mmap(..):sr_packet.c::packet_open_link");
+        return -1;
+    }
+    link->tx_ring = link->rx_ring + rx_size;
+
+#ifdef PACKET_IGNORE_OUTGOING
+    /* -- our own transmissions would show up on the receive ring -- */
+    v = 1;
+    setsockopt(link->fd, SOL_PACKET, PACKET_IGNORE_OUTGOING, &v, sizeof(v));
+#endif /* PACKET_IGNORE_OUTGOING */
+
+    memset(&sll, 0, sizeof(sll));
+    sll.sll_family = AF_PACKET;
+    sll.sll_protocol = htons(ETH_P_ALL);
+    sll.sll_ifindex = link->devindex;
+    if (bind(link->fd, (struct sockaddr*)&sll, sizeof(sll)) != 0) {
+        perror("bind(..):sr_packet.c::packet_open_link");
+        return -1;
+    }
+    printf("Interface %s on %s (AF_PACKET)\n", link->l.name, link->l.dev);
+    return 0;
+}
+
+/* Have the kernel send the filled transmit slots. */
+static void packet_kick(struct packet_link* link, int wait)
+{
+    if (sendto(link->fd, 0, 0, wait ? 0 : MSG_DONTWAIT, 0, 0) < 0 &&
+        errno != EAGAIN && errno != ENOBUFS && errno != EINTR) {
+        perror("sendto(..):sr_packet.c::packet_kick");
+    }
+    link->tx_queued = 0;
+    pk.tx_kicks++;
+}
+
+/* sr_io flush; also run by the loop after each batch. */
+static int packet_flush(struct sr_instance* sr)
+{
+    unsigned int i;
+
+    pthread_mutex_lock(&(sr->tx_lock));
+    for (i = 0; i < pk.nlinks; i++) {
+        if (pk.links[i].tx_queued) {
+            packet_kick(&pk.links[i], 0);
+        }
+    }
+    pthread_mutex_unlock(&(sr->tx_lock));
+    return 0;
+}
+
+/* sr_io send: copy the frame into the link's next transmit slot. */
+static int packet_send(struct sr_instance* sr, uint8_t* buf, unsigned int len,
+                       unsigned int ifindex)
+{
+    struct packet_link* link;
+    struct tpacket3_hdr* hdr;
+    int ret = -1;
+
+    pthread_mutex_lock(&(sr->tx_lock));
+
+    link = pk.by_ifindex && ifindex < sr->if_count ?
+           (struct packet_link*)pk.by_ifindex[ifindex] : 0;
+    if (link == 0) {
+        goto out;
+    }
+    if (len > SR_PACKET_FRAME - TX_DATA_OFF) {
+        pk.tx_oversize++;
+        goto out;
+    }
+
+    hdr = (struct tpacket3_hdr*)(link->tx_ring +
+                                 (size_t)link->tx_slot * SR_PACKET_FRAME);
+    if (hdr->tp_status != TP_STATUS_AVAILABLE) {
+        /* -- ring full: wait for the kernel to send what it holds -- */
+        packet_kick(link, 1);
+        if (hdr->tp_status != TP_STATUS_AVAILABLE) {
+            pk.tx_full++;
+            goto out;
+        }
+    }
+
+    memcpy((uint8_t*)hdr + TX_DATA_OFF, buf, len);
+    hdr->tp_len = len;
+    hdr->tp_snaplen = len;
+    hdr->tp_next_offset = 0;
+    __sync_synchronize();
+    hdr->tp_status = TP_STATUS_SEND_REQUEST;
+
+    link->tx_slot = (link->tx_slot + 1) % SR_PACKET_TX_FRAMES;
+    link->tx_queued++;
+    pk.tx_frames++;
+    ret = 0;
+
+out:
+    pthread_mutex_unlock(&(sr->tx_lock));
+    return ret;
+}
+
+/* sr_io hwaddr: a router interface without a MAC takes its device's. */
+static int packet_hwaddr(struct sr_instance* sr, const char* name,
+                         unsigned char* addr)
+{
+    unsigned int i;
+
+    for (i = 0; i < pk.nlinks; i++) {
+        if (strncmp(pk.links[i].l.name, name, sr_IFACE_NAMELEN) == 0) {
+            memcpy(addr, pk.links[i].hwaddr, ETHER_ADDR_LEN);
+            return 0;
+        }
+    }
+    return -1;
+}
+
+int sr_packet_open(struct sr_instance* sr, const char* links)
+{
+    assert(sr);
+    assert(links);
+    assert(pk.links == 0);
+
+    pk.links = (struct packet_link*)sr_link_open_all(links,
+               sizeof(struct packet_link), &pk.nlinks, packet_open_link,
+               packet_close, 0);
+    if (pk.links == 0) {
+        return -1;
+    }
+
+    pk.io.name = "AF_PACKET";
+    pk.io.send = packet_send;
+    pk.io.flush = packet_flush;
+    pk.io.hwaddr = packet_hwaddr;
+    pk.io.state = &pk;
+    sr->io = &pk.io;
+    return 0;
+}
+
+/* A local sender on a veth leaves its TCP or UDP checksum to offload
+   that never happens (TP_STATUS_CSUMNOTREADY); the frame is about to be
+   forwarded, so fill it in. */
+static void packet_csum_fix(uint8_t* frame, unsigned int len)
+{
+    sr_ethernet_hdr_t* eth = (sr_ethernet_hdr_t*)frame;
+    sr_ip_hdr_t* ip = (sr_ip_hdr_t*)(frame + sizeof(sr_ethernet_hdr_t));
+    unsigned int hl, l4len, i;
+    uint8_t* l4;
+    uint16_t* sum;
+    uint32_t acc;
+
+    if (eth->ether_type != htons(ethertype_ip) ||
+        len < sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t) ||
+        (ntohs(ip->ip_off) & IP_OFFMASK) != 0) {
+        return;
+    }
+    hl = ip->ip_hl * 4;
+    if (ntohs(ip->ip_len) < hl ||
+        sizeof(sr_ethernet_hdr_t) + ntohs(ip->ip_len) > len) {
+        return;
+    }
+    l4 = (uint8_t*)ip + hl;
+    l4len = ntohs(ip->ip_len) - hl;
+    if (ip->ip_p == ip_protocol_tcp && l4len >= 20) {
+        sum = (uint16_t*)(l4 + 16);
+    } else if (ip->ip_p == ip_protocol_udp && l4len >= 8) {
+        sum = (uint16_t*)(l4 + 6);
+    } else {
+        return;
+    }
+
+    /* -- pseudo header, then the segment -- */
+    *sum = 0;
+    acc = (ntohl(ip->ip_src) >> 16) + (ntohl(ip->ip_src) & 0xffff) +
+          (ntohl(ip->ip_dst) >> 16) + (ntohl(ip->ip_dst) & 0xffff) +
+          ip->ip_p + l4len;
+    for (i = 0; i + 1 < l4len; i += 2) {
+        acc += l4[i] << 8 | l4[i + 1];
+    }
+    if (l4len & 1) {
+        acc += l4[l4len - 1] << 8;
+    }
+    while (acc > 0xffff) {
+        acc = (acc >> 16) + (acc & 0xffff);
+    }
+    acc = ~acc & 0xffff;
+    *sum = htons(acc ? acc : 0xffff);
+}
+
+/* Handle every block the kernel has handed up on 'link'. */
+static void packet_rx(struct sr_instance* sr, struct packet_link* link)
+{
+    struct tpacket_block_desc* bd;
+    struct tpacket3_hdr* hdr;
+    const uint8_t bcast[ETHER_ADDR_LEN] = { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff };
+    uint8_t* frame;
+    unsigned int i;
+
+    for (;;) {
+        bd = (struct tpacket_block_desc*)(link->rx_ring +
+                                          (size_t)link->rx_block * SR_PACKET_BLOCK);
+        if ((bd->hdr.bh1.block_status & TP_STATUS_USER) == 0) {
+            break;
+        }
+        __sync_synchronize();
+
+        hdr = (struct tpacket3_hdr*)((uint8_t*)bd + bd->hdr.bh1.offset_to_first_pkt);
+        for (i = 0; i < bd->hdr.bh1.num_pkts; i++) {
+            struct sockaddr_ll* sll = (struct sockaddr_ll*)
+                ((uint8_t*)hdr + TPACKET_ALIGN(sizeof(struct tpacket3_hdr)));
+
+            frame = (uint8_t*)hdr + hdr->tp_mac;
+            if (sll->sll_pkttype == PACKET_OUTGOING ||
+                hdr->tp_snaplen < sizeof(sr_ethernet_hdr_t)) {
+                /* -- ours, before PACKET_IGNORE_OUTGOING -- */
+            } else if (memcmp(frame, link->l.iface->addr, ETHER_ADDR_LEN) != 0 &&
+                       memcmp(frame, bcast, ETHER_ADDR_LEN) != 0) {
+                pk.rx_other++;
+            } else {
+                pk.rx_frames++;
+                if (hdr->tp_status & TP_STATUS_CSUMNOTREADY) {
+                    packet_csum_fix(frame, hdr->tp_snaplen);
+                }
+                sr_reload_enter(sr);
+                sr_handlepacket_ifindex(sr, frame, hdr->tp_snaplen,
+                                        link->l.iface->ifindex);
+                sr_reload_exit(sr);
+            }
+            hdr = (struct tpacket3_hdr*)((uint8_t*)hdr + hdr->tp_next_offset);
+        }
+
+        /* -- the whole block goes back at once -- */
+        __sync_synchronize();
+        bd->hdr.bh1.block_status = TP_STATUS_KERNEL;
+        link->rx_block = (link->rx_block + 1) % SR_PACKET_RX_BLOCKS;
+        pk.rx_blocks++;
+    }
+}
+
+int sr_packet_run(struct sr_instance* sr)
+{
+    struct pollfd* pfds;
+    struct packet_mreq mreq;
+    unsigned int i;
+    int ret = 0;
+
+    assert(sr);
+    assert(sr->io == &pk.io);
+
+    pfds = (struct pollfd*)calloc(pk.nlinks, sizeof(struct pollfd));
+    assert(pfds);
+    pk.by_ifindex = sr_link_bind(sr, pk.links, sizeof(struct packet_link),
+                                 pk.nlinks, "link");
+    if (pk.by_ifindex == 0) {
+        ret = -1;
+        goto out;
+    }
+    for (i = 0; i < pk.nlinks; i++) {
+        struct packet_link* link = &pk.links[i];
+
+        pfds[i].fd = link->fd;
+        pfds[i].events = POLLIN;
+
+        /* -- a MAC other than the device's needs promiscuous mode -- */
+        if (memcmp(link->l.iface->addr, link->hwaddr, ETHER_ADDR_LEN) != 0) {
+            memset(&mreq, 0, sizeof(mreq));
+            mreq.mr_ifindex = link->devindex;
+            mreq.mr_type = PACKET_MR_PROMISC;
+            if (setsockopt(link->fd, SOL_PACKET, PACKET_ADD_MEMBERSHIP,
+                           &mreq, sizeof(mreq)) != 0) {
+                perror("setsockopt(PACKET_ADD_MEMBERSHIP):sr_packet.c");
+            }
+        }
+    }
+
+    sr_link_catch_signals();
+
+    printf(" <-- Ready to process packets --> \n");
+    while (!sr_link_stopping()) {
+        if (poll(pfds, pk.nlinks, 100) < 0 && errno != EINTR) {
+            perror("poll(..):sr_packet.c::sr_packet_run");
+            ret = -1;
+            break;
+        }
+        pk.rx_polls++;
+        for (i = 0; i < pk.nlinks; i++) {
+            packet_rx(sr, &pk.links[i]);
+        }
+        packet_flush(sr);
+    }
+
+    fprintf(stderr, "AF_PACKET rx: %lu frames in %lu blocks, %lu polls, "
+            "%lu for other MACs\n", pk.rx_frames, pk.rx_blocks, pk.rx_polls,
+            pk.rx_other);
+    fprintf(stderr, "AF_PACKET tx: %lu frames in %lu kicks, %lu dropped "
+            "(ring full), %lu oversize\n", pk.tx_frames, pk.tx_kicks,
+            pk.tx_full, pk.tx_oversize);
+
+out:
+    sr_link_close_all(sr, pk.links, sizeof(struct packet_link), pk.nlinks,
+                      pk.by_ifindex, packet_close);
+    free(pfds);
+    return ret;
+}
@@ -0,0 +1,46 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_packet.h
+ *
+ * Description:
+ *
+ * AF_PACKET data plane: each router interface is bound to a Linux network
+ * interface (a NIC, or one end of a veth pair) and frames go straight
+ * between the router and the device, without VNS, POX or TCP.
+ *
+ * Every link has a TPACKET_V3 receive ring and a transmit ring mapped into
+ * the process.  The kernel fills receive blocks with many frames each, and
+ * the router handles them where they sit and hands whole blocks back.
+ * Sent frames are copied into free transmit slots and the kernel is kicked
+ * once per batch, like the VNS transmit queue.
+ *
+ * Only frames for the interface's MAC and broadcasts are handled, as the
+ * VNS server would deliver them.  Device offloads that hand up frames
+ * larger than the MTU (GRO, LRO) should be off on the router's links.
+ *
+ *---------------------------------------------------------------------------*/
+
+#ifndef SR_PACKET_H
+#define SR_PACKET_H
+
+struct sr_instance;
+
+#define SR_PACKET_BLOCK      (1 << 16) /* receive ring block */
+#define SR_PACKET_RX_BLOCKS  64
+#define SR_PACKET_BLOCK_TOV  1         /* ms before a partial block is
+                                          handed up */
+#define SR_PACKET_FRAME      2048      /* transmit slot, header included */
+#define SR_PACKET_TX_FRAMES  1024
+
+/* Open a socket and rings for every link in 'links', a comma separated
+   list of "router interface=device" (or just "device" for the same
+   name), and make them the router's data plane.  Call before
+   sr_load_hwinfo(), which then takes the devices' MACs for interfaces
+   the file gives none for.  Returns 0, or -1 with nothing set up. */
+int sr_packet_open(struct sr_instance* sr, const char* links);
+
+/* Handle frames from every link until SIGINT or SIGTERM, then print what
+   was received and sent.  Every router interface must have a link.
+   Returns 0, or -1 on error. */
+int sr_packet_run(struct sr_instance* sr);
+
+#endif /* -- SR_PACKET_H -- */
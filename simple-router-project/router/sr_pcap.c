@@ -0,0 +1,688 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_pcap.c
+ *
+ * Description:
+ *
+ * Offline replay of pcap and pcapng captures.  See sr_pcap.h.
+ *
+ * The input file is mapped and indexed once, ingress interfaces included,
+ * so the replay loop only copies each frame to a scratch buffer (the
+ * router rewrites frames in place) and hands it to the router.
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+
+#include "sr_pcap.h"
+#include "sr_router.h"
+#include "sr_reload.h"
+#include "sr_if.h"
+#include "sr_rt.h"
+#include "sr_fib.h"
+#include "sr_protocol.h"
+#include "sr_dumper.h"
+
+#define PCAP_MAGIC_NSEC  0xa1b23c4d
+#define PCAPNG_SHB       0x0a0d0d0a
+#define PCAPNG_IDB       1
+#define PCAPNG_SPB       3
+#define PCAPNG_EPB       6
+#define PCAPNG_BOM       0x1a2b3c4d
+#define PCAPNG_IF_NAME   2
+#define PCAPNG_IF_TSRESOL 9
+
+/* block sizes without data or options: header, fixed fields, trailer */
+#define PCAPNG_IDB_MIN   20
+#define PCAPNG_EPB_MIN   32
+#define PCAPNG_SPB_MIN   16
+
+#define NSEC 1000000000ULL
+
+/* One frame of the input file. */
+struct pcap_frame
+{
+    const uint8_t* data;        /* in the mapping */
+    unsigned int len;
+    unsigned int ifindex;       /* ingress */
+    uint64_t ts;                /* ns */
+};
+
+/* What the router sent, by kind. */
+enum
+{
+    OUT_FORWARD, OUT_ARP_REQUEST, OUT_ARP_REPLY, OUT_ECHO_REPLY,
+    OUT_NET_UNREACH, OUT_HOST_UNREACH, OUT_PORT_UNREACH, OUT_TIME_EXCEEDED,
+    OUT_OTHER, OUT_KINDS
+};
+
+static const char* out_names[OUT_KINDS] = {
+    "forwarded", "ARP request", "ARP reply", "ICMP echo reply",
+    "ICMP net unreachable", "ICMP host unreachable",
+    "ICMP port unreachable", "ICMP time exceeded", "other" };
+
+struct pcap_state
+{
+    struct sr_io io;
+    struct pcap_frame* frames;
+    unsigned int nframes;
+    unsigned long skipped;      /* truncated, not Ethernet, no ingress */
+    unsigned long own;          /* sent by the router in the capture */
+    FILE* out;
+    int ng;                     /* out is pcapng */
+    uint64_t now;               /* timestamp of the frame being handled */
+    unsigned long sent[OUT_KINDS];
+    unsigned long sent_total;
+};
+
+/* One replay per process; the ARP thread may still send through it after
+   sr_pcap_replay() returns. */
+static struct pcap_state pcap;
+
+/* Interface block of a pcapng section. */
+struct pcapng_if
+{
+    unsigned int linktype;
+    unsigned int snaplen;
+    unsigned int ifindex;       /* named router interface, or NONE */
+    int tsresol;                /* 10^-n seconds, or 2^-n if negative */
+};
+
+/* -- reading -- */
+
+static uint32_t rd32(const uint8_t* p, int swap)
+{
+    uint32_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return swap ? __builtin_bswap32(v) : v;
+}
+
+static uint16_t rd16(const uint8_t* p, int swap)
+{
+    uint16_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return swap ? (uint16_t)((v >> 8) | (v << 8)) : v;
+}
+
+static uint64_t ts_to_ns(uint64_t ts, int tsresol)
+{
+    uint64_t ns = 0;
+    int i;
+
+    if (tsresol < 0) {
+        i = -tsresol;
+        return (ts >> i) * NSEC + (((ts & ((1ULL << i) - 1)) * NSEC) >> i);
+    }
+    if (tsresol <= 9) {
+        ns = ts;
+        for (i = tsresol; i < 9; i++) {
+            ns *= 10;
+        }
+    } else {
+        ns = ts;
+        for (i = 9; i < tsresol; i++) {
+            ns /= 10;
+        }
+    }
+    return ns;
+}
+
+/* Router interface for a capture interface name: the same name, or
+   "sw0-ethN" for ethN. */
+static unsigned int pcap_ifindex_by_name(struct sr_instance* sr,
+                                         const char* name)
+{
+    struct sr_if* iface = sr_get_interface(sr, name);
+    const char* p;
+
+    if (iface == 0 && (p = strstr(name, "-eth")) != 0) {
+        iface = sr_get_interface(sr, p + 1);
+    }
+    return iface ? iface->ifindex : SR_IFINDEX_NONE;
+}
+
+/* Ingress interface of a frame with no named interface: whoever owns its
+   destination MAC, else the interface the sender is routed through. */
+static unsigned int pcap_guess_ifindex(struct sr_instance* sr,
+                                       const uint8_t* frame, unsigned int len)
+{
+    const sr_ethernet_hdr_t* eth = (const sr_ethernet_hdr_t*)frame;
+    const uint8_t* l3 = frame + sizeof(sr_ethernet_hdr_t);
+    struct sr_if* iface;
+    struct sr_rt* rt;
+    uint32_t src;
+
+    for (iface = sr->if_list; iface; iface = iface->next) {
+        if (memcmp(eth->ether_dhost, iface->addr, ETHER_ADDR_LEN) == 0) {
+            return iface->ifindex;
+        }
+    }
+
+    if (eth->ether_type == htons(ethertype_arp) &&
+        len >= sizeof(sr_ethernet_hdr_t) + sizeof(sr_arp_hdr_t)) {
+        src = ((const sr_arp_hdr_t*)l3)->ar_sip;
+    } else if (eth->ether_type == htons(ethertype_ip) &&
+               len >= sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t)) {
+        src = ((const sr_ip_hdr_t*)l3)->ip_src;
+    } else {
+        return SR_IFINDEX_NONE;
+    }
+
+    rt = sr_fib_lookup(sr->fib, src);
+    if (rt && !rt->local) {
+        return rt->ifindex;
+    }
+    return SR_IFINDEX_NONE;
+}
+
+/* Sent by one of the router's interfaces. */
+static int pcap_from_router(struct sr_instance* sr, const uint8_t* frame)
+{
+    const sr_ethernet_hdr_t* eth = (const sr_ethernet_hdr_t*)frame;
+    struct sr_if* iface;
+
+    for (iface = sr->if_list; iface; iface = iface->next) {
+        if (memcmp(eth->ether_shost, iface->addr, ETHER_ADDR_LEN) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Index one frame; ifindex NONE means work it out from the frame. */
+static void pcap_add_frame(struct sr_instance* sr, struct pcap_state* st,
+                           const uint8_t* data, unsigned int caplen,
+                           unsigned int len, unsigned int ifindex,
+                           uint64_t ts, unsigned int* cap)
+{
+    struct pcap_frame* f;
+
+    if (caplen < len || len < sizeof(sr_ethernet_hdr_t)) {
+        st->skipped++;
+        return;
+    }
+    if (pcap_from_router(sr, data)) {
+        st->own++;
+        return;
+    }
+    if (ifindex == SR_IFINDEX_NONE) {
+        ifindex = pcap_guess_ifindex(sr, data, len);
+    }
+    if (ifindex == SR_IFINDEX_NONE) {
+        st->skipped++;
+        return;
+    }
+
+    if (st->nframes == *cap) {
+        *cap = *cap ? *cap * 2 : 1024;
+        st->frames = (struct pcap_frame*)realloc(st->frames,
+                                                 *cap * sizeof(*f));
+        assert(st->frames);
+    }
+    f = &st->frames[st->nframes++];
+    f->data = data;
+    f->len = len;
+    f->ifindex = ifindex;
+    f->ts = ts;
+}
+
+static int pcap_index_classic(struct sr_instance* sr, struct pcap_state* st,
+                              const uint8_t* p, size_t size)
+{
+    const uint8_t* end = p + size;
+    uint32_t magic = rd32(p, 0);
+    int swap = (magic == __builtin_bswap32(TCPDUMP_MAGIC) ||
+                magic == __builtin_bswap32(PCAP_MAGIC_NSEC));
+    int nsec = (magic == PCAP_MAGIC_NSEC ||
+                magic == __builtin_bswap32(PCAP_MAGIC_NSEC));
+    unsigned int cap = 0;
+    uint32_t caplen;
+    uint64_t ts;
+
+    if (size < sizeof(struct pcap_file_header)) {
+        return -1;
+    }
+    if (rd32(p + 20, swap) != LINKTYPE_ETHERNET) {
+        fprintf(stderr, "pcap: link type %u, not Ethernet\n", rd32(p + 20, swap));
+        return -1;
+    }
+
+    for (p += sizeof(struct pcap_file_header); p + 16 <= end; p += 16 + caplen) {
+        caplen = rd32(p + 8, swap);
+        if (caplen > (size_t)(end - p) - 16) {
+            break;
+        }
+        ts = (uint64_t)rd32(p, swap) * NSEC +
+             (uint64_t)rd32(p + 4, swap) * (nsec ? 1 : 1000);
+        pcap_add_frame(sr, st, p + 16, caplen, rd32(p + 12, swap),
+                       SR_IFINDEX_NONE, ts, &cap);
+    }
+    return 0;
+}
+
+/* Interface block options: if_name and if_tsresol. */
+static void pcapng_if_options(struct sr_instance* sr, struct pcapng_if* idb,
+                              const uint8_t* p, const uint8_t* end, int swap)
+{
+    char name[64];
+    uint16_t code, len;
+
+    while (p + 4 <= end) {
+        code = rd16(p, swap);
+        len = rd16(p + 2, swap);
+        p += 4;
+        if (code == 0 || p + len > end) {
+            break;
+        }
+        if (code == PCAPNG_IF_NAME) {
+            unsigned int n = len < sizeof(name) - 1 ? len : sizeof(name) - 1;
+            memcpy(name, p, n);
+            name[n] = 0;
+            idb->ifindex = pcap_ifindex_by_name(sr, name);
+        } else if (code == PCAPNG_IF_TSRESOL && len >= 1) {
+            idb->tsresol = (p[0] & 0x80) ? -(int)(p[0] & 0x7f) : p[0];
+        }
+        p += (len + 3) & ~3;
+    }
+}
+
+static int pcap_index_ng(struct sr_instance* sr, struct pcap_state* st,
+                         const uint8_t* p, size_t size)
+{
+    const uint8_t* end = p + size;
+    struct pcapng_if* ifs = 0;
+    struct pcapng_if* idb;
+    unsigned int nifs = 0, cap = 0, id;
+    uint32_t type, blen, caplen, len;
+    uint64_t ts;
+    int swap = 0;
+
+    for (; p + 12 <= end; p += blen) {
+        type = rd32(p, swap);
+        if (type == PCAPNG_SHB) {
+            /* -- new section: byte order and interfaces start over -- */
+            swap = rd32(p + 8, 0) != PCAPNG_BOM;
+            nifs = 0;
+        }
+        blen = rd32(p + 4, swap);
+        if (blen < 12 || (blen & 3) || p + blen > end) {
+            fprintf(stderr, "pcapng: bad block length %u\n", blen);
+            free(ifs);
+            return -1;
+        }
+
+        switch (type) {
+        case PCAPNG_IDB:
+            if (blen < PCAPNG_IDB_MIN) {
+                fprintf(stderr, "pcapng: bad interface block length %u\n",
+                        blen);
+                free(ifs);
+                return -1;
+            }
+            ifs = (struct pcapng_if*)realloc(ifs, (nifs + 1) * sizeof(*ifs));
+            assert(ifs);
+            idb = &ifs[nifs++];
+            idb->linktype = rd16(p + 8, swap);
+            idb->snaplen = rd32(p + 12, swap);
+            idb->ifindex = SR_IFINDEX_NONE;
+            idb->tsresol = 6;
+            pcapng_if_options(sr, idb, p + 16, p + blen - 4, swap);
+            break;
+
+        case PCAPNG_EPB:
+            if (blen < PCAPNG_EPB_MIN) {
+                st->skipped++;
+                break;
+            }
+            id = rd32(p + 8, swap);
+            caplen = rd32(p + 20, swap);
+            len = rd32(p + 24, swap);
+            if (id >= nifs || ifs[id].linktype != LINKTYPE_ETHERNET ||
+                caplen > blen - PCAPNG_EPB_MIN) {
+                st->skipped++;
+                break;
+            }
+            ts = ((uint64_t)rd32(p + 12, swap) << 32) | rd32(p + 16, swap);
+            pcap_add_frame(sr, st, p + 28, caplen, len, ifs[id].ifindex,
+                           ts_to_ns(ts, ifs[id].tsresol), &cap);
+            break;
+
+        case PCAPNG_SPB:
+            if (blen < PCAPNG_SPB_MIN || nifs == 0 ||
+                ifs[0].linktype != LINKTYPE_ETHERNET) {
+                st->skipped++;
+                break;
+            }
+            len = rd32(p + 8, swap);
+            caplen = blen - PCAPNG_SPB_MIN;
+            if (ifs[0].snaplen && caplen > ifs[0].snaplen) {
+                caplen = ifs[0].snaplen;
+            }
+            pcap_add_frame(sr, st, p + 12, caplen < len ? caplen : len, len,
+                           ifs[0].ifindex, 0, &cap);
+            break;
+
+        default:
+            break;
+        }
+    }
+
+    free(ifs);
+    return 0;
+}
+
+/* -- writing -- */
+
+static void pcapng_write_block(FILE* fp, uint32_t type, const void* body,
+                               unsigned int len, const void* data,
+                               unsigned int dlen)
+{
+    static const uint8_t pad[4] = { 0, 0, 0, 0 };
+    uint32_t blen = 12 + len + ((dlen + 3) & ~3);
+
+    fwrite(&type, 4, 1, fp);
+    fwrite(&blen, 4, 1, fp);
+    fwrite(body, len, 1, fp);
+    if (dlen) {
+        fwrite(data, dlen, 1, fp);
+        fwrite(pad, (4 - (dlen & 3)) & 3, 1, fp);
+    }
+    fwrite(&blen, 4, 1, fp);
+}
+
+/* Section header, then an interface block per router interface, in
+   ifindex order so that interface ids are ifindexes. */
+static void pcapng_write_header(struct sr_instance* sr, FILE* fp)
+{
+    struct
+    {
+        uint32_t bom;
+        uint16_t major, minor;
+        int64_t section_len;
+    } __attribute__ ((packed)) shb = { PCAPNG_BOM, 1, 0, -1 };
+    uint32_t idb[2];
+    uint8_t opts[4 + sr_IFACE_NAMELEN + 4 + 4];
+    uint16_t opt[2];
+    unsigned int i, n, olen;
+    struct sr_if* iface;
+
+    pcapng_write_block(fp, PCAPNG_SHB, &shb, sizeof(shb), 0, 0);
+
+    for (i = 0; i < sr->if_count; i++) {
+        iface = sr_get_interface_by_index(sr, i);
+        idb[0] = LINKTYPE_ETHERNET;
+        idb[1] = 0;
+        n = strlen(iface->name);
+        opt[0] = PCAPNG_IF_NAME;
+        opt[1] = n;
+        memset(opts, 0, sizeof(opts));
+        memcpy(opts, opt, 4);
+        memcpy(opts + 4, iface->name, n);
+        olen = 4 + ((n + 3) & ~3) + 4; /* -- then opt_endofopt -- */
+        pcapng_write_block(fp, PCAPNG_IDB, idb, sizeof(idb), opts, olen);
+    }
+}
+
+static void pcap_write(struct pcap_state* st, const uint8_t* buf,
+                       unsigned int len, unsigned int ifindex)
+{
+    if (st->ng) {
+        uint64_t us = st->now / 1000;
+        uint32_t epb[5];
+
+        epb[0] = ifindex;
+        epb[1] = (uint32_t)(us >> 32);
+        epb[2] = (uint32_t)us;
+        epb[3] = len;
+        epb[4] = len;
+        pcapng_write_block(st->out, PCAPNG_EPB, epb, sizeof(epb), buf, len);
+    } else {
+        struct pcap_pkthdr h;
+
+        h.ts.tv_sec = st->now / NSEC;
+        h.ts.tv_usec = (st->now % NSEC) / 1000;
+        h.caplen = len;
+        h.len = len;
+        sr_dump(st->out, &h, buf);
+    }
+}
+
+static int pcap_classify(struct sr_instance* sr, const uint8_t* buf,
+                         unsigned int len)
+{
+    const sr_ethernet_hdr_t* eth = (const sr_ethernet_hdr_t*)buf;
+    const uint8_t* l3 = buf + sizeof(sr_ethernet_hdr_t);
+    const sr_ip_hdr_t* ip;
+    const sr_icmp_hdr_t* icmp;
+    struct sr_if* iface;
+
+    if (eth->ether_type == htons(ethertype_arp) &&
+        len >= sizeof(sr_ethernet_hdr_t) + sizeof(sr_arp_hdr_t)) {
+        return ((const sr_arp_hdr_t*)l3)->ar_op == htons(arp_op_request) ?
+            OUT_ARP_REQUEST : OUT_ARP_REPLY;
+    }
+    if (eth->ether_type != htons(ethertype_ip) ||
+        len < sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t)) {
+        return OUT_OTHER;
+    }
+
+    /* -- from an address of ours: an ICMP message the router made -- */
+    ip = (const sr_ip_hdr_t*)l3;
+    for (iface = sr->if_list; iface; iface = iface->next) {
+        if (ip->ip_src == iface->ip) {
+            break;
+        }
+    }
+    if (iface == 0) {
+        return OUT_FORWARD;
+    }
+    if (ip->ip_p != ip_protocol_icmp ||
+        len < sizeof(sr_ethernet_hdr_t) + ip->ip_hl * 4 + sizeof(sr_icmp_hdr_t)) {
+        return OUT_OTHER;
+    }
+    icmp = (const sr_icmp_hdr_t*)(l3 + ip->ip_hl * 4);
+    switch (icmp->icmp_type) {
+    case 0:
+        return OUT_ECHO_REPLY;
+    case 3:
+        return icmp->icmp_code == 0 ? OUT_NET_UNREACH :
+               icmp->icmp_code == 1 ? OUT_HOST_UNREACH :
+               icmp->icmp_code == 3 ? OUT_PORT_UNREACH : OUT_OTHER;
+    case 11:
+        return OUT_TIME_EXCEEDED;
+    default:
+        return OUT_OTHER;
+    }
+}
+
+/* sr_io send: count the frame and write it out.  Both the replay loop
+   and the ARP thread send. */
+static int pcap_send(struct sr_instance* sr, uint8_t* buf, unsigned int len,
+                     unsigned int ifindex)
+{
+    struct pcap_state* st = (struct pcap_state*)sr->io->state;
+
+    pthread_mutex_lock(&(sr->tx_lock));
+    st->sent[pcap_classify(sr, buf, len)]++;
+    st->sent_total++;
+    if (st->out) {
+        pcap_write(st, buf, len, ifindex);
+    }
+    pthread_mutex_unlock(&(sr->tx_lock));
+    return 0;
+}
+
+/* -- replay -- */
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * NSEC + ts.tv_nsec;
+}
+
+/* Wait until 'deadline': sleep while it is far off, then spin. */
+static void pace(uint64_t deadline)
+{
+    struct timespec ts;
+    uint64_t t;
+
+    while ((t = now_ns()) < deadline) {
+        if (deadline - t > 200000) {
+            ts.tv_sec = 0;
+            ts.tv_nsec = deadline - t - 100000;
+            nanosleep(&ts, 0);
+        }
+    }
+}
+
+static void pcap_report(struct pcap_state* st, unsigned long handled,
+                        uint64_t elapsed)
+{
+    double sec = elapsed / 1e9;
+    int i;
+
+    fprintf(stderr, "Replayed %lu frames in %.3f s: %.0f pps, %.0f ns/packet\n",
+            handled, sec, sec > 0 ? handled / sec : 0.0,
+            handled ? (double)elapsed / handled : 0.0);
+    if (st->skipped || st->own) {
+        fprintf(stderr, "  not replayed: %lu sent by the router, %lu unusable"
+                " (truncated, not Ethernet, or no ingress interface)\n",
+                st->own, st->skipped);
+    }
+    fprintf(stderr, "Sent %lu frames\n", st->sent_total);
+    for (i = 0; i < OUT_KINDS; i++) {
+        if (st->sent[i]) {
+            fprintf(stderr, "  %-22s %lu\n", out_names[i], st->sent[i]);
+        }
+    }
+}
+
+int sr_pcap_replay(struct sr_instance* sr, const char* in, const char* out,
+                   unsigned long rate, unsigned int loops)
+{
+    struct pcap_state* st = &pcap;
+    struct stat sb;
+    const uint8_t* map = MAP_FAILED;
+    uint8_t* scratch = 0;
+    unsigned int i, loop, max_len = 0;
+    unsigned long handled = 0;
+    uint64_t start, elapsed, span, offset;
+    int fd, ret = -1;
+
+    assert(sr);
+    assert(in);
+
+    memset(st, 0, sizeof(*st));
+    st->io.name = "pcap";
+    st->io.send = pcap_send;
+    st->io.state = st;
+
+    /* -- map and index the input -- */
+    if ((fd = open(in, O_RDONLY)) < 0 || fstat(fd, &sb) != 0) {
+        perror("open(..):sr_pcap.c::sr_pcap_replay");
+        goto out;
+    }
+    if (sb.st_size >= 4) {
+        map = (const uint8_t*)mmap(0, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "%s: empty or unreadable\n", in);
+        goto out;
+    }
+    if (rd32(map, 0) == PCAPNG_SHB) {
+        ret = pcap_index_ng(sr, st, map, sb.st_size);
+    } else if (rd32(map, 0) == TCPDUMP_MAGIC ||
+               rd32(map, 0) == PCAP_MAGIC_NSEC ||
+               rd32(map, 1) == TCPDUMP_MAGIC ||
+               rd32(map, 1) == PCAP_MAGIC_NSEC) {
+        ret = pcap_index_classic(sr, st, map, sb.st_size);
+    } else {
+        fprintf(stderr, "%s: not a pcap or pcapng file\n", in);
+    }
+    if (ret != 0) {
+        goto out;
+    }
+    ret = -1;
+    for (i = 0; i < st->nframes; i++) {
+        if (st->frames[i].len > max_len) {
+            max_len = st->frames[i].len;
+        }
+    }
+    scratch = (uint8_t*)malloc(max_len + 64);
+    assert(scratch);
+
+    if (out) {
+        st->ng = strlen(out) > 7 && strcmp(out + strlen(out) - 7, ".pcapng") == 0;
+        if (st->ng) {
+            if ((st->out = fopen(out, "w")) != 0) {
+                pcapng_write_header(sr, st->out);
+            }
+        } else {
+            st->out = sr_dump_open(out, 0, 65535);
+        }
+        if (st->out == 0) {
+            fprintf(stderr, "Error opening %s\n", out);
+            goto out;
+        }
+    }
+
+    fprintf(stderr, "Replaying %u frames from %s%s\n", st->nframes, in,
+            loops > 1 ? ", repeatedly" : "");
+    span = st->nframes ? st->frames[st->nframes - 1].ts - st->frames[0].ts + 1000 : 0;
+    sr->io = &st->io;
+
+    /* -- the loop being measured -- */
+    start = now_ns();
+    for (loop = 0; loop < loops; loop++) {
+        offset = loop * span;
+        for (i = 0; i < st->nframes; i++) {
+            struct pcap_frame* f = &st->frames[i];
+
+            if (rate) {
+                pace(start + handled * NSEC / rate);
+            }
+            memcpy(scratch + 64, f->data, f->len);
+            st->now = f->ts + offset;
+
+            sr_reload_enter(sr);
+            sr_handlepacket_ifindex(sr, scratch + 64, f->len, f->ifindex);
+            sr_reload_exit(sr);
+            handled++;
+        }
+    }
+    elapsed = now_ns() - start;
+
+    pcap_report(st, handled, elapsed);
+    ret = 0;
+
+out:
+    /* -- the ARP thread may still be sending: it only counts from now -- */
+    pthread_mutex_lock(&(sr->tx_lock));
+    if (st->out) {
+        sr_dump_close(st->out);
+        st->out = 0;
+    }
+    pthread_mutex_unlock(&(sr->tx_lock));
+    if (map != MAP_FAILED) {
+        munmap((void*)map, sb.st_size);
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    free(scratch);
+    free(st->frames);
+    return ret;
+}
@@ -0,0 +1,39 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_pcap.h
+ *
+ * Description:
+ *
+ * Offline replay: frames are read from a pcap or pcapng file instead of
+ * the VNS socket and pushed through sr_handlepacket_ifindex(), and the
+ * frames the router sends are counted by kind and optionally written to
+ * a capture file.  With the interfaces from sr_load_hwinfo() this runs
+ * the router without POX or Mininet, the same way every time.
+ *
+ * The ingress interface of a frame is the interface named by its pcapng
+ * interface block (if_name, "sw0-eth1" matching eth1 as in the POX
+ * module).  Classic pcap files, and blocks without a usable name, go by
+ * the frame: the interface owning the destination MAC, or for broadcasts
+ * the one the routing table reaches the sender through.  Frames sent by
+ * the router itself, as found in captures taken on its links, are
+ * skipped.
+ *
+ * The output is pcapng, one interface block per router interface so each
+ * frame records its egress interface, if the file name ends in
+ * ".pcapng", classic pcap otherwise.  Output timestamps are those of the
+ * input frame being handled.
+ *
+ *---------------------------------------------------------------------------*/
+
+#ifndef SR_PCAP_H
+#define SR_PCAP_H
+
+struct sr_instance;
+
+/* Replay every frame of 'in' 'loops' times, at 'rate' frames per second
+   or as fast as possible if 0, writing sent frames to 'out' unless it is
+   0.  Prints throughput and what was sent to stderr.  Returns 0, or -1 if
+   a file could not be read or written. */
+int sr_pcap_replay(struct sr_instance* sr, const char* in, const char* out,
+                   unsigned long rate, unsigned int loops);
+
+#endif /* -- SR_PCAP_H -- */
@@ -0,0 +1,237 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_pktbuf.c
+ *
+ * Description:
+ *
+ * Packet buffer pool with per-thread caches.  See sr_pktbuf.h.
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "sr_pktbuf.h"
+
+#define HUGEPAGE_SIZE (2 * 1024 * 1024)
+
+/* The pool: one mapping carved into SR_PKTBUF_SIZE buffers, the free ones
+   on 'free' unless a thread cache holds them. */
+static struct
+{
+    uint8_t* base;
+    size_t size;                /* of the mapping */
+    unsigned int count;
+    int hugepages;              /* 1 reserved hugepages, 2 transparent */
+    struct sr_pktbuf* free;
+    pthread_mutex_t lock;
+    unsigned long refills;      /* batches handed to thread caches */
+    unsigned long heap_allocs;  /* the pool was empty */
+    unsigned long oversize;     /* frames larger than SR_PKTBUF_ROOM */
+} pool = { 0, 0, 0, 0, 0, PTHREAD_MUTEX_INITIALIZER, 0, 0, 0 };
+
+/* Free buffers of the calling thread. */
+static __thread struct sr_pktbuf* cache_head;
+static __thread unsigned int cache_count;
+
+static void pktbuf_reset(struct sr_pktbuf* pkt)
+{
+    pkt->next = 0;
+    pkt->data = (uint8_t*)(pkt + 1) + SR_PKTBUF_HEADROOM;
+    pkt->len = 0;
+    pkt->ifindex = 0;
+}
+
+int sr_pktbuf_pool_init(unsigned int count, int hugepages)
+{
+    unsigned int i;
+    void* map = MAP_FAILED;
+
+    assert(pool.base == 0);
+
+    if (count == 0) {
+        count = SR_PKTBUF_COUNT;
+    }
+    pool.size = (size_t)count * SR_PKTBUF_SIZE;
+
+#ifdef MAP_HUGETLB
+    if (hugepages) {
+        size_t size = (pool.size + HUGEPAGE_SIZE - 1) & ~(size_t)(HUGEPAGE_SIZE - 1);
+        map = mmap(0, size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (map != MAP_FAILED) {
+            pool.size = size;
+            pool.hugepages = 1;
+        }
+    }
+#endif /* MAP_HUGETLB */
+
+    if (map == MAP_FAILED) {
+        map = mmap(0, pool.size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (map == MAP_FAILED) {
+            perror("mmap(..):sr_pktbuf.c::sr_pktbuf_pool_init");
+            return -1;
+        }
+#ifdef MADV_HUGEPAGE
+        /* -- no reserved hugepages: ask for transparent ones -- */
+        if (hugepages && madvise(map, pool.size, MADV_HUGEPAGE) == 0) {
+            pool.hugepages = 2;
+        }
+#endif /* MADV_HUGEPAGE */
+    }
+
+    pool.base = (uint8_t*)map;
+    pool.count = count;
+
+    /* -- free list in address order, so the first buffers used are
+          adjacent -- */
+    pool.free = 0;
+    for (i = count; i-- > 0; ) {
+        struct sr_pktbuf* pkt = (struct sr_pktbuf*)(pool.base +
+                                                    (size_t)i * SR_PKTBUF_SIZE);
+        pktbuf_reset(pkt);
+        pkt->room = SR_PKTBUF_ROOM;
+        pkt->flags = 0;
+        pkt->next = pool.free;
+        pool.free = pkt;
+    }
+
+    return 0;
+}
+
+void sr_pktbuf_pool_destroy(void)
+{
+    if (pool.base) {
+        munmap(pool.base, pool.size);
+    }
+    pool.base = 0;
+    pool.free = 0;
+    pool.count = 0;
+    cache_head = 0;
+    cache_count = 0;
+}
+
+/* Take up to SR_PKTBUF_BATCH buffers from the pool into this thread's
+   cache. */
+static void pktbuf_refill(void)
+{
+    unsigned int n = 0;
+
+    pthread_mutex_lock(&pool.lock);
+    while (pool.free && n < SR_PKTBUF_BATCH) {
+        struct sr_pktbuf* pkt = pool.free;
+        pool.free = pkt->next;
+        pkt->next = cache_head;
+        cache_head = pkt;
+        n++;
+    }
+    if (n) {
+        pool.refills++;
+    }
+    pthread_mutex_unlock(&pool.lock);
+    cache_count += n;
+}
+
+/* A buffer outside the pool: heap, same layout, room for len bytes. */
+static struct sr_pktbuf* pktbuf_heap(unsigned int len)
+{
+    unsigned int room = len > SR_PKTBUF_ROOM ? len : SR_PKTBUF_ROOM;
+    struct sr_pktbuf* pkt = (struct sr_pktbuf*)malloc(sizeof(struct sr_pktbuf) +
+                                                      SR_PKTBUF_HEADROOM + room);
+
+    if (pkt == 0) {
+        return 0;
+    }
+    pktbuf_reset(pkt);
+    pkt->room = room;
+    pkt->flags = SR_PKTBUF_HEAP;
+    return pkt;
+}
+
+struct sr_pktbuf* sr_pktbuf_alloc(unsigned int len)
+{
+    struct sr_pktbuf* pkt;
+
+    if (len > SR_PKTBUF_ROOM) {
+        __sync_fetch_and_add(&pool.oversize, 1);
+        pkt = pktbuf_heap(len);
+    } else {
+        if (cache_head == 0) {
+            pktbuf_refill();
+        }
+        if (cache_head) {
+            pkt = cache_head;
+            cache_head = pkt->next;
+            cache_count--;
+            pktbuf_reset(pkt);
+        } else {
+            __sync_fetch_and_add(&pool.heap_allocs, 1);
+            pkt = pktbuf_heap(len);
+        }
+    }
+
+    if (pkt) {
+        pkt->len = len;
+    }
+    return pkt;
+}
+
+struct sr_pktbuf* sr_pktbuf_copy(const uint8_t* frame, unsigned int len)
+{
+    struct sr_pktbuf* pkt = sr_pktbuf_alloc(len);
+
+    if (pkt) {
+        memcpy(pkt->data, frame, len);
+    }
+    return pkt;
+}
+
+void sr_pktbuf_free(struct sr_pktbuf* pkt)
+{
+    if (pkt == 0) {
+        return;
+    }
+    if (pkt->flags & SR_PKTBUF_HEAP) {
+        free(pkt);
+        return;
+    }
+
+    pkt->next = cache_head;
+    cache_head = pkt;
+    cache_count++;
+
+    /* -- cache full: give a batch back to the pool -- */
+    if (cache_count > SR_PKTBUF_CACHE) {
+        struct sr_pktbuf* first = cache_head;
+        struct sr_pktbuf* last = cache_head;
+        unsigned int n;
+
+        for (n = 1; n < SR_PKTBUF_BATCH; n++) {
+            last = last->next;
+        }
+        cache_head = last->next;
+        cache_count -= SR_PKTBUF_BATCH;
+
+        pthread_mutex_lock(&pool.lock);
+        last->next = pool.free;
+        pool.free = first;
+        pthread_mutex_unlock(&pool.lock);
+    }
+}
+
+void sr_pktbuf_print_stats(void)
+{
+    if (pool.base == 0) {
+        return;
+    }
+    fprintf(stderr, "Packet buffers: %u x %u bytes (%s), %lu refills, "
+            "%lu heap fallbacks, %lu oversize\n",
+            pool.count, (unsigned int)SR_PKTBUF_SIZE,
+            pool.hugepages == 1 ? "hugepages" :
+            pool.hugepages == 2 ? "transparent hugepages" : "small pages",
+            pool.refills, pool.heap_allocs, pool.oversize);
+}
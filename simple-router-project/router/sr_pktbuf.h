@@ -0,0 +1,72 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_pktbuf.h
+ *
+ * Description:
+ *
+ * Packet buffers.  Every frame the router builds or has to keep past the
+ * receive batch lives in a fixed-size buffer from one pool, allocated at
+ * startup (optionally on hugepages).  Each buffer reserves
+ * SR_PKTBUF_HEADROOM bytes in front of the frame, so the VNS header is
+ * written there on transmit and the buffer itself is handed to the
+ * transmit queue: from being filled, through the ARP queue, to the
+ * socket, a frame is passed by reference and never copied.
+ *
+ * Each thread keeps a small cache of free buffers and only takes the pool
+ * lock to move SR_PKTBUF_BATCH of them at a time.  Frames too large for a
+ * pool buffer, and any allocation while the pool is empty, get a buffer
+ * of the same shape from the heap; sr_pktbuf_free() tells them apart.
+ *
+ *---------------------------------------------------------------------------*/
+
+#ifndef SR_PKTBUF_H
+#define SR_PKTBUF_H
+
+#ifdef _LINUX_
+#include <stdint.h>
+#endif /* _LINUX_ */
+
+#ifdef _DARWIN_
+#include <inttypes.h>
+#endif /* _DARWIN_ */
+
+#define SR_PKTBUF_SIZE     2048 /* pool buffer, header included */
+#define SR_PKTBUF_HEADROOM 64   /* VNS c_packet_header and encapsulation */
+#define SR_PKTBUF_COUNT    4096 /* default pool size, see -B */
+#define SR_PKTBUF_CACHE    64   /* free buffers a thread keeps */
+#define SR_PKTBUF_BATCH    32   /* moved between thread and pool at once */
+
+#define SR_PKTBUF_HEAP     0x1  /* from malloc, not from the pool */
+
+struct sr_pktbuf
+{
+    struct sr_pktbuf* next;     /* free list, ARP queue */
+    uint8_t* data;              /* the frame, headroom in front of it */
+    unsigned int len;           /* frame length */
+    unsigned int room;          /* bytes available at data */
+    unsigned int ifindex;       /* outgoing interface while queued */
+    unsigned int flags;
+};
+
+/* Room after the headroom in a pool buffer. */
+#define SR_PKTBUF_ROOM \
+    (SR_PKTBUF_SIZE - sizeof(struct sr_pktbuf) - SR_PKTBUF_HEADROOM)
+
+/* Set up the pool with 'count' buffers (0 for SR_PKTBUF_COUNT), on
+   hugepages if 'hugepages' is set and the system has them.  Without a
+   pool every buffer comes from the heap. */
+int  sr_pktbuf_pool_init(unsigned int count, int hugepages);
+void sr_pktbuf_pool_destroy(void);
+
+/* A buffer for a frame of len bytes, data at the start of its room.
+   Never fails short of the heap running out. */
+struct sr_pktbuf* sr_pktbuf_alloc(unsigned int len);
+
+/* A buffer holding a copy of the len bytes at frame. */
+struct sr_pktbuf* sr_pktbuf_copy(const uint8_t* frame, unsigned int len);
+
+void sr_pktbuf_free(struct sr_pktbuf* pkt);
+
+/* Prints pool occupancy and heap fallbacks. */
+void sr_pktbuf_print_stats(void);
+
+#endif /* -- SR_PKTBUF_H -- */
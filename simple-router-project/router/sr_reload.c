@@ -0,0 +1,258 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_reload.c
+ *
+ * Description:
+ *
+ * SIGHUP routing table reload.  See sr_reload.h.
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+#include "sr_reload.h"
+#include "sr_rt.h"
+#include "sr_fib.h"
+#include "sr_router.h"
+
+static double reload_now_ms(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+    return tv.tv_sec * 1e3 + tv.tv_usec / 1e3;
+}
+
+/*---------------------------------------------------------------------
+ * Method: reload_same_route
+ * Scope:  Local
+ *
+ *---------------------------------------------------------------------*/
+
+static int reload_same_route(const struct sr_rt* a, const struct sr_rt* b)
+{
+    return a->gw.s_addr == b->gw.s_addr &&
+           strncmp(a->interface, b->interface, sr_IFACE_NAMELEN) == 0;
+}
+
+/*---------------------------------------------------------------------
+ * Method: reload_diff
+ * Scope:  Local
+ *
+ * Count prefixes added, removed and changed (same prefix, different
+ * gateway or interface) going from the old FIB to the new one.  Only the
+ * route actually installed for a prefix counts; shadowed duplicates in
+ * the file are ignored.  O(n) through the FIBs' rule hashes.
+ *
+ *---------------------------------------------------------------------*/
+
+static void reload_diff(struct sr_rt* old_list, struct sr_fib* old_fib,
+                        struct sr_rt* new_list, struct sr_fib* new_fib,
+                        unsigned int* added, unsigned int* removed,
+                        unsigned int* changed)
+{
+    struct sr_rt* rt;
+
+    *added = *removed = *changed = 0;
+
+    for (rt = new_list; rt; rt = rt->next) {
+        struct sr_rt* o;
+
+        if (sr_fib_find(new_fib, rt->dest, rt->mask) != rt) {
+            continue;
+        }
+        o = sr_fib_find(old_fib, rt->dest, rt->mask);
+        if (!o) {
+            (*added)++;
+        } else if (!reload_same_route(o, rt)) {
+            (*changed)++;
+        }
+    }
+    for (rt = old_list; rt; rt = rt->next) {
+        if (sr_fib_find(old_fib, rt->dest, rt->mask) == rt &&
+            !sr_fib_find(new_fib, rt->dest, rt->mask)) {
+            (*removed)++;
+        }
+    }
+}
+
+/*---------------------------------------------------------------------
+ * Method: reload_quiesce
+ * Scope:  Local
+ *
+ * Wait until neither the packet thread nor the ARP thread can still hold
+ * a pointer obtained from the table that was just replaced.
+ *
+ *---------------------------------------------------------------------*/
+
+static void reload_quiesce(struct sr_instance* sr)
+{
+    unsigned long epoch;
+
+    __sync_synchronize();
+    epoch = sr->pkt_epoch;
+    if (epoch & 1) {
+        /* -- a packet is in flight, it may have seen the old table -- */
+        while (sr->pkt_epoch == epoch) {
+            usleep(100);
+        }
+    }
+
+    /* -- likewise for ICMP errors the ARP thread is sending -- */
+    epoch = sr->arp_epoch;
+    if (epoch & 1) {
+        while (sr->arp_epoch == epoch) {
+            usleep(100);
+        }
+    }
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_reload_rt
+ * Scope:  Global
+ *
+ * Load sr->rtable into a scratch instance, diff it against the live
+ * table, publish it and free the old one once nothing can reference it.
+ *
+ *---------------------------------------------------------------------*/
+
+int sr_reload_rt(struct sr_instance* sr)
+{
+    struct sr_instance* next;
+    struct sr_rt* old_list;
+    struct sr_fib* old_fib;
+    unsigned int added, removed, changed;
+    double t0, t1, t2;
+
+    /* -- REQUIRES -- */
+    assert(sr);
+
+    if (!sr->rtable) {
+        fprintf(stderr, "Reload: no routing table file to reload\n");
+        return -1;
+    }
+
+    next = (struct sr_instance*)calloc(1, sizeof(struct sr_instance));
+    assert(next);
+
+    /* -- build the new table off to the side -- */
+    t0 = reload_now_ms();
+    if (sr_load_rt(next, sr->rtable) != 0) {
+        fprintf(stderr, "Reload: error loading %s, keeping current table\n",
+                sr->rtable);
+        old_fib = next->fib;
+        next->fib = 0;
+        sr_flush_rt(next);
+        sr_fib_destroy(old_fib);
+        free(next);
+        return -1;
+    }
+    if (next->fib == 0) {
+        /* -- empty file: switch to an empty table -- */
+        next->fib = sr_fib_create();
+        assert(next->fib);
+    }
+    if (sr_rt_bind_interfaces(sr, next->routing_table) != 0) {
+        fprintf(stderr, "Reload: %s names interfaces that do not exist, "
+                "keeping current table\n", sr->rtable);
+        old_fib = next->fib;
+        next->fib = 0;
+        sr_flush_rt(next);
+        sr_fib_destroy(old_fib);
+        free(next);
+        return -1;
+    }
+    reload_diff(sr->routing_table, sr->fib, next->routing_table, next->fib,
+                &added, &removed, &changed);
+    if (sr_rt_install_local(sr, next->fib) != 0) {
+        fprintf(stderr, "Reload: out of memory, keeping current table\n");
+        old_fib = next->fib;
+        next->fib = 0;
+        sr_flush_rt(next);
+        sr_fib_destroy(old_fib);
+        free(next);
+        return -1;
+    }
+    t1 = reload_now_ms();
+
+    /* -- switch: one pointer store, then tell the packet path -- */
+    old_list = sr->routing_table;
+    old_fib = sr->fib;
+    sr->routing_table = next->routing_table;
+    sr->rt_tail = next->rt_tail;
+    sr->rt_count = next->rt_count;
+    __sync_synchronize();
+    sr->fib = next->fib;
+    __sync_synchronize();
+    sr->fib_version++;
+
+    /* -- reclaim the old table -- */
+    reload_quiesce(sr);
+    t2 = reload_now_ms();
+
+    next->routing_table = old_list;
+    next->fib = 0;
+    sr_flush_rt(next);
+    sr_fib_destroy(old_fib);
+    free(next);
+
+    printf("Reloaded routing table %s: %u routes, %u added, %u removed, "
+           "%u changed (built in %.1f ms, switched in %.3f ms)\n",
+           sr->rtable, sr->rt_count, added, removed, changed,
+           t1 - t0, t2 - t1);
+    return 0;
+} /* -- sr_reload_rt -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_reload_thread
+ * Scope:  Local
+ *
+ *---------------------------------------------------------------------*/
+
+static void* sr_reload_thread(void* sr_ptr)
+{
+    struct sr_instance* sr = (struct sr_instance*)sr_ptr;
+    sigset_t set;
+    int sig;
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGHUP);
+
+    while (1) {
+        if (sigwait(&set, &sig) != 0) {
+            continue;
+        }
+        printf("SIGHUP: reloading routing table\n");
+        sr_reload_rt(sr);
+    }
+
+    return NULL;
+} /* -- sr_reload_thread -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_reload_init
+ * Scope:  Global
+ *
+ *---------------------------------------------------------------------*/
+
+void sr_reload_init(struct sr_instance* sr)
+{
+    pthread_t thread;
+    sigset_t set;
+
+    /* -- REQUIRES -- */
+    assert(sr);
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &set, 0);
+
+    if (pthread_create(&thread, &(sr->attr), sr_reload_thread, sr) != 0) {
+        fprintf(stderr, "Error starting routing table reload thread\n");
+    }
+} /* -- sr_reload_init -- */
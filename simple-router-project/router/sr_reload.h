@@ -0,0 +1,68 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_reload.h
+ *
+ * Description:
+ *
+ * Hitless routing table reload.  A reload thread waits for SIGHUP,
+ * re-reads the routing table file into a new route list and FIB off to
+ * the side and then publishes the new FIB with a single pointer store.
+ *
+ * The packet path never takes a lock for this.  sr_read_from_server()
+ * brackets every packet with sr_reload_enter()/sr_reload_exit(), which
+ * bump sr->pkt_epoch (odd while a packet is being handled).  The reload
+ * thread frees the old table only once that packet has finished, and the
+ * packet path drops the destination cache when it notices a new
+ * sr->fib_version, so no cached route outlives its table.
+ *
+ * With one thread for everything (sr -E) there is no reload thread: the
+ * event loop takes SIGHUP from a signalfd and calls sr_reload_rt()
+ * between messages, so the old table is never still in use.
+ *
+ *---------------------------------------------------------------------------*/
+
+#ifndef SR_RELOAD_H
+#define SR_RELOAD_H
+
+#include "sr_router.h"
+#include "sr_fib.h"
+
+/* Block SIGHUP and start the reload thread.  Must be called before any
+   other thread is created so that they all inherit the blocked mask. */
+void sr_reload_init(struct sr_instance* sr);
+
+/* Re-read sr->rtable and switch to it.  Returns 0 on success; on error
+   the live table is left alone.  Runs on the reload thread. */
+int sr_reload_rt(struct sr_instance* sr);
+
+/*---------------------------------------------------------------------
+ * Method: sr_reload_enter
+ *
+ * Called by the packet thread before handling a packet.
+ *
+ *---------------------------------------------------------------------*/
+
+static __inline__ void sr_reload_enter(struct sr_instance* sr)
+{
+    sr->pkt_epoch++;
+    __sync_synchronize();
+    if (sr->dst_cache && sr->dst_cache->fib_version != sr->fib_version) {
+        sr->dst_cache->fib_version = sr->fib_version;
+        sr_dst_cache_invalidate(sr->dst_cache);
+    }
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_reload_exit
+ *
+ * Called by the packet thread once a packet has been handled; no
+ * pointer into the routing table may be held past this point.
+ *
+ *---------------------------------------------------------------------*/
+
+static __inline__ void sr_reload_exit(struct sr_instance* sr)
+{
+    __sync_synchronize();
+    sr->pkt_epoch++;
+}
+
+#endif /* -- SR_RELOAD_H -- */
@@ -19,22 +19,26 @@
 
 #include "sr_if.h"
 #include "sr_rt.h"
+#include "sr_fib.h"
+#include "sr_adj.h"
+#include "sr_ecmp.h"
+#include "sr_reload.h"
 #include "sr_router.h"
 #include "sr_protocol.h"
 #include "sr_arpcache.h"
+#include "sr_pktbuf.h"
 #include "sr_utils.h"
 
 /* Forward declarations */
 static uint16_t ip_checksum(const void *buf, int len);
 static struct sr_if* sr_get_interface_by_ip(struct sr_instance *sr, uint32_t ip);
-static struct sr_rt* lpm_lookup(struct sr_instance *sr, uint32_t dst_ip);
-static void handle_arp_packet(struct sr_instance *sr, uint8_t *packet, unsigned int len, char *interface);
-static void handle_ip_packet(struct sr_instance *sr, uint8_t *packet, unsigned int len, char *interface);
-static void send_arp_request(struct sr_instance *sr, uint32_t tip, char *interface);
-static void send_arp_reply(struct sr_instance *sr, uint8_t *packet, unsigned int len, char *interface);
-static void send_icmp_echo_reply(struct sr_instance *sr, uint8_t *packet, unsigned int len, char *interface);
+static void handle_arp_packet(struct sr_instance *sr, uint8_t *packet, unsigned int len, struct sr_if *in_iface);
+static void handle_ip_packet(struct sr_instance *sr, uint8_t *packet, unsigned int len, struct sr_if *in_iface);
+static void send_arp_reply(struct sr_instance *sr, uint8_t *packet, unsigned int len, struct sr_if *in_iface, struct sr_if *iface);
+static void send_icmp_echo_reply(struct sr_instance *sr, uint8_t *packet, unsigned int len, struct sr_if *in_iface);
 static void send_icmp_t3(struct sr_instance *sr, uint8_t *packet, unsigned int len, uint8_t type, uint8_t code);
-static void forward_ip_packet(struct sr_instance *sr, uint8_t *packet, unsigned int len);
+static void forward_ip_packet(struct sr_instance *sr, uint8_t *packet, unsigned int len, struct sr_dst_entry *dst);
+static struct sr_adj* adj_resolved(struct sr_instance *sr, struct sr_if *iface, uint32_t ip, const unsigned char *mac, time_t expires);
 
 /*---------------------------------------------------------------------
  * Method: print_ip_addr
@@ -58,7 +62,9 @@ static void print_ip_addr(uint32_t ip) {
  * Method: ip_checksum
  * Scope:  Static helper
  *
- * Compute IP checksum using 16-bit one's complement
+ * Compute IP checksum using 16-bit one's complement.  The words are
+ * summed as they sit in the packet, so the result is already in network
+ * byte order and is stored as is.
  *
  *---------------------------------------------------------------------*/
 static uint16_t ip_checksum(const void *buf, int len)
@@ -90,45 +96,42 @@ static uint16_t ip_checksum(const void *buf, int len)
  * Method: sr_get_interface_by_ip
  * Scope:  Static helper
  *
- * Find interface by IP address
+ * Find interface by IP address: one exact-match probe for the local /32
+ * in the FIB
  *
  *---------------------------------------------------------------------*/
 static struct sr_if* sr_get_interface_by_ip(struct sr_instance *sr, uint32_t ip)
 {
-    struct sr_if *iface = sr->if_list;
-    while (iface) {
-        if (iface->ip == ip) {
-            return iface;
-        }
-        iface = iface->next;
+    struct in_addr dest, mask;
+    dest.s_addr = ip;
+    mask.s_addr = 0xffffffff;
+    
+    struct sr_rt *rt = sr_fib_find(sr->fib, dest, mask);
+    if (rt && rt->local) {
+        return sr_get_interface_by_index(sr, rt->ifindex);
     }
     return NULL;
 }
 
 /*---------------------------------------------------------------------
- * Method: lpm_lookup
+ * Method: adj_resolved
  * Scope:  Static helper
  *
- * Longest prefix match route lookup
+ * ARP resolved ip on iface: complete its adjacency.  If making room freed
+ * expired host adjacencies, no cached destination may point at them.
  *
  *---------------------------------------------------------------------*/
-static struct sr_rt* lpm_lookup(struct sr_instance *sr, uint32_t dst_ip)
+static struct sr_adj* adj_resolved(struct sr_instance *sr, struct sr_if *iface,
+                                   uint32_t ip, const unsigned char *mac,
+                                   time_t expires)
 {
-    struct sr_rt *best = NULL;
-    struct sr_rt *rt;
-    uint32_t best_mask = 0;
-    
-    for (rt = sr->routing_table; rt; rt = rt->next) {
-        uint32_t mask = rt->mask.s_addr;
-        if ((dst_ip & mask) == (rt->dest.s_addr & mask)) {
-            if (ntohl(mask) > ntohl(best_mask)) {
-                best = rt;
-                best_mask = mask;
-            }
-        }
-    }
+    unsigned long reclaimed = sr->adj_table->reclaimed;
+    struct sr_adj *adj = sr_adj_update(sr->adj_table, iface, ip, mac, expires);
     
-    return best;
+    if (sr->adj_table->reclaimed != reclaimed) {
+        sr_dst_cache_invalidate(sr->dst_cache);
+    }
+    return adj;
 }
 
 /*---------------------------------------------------------------------
@@ -144,8 +147,20 @@ void sr_init(struct sr_instance* sr)
     /* REQUIRES */
     assert(sr);
 
+    /* Packet buffers for every frame built or held past its batch */
+    if (sr_pktbuf_pool_init(sr->pktbuf_count, sr->pktbuf_hugepages) != 0) {
+        fprintf(stderr, "Packet buffer pool unavailable, using the heap\n");
+    }
+
     /* Initialize cache and cache cleanup thread */
-    sr_arpcache_init(&(sr->cache));
+    sr_arpcache_init(&(sr->cache), sr->arp_capacity);
+
+    /* Destination cache in front of the FIB, and the adjacencies it
+       resolves to: at most one per host the ARP cache can hold */
+    sr->dst_cache = sr_dst_cache_create();
+    assert(sr->dst_cache);
+    sr->adj_table = sr_adj_table_create(sr->cache.capacity);
+    assert(sr->adj_table);
 
     pthread_attr_init(&(sr->attr));
     pthread_attr_setdetachstate(&(sr->attr), PTHREAD_CREATE_JOINABLE);
@@ -153,7 +168,20 @@ void sr_init(struct sr_instance* sr)
     pthread_attr_setscope(&(sr->attr), PTHREAD_SCOPE_SYSTEM);
     pthread_t thread;
 
-    pthread_create(&thread, &(sr->attr), sr_arpcache_timeout, sr);
+    /* With one thread for everything (sr -E), the event loop reloads on
+       SIGHUP and runs the ARP timers, and the cache takes no lock */
+    sr->cache.single = sr->one_thread;
+    sr->adj_table->single = sr->one_thread;
+    if(sr->one_thread)
+        return;
+
+    /* SIGHUP reloads the routing table; start this before any other
+       thread so that only the reload thread ever sees the signal */
+    sr_reload_init(sr);
+
+    /* the io_uring loop runs the ARP timers itself, see sr_vns_uring_run */
+    if(!sr->uring)
+        pthread_create(&thread, &(sr->attr), sr_arpcache_timeout, sr);
     
     /* Add initialization code here! */
 
@@ -167,7 +195,7 @@ void sr_init(struct sr_instance* sr)
  *
  *---------------------------------------------------------------------*/
 static void handle_arp_packet(struct sr_instance *sr, uint8_t *packet, 
-                              unsigned int len, char *interface)
+                              unsigned int len, struct sr_if *in_iface)
 {
     if (len < sizeof(sr_ethernet_hdr_t) + sizeof(sr_arp_hdr_t)) {
         return;
@@ -181,19 +209,26 @@ static void handle_arp_packet(struct sr_instance *sr, uint8_t *packet,
         /* Check if the target IP is one of our interfaces */
         struct sr_if *iface = sr_get_interface_by_ip(sr, arp_hdr->ar_tip);
         if (iface) {
-            send_arp_reply(sr, packet, len, interface);
+            send_arp_reply(sr, packet, len, in_iface, iface);
         }
     } else if (op == arp_op_reply) {
         
         /* Insert into cache */
         struct sr_arpreq *req = sr_arpcache_insert(&sr->cache, arp_hdr->ar_sha, arp_hdr->ar_sip);
         
+        /* Complete the prebuilt header of this neighbour's adjacency */
+        adj_resolved(sr, in_iface, arp_hdr->ar_sip, arp_hdr->ar_sha,
+                     time(NULL) + (time_t)SR_ARPCACHE_TO);
+        
         /* If there were pending requests, send them */
         if (req) {
-            struct sr_packet *pkt = req->packets;
+            /* The buffers go to the transmit queue as they are */
+            struct sr_pktbuf *pkt = req->packets;
+            req->packets = req->tail = NULL;
             while (pkt) {
-                sr_ethernet_hdr_t *queued_eth = (sr_ethernet_hdr_t *)pkt->buf;
-                struct sr_if *out_iface = sr_get_interface(sr, pkt->iface);
+                struct sr_pktbuf *next = pkt->next;
+                sr_ethernet_hdr_t *queued_eth = (sr_ethernet_hdr_t *)pkt->data;
+                struct sr_if *out_iface = sr_get_interface_by_index(sr, pkt->ifindex);
                 
                 /* Fill in Ethernet header */
                 memcpy(queued_eth->ether_dhost, arp_hdr->ar_sha, ETHER_ADDR_LEN);
@@ -201,145 +236,93 @@ static void handle_arp_packet(struct sr_instance *sr, uint8_t *packet,
                 queued_eth->ether_type = htons(ethertype_ip);
                 
                 /* Send the packet */
-                sr_send_packet(sr, pkt->buf, pkt->len, pkt->iface);
-                pkt = pkt->next;
+                sr_send_pktbuf(sr, pkt, out_iface->ifindex);
+                pkt = next;
             }
             sr_arpreq_destroy(&sr->cache, req);
         }
     }
 }
 
-/*---------------------------------------------------------------------
- * Method: send_arp_request
- * Scope:  Static helper
- *
- * Send an ARP request for target IP
- *
- *---------------------------------------------------------------------*/
-static void send_arp_request(struct sr_instance *sr, uint32_t tip, char *interface)
-{
-    struct sr_if *iface = sr_get_interface(sr, interface);
-    if (!iface) {
-        return;
-    }
-    
-    unsigned int len = sizeof(sr_ethernet_hdr_t) + sizeof(sr_arp_hdr_t);
-    uint8_t *packet = (uint8_t *)malloc(len);
-    
-    sr_ethernet_hdr_t *eth_hdr = (sr_ethernet_hdr_t *)packet;
-    sr_arp_hdr_t *arp_hdr = (sr_arp_hdr_t *)(packet + sizeof(sr_ethernet_hdr_t));
-    
-    /* Ethernet header */
-    memset(eth_hdr->ether_dhost, 0xFF, ETHER_ADDR_LEN); /* Broadcast */
-    memcpy(eth_hdr->ether_shost, iface->addr, ETHER_ADDR_LEN);
-    eth_hdr->ether_type = htons(ethertype_arp);
-    
-    /* ARP header */
-    arp_hdr->ar_hrd = htons(arp_hrd_ethernet);
-    arp_hdr->ar_pro = htons(ethertype_ip);
-    arp_hdr->ar_hln = ETHER_ADDR_LEN;
-    arp_hdr->ar_pln = 4;
-    arp_hdr->ar_op = htons(arp_op_request);
-    memcpy(arp_hdr->ar_sha, iface->addr, ETHER_ADDR_LEN);
-    arp_hdr->ar_sip = iface->ip;
-    memset(arp_hdr->ar_tha, 0x00, ETHER_ADDR_LEN);
-    arp_hdr->ar_tip = tip;
-    
-    sr_send_packet(sr, packet, len, interface);
-    free(packet);
-}
-
 /*---------------------------------------------------------------------
  * Method: send_arp_reply
  * Scope:  Static helper
  *
- * Send an ARP reply
+ * Send an ARP reply on in_iface for iface, the interface owning the
+ * requested address.  The request is turned into the reply in place.
  *
  *---------------------------------------------------------------------*/
 static void send_arp_reply(struct sr_instance *sr, uint8_t *packet, 
-                           unsigned int len, char *interface)
+                           unsigned int len, struct sr_if *in_iface,
+                           struct sr_if *iface)
 {
-    sr_ethernet_hdr_t *req_eth = (sr_ethernet_hdr_t *)packet;
-    sr_arp_hdr_t *req_arp = (sr_arp_hdr_t *)(packet + sizeof(sr_ethernet_hdr_t));
-    
-    struct sr_if *iface = sr_get_interface_by_ip(sr, req_arp->ar_tip);
-    if (!iface) {
-        return;
-    }
+    sr_ethernet_hdr_t *eth = (sr_ethernet_hdr_t *)packet;
+    sr_arp_hdr_t *arp = (sr_arp_hdr_t *)(packet + sizeof(sr_ethernet_hdr_t));
     
     unsigned int reply_len = sizeof(sr_ethernet_hdr_t) + sizeof(sr_arp_hdr_t);
-    uint8_t *reply = (uint8_t *)malloc(reply_len);
     
-    sr_ethernet_hdr_t *reply_eth = (sr_ethernet_hdr_t *)reply;
-    sr_arp_hdr_t *reply_arp = (sr_arp_hdr_t *)(reply + sizeof(sr_ethernet_hdr_t));
-    
-    /* Ethernet header */
-    memcpy(reply_eth->ether_dhost, req_eth->ether_shost, ETHER_ADDR_LEN);
-    memcpy(reply_eth->ether_shost, iface->addr, ETHER_ADDR_LEN);
-    reply_eth->ether_type = htons(ethertype_arp);
-    
-    /* ARP header */
-    reply_arp->ar_hrd = htons(arp_hrd_ethernet);
-    reply_arp->ar_pro = htons(ethertype_ip);
-    reply_arp->ar_hln = ETHER_ADDR_LEN;
-    reply_arp->ar_pln = 4;
-    reply_arp->ar_op = htons(arp_op_reply);
-    memcpy(reply_arp->ar_sha, iface->addr, ETHER_ADDR_LEN);
-    reply_arp->ar_sip = iface->ip;
-    memcpy(reply_arp->ar_tha, req_arp->ar_sha, ETHER_ADDR_LEN);
-    reply_arp->ar_tip = req_arp->ar_sip;
-    
-    sr_send_packet(sr, reply, reply_len, interface);
-    free(reply);
+    /* Ethernet header: back to the requester */
+    memcpy(eth->ether_dhost, eth->ether_shost, ETHER_ADDR_LEN);
+    memcpy(eth->ether_shost, iface->addr, ETHER_ADDR_LEN);
+    eth->ether_type = htons(ethertype_arp);
+    
+    /* ARP header: the sender becomes the target */
+    arp->ar_hrd = htons(arp_hrd_ethernet);
+    arp->ar_pro = htons(ethertype_ip);
+    arp->ar_hln = ETHER_ADDR_LEN;
+    arp->ar_pln = 4;
+    arp->ar_op = htons(arp_op_reply);
+    memcpy(arp->ar_tha, arp->ar_sha, ETHER_ADDR_LEN);
+    arp->ar_tip = arp->ar_sip;
+    memcpy(arp->ar_sha, iface->addr, ETHER_ADDR_LEN);
+    arp->ar_sip = iface->ip;
+    
+    sr_send_packet_ifindex(sr, packet, reply_len, in_iface->ifindex);
 }
 
 /*---------------------------------------------------------------------
  * Method: send_icmp_echo_reply
  * Scope:  Static helper
  *
- * Send ICMP echo reply (type 0)
+ * Send ICMP echo reply (type 0).  The request is turned into the reply
+ * in place; the address swap leaves the IP checksum as it is, and the
+ * TTL and type changes are folded into the checksums incrementally.
  *
  *---------------------------------------------------------------------*/
 static void send_icmp_echo_reply(struct sr_instance *sr, uint8_t *packet, 
-                                 unsigned int len, char *interface)
+                                 unsigned int len, struct sr_if *in_iface)
 {
-    sr_ethernet_hdr_t *req_eth = (sr_ethernet_hdr_t *)packet;
-    
-    /* Create reply packet (same size as request) */
-    uint8_t *reply = (uint8_t *)malloc(len);
-    memcpy(reply, packet, len);
+    sr_ethernet_hdr_t *eth = (sr_ethernet_hdr_t *)packet;
+    sr_ip_hdr_t *ip = (sr_ip_hdr_t *)(packet + sizeof(sr_ethernet_hdr_t));
+    sr_icmp_hdr_t *icmp = (sr_icmp_hdr_t *)((uint8_t *)ip + ip->ip_hl * 4);
+    uint16_t old_word, new_word;
     
-    sr_ethernet_hdr_t *reply_eth = (sr_ethernet_hdr_t *)reply;
-    sr_ip_hdr_t *reply_ip = (sr_ip_hdr_t *)(reply + sizeof(sr_ethernet_hdr_t));
-    sr_icmp_hdr_t *reply_icmp = (sr_icmp_hdr_t *)(reply + sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t));
-    
-    /* Find the interface that received the packet */
-    struct sr_if *iface = sr_get_interface(sr, interface);
+    if ((uint8_t *)icmp + sizeof(sr_icmp_hdr_t) > packet + len) {
+        return;
+    }
     
-    /* Swap Ethernet addresses */
-    memcpy(reply_eth->ether_dhost, req_eth->ether_shost, ETHER_ADDR_LEN);
-    memcpy(reply_eth->ether_shost, iface->addr, ETHER_ADDR_LEN);
+    /* Reply out of the interface that received the packet */
+    memcpy(eth->ether_dhost, eth->ether_shost, ETHER_ADDR_LEN);
+    memcpy(eth->ether_shost, in_iface->addr, ETHER_ADDR_LEN);
     
     /* Swap IP addresses */
-    uint32_t tmp_ip = reply_ip->ip_src;
-    reply_ip->ip_src = reply_ip->ip_dst;
-    reply_ip->ip_dst = tmp_ip;
-    reply_ip->ip_ttl = 64;
-    
-    /* Recompute IP checksum */
-    reply_ip->ip_sum = 0;
-    reply_ip->ip_sum = htons(ip_checksum(reply_ip, reply_ip->ip_hl * 4));
-    
-    /* Update ICMP header */
-    reply_icmp->icmp_type = 0; /* Echo reply */
-    reply_icmp->icmp_code = 0;
-    
-    /* Recompute ICMP checksum */
-    reply_icmp->icmp_sum = 0;
-    reply_icmp->icmp_sum = htons(ip_checksum(reply_icmp, len - sizeof(sr_ethernet_hdr_t) - sizeof(sr_ip_hdr_t)));
-    
-    sr_send_packet(sr, reply, len, interface);
-    free(reply);
+    uint32_t tmp_ip = ip->ip_src;
+    ip->ip_src = ip->ip_dst;
+    ip->ip_dst = tmp_ip;
+    
+    memcpy(&old_word, &ip->ip_ttl, sizeof(old_word));
+    ip->ip_ttl = 64;
+    memcpy(&new_word, &ip->ip_ttl, sizeof(new_word));
+    ip->ip_sum = cksum_update(ip->ip_sum, old_word, new_word);
+    
+    /* Echo reply */
+    memcpy(&old_word, &icmp->icmp_type, sizeof(old_word));
+    icmp->icmp_type = 0;
+    icmp->icmp_code = 0;
+    memcpy(&new_word, &icmp->icmp_type, sizeof(new_word));
+    icmp->icmp_sum = cksum_update(icmp->icmp_sum, old_word, new_word);
+    
+    sr_send_packet_ifindex(sr, packet, len, in_iface->ifindex);
 }
 
 /*---------------------------------------------------------------------
@@ -356,7 +339,8 @@ static void send_icmp_t3(struct sr_instance *sr, uint8_t *packet,
     
     /* Build new packet */
     unsigned int reply_len = sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t) + sizeof(sr_icmp_t3_hdr_t);
-    uint8_t *reply = (uint8_t *)malloc(reply_len);
+    struct sr_pktbuf *pkt = sr_pktbuf_alloc(reply_len);
+    uint8_t *reply = pkt->data;
     memset(reply, 0, reply_len);
     
     sr_ethernet_hdr_t *reply_eth = (sr_ethernet_hdr_t *)reply;
@@ -364,15 +348,18 @@ static void send_icmp_t3(struct sr_instance *sr, uint8_t *packet,
     sr_icmp_t3_hdr_t *reply_icmp = (sr_icmp_t3_hdr_t *)(reply + sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t));
     
     /* Find route back to sender */
-    struct sr_rt *rt = lpm_lookup(sr, req_ip->ip_src);
-    if (!rt) {
-        free(reply);
+    struct sr_dst_entry *dst = sr_dst_cache_lookup(sr->dst_cache, req_ip->ip_src);
+    if (!dst) {
+        dst = sr_dst_cache_fill(sr, req_ip->ip_src);
+    }
+    if (!dst->rt) {
+        sr_pktbuf_free(pkt);
         return;
     }
     
-    struct sr_if *out_iface = sr_get_interface(sr, rt->interface);
+    struct sr_if *out_iface = dst->iface;
     if (!out_iface) {
-        free(reply);
+        sr_pktbuf_free(pkt);
         return;
     }
     
@@ -388,7 +375,7 @@ static void send_icmp_t3(struct sr_instance *sr, uint8_t *packet,
     reply_ip->ip_src = out_iface->ip;
     reply_ip->ip_dst = req_ip->ip_src;
     reply_ip->ip_sum = 0;
-    reply_ip->ip_sum = htons(ip_checksum(reply_ip, reply_ip->ip_hl * 4));
+    reply_ip->ip_sum = ip_checksum(reply_ip, reply_ip->ip_hl * 4);
     
     /* ICMP header */
     reply_icmp->icmp_type = type;
@@ -400,37 +387,43 @@ static void send_icmp_t3(struct sr_instance *sr, uint8_t *packet,
     memcpy(reply_icmp->data, req_ip, ICMP_DATA_SIZE);
     
     reply_icmp->icmp_sum = 0;
-    reply_icmp->icmp_sum = htons(ip_checksum(reply_icmp, sizeof(sr_icmp_t3_hdr_t)));
+    reply_icmp->icmp_sum = ip_checksum(reply_icmp, sizeof(sr_icmp_t3_hdr_t));
     
     /* Determine next hop */
-    uint32_t next_hop = (rt->gw.s_addr) ? rt->gw.s_addr : req_ip->ip_src;
+    uint32_t next_hop = dst->next_hop;
+    struct sr_adj *adj = dst->adj;
+    
+    if (adj && sr_adj_usable(adj, time(NULL))) {
+        /* Neighbour resolved: prebuilt Ethernet header */
+        memcpy(reply_eth, &adj->l2hdr, sizeof(sr_ethernet_hdr_t));
+        sr_send_pktbuf(sr, pkt, out_iface->ifindex);
+        return;
+    }
     
     /* Check ARP cache */
-    struct sr_arpentry *arp_entry = sr_arpcache_lookup(&sr->cache, next_hop);
+    struct sr_arpentry arp_entry;
     
-    if (arp_entry) {
+    if (sr_arpcache_lookup_copy(&sr->cache, next_hop, &arp_entry)) {
         /* Fill Ethernet header and send */
-        memcpy(reply_eth->ether_dhost, arp_entry->mac, ETHER_ADDR_LEN);
+        memcpy(reply_eth->ether_dhost, arp_entry.mac, ETHER_ADDR_LEN);
         memcpy(reply_eth->ether_shost, out_iface->addr, ETHER_ADDR_LEN);
         reply_eth->ether_type = htons(ethertype_ip);
         
-        sr_send_packet(sr, reply, reply_len, out_iface->name);
-        free(arp_entry);
-        free(reply);
+        adj = adj_resolved(sr, out_iface, next_hop, arp_entry.mac,
+                           arp_entry.added + (time_t)SR_ARPCACHE_TO);
+        if (adj && !dst->adj && dst->iface == out_iface &&
+            dst->next_hop == next_hop) {
+            dst->adj = adj;
+        }
+        sr_send_pktbuf(sr, pkt, out_iface->ifindex);
     } else {
         /* Queue for ARP resolution */
         memcpy(reply_eth->ether_shost, out_iface->addr, ETHER_ADDR_LEN);
         reply_eth->ether_type = htons(ethertype_ip);
         
-        struct sr_arpreq *req = sr_arpcache_queuereq(&sr->cache, next_hop, reply, reply_len, out_iface->name);
-        /* Note: ownership of 'reply' transferred to queue, don't free */
-        
-        /* Only send ARP request if this is a new request */
-        if (req->times_sent == 0) {
-            send_arp_request(sr, next_hop, out_iface->name);
-            req->sent = time(NULL);
-            req->times_sent = 1;
-        }
+        /* The cache sends the ARP request and its retransmissions */
+        sr_arpcache_queuereq(&sr->cache, next_hop, pkt, out_iface->ifindex);
+        /* Note: ownership of 'pkt' transferred to queue, don't free */
     }
 }
 
@@ -442,7 +435,7 @@ static void send_icmp_t3(struct sr_instance *sr, uint8_t *packet,
  *
  *---------------------------------------------------------------------*/
 static void handle_ip_packet(struct sr_instance *sr, uint8_t *packet, 
-                             unsigned int len, char *interface)
+                             unsigned int len, struct sr_if *in_iface)
 {
     if (len < sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t)) {
         return;
@@ -491,10 +484,13 @@ static void handle_ip_packet(struct sr_instance *sr, uint8_t *packet,
     }
     */
     
-    /* Check if packet is destined for one of our interfaces */
-    struct sr_if *iface = sr_get_interface_by_ip(sr, ip_hdr->ip_dst);
+    /* One lookup decides: for us (local /32), forward, or no route */
+    struct sr_dst_entry *dst = sr_dst_cache_lookup(sr->dst_cache, ip_hdr->ip_dst);
+    if (!dst) {
+        dst = sr_dst_cache_fill(sr, ip_hdr->ip_dst);
+    }
     
-    if (iface) {
+    if (dst->rt && dst->rt->local) {
         /* Packet is for us */
         printf("*** -> Received packet of length %d \n", len);
         if (ip_hdr->ip_p == ip_protocol_icmp) {
@@ -502,7 +498,7 @@ static void handle_ip_packet(struct sr_instance *sr, uint8_t *packet,
             sr_icmp_hdr_t *icmp_hdr = (sr_icmp_hdr_t *)(packet + sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t));
             
             if (icmp_hdr->icmp_type == 8) { /* Echo request */
-                send_icmp_echo_reply(sr, packet, len, interface);
+                send_icmp_echo_reply(sr, packet, len, in_iface);
             }
         } else {
             /* TCP/UDP to router - send port unreachable */
@@ -510,7 +506,7 @@ static void handle_ip_packet(struct sr_instance *sr, uint8_t *packet,
         }
     } else {
         /* Packet needs to be forwarded */
-        forward_ip_packet(sr, packet, len);
+        forward_ip_packet(sr, packet, len, dst);
     }
 }
 
@@ -518,11 +514,12 @@ static void handle_ip_packet(struct sr_instance *sr, uint8_t *packet,
  * Method: forward_ip_packet
  * Scope:  Static helper
  *
- * Forward IP packet (decrement TTL, update checksum, route)
+ * Forward IP packet (decrement TTL, update checksum, route).  dst is the
+ * route lookup handle_ip_packet already did for the destination.
  *
  *---------------------------------------------------------------------*/
 static void forward_ip_packet(struct sr_instance *sr, uint8_t *packet, 
-                               unsigned int len)
+                               unsigned int len, struct sr_dst_entry *dst)
 {
     sr_ethernet_hdr_t *eth_hdr = (sr_ethernet_hdr_t *)packet;
     sr_ip_hdr_t *ip_hdr = (sr_ip_hdr_t *)(packet + sizeof(sr_ethernet_hdr_t));
@@ -533,63 +530,84 @@ static void forward_ip_packet(struct sr_instance *sr, uint8_t *packet,
         return;
     }
     
-    /* Decrement TTL */
+    /* Decrement TTL, patching the checksum for the changed TTL/protocol
+       word instead of summing the whole header (RFC 1624) */
+    uint16_t old_word, new_word;
+    memcpy(&old_word, &ip_hdr->ip_ttl, sizeof(old_word));
     ip_hdr->ip_ttl--;
-    
-    /* Recompute IP checksum */
-    ip_hdr->ip_sum = 0;
-    ip_hdr->ip_sum = htons(ip_checksum(ip_hdr, ip_hdr->ip_hl * 4));
+    memcpy(&new_word, &ip_hdr->ip_ttl, sizeof(new_word));
+    ip_hdr->ip_sum = cksum_update(ip_hdr->ip_sum, old_word, new_word);
     
     /* Print modified packet info */
     printf("Modified IP packet, length(%d)\n", len);
     
-    /* Lookup route */
-    struct sr_rt *rt = lpm_lookup(sr, ip_hdr->ip_dst);
-    
-    if (!rt) {
+    if (!dst->rt) {
         send_icmp_t3(sr, packet, len, 3, 0);
         return;
     }
     
-    struct sr_if *out_iface = sr_get_interface(sr, rt->interface);
+    struct sr_if *out_iface = dst->iface;
+    
+    /* Determine next hop */
+    uint32_t next_hop = dst->next_hop;
+    struct sr_adj *adj = dst->adj;
+    
+    /* Multipath: pick the member for this flow */
+    if (dst->rt->ecmp) {
+        struct sr_ecmp_member *m = sr_ecmp_pick(sr, dst->rt->ecmp,
+                sr_flow_hash(ip_hdr, len - sizeof(sr_ethernet_hdr_t)));
+        if (m) {
+            out_iface = m->iface;
+            next_hop = m->rt->gw.s_addr ? m->rt->gw.s_addr : ip_hdr->ip_dst;
+            adj = m->rt->gw.s_addr ? m->adj : dst->adj;
+            if (!m->rt->gw.s_addr && (!adj || adj->iface != out_iface)) {
+                adj = 0;
+            }
+        }
+    }
+    
     if (!out_iface) {
         return;
     }
     
-    /* Determine next hop */
-    uint32_t next_hop = (rt->gw.s_addr) ? rt->gw.s_addr : ip_hdr->ip_dst;
+    if (adj && sr_adj_usable(adj, time(NULL))) {
+        /* Fast path: one header copy */
+        memcpy(eth_hdr, &adj->l2hdr, sizeof(sr_ethernet_hdr_t));
+        sr_send_packet_ifindex(sr, packet, len, out_iface->ifindex);
+        return;
+    }
     
     /* Check ARP cache */
-    struct sr_arpentry *arp_entry = sr_arpcache_lookup(&sr->cache, next_hop);
+    struct sr_arpentry arp_entry;
     
-    if (arp_entry) {
+    if (sr_arpcache_lookup_copy(&sr->cache, next_hop, &arp_entry)) {
         /* Update Ethernet header and send */
-        memcpy(eth_hdr->ether_dhost, arp_entry->mac, ETHER_ADDR_LEN);
+        memcpy(eth_hdr->ether_dhost, arp_entry.mac, ETHER_ADDR_LEN);
         memcpy(eth_hdr->ether_shost, out_iface->addr, ETHER_ADDR_LEN);
         eth_hdr->ether_type = htons(ethertype_ip);
         
-        sr_send_packet(sr, packet, len, out_iface->name);
-        free(arp_entry);
+        /* Complete the adjacency so later packets take the fast path */
+        adj = adj_resolved(sr, out_iface, next_hop, arp_entry.mac,
+                           arp_entry.added + (time_t)SR_ARPCACHE_TO);
+        if (adj && !dst->adj && dst->iface == out_iface &&
+            dst->next_hop == next_hop) {
+            dst->adj = adj;
+        }
+        sr_send_packet_ifindex(sr, packet, len, out_iface->ifindex);
     } else {
         /* Need to queue and send ARP request */
         
-        /* Make a copy of the packet */
-        uint8_t *pkt_copy = (uint8_t *)malloc(len);
-        memcpy(pkt_copy, packet, len);
+        /* The one copy of the packet; the queue keeps this buffer and
+           hands it on to the transmit queue */
+        struct sr_pktbuf *pkt_copy = sr_pktbuf_copy(packet, len);
         
-        sr_ethernet_hdr_t *copy_eth = (sr_ethernet_hdr_t *)pkt_copy;
+        sr_ethernet_hdr_t *copy_eth = (sr_ethernet_hdr_t *)pkt_copy->data;
         memcpy(copy_eth->ether_shost, out_iface->addr, ETHER_ADDR_LEN);
         copy_eth->ether_type = htons(ethertype_ip);
         
-        struct sr_arpreq *req = sr_arpcache_queuereq(&sr->cache, next_hop, pkt_copy, len, out_iface->name);
+        /* The cache sends the ARP request and its retransmissions */
+        sr_arpcache_queuereq(&sr->cache, next_hop, pkt_copy, out_iface->ifindex);
         /* Note: ownership of pkt_copy transferred to queue */
-        
-        /* Only send ARP request if this is a new request (times_sent == 0) */
-        if (req->times_sent == 0) {
-            send_arp_request(sr, next_hop, out_iface->name);
-            req->sent = time(NULL);
-            req->times_sent = 1;
-        }
     }
 }
 
@@ -614,11 +632,43 @@ void sr_handlepacket(struct sr_instance* sr,
         unsigned int len,
         char* interface/* lent */)
 {
+  struct sr_if *iface;
+
   /* REQUIRES */
   assert(sr);
   assert(packet);
   assert(interface);
 
+  iface = sr_get_interface(sr, interface);
+  if (iface) {
+      sr_handlepacket_ifindex(sr, packet, len, iface->ifindex);
+  }
+}/* end sr_handlepacket */
+
+/*---------------------------------------------------------------------
+ * Method: sr_handlepacket_ifindex(uint8_t* p,unsigned int ifindex)
+ * Scope:  Global
+ *
+ * As sr_handlepacket, with the receiving interface already translated
+ * to its ifindex.  Everything from here on works with interface records
+ * and indices, never names.
+ *
+ *---------------------------------------------------------------------*/
+
+void sr_handlepacket_ifindex(struct sr_instance* sr,
+        uint8_t * packet/* lent */,
+        unsigned int len,
+        unsigned int ifindex)
+{
+  /* REQUIRES */
+  assert(sr);
+  assert(packet);
+
+  struct sr_if *in_iface = sr_get_interface_by_index(sr, ifindex);
+  if (!in_iface) {
+      return;
+  }
+
   /* Minimum length check */
   if (len < sizeof(sr_ethernet_hdr_t)) {
       return;
@@ -630,10 +680,9 @@ void sr_handlepacket(struct sr_instance* sr,
   
   /* Dispatch based on ethertype */
   if (ether_type == ethertype_arp) {
-      handle_arp_packet(sr, packet, len, interface);
+      handle_arp_packet(sr, packet, len, in_iface);
   } else if (ether_type == ethertype_ip) {
-      handle_ip_packet(sr, packet, len, interface);
+      handle_ip_packet(sr, packet, len, in_iface);
   }
 
 }/* end sr_ForwardPacket */
-
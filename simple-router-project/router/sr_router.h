@@ -11,6 +11,7 @@
 
 #include <netinet/in.h>
 #include <sys/time.h>
+#include <sys/uio.h>
 #include <stdio.h>
 
 #include "sr_protocol.h"
@@ -29,10 +30,48 @@
 
 #define INIT_TTL 255
 #define PACKET_DUMP_SIZE 1024
+#define SR_VNS_MAX_MSG 10000 /* longest message the server may send */
+#define SR_VNS_RX_RING (256 * 1024) /* receive ring, many messages per recv */
+#define SR_VNS_TX_BUF (256 * 1024) /* transmit arena for copied frames */
+#define SR_VNS_TX_IOV 1024 /* queued frames per sendmsg, IOV_MAX on Linux */
+#define SR_VNS_TX_HIWAT (128 * 1024) /* queued bytes before rx waits for tx */
+#define SR_VNS_TX_FLUSH_MS 1 /* longest a queued frame waits when idle */
+#define SR_VNS_RX_MSGS 16 /* messages per recvmmsg() on a SEQPACKET socket */
+#define SR_VNS_CREDIT_STEP (SR_VNS_RX_RING / 4) /* handled bytes per grant */
+#define SR_VNS_SHM_BATCH 64 /* ring records handled between socket checks */
+#define SR_VNS_SHM_IDLE_MS 10 /* longest a wait on an idle ring lasts */
+#define SR_VNS_URING_BUFS 64 /* io_uring receive buffers, SR_VNS_MAX_MSG each */
 
 /* forward declare */
 struct sr_if;
 struct sr_rt;
+struct sr_fib;
+struct sr_dst_cache;
+struct sr_adj_table;
+struct sr_io;
+struct c_shm_ring;
+struct sr_uring;
+
+/* ----------------------------------------------------------------------------
+ * struct sr_io
+ *
+ * A data plane other than the VNS socket (see sr_pcap.c, sr_packet.c,
+ * sr_tap.c).  Frames the router sends are checked and logged as usual
+ * and then handed to 'send' instead of the VNS transmit queue; the buffer
+ * is the caller's again on return.  'flush', if set, is what sr_vns_flush() calls.
+ * 'hwaddr', if set, gives sr_load_hwinfo() the MAC of an interface the
+ * file does not give one for; it returns 0 if it did.
+ *
+ * -------------------------------------------------------------------------- */
+
+struct sr_io
+{
+    const char* name;
+    int (*send)(struct sr_instance* , uint8_t* , unsigned int , unsigned int );
+    int (*flush)(struct sr_instance* );
+    int (*hwaddr)(struct sr_instance* , const char* , unsigned char* );
+    void* state;
+};
 
 /* ----------------------------------------------------------------------------
  * struct sr_instance
@@ -44,14 +83,72 @@ struct sr_rt;
 struct sr_instance
 {
     int  sockfd;   /* socket to server */
+    int  seqpacket; /* sockfd is AF_UNIX SOCK_SEQPACKET, a message a record */
+    int  vns_batch; /* the server sends and takes VNS_PACKETS batches */
+    int  vns_credit; /* the server sends no more than we grant */
+    uint8_t* rx_buf; /* receive ring, SR_VNS_RX_RING bytes */
+    unsigned int rx_head; /* first unparsed byte in rx_buf */
+    unsigned int rx_tail; /* end of received data in rx_buf */
+    unsigned long rx_reads; /* recv() calls on sockfd */
+    unsigned long rx_msgs; /* messages parsed out of them */
+    unsigned long rx_batched; /* frames that came in VNS_PACKETS batches */
+    unsigned long rx_short; /* SEQPACKET records too short for a message */
+    uint32_t rx_credit_used; /* message bytes handled since VNS_CREDIT */
+    uint32_t rx_credit_limit; /* the last grant */
+    unsigned long rx_grants; /* grants sent */
+    uint8_t* rx_frame; /* frame being handled, may be sent in place */
+    unsigned int rx_frame_room; /* bytes from rx_frame to its message's end */
+    uint8_t* shm; /* VNS_SHM rings, mapped, or 0 */
+    size_t shm_len; /* bytes mapped */
+    uint32_t shm_size; /* record bytes per ring */
+    struct c_shm_ring* shm_rx; /* frames from the server */
+    struct c_shm_ring* shm_tx; /* frames to it */
+    uint32_t shm_tx_head; /* shm_tx written up to here, not yet published */
+    unsigned long shm_rx_frames; /* frames taken off shm_rx */
+    unsigned long shm_sleeps; /* waits on an empty shm_rx */
+    unsigned long shm_full; /* waits for room in shm_tx */
+    uint8_t* tx_buf; /* transmit arena, SR_VNS_TX_BUF bytes */
+    unsigned int tx_used; /* bytes of tx_buf in use */
+    struct iovec* tx_iov; /* queued frames, SR_VNS_TX_IOV entries */
+    struct sr_pktbuf** tx_owner; /* buffer behind each entry, or 0 */
+    uint8_t* tx_start; /* per entry, non-zero if a message starts there */
+    struct mmsghdr* tx_msgs; /* one record per message, SEQPACKET only */
+    uint8_t* tx_batch; /* VNS_PACKETS message still taking frames, or 0 */
+    unsigned int tx_batch_len; /* its length so far */
+    unsigned int tx_niov; /* entries in tx_iov */
+    unsigned int tx_first; /* first entry not fully written */
+    unsigned int tx_pending; /* bytes queued and not yet written */
+    unsigned int tx_ring; /* queued frames sent in place from rx_buf */
+    unsigned long tx_frames; /* frames queued */
+    unsigned long tx_writes; /* sendmsg()/sendmmsg() calls that wrote */
+    unsigned long tx_stalls; /* times the socket was full */
+    pthread_mutex_t tx_lock; /* tx_*, the ARP thread sends too */
+    int one_thread; /* sr_vns_epoll_run does everything: no threads, no locks */
+    struct sr_io* io; /* data plane backend, 0 for the VNS socket */
+    struct sr_uring* uring; /* io_uring running the VNS loop, or 0 */
     char user[32]; /* user name */
     char host[32]; /* host name */ 
     char template[30]; /* template name if any */
     unsigned short topo_id;
     struct sockaddr_in sr_addr; /* address to server */
     struct sr_if* if_list; /* list of interfaces */
+    struct sr_if** if_table; /* the same, indexed by ifindex */
+    unsigned int if_count; /* entries in if_table */
     struct sr_rt* routing_table; /* routing table */
+    struct sr_rt* rt_tail; /* last entry, for O(1) appends */
+    unsigned int rt_count; /* entries in routing_table */
+    const char* rtable; /* routing table file, re-read on SIGHUP */
+    struct sr_fib* fib; /* lookup structure built from routing_table */
+    struct sr_rt* local_rt; /* /32 per interface address, by ifindex */
+    struct sr_dst_cache* dst_cache; /* per-destination cache over fib */
+    struct sr_adj_table* adj_table; /* next hops with prebuilt L2 headers */
+    volatile uint32_t fib_version; /* bumped each time fib is replaced */
+    volatile unsigned long pkt_epoch; /* odd while a packet is handled */
+    volatile unsigned long arp_epoch; /* odd while the ARP thread sends */
     struct sr_arpcache cache;   /* ARP cache */
+    unsigned int arp_capacity; /* ARP cache entries, 0 for the default */
+    unsigned int pktbuf_count; /* packet buffers, 0 for the default */
+    int pktbuf_hugepages; /* put the packet buffers on hugepages */
     pthread_attr_t attr;
     FILE* logfile;
 };
@@ -61,12 +158,24 @@ int sr_verify_routing_table(struct sr_instance* sr);
 
 /* -- sr_vns_comm.c -- */
 int sr_send_packet(struct sr_instance* , uint8_t* , unsigned int , const char*);
+int sr_vns_flush(struct sr_instance* );
+int sr_send_pktbuf(struct sr_instance* , struct sr_pktbuf* , unsigned int );
+int sr_send_packet_ifindex(struct sr_instance* , uint8_t* , unsigned int ,
+                           unsigned int );
 int sr_connect_to_server(struct sr_instance* ,unsigned short , char* );
+int sr_load_hwinfo(struct sr_instance* , const char* );
 int sr_read_from_server(struct sr_instance* );
+int sr_vns_epoll_run(struct sr_instance* );
+#ifdef SR_IO_URING
+int sr_vns_uring_open(struct sr_instance* );
+int sr_vns_uring_run(struct sr_instance* );
+#endif
 
 /* -- sr_router.c -- */
 void sr_init(struct sr_instance* );
 void sr_handlepacket(struct sr_instance* , uint8_t * , unsigned int , char* );
+void sr_handlepacket_ifindex(struct sr_instance* , uint8_t * , unsigned int ,
+                             unsigned int );
 
 /* -- sr_if.c -- */
 void sr_add_interface(struct sr_instance* , const char* );
@@ -74,4 +183,11 @@ void sr_set_ether_ip(struct sr_instance* , uint32_t );
 void sr_set_ether_addr(struct sr_instance* , const unsigned char* );
 void sr_print_if_list(struct sr_instance* );
 
+/* Interface with the given ifindex, or 0. */
+static __inline__ struct sr_if* sr_get_interface_by_index(
+        struct sr_instance* sr, unsigned int ifindex)
+{
+    return ifindex < sr->if_count ? sr->if_table[ifindex] : 0;
+}
+
 #endif /* SR_ROUTER_H */
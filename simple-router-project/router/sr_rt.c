@@ -12,6 +12,7 @@
 #include <assert.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
 
 
 #include <sys/socket.h>
@@ -20,24 +21,144 @@
 #include <arpa/inet.h>
 
 #include "sr_rt.h"
+#include "sr_fib.h"
+#include "sr_ecmp.h"
 #include "sr_router.h"
 
+#define SR_RT_READ_SZ 65536 /* read() chunk, also the longest line */
+
 /*---------------------------------------------------------------------
- * Method:
+ * Method: rt_parse_ip
+ * Scope:  Local
+ *
+ * Convert a NUL terminated dotted quad to an address.  Plain a.b.c.d is
+ * handled inline; anything else (hex, octal, short forms) goes through
+ * inet_aton.  Returns 0 if s is not a valid address, like inet_aton.
  *
  *---------------------------------------------------------------------*/
 
-int sr_load_rt(struct sr_instance* sr,const char* filename)
+static int rt_parse_ip(const char* s, struct in_addr* addr)
+{
+    const char* p = s;
+    uint32_t ip = 0;
+    int octets = 0;
+
+    for (;;) {
+        uint32_t v = 0;
+        int digits = 0;
+
+        while (*p >= '0' && *p <= '9' && digits < 4) {
+            v = v * 10 + (*p++ - '0');
+            digits++;
+        }
+        if (digits == 0 || v > 255 ||
+            (digits > 1 && p[-digits] == '0')) {
+            break; /* let inet_aton decide */
+        }
+        ip = (ip << 8) | v;
+        if (++octets == 4) {
+            if (*p == '\0') {
+                addr->s_addr = htonl(ip);
+                return 1;
+            }
+            break;
+        }
+        if (*p++ != '.') {
+            break;
+        }
+    }
+    return inet_aton(s, addr);
+} /* -- rt_parse_ip -- */
+
+/*---------------------------------------------------------------------
+ * Method: rt_load_line
+ * Scope:  Local
+ *
+ * Parse one routing table line (modified in place) and append it.  Blank
+ * lines and lines starting with '#' are skipped.  Returns 0 on success.
+ *
+ *---------------------------------------------------------------------*/
+
+static int rt_load_line(struct sr_instance* sr, char* line,
+                        int* clear_routing_table)
 {
-    FILE* fp;
-    char  line[BUFSIZ];
-    char  dest[32];
-    char  gw[32];
-    char  mask[32];
-    char  iface[32];
+    char* field[4];
     struct in_addr dest_addr;
     struct in_addr gw_addr;
     struct in_addr mask_addr;
+    int n = 0;
+
+    while (n < 4) {
+        while (*line == ' ' || *line == '\t' || *line == '\r') {
+            line++;
+        }
+        if (*line == '\0' || (n == 0 && *line == '#')) {
+            break;
+        }
+        field[n++] = line;
+        while (*line && *line != ' ' && *line != '\t' && *line != '\r') {
+            line++;
+        }
+        if (*line) {
+            *line++ = '\0';
+        }
+    }
+    if (n == 0) {
+        return 0;
+    }
+    if (n < 4) {
+        fprintf(stderr,
+                "Error loading routing table, malformed line starting with %s\n",
+                field[0]);
+        return -1;
+    }
+
+    if(rt_parse_ip(field[0],&dest_addr) == 0)
+    {
+        fprintf(stderr,
+                "Error loading routing table, cannot convert %s to valid IP\n",
+                field[0]);
+        return -1;
+    }
+    if(rt_parse_ip(field[1],&gw_addr) == 0)
+    {
+        fprintf(stderr,
+                "Error loading routing table, cannot convert %s to valid IP\n",
+                field[1]);
+        return -1;
+    }
+    if(rt_parse_ip(field[2],&mask_addr) == 0)
+    {
+        fprintf(stderr,
+                "Error loading routing table, cannot convert %s to valid IP\n",
+                field[2]);
+        return -1;
+    }
+    if( *clear_routing_table == 0 ){
+        printf("Loading routing table from server, clear local routing table.\n");
+        sr_flush_rt(sr);
+        *clear_routing_table = 1;
+    }
+    sr_add_rt_entry(sr,dest_addr,gw_addr,mask_addr,field[3]);
+    return 0;
+} /* -- rt_load_line -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_load_rt
+ *
+ * Load a routing table, either a text file (one "dest gw mask iface" per
+ * line) or a binary FIB snapshot written with sr -F.  The text file is
+ * read in large chunks and parsed in place; each route is an O(1) append.
+ *
+ *---------------------------------------------------------------------*/
+
+int sr_load_rt(struct sr_instance* sr,const char* filename)
+{
+    char* buf;
+    size_t have = 0;
+    ssize_t got;
+    int fd;
+    int ret = 0;
     int clear_routing_table = 0;
 
     /* -- REQUIRES -- */
@@ -48,86 +169,296 @@ int sr_load_rt(struct sr_instance* sr,const char* filename)
         return -1;
     }
 
-    fp = fopen(filename,"r");
+    if(sr_fib_snapshot_check(filename))
+    { return sr_fib_snapshot_load(sr, filename); }
 
-    while( fgets(line,BUFSIZ,fp) != 0)
+    fd = open(filename, O_RDONLY);
+    if(fd < 0)
     {
-        sscanf(line,"%s %s %s %s",dest,gw,mask,iface);
-        if(inet_aton(dest,&dest_addr) == 0)
-        { 
-            fprintf(stderr,
-                    "Error loading routing table, cannot convert %s to valid IP\n",
-                    dest);
-            return -1; 
-        }
-        if(inet_aton(gw,&gw_addr) == 0)
-        { 
-            fprintf(stderr,
-                    "Error loading routing table, cannot convert %s to valid IP\n",
-                    gw);
-            return -1; 
+        perror("open");
+        return -1;
+    }
+    buf = (char*)malloc(SR_RT_READ_SZ + 1);
+    assert(buf);
+
+    do
+    {
+        char* line;
+        char* nl;
+
+        got = read(fd, buf + have, SR_RT_READ_SZ - have);
+        if(got < 0)
+        {
+            perror("read");
+            ret = -1;
+            break;
         }
-        if(inet_aton(mask,&mask_addr) == 0)
-        { 
-            fprintf(stderr,
-                    "Error loading routing table, cannot convert %s to valid IP\n",
-                    mask);
-            return -1; 
+        have += got;
+        if(got == 0 && have > 0)
+        { buf[have++] = '\n'; } /* -- last line without newline -- */
+
+        line = buf;
+        while((nl = memchr(line, '\n', have - (line - buf))) != 0)
+        {
+            *nl = '\0';
+            if(rt_load_line(sr, line, &clear_routing_table) != 0)
+            {
+                ret = -1;
+                break;
+            }
+            line = nl + 1;
         }
-        if( clear_routing_table == 0 ){
-            printf("Loading routing table from server, clear local routing table.\n");
-            sr->routing_table = 0;
-            clear_routing_table = 1;
+        if(ret != 0)
+        { break; }
+
+        have -= line - buf;
+        if(have == SR_RT_READ_SZ)
+        {
+            fprintf(stderr,"Error loading routing table, line too long\n");
+            ret = -1;
+            break;
         }
-        sr_add_rt_entry(sr,dest_addr,gw_addr,mask_addr,iface);
-    } /* -- while -- */
+        memmove(buf, line, have);
+    } while(got > 0);
 
-    return 0; /* -- success -- */
+    free(buf);
+    close(fd);
+    return ret;
 } /* -- sr_load_rt -- */
 
 /*---------------------------------------------------------------------
- * Method:
+ * Method: sr_flush_rt
+ *
+ * Remove every route, from the list and from the FIB.
  *
  *---------------------------------------------------------------------*/
 
-void sr_add_rt_entry(struct sr_instance* sr, struct in_addr dest,
-struct in_addr gw, struct in_addr mask,char* if_name)
+void sr_flush_rt(struct sr_instance* sr)
 {
-    struct sr_rt* rt_walker = 0;
+    struct sr_rt* rt = 0;
+
+    /* -- REQUIRES -- */
+    assert(sr);
+
+    rt = sr->routing_table;
+    while(rt)
+    {
+        struct sr_rt* next = rt->next;
+        free(rt->ecmp);
+        free(rt);
+        rt = next;
+    }
+    sr->routing_table = 0;
+    sr->rt_tail = 0;
+    sr->rt_count = 0;
+
+    if(sr->fib)
+    { sr_fib_flush(sr->fib); }
+    sr_dst_cache_invalidate(sr->dst_cache);
+} /* -- sr_flush_rt -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_rt_join_ecmp
+ *
+ * rt has the same prefix as a route already in the FIB: make it another
+ * path of that route's ECMP group (unless it is an exact duplicate).
+ *
+ *---------------------------------------------------------------------*/
+
+void sr_rt_join_ecmp(struct sr_fib* fib, struct sr_rt* rt)
+{
+    struct sr_rt* head = sr_fib_find(fib, rt->dest, rt->mask);
+
+    if(head == 0 || head == rt)
+    { return; }
+    if(sr_ecmp_add(head, rt) < 0)
+    {
+        fprintf(stderr,"Error adding %s to multipath group of %s, "
+                "more than %d paths\n", rt->interface,
+                inet_ntoa(rt->dest), SR_ECMP_MAX);
+    }
+} /* -- sr_rt_join_ecmp -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_append_rt_entry
+ *
+ * Append a route to the routing table list without touching the FIB.
+ * Used by sr_add_rt_entry and when the FIB comes from a snapshot.
+ *
+ *---------------------------------------------------------------------*/
+
+struct sr_rt* sr_append_rt_entry(struct sr_instance* sr, struct in_addr dest,
+        struct in_addr gw, struct in_addr mask, const char* if_name)
+{
+    struct sr_rt* rt = 0;
 
     /* -- REQUIRES -- */
     assert(if_name);
     assert(sr);
 
-    /* -- empty list special case -- */
+    rt = (struct sr_rt*)malloc(sizeof(struct sr_rt));
+    assert(rt);
+    rt->next = 0;
+    rt->dest = dest;
+    rt->gw   = gw;
+    rt->mask = mask;
+    rt->adj  = 0;
+    rt->ecmp = 0;
+    strncpy(rt->interface,if_name,sr_IFACE_NAMELEN);
+    rt->ifindex = SR_IFINDEX_NONE;
+    rt->local = 0;
+    if(sr->if_list)
+    {
+        struct sr_if* iface = sr_get_interface(sr, if_name);
+        if(iface)
+        { rt->ifindex = iface->ifindex; }
+    }
+
     if(sr->routing_table == 0)
+    { sr->routing_table = rt; }
+    else
+    { sr->rt_tail->next = rt; }
+    sr->rt_tail = rt;
+    sr->rt_count++;
+
+    return rt;
+} /* -- sr_append_rt_entry -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_rt_bind_interfaces
+ * Scope:  Global
+ *
+ * Resolve the interface name of every route in list to an ifindex of
+ * sr's interfaces, so the data plane never looks interfaces up by name.
+ * Routes are usually loaded before the interfaces are known and are
+ * bound once HWINFO arrives.  Returns the number of routes naming an
+ * interface that does not exist.
+ *
+ *---------------------------------------------------------------------*/
+
+unsigned int sr_rt_bind_interfaces(struct sr_instance* sr, struct sr_rt* list)
+{
+    struct sr_rt* rt;
+    struct sr_if* last_if = 0;
+    unsigned int missing = 0;
+
+    /* -- REQUIRES -- */
+    assert(sr);
+
+    for(rt = list; rt; rt = rt->next)
     {
-        sr->routing_table = (struct sr_rt*)malloc(sizeof(struct sr_rt));
-        assert(sr->routing_table);
-        sr->routing_table->next = 0;
-        sr->routing_table->dest = dest;
-        sr->routing_table->gw   = gw;
-        sr->routing_table->mask = mask;
-        strncpy(sr->routing_table->interface,if_name,sr_IFACE_NAMELEN);
+        /* -- routes mostly share a handful of interfaces; try the last
+              match first -- */
+        if( !last_if ||
+            strncmp(last_if->name, rt->interface, sr_IFACE_NAMELEN) != 0)
+        {
+            struct sr_if* iface = sr_get_interface(sr, rt->interface);
+            if(iface == 0)
+            {
+                rt->ifindex = SR_IFINDEX_NONE;
+                missing++;
+                continue;
+            }
+            last_if = iface;
+        }
+        rt->ifindex = last_if->ifindex;
+    }
 
-        return;
+    return missing;
+} /* -- sr_rt_bind_interfaces -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_rt_install_local
+ * Scope:  Global
+ *
+ * Put a "local" /32 for each interface address into fib, so that the
+ * one lookup per packet also tells whether the packet is for the
+ * router.  The local routes are not part of the routing table list;
+ * they are created on first use and shared by every FIB built after
+ * that.  A configured route for the same /32 is shadowed.
+ *
+ * Returns 0 on success, -1 on allocation failure.
+ *
+ *---------------------------------------------------------------------*/
+
+int sr_rt_install_local(struct sr_instance* sr, struct sr_fib* fib)
+{
+    struct sr_if* if_walker = 0;
+    struct sr_rt* rt = 0;
+    int ret;
+
+    /* -- REQUIRES -- */
+    assert(sr);
+    assert(fib);
+
+    if(sr->local_rt == 0 && sr->if_count)
+    {
+        sr->local_rt = (struct sr_rt*)calloc(sr->if_count,
+                                              sizeof(struct sr_rt));
+        if(sr->local_rt == 0)
+        { return -1; }
+
+        for(if_walker = sr->if_list; if_walker; if_walker = if_walker->next)
+        {
+            rt = &sr->local_rt[if_walker->ifindex];
+            rt->dest.s_addr = if_walker->ip;
+            rt->mask.s_addr = 0xffffffff;
+            rt->gw.s_addr = 0;
+            strncpy(rt->interface, if_walker->name, sr_IFACE_NAMELEN);
+            rt->ifindex = if_walker->ifindex;
+            rt->local = 1;
+        }
     }
 
-    /* -- find the end of the list -- */
-    rt_walker = sr->routing_table;
-    while(rt_walker->next){
-      rt_walker = rt_walker->next; 
+    for(if_walker = sr->if_list; if_walker; if_walker = if_walker->next)
+    {
+        rt = &sr->local_rt[if_walker->ifindex];
+        if(rt->dest.s_addr == 0)
+        { continue; } /* -- no address configured -- */
+
+        ret = sr_fib_insert(fib, rt);
+        if(ret == 1 && sr_fib_find(fib, rt->dest, rt->mask) != rt)
+        {
+            sr_fib_delete(fib, rt->dest, rt->mask);
+            ret = sr_fib_insert(fib, rt);
+        }
+        if(ret < 0)
+        { return -1; }
+    }
+
+    return 0;
+} /* -- sr_rt_install_local -- */
+
+/*---------------------------------------------------------------------
+ * Method:
+ *
+ *---------------------------------------------------------------------*/
+
+void sr_add_rt_entry(struct sr_instance* sr, struct in_addr dest,
+struct in_addr gw, struct in_addr mask,char* if_name)
+{
+    struct sr_rt* rt_walker = 0;
+    int ret;
+
+    /* -- REQUIRES -- */
+    assert(if_name);
+    assert(sr);
+
+    if(sr->fib == 0)
+    {
+        sr->fib = sr_fib_create();
+        assert(sr->fib);
     }
 
-    rt_walker->next = (struct sr_rt*)malloc(sizeof(struct sr_rt));
-    assert(rt_walker->next);
-    rt_walker = rt_walker->next;
+    /* -- any cached forwarding decision may now be stale -- */
+    sr_dst_cache_invalidate(sr->dst_cache);
 
-    rt_walker->next = 0;
-    rt_walker->dest = dest;
-    rt_walker->gw   = gw;
-    rt_walker->mask = mask;
-    strncpy(rt_walker->interface,if_name,sr_IFACE_NAMELEN);
+    rt_walker = sr_append_rt_entry(sr, dest, gw, mask, if_name);
+    ret = sr_fib_insert(sr->fib, rt_walker);
+    if(ret < 0)
+    { fprintf(stderr,"Error adding route to forwarding table\n"); }
+    else if(ret == 1)
+    { sr_rt_join_ecmp(sr->fib, rt_walker); }
 
 } /* -- sr_add_entry -- */
 
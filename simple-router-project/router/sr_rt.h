@@ -20,6 +20,10 @@
 
 #include "sr_if.h"
 
+struct sr_adj;
+struct sr_ecmp;
+struct sr_fib;
+
 /* ----------------------------------------------------------------------------
  * struct sr_rt
  *
@@ -33,6 +37,11 @@ struct sr_rt
     struct in_addr gw;
     struct in_addr mask;
     char   interface[sr_IFACE_NAMELEN];
+    unsigned int ifindex; /* of 'interface', SR_IFINDEX_NONE until bound */
+    int    local; /* /32 of one of the router's own addresses */
+    struct sr_adj* adj; /* adjacency for gw, resolved on first use */
+    struct sr_ecmp* ecmp; /* multipath group if this prefix has several
+                             routes (set on the route in the FIB only) */
     struct sr_rt* next;
 };
 
@@ -40,6 +49,12 @@ struct sr_rt
 int sr_load_rt(struct sr_instance*,const char*);
 void sr_add_rt_entry(struct sr_instance*, struct in_addr,struct in_addr,
                   struct in_addr, char*);
+struct sr_rt* sr_append_rt_entry(struct sr_instance*, struct in_addr,
+                  struct in_addr, struct in_addr, const char*);
+void sr_flush_rt(struct sr_instance* sr);
+unsigned int sr_rt_bind_interfaces(struct sr_instance* sr, struct sr_rt* list);
+int sr_rt_install_local(struct sr_instance* sr, struct sr_fib* fib);
+void sr_rt_join_ecmp(struct sr_fib* fib, struct sr_rt* rt);
 void sr_print_routing_table(struct sr_instance* sr);
 void sr_print_routing_entry(struct sr_rt* entry);
 
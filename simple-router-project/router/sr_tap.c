@@ -0,0 +1,273 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_tap.c
+ *
+ * Description:
+ *
+ * Multi-queue TAP data plane.  See sr_tap.h.
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <linux/if_tun.h>
+
+#include "sr_tap.h"
+#include "sr_link.h"
+#include "sr_router.h"
+#include "sr_reload.h"
+#include "sr_if.h"
+#include "sr_protocol.h"
+
+struct tap_link
+{
+    struct sr_link l;               /* router interface and TAP device */
+    int fd[SR_TAP_QUEUES_MAX];      /* one per queue */
+};
+
+static struct
+{
+    struct sr_io io;
+    struct tap_link* links;
+    unsigned int nlinks;
+    unsigned int queues;
+    struct sr_link** by_ifindex;    /* struct tap_link */
+    unsigned long rx_frames;
+    unsigned long rx_wakeups;       /* polls that found a queue ready */
+    unsigned long rx_full;          /* wakeups that filled a batch */
+    unsigned long rx_other;         /* not for the router's MAC */
+    unsigned long tx_frames;
+    unsigned long tx_errors;
+} tp;
+
+static void tap_close(struct sr_link* l)
+{
+    struct tap_link* link = (struct tap_link*)l;
+    unsigned int q;
+
+    for (q = 0; q < SR_TAP_QUEUES_MAX; q++) {
+        if (link->fd[q] >= 0) {
+            close(link->fd[q]);
+        }
+        link->fd[q] = -1;
+    }
+}
+
+/* Attach *queues queues to the TAP, creating it if needed, and bring it
+   up. */
+static int tap_open_link(struct sr_link* l, void* arg)
+{
+    struct tap_link* link = (struct tap_link*)l;
+    unsigned int queues = *(unsigned int*)arg;
+    struct ifreq ifr;
+    unsigned int q;
+    int s;
+
+    for (q = 0; q < SR_TAP_QUEUES_MAX; q++) {
+        link->fd[q] = -1;
+    }
+    for (q = 0; q < queues; q++) {
+        if ((link->fd[q] = open("/dev/net/tun", O_RDWR | O_NONBLOCK)) < 0) {
+            perror("open(/dev/net/tun):sr_tap.c::tap_open_link");
+            return -1;
+        }
+        memset(&ifr, 0, sizeof(ifr));
+        strncpy(ifr.ifr_name, link->l.dev, IFNAMSIZ - 1);
+        ifr.ifr_flags = IFF_TAP | IFF_NO_PI | IFF_MULTI_QUEUE;
+        if (ioctl(link->fd[q], TUNSETIFF, &ifr) != 0) {
+            fprintf(stderr, "%s: cannot attach queue %u: %s\n", link->l.dev, q,
+                    strerror(errno));
+            return -1;
+        }
+    }
+
+    /* -- best effort: the TAP may be moved to a namespace later anyway -- */
+    if ((s = socket(AF_INET, SOCK_DGRAM, 0)) >= 0) {
+        memset(&ifr, 0, sizeof(ifr));
+        strncpy(ifr.ifr_name, link->l.dev, IFNAMSIZ - 1);
+        if (ioctl(s, SIOCGIFFLAGS, &ifr) == 0 && !(ifr.ifr_flags & IFF_UP)) {
+            ifr.ifr_flags |= IFF_UP;
+            ioctl(s, SIOCSIFFLAGS, &ifr);
+        }
+        close(s);
+    }
+    printf("Interface %s on %s (TAP, %u queues)\n", link->l.name, link->l.dev,
+           queues);
+    return 0;
+}
+
+/* The queue a frame goes out on: IPv4 frames by address pair, so a flow
+   stays on one queue, everything else on the first. */
+static unsigned int tap_queue(const uint8_t* buf, unsigned int len)
+{
+    const sr_ethernet_hdr_t* eth = (const sr_ethernet_hdr_t*)buf;
+    const sr_ip_hdr_t* ip;
+    uint32_t h;
+
+    if (tp.queues == 1 ||
+        len < sizeof(sr_ethernet_hdr_t) + sizeof(sr_ip_hdr_t) ||
+        eth->ether_type != htons(ethertype_ip)) {
+        return 0;
+    }
+    ip = (const sr_ip_hdr_t*)(buf + sizeof(sr_ethernet_hdr_t));
+    h = ip->ip_src ^ ip->ip_dst;
+    h ^= h >> 16;
+    h ^= h >> 8;
+    return h % tp.queues;
+}
+
+/* sr_io send: a TAP takes one frame per write, straight into the host
+   stack, so there is nothing to hold back for a flush. */
+static int tap_send(struct sr_instance* sr, uint8_t* buf, unsigned int len,
+                    unsigned int ifindex)
+{
+    struct tap_link* link;
+    int ret = -1;
+
+    pthread_mutex_lock(&(sr->tx_lock));
+
+    link = tp.by_ifindex && ifindex < sr->if_count ?
+           (struct tap_link*)tp.by_ifindex[ifindex] : 0;
+    if (link == 0) {
+        goto out;
+    }
+    if (write(link->fd[tap_queue(buf, len)], buf, len) != (ssize_t)len) {
+        tp.tx_errors++;
+        goto out;
+    }
+    tp.tx_frames++;
+    ret = 0;
+
+out:
+    pthread_mutex_unlock(&(sr->tx_lock));
+    return ret;
+}
+
+int sr_tap_open(struct sr_instance* sr, const char* links, unsigned int queues)
+{
+    assert(sr);
+    assert(links);
+    assert(tp.links == 0);
+
+    if (queues < 1 || queues > SR_TAP_QUEUES_MAX) {
+        fprintf(stderr, "TAP queues must be 1 to %d\n", SR_TAP_QUEUES_MAX);
+        return -1;
+    }
+    tp.links = (struct tap_link*)sr_link_open_all(links, sizeof(struct tap_link),
+                                                  &tp.nlinks, tap_open_link,
+                                                  tap_close, &queues);
+    if (tp.links == 0) {
+        return -1;
+    }
+
+    tp.queues = queues;
+    tp.io.name = "TAP";
+    tp.io.send = tap_send;
+    tp.io.flush = 0;
+    tp.io.hwaddr = 0;
+    tp.io.state = &tp;
+    sr->io = &tp.io;
+    return 0;
+}
+
+/* Handle up to a batch of frames waiting on one queue of 'link'. */
+static void tap_rx(struct sr_instance* sr, struct tap_link* link, int fd,
+                   uint8_t* buf)
+{
+    const uint8_t bcast[ETHER_ADDR_LEN] = { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff };
+    unsigned int n;
+    ssize_t len;
+
+    for (n = 0; n < SR_TAP_BATCH; n++) {
+        if ((len = read(fd, buf, SR_TAP_FRAME)) <= 0) {
+            if (len < 0 && errno != EAGAIN && errno != EINTR) {
+                perror("read(..):sr_tap.c::tap_rx");
+            }
+            return;
+        }
+        if ((size_t)len < sizeof(sr_ethernet_hdr_t)) {
+            continue;
+        }
+        if (memcmp(buf, link->l.iface->addr, ETHER_ADDR_LEN) != 0 &&
+            memcmp(buf, bcast, ETHER_ADDR_LEN) != 0) {
+            tp.rx_other++;
+            continue;
+        }
+        tp.rx_frames++;
+        sr_reload_enter(sr);
+        sr_handlepacket_ifindex(sr, buf, len, link->l.iface->ifindex);
+        sr_reload_exit(sr);
+    }
+    tp.rx_full++;
+}
+
+int sr_tap_run(struct sr_instance* sr)
+{
+    struct pollfd* pfds;
+    uint8_t* buf;
+    unsigned int i, q, nfds;
+    int n, ret = 0;
+
+    assert(sr);
+    assert(sr->io == &tp.io);
+
+    nfds = tp.nlinks * tp.queues;
+    pfds = (struct pollfd*)calloc(nfds, sizeof(struct pollfd));
+    buf = (uint8_t*)malloc(SR_TAP_FRAME);
+    assert(pfds && buf);
+    tp.by_ifindex = sr_link_bind(sr, tp.links, sizeof(struct tap_link),
+                                 tp.nlinks, "TAP");
+    if (tp.by_ifindex == 0) {
+        ret = -1;
+        goto out;
+    }
+    for (i = 0; i < tp.nlinks; i++) {
+        for (q = 0; q < tp.queues; q++) {
+            pfds[i * tp.queues + q].fd = tp.links[i].fd[q];
+            pfds[i * tp.queues + q].events = POLLIN;
+        }
+    }
+
+    sr_link_catch_signals();
+
+    printf(" <-- Ready to process packets --> \n");
+    while (!sr_link_stopping()) {
+        if ((n = poll(pfds, nfds, 100)) <= 0) {
+            if (n == 0 || errno == EINTR) {
+                continue;
+            }
+            perror("poll(..):sr_tap.c::sr_tap_run");
+            ret = -1;
+            break;
+        }
+        tp.rx_wakeups++;
+        for (i = 0; i < nfds; i++) {
+            if (pfds[i].revents & POLLIN) {
+                tap_rx(sr, &tp.links[i / tp.queues], pfds[i].fd, buf);
+            }
+        }
+    }
+
+    fprintf(stderr, "TAP rx: %lu frames in %lu wakeups (%lu full batches), "
+            "%lu for other MACs\n", tp.rx_frames, tp.rx_wakeups, tp.rx_full,
+            tp.rx_other);
+    fprintf(stderr, "TAP tx: %lu frames, %lu write errors\n", tp.tx_frames,
+            tp.tx_errors);
+
+out:
+    sr_link_close_all(sr, tp.links, sizeof(struct tap_link), tp.nlinks,
+                      tp.by_ifindex, tap_close);
+    free(buf);
+    free(pfds);
+    return ret;
+}
@@ -0,0 +1,46 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_tap.h
+ *
+ * Description:
+ *
+ * TAP data plane: the router owns a Linux TAP device per interface and is
+ * the far end of its wire.  Frames the host stack sends out of the TAP
+ * are read by the router, and frames the router writes arrive at the TAP
+ * as if received, so hosts in network namespaces (the TAP moved into one)
+ * can be routed between with no VNS, POX or OpenFlow relay.
+ *
+ * Devices are opened with IFF_MULTI_QUEUE and several queues each; the
+ * kernel spreads the flows it sends over the queues, and the router
+ * spreads its own the same way.  Every wakeup drains up to a batch of
+ * frames from each ready queue; a TAP takes one frame per write, so sent
+ * frames go out as they are made.
+ *
+ * The TAP's own MAC is the host's, so router interfaces take theirs from
+ * the interface file (or 02:00:00:00:00:<n>).  Only frames for those
+ * MACs and broadcasts are handled.
+ *
+ *---------------------------------------------------------------------------*/
+
+#ifndef SR_TAP_H
+#define SR_TAP_H
+
+struct sr_instance;
+
+#define SR_TAP_QUEUES_MAX  16
+#define SR_TAP_BATCH       64      /* frames read per queue per wakeup */
+#define SR_TAP_FRAME       65536   /* read buffer, any frame the TAP takes */
+
+/* Open 'queues' queues on every TAP in 'links', a comma separated list of
+   "router interface=TAP" (or just "TAP" for the same name), and make
+   them the router's data plane.  A TAP that does not exist is created
+   and goes away when the router exits; one made with "ip tuntap add ...
+   multi_queue" stays.  Returns 0, or -1 with nothing set up. */
+int sr_tap_open(struct sr_instance* sr, const char* links,
+                unsigned int queues);
+
+/* Handle frames from every TAP until SIGINT or SIGTERM, then print what
+   was received and sent.  Every router interface must have a TAP.
+   Returns 0, or -1 on error. */
+int sr_tap_run(struct sr_instance* sr);
+
+#endif /* -- SR_TAP_H -- */
@@ -0,0 +1,241 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_timer.c
+ *
+ * Description:
+ *
+ * Hierarchical timer wheel.  See sr_timer.h.
+ *
+ *---------------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <time.h>
+
+#include "sr_timer.h"
+
+/* bits of the tick consumed by levels 0..l-1 */
+#define TW_SHIFT(l) (SR_TW_BITS0 + ((l) - 1) * SR_TW_BITS)
+
+uint64_t sr_timer_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void sr_timer_wheel_init(struct sr_timer_wheel* wheel, uint64_t now)
+{
+    memset(wheel, 0, sizeof(*wheel));
+    wheel->now = now;
+}
+
+void sr_timer_init(struct sr_timer* timer, sr_timer_fn fn, void* arg)
+{
+    timer->next = 0;
+    timer->pprev = 0;
+    timer->expires = 0;
+    timer->fn = fn;
+    timer->arg = arg;
+}
+
+static void tw_link(struct sr_timer** head, struct sr_timer* timer)
+{
+    timer->next = *head;
+    if (*head) {
+        (*head)->pprev = &timer->next;
+    }
+    timer->pprev = head;
+    *head = timer;
+}
+
+static void tw_unlink(struct sr_timer* timer)
+{
+    *timer->pprev = timer->next;
+    if (timer->next) {
+        timer->next->pprev = timer->pprev;
+    }
+    timer->next = 0;
+    timer->pprev = 0;
+}
+
+/*---------------------------------------------------------------------
+ * Method: tw_place
+ * Scope:  Local
+ *
+ * Put a timer in the slot matching its distance from wheel->now.
+ *
+ *---------------------------------------------------------------------*/
+
+static void tw_place(struct sr_timer_wheel* wheel, struct sr_timer* timer)
+{
+    uint64_t expires = timer->expires;
+    uint64_t delta;
+    int l;
+
+    if (expires <= wheel->now) {
+        expires = wheel->now + 1;
+    }
+    delta = expires - wheel->now;
+
+    if (delta < SR_TW_SLOTS0) {
+        tw_link(&wheel->level0[expires & (SR_TW_SLOTS0 - 1)], timer);
+        return;
+    }
+    for (l = 1; l < SR_TW_LEVELS; l++) {
+        if (delta < ((uint64_t)1 << (TW_SHIFT(l) + SR_TW_BITS)) ||
+            l == SR_TW_LEVELS - 1) {
+            if (delta >= ((uint64_t)1 << (TW_SHIFT(l) + SR_TW_BITS))) {
+                /* beyond the wheel: park in the furthest slot */
+                expires = wheel->now +
+                          ((uint64_t)1 << (TW_SHIFT(l) + SR_TW_BITS)) - 1;
+            }
+            tw_link(&wheel->levels[l - 1][(expires >> TW_SHIFT(l)) &
+                                          (SR_TW_SLOTS - 1)], timer);
+            return;
+        }
+    }
+}
+
+void sr_timer_add(struct sr_timer_wheel* wheel, struct sr_timer* timer,
+                  uint64_t expires)
+{
+    if (timer->pprev) {
+        tw_unlink(timer);
+    } else {
+        wheel->count++;
+    }
+    timer->expires = expires;
+    tw_place(wheel, timer);
+}
+
+void sr_timer_cancel(struct sr_timer_wheel* wheel, struct sr_timer* timer)
+{
+    if (timer->pprev) {
+        tw_unlink(timer);
+        wheel->count--;
+    }
+}
+
+/*---------------------------------------------------------------------
+ * Method: tw_cascade
+ * Scope:  Local
+ *
+ * Redistribute the timers of the current slot of level l into the
+ * levels below.  Returns the slot index, 0 meaning the level above is
+ * due as well.
+ *
+ *---------------------------------------------------------------------*/
+
+static unsigned int tw_cascade(struct sr_timer_wheel* wheel, int l)
+{
+    unsigned int idx = (wheel->now >> TW_SHIFT(l)) & (SR_TW_SLOTS - 1);
+    struct sr_timer* t = wheel->levels[l - 1][idx];
+
+    wheel->levels[l - 1][idx] = 0;
+    while (t) {
+        struct sr_timer* next = t->next;
+        t->pprev = 0;
+        if (t->expires <= wheel->now) {
+            /* due this very tick, which has not been run yet */
+            tw_link(&wheel->level0[wheel->now & (SR_TW_SLOTS0 - 1)], t);
+        } else {
+            tw_place(wheel, t);
+        }
+        t = next;
+    }
+    return idx;
+}
+
+/*---------------------------------------------------------------------
+ * Method: sr_timer_wheel_advance
+ * Scope:  Global
+ *
+ *---------------------------------------------------------------------*/
+
+void sr_timer_wheel_advance(struct sr_timer_wheel* wheel, uint64_t now)
+{
+    while (wheel->now < now) {
+        unsigned int idx;
+        struct sr_timer* t;
+
+        if (wheel->count == 0) {
+            wheel->now = now;   /* idle: nothing to step through */
+            break;
+        }
+        if (!wheel->level0[(wheel->now + 1) & (SR_TW_SLOTS0 - 1)]) {
+            /* skip ahead to just before the next tick with any work */
+            uint64_t next = sr_timer_wheel_next(wheel);
+            if (next > now) {
+                wheel->now = now;
+                break;
+            }
+            wheel->now = next - 1;
+        }
+
+        wheel->now++;
+        idx = wheel->now & (SR_TW_SLOTS0 - 1);
+        if (idx == 0) {
+            int l;
+            for (l = 1; l < SR_TW_LEVELS && tw_cascade(wheel, l) == 0; l++)
+                ;
+        }
+
+        /* detach the slot first: callbacks may re-add into it */
+        t = wheel->level0[idx];
+        wheel->level0[idx] = 0;
+        if (t) {
+            t->pprev = &t;
+        }
+        while (t) {
+            struct sr_timer* timer = t;
+            tw_unlink(timer);
+            wheel->count--;
+            timer->fn(timer, timer->arg);
+        }
+    }
+} /* -- sr_timer_wheel_advance -- */
+
+/*---------------------------------------------------------------------
+ * Method: sr_timer_wheel_next
+ * Scope:  Global
+ *
+ *---------------------------------------------------------------------*/
+
+uint64_t sr_timer_wheel_next(const struct sr_timer_wheel* wheel)
+{
+    uint64_t best = 0;
+    uint64_t t;
+    int l;
+
+    if (wheel->count == 0) {
+        return 0;
+    }
+
+    for (t = wheel->now + 1; t <= wheel->now + SR_TW_SLOTS0; t++) {
+        if (wheel->level0[t & (SR_TW_SLOTS0 - 1)]) {
+            best = t;
+            break;
+        }
+    }
+
+    /* a timer on an upper level needs a wakeup when its slot cascades,
+       which is never later than it expires */
+    for (l = 1; l < SR_TW_LEVELS; l++) {
+        uint64_t slot = (wheel->now >> TW_SHIFT(l)) + 1;
+        unsigned int i;
+
+        for (i = 0; i < SR_TW_SLOTS; i++, slot++) {
+            if (wheel->levels[l - 1][slot & (SR_TW_SLOTS - 1)]) {
+                t = slot << TW_SHIFT(l);
+                if (best == 0 || t < best) {
+                    best = t;
+                }
+                break;
+            }
+        }
+    }
+
+    return best;
+} /* -- sr_timer_wheel_next -- */
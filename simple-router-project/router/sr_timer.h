@@ -0,0 +1,85 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_timer.h
+ *
+ * Description:
+ *
+ * Hierarchical timer wheel with 1 ms resolution.  Level 0 has one slot
+ * per millisecond for the next 256 ms; each further level has 64 slots,
+ * each covering one full turn of the level below, so four levels reach
+ * 2^26 ms (about 18 hours; longer timers wait in the furthest slot and
+ * are refiled when it comes round).  Adding and cancelling a timer is
+ * O(1); advancing runs the due level 0 slots and skips straight over
+ * stretches with nothing due, so an empty wheel costs nothing.
+ *
+ * The wheel does no locking and never allocates: timers are embedded in
+ * the objects they time.  Callbacks run from sr_timer_wheel_advance() and
+ * may add or cancel timers, including their own.
+ *
+ *---------------------------------------------------------------------------*/
+
+#ifndef SR_TIMER_H
+#define SR_TIMER_H
+
+#ifdef _LINUX_
+#include <stdint.h>
+#endif /* _LINUX_ */
+
+#ifdef _DARWIN_
+#include <inttypes.h>
+#endif /* _DARWIN_ */
+
+#define SR_TW_BITS0  8
+#define SR_TW_BITS   6
+#define SR_TW_LEVELS 4
+#define SR_TW_SLOTS0 (1 << SR_TW_BITS0)
+#define SR_TW_SLOTS  (1 << SR_TW_BITS)
+
+struct sr_timer;
+typedef void (*sr_timer_fn)(struct sr_timer* timer, void* arg);
+
+struct sr_timer
+{
+    struct sr_timer* next;
+    struct sr_timer** pprev;    /* NULL when not scheduled */
+    uint64_t expires;           /* ms, sr_timer_now() clock */
+    sr_timer_fn fn;
+    void* arg;
+};
+
+struct sr_timer_wheel
+{
+    uint64_t now;               /* last tick processed */
+    unsigned int count;         /* scheduled timers */
+    struct sr_timer* level0[SR_TW_SLOTS0];
+    struct sr_timer* levels[SR_TW_LEVELS - 1][SR_TW_SLOTS];
+};
+
+/* Milliseconds on a monotonic clock. */
+uint64_t sr_timer_now(void);
+
+void sr_timer_wheel_init(struct sr_timer_wheel* wheel, uint64_t now);
+
+void sr_timer_init(struct sr_timer* timer, sr_timer_fn fn, void* arg);
+
+/* (Re)schedule timer to fire at 'expires'.  A time not after the wheel's
+   current tick fires on the next advance. */
+void sr_timer_add(struct sr_timer_wheel* wheel, struct sr_timer* timer,
+                  uint64_t expires);
+
+/* Unschedule timer; harmless if it is not scheduled. */
+void sr_timer_cancel(struct sr_timer_wheel* wheel, struct sr_timer* timer);
+
+/* Run every timer due up to and including 'now'. */
+void sr_timer_wheel_advance(struct sr_timer_wheel* wheel, uint64_t now);
+
+/* Earliest time at which the wheel has work to do: the exact expiry when
+   the next timer is within 256 ms, otherwise the (earlier) time at which
+   its slot is cascaded.  Returns 0 if no timer is scheduled. */
+uint64_t sr_timer_wheel_next(const struct sr_timer_wheel* wheel);
+
+static __inline__ int sr_timer_pending(const struct sr_timer* timer)
+{
+    return timer->pprev != 0;
+}
+
+#endif /* -- SR_TIMER_H -- */
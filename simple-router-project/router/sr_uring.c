@@ -0,0 +1,246 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_uring.c
+ *
+ * Description:
+ *
+ * Raw io_uring set up and ring access.  See sr_uring.h.
+ *
+ *---------------------------------------------------------------------------*/
+
+#ifdef SR_IO_URING
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "sr_uring.h"
+
+/* operations sr_vns_uring_run() submits */
+static const int uring_ops[] =
+{ IORING_OP_RECV, IORING_OP_SENDMSG, IORING_OP_TIMEOUT,
+  IORING_OP_TIMEOUT_REMOVE };
+
+static int uring_register(int fd, unsigned int op, void* arg,
+                          unsigned int nr)
+{
+    return syscall(__NR_io_uring_register, fd, op, arg, nr);
+}
+
+static int uring_probe(struct sr_uring* u)
+{
+    struct io_uring_probe* probe;
+    size_t len = sizeof(*probe) + 256 * sizeof(struct io_uring_probe_op);
+    unsigned int i;
+    int ret = -1;
+
+    probe = (struct io_uring_probe*)calloc(1, len);
+    if (!probe)
+        return -1;
+    if (uring_register(u->fd, IORING_REGISTER_PROBE, probe, 256) < 0)
+        goto out;
+    for (i = 0; i < sizeof(uring_ops) / sizeof(uring_ops[0]); i++) {
+        if (uring_ops[i] > probe->last_op ||
+            !(probe->ops[uring_ops[i]].flags & IO_URING_OP_SUPPORTED)) {
+            errno = EOPNOTSUPP;
+            goto out;
+        }
+    }
+    ret = 0;
+out:
+    free(probe);
+    return ret;
+}
+
+static int uring_bufs(struct sr_uring* u, unsigned int nbufs,
+                      unsigned int buf_size)
+{
+    struct io_uring_buf_reg reg;
+    unsigned int i;
+
+    u->br_len = nbufs * sizeof(struct io_uring_buf);
+    u->br = (struct io_uring_buf_ring*)mmap(0, u->br_len,
+            PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (u->br == MAP_FAILED) {
+        u->br = 0;
+        return -1;
+    }
+    u->bufs = (uint8_t*)malloc((size_t)nbufs * buf_size);
+    if (!u->bufs)
+        return -1;
+    u->nbufs = nbufs;
+    u->buf_size = buf_size;
+
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (unsigned long)u->br;
+    reg.ring_entries = nbufs;
+    reg.bgid = SR_URING_BGID;
+    if (uring_register(u->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+        return -1;
+
+    for (i = 0; i < nbufs; i++) {
+        struct io_uring_buf* buf = &u->br->bufs[(u->br_tail + i) & (nbufs - 1)];
+        buf->addr = (unsigned long)(u->bufs + (size_t)i * buf_size);
+        buf->len = buf_size;
+        buf->bid = i;
+    }
+    u->br_tail += nbufs;
+    __atomic_store_n(&u->br->tail, u->br_tail, __ATOMIC_RELEASE);
+    return 0;
+}
+
+int sr_uring_init(struct sr_uring* u, unsigned int nbufs,
+                  unsigned int buf_size)
+{
+    struct io_uring_params p;
+    uint8_t* sq;
+    uint8_t* cq;
+    int err;
+
+    memset(u, 0, sizeof(*u));
+    memset(&p, 0, sizeof(p));
+    u->fd = syscall(__NR_io_uring_setup, SR_URING_ENTRIES, &p);
+    if (u->fd < 0)
+        return -1;
+    u->features = p.features;
+
+    u->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    u->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (u->cq_len > u->sq_len)
+            u->sq_len = u->cq_len;
+        u->cq_len = 0;
+    }
+    u->sq_map = mmap(0, u->sq_len, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+    if (u->sq_map == MAP_FAILED) {
+        u->sq_map = 0;
+        goto fail;
+    }
+    if (u->cq_len) {
+        u->cq_map = mmap(0, u->cq_len, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+        if (u->cq_map == MAP_FAILED) {
+            u->cq_map = 0;
+            goto fail;
+        }
+    }
+    u->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes = (struct io_uring_sqe*)mmap(0, u->sqes_len,
+              PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd,
+              IORING_OFF_SQES);
+    if (u->sqes == MAP_FAILED) {
+        u->sqes = 0;
+        goto fail;
+    }
+
+    sq = (uint8_t*)u->sq_map;
+    cq = u->cq_map ? (uint8_t*)u->cq_map : sq;
+    u->sq_head = (unsigned int*)(sq + p.sq_off.head);
+    u->sq_tail = (unsigned int*)(sq + p.sq_off.tail);
+    u->sq_mask = *(unsigned int*)(sq + p.sq_off.ring_mask);
+    u->sq_array = (unsigned int*)(sq + p.sq_off.array);
+    u->sq_local = *u->sq_tail;
+    u->cq_head = (unsigned int*)(cq + p.cq_off.head);
+    u->cq_tail = (unsigned int*)(cq + p.cq_off.tail);
+    u->cq_mask = *(unsigned int*)(cq + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+
+    if (uring_probe(u) < 0 || uring_bufs(u, nbufs, buf_size) < 0)
+        goto fail;
+    return 0;
+
+fail:
+    err = errno;
+    sr_uring_exit(u);
+    errno = err;
+    return -1;
+}
+
+void sr_uring_exit(struct sr_uring* u)
+{
+    if (u->sqes)
+        munmap(u->sqes, u->sqes_len);
+    if (u->cq_map)
+        munmap(u->cq_map, u->cq_len);
+    if (u->sq_map)
+        munmap(u->sq_map, u->sq_len);
+    if (u->fd >= 0)
+        close(u->fd);
+    if (u->br)
+        munmap(u->br, u->br_len);
+    free(u->bufs);
+    memset(u, 0, sizeof(*u));
+    u->fd = -1;
+}
+
+unsigned int sr_uring_sq_space(struct sr_uring* u)
+{
+    unsigned int head = __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+    return u->sq_mask + 1 - (u->sq_local - head);
+}
+
+struct io_uring_sqe* sr_uring_sqe(struct sr_uring* u)
+{
+    struct io_uring_sqe* sqe;
+    unsigned int idx;
+
+    if (sr_uring_sq_space(u) == 0)
+        return 0;
+    idx = u->sq_local & u->sq_mask;
+    u->sq_array[idx] = idx;
+    sqe = &u->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    u->sq_local++;
+    return sqe;
+}
+
+int sr_uring_enter(struct sr_uring* u, unsigned int wait)
+{
+    unsigned int submit = u->sq_local - *u->sq_tail;
+    int ret;
+
+    __atomic_store_n(u->sq_tail, u->sq_local, __ATOMIC_RELEASE);
+    ret = syscall(__NR_io_uring_enter, u->fd, submit, wait,
+                  wait ? IORING_ENTER_GETEVENTS : 0, 0, 0);
+    u->enters++;
+    if (ret < 0)
+        return -1;
+    u->submitted += ret;
+    return 0;
+}
+
+struct io_uring_cqe* sr_uring_cqe(struct sr_uring* u)
+{
+    unsigned int head = *u->cq_head;
+
+    if (head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE))
+        return 0;
+    return &u->cqes[head & u->cq_mask];
+}
+
+void sr_uring_cqe_seen(struct sr_uring* u)
+{
+    __atomic_store_n(u->cq_head, *u->cq_head + 1, __ATOMIC_RELEASE);
+    u->completed++;
+}
+
+uint8_t* sr_uring_buf(struct sr_uring* u, unsigned int bid)
+{
+    return u->bufs + (size_t)bid * u->buf_size;
+}
+
+void sr_uring_buf_recycle(struct sr_uring* u, unsigned int bid)
+{
+    struct io_uring_buf* buf = &u->br->bufs[u->br_tail & (u->nbufs - 1)];
+
+    buf->addr = (unsigned long)sr_uring_buf(u, bid);
+    buf->len = u->buf_size;
+    buf->bid = bid;
+    u->br_tail++;
+    __atomic_store_n(&u->br->tail, u->br_tail, __ATOMIC_RELEASE);
+}
+
+#endif /* SR_IO_URING */
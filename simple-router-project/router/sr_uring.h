@@ -0,0 +1,101 @@
+/*-----------------------------------------------------------------------------
+ * file:  sr_uring.h
+ *
+ * Description:
+ *
+ * A minimal io_uring, made with the raw system calls (no liburing): the
+ * submission and completion rings mapped from the kernel, and a ring of
+ * provided buffers that multishot receives fill.  Only built with
+ * "make IO_URING=1" (SR_IO_URING); sr_vns_uring_run() in sr_vns_comm.c
+ * is the event loop on top of it.
+ *
+ * Everything here is for one thread.  Completions are taken in order with
+ * sr_uring_cqe() and handed back with sr_uring_cqe_seen(); a buffer named
+ * by a completion is the caller's until sr_uring_buf_recycle().
+ *
+ *---------------------------------------------------------------------------*/
+
+#ifndef SR_URING_H
+#define SR_URING_H
+
+#ifdef SR_IO_URING
+
+#include <stddef.h>
+#include <stdint.h>
+#include <linux/io_uring.h>
+
+#define SR_URING_ENTRIES   64      /* submission queue entries */
+#define SR_URING_BGID      0       /* buffer group of the provided buffers */
+
+struct sr_uring
+{
+    int fd;
+    unsigned int features;          /* IORING_FEAT_* */
+
+    /* submission queue, entries are handed out in array order */
+    unsigned int* sq_head;
+    unsigned int* sq_tail;
+    unsigned int sq_mask;
+    unsigned int* sq_array;
+    struct io_uring_sqe* sqes;
+    unsigned int sq_local;          /* tail of entries not yet submitted */
+
+    /* completion queue */
+    unsigned int* cq_head;
+    unsigned int* cq_tail;
+    unsigned int cq_mask;
+    struct io_uring_cqe* cqes;
+
+    /* provided buffers, 'nbufs' (a power of 2) of 'buf_size' bytes */
+    struct io_uring_buf_ring* br;
+    uint8_t* bufs;
+    unsigned int nbufs;
+    unsigned int buf_size;
+    uint16_t br_tail;
+
+    void* sq_map;
+    size_t sq_len;
+    void* cq_map;
+    size_t cq_len;
+    size_t sqes_len;
+    size_t br_len;
+
+    unsigned long enters;           /* io_uring_enter() calls */
+    unsigned long submitted;        /* entries they submitted */
+    unsigned long completed;        /* completions taken */
+};
+
+/* Set up a ring and 'nbufs' provided buffers of 'buf_size' bytes in group
+   SR_URING_BGID, and check that the kernel has every operation the loop
+   uses.  Returns 0, or -1 with errno set and nothing left open. */
+int sr_uring_init(struct sr_uring* u, unsigned int nbufs,
+                  unsigned int buf_size);
+
+/* Unmap and close everything sr_uring_init() set up. */
+void sr_uring_exit(struct sr_uring* u);
+
+/* A cleared submission entry, or 0 if the queue is full.  It is submitted
+   by the next sr_uring_enter(). */
+struct io_uring_sqe* sr_uring_sqe(struct sr_uring* u);
+
+/* Entries free in the submission queue. */
+unsigned int sr_uring_sq_space(struct sr_uring* u);
+
+/* Submit what sr_uring_sqe() handed out and wait until at least 'wait'
+   completions are ready.  Returns 0, or -1 with errno set (EINTR, ETIME
+   and EBUSY are not errors to the caller's loop). */
+int sr_uring_enter(struct sr_uring* u, unsigned int wait);
+
+/* The oldest completion not yet seen, or 0. */
+struct io_uring_cqe* sr_uring_cqe(struct sr_uring* u);
+
+/* Done with the completion sr_uring_cqe() returned. */
+void sr_uring_cqe_seen(struct sr_uring* u);
+
+/* Provided buffer 'bid', and handing it back to the kernel. */
+uint8_t* sr_uring_buf(struct sr_uring* u, unsigned int bid);
+void sr_uring_buf_recycle(struct sr_uring* u, unsigned int bid);
+
+#endif /* SR_IO_URING */
+
+#endif /* -- SR_URING_H -- */
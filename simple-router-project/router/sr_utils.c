@@ -20,6 +20,18 @@ uint16_t cksum (const void *_data, int len) {
 }
 
 
+/* Incrementally update checksum 'sum' after a 16-bit field changed from
+   old_word to new_word (RFC 1624, eqn. 3: HC' = ~(~HC + ~m + m')).  All
+   three values are taken as they sit in the packet, so the result is in
+   the same byte order as 'sum'. */
+uint16_t cksum_update(uint16_t sum, uint16_t old_word, uint16_t new_word) {
+  uint32_t s = (uint16_t)~sum + (uint16_t)~old_word + new_word;
+  s = (s & 0xffff) + (s >> 16);
+  s = (s & 0xffff) + (s >> 16);
+  return (uint16_t)~s;
+}
+
+
 uint16_t ethertype(uint8_t *buf) {
   sr_ethernet_hdr_t *ehdr = (sr_ethernet_hdr_t *)buf;
   return ntohs(ehdr->ether_type);
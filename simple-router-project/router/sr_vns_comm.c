@@ -32,14 +32,33 @@
 #include <errno.h>
 
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <sys/time.h>
+#include <sys/uio.h>
+#include <poll.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
 
 #include "sr_dumper.h"
 #include "sr_router.h"
+#include "sr_reload.h"
+#include "sr_rt.h"
+#include "sr_fib.h"
 #include "sr_if.h"
 #include "sr_protocol.h"
+#include "sr_pktbuf.h"
+#include "sr_uring.h"
 
 #include "sha1.h"
 #include "vnscommand.h"
@@ -48,8 +67,32 @@ static void sr_log_packet(struct sr_instance* , uint8_t* , int );
 static int  sr_arp_req_not_for_us(struct sr_instance* sr,
                                   uint8_t * packet /* lent */,
                                   unsigned int len,
-                                  char* interface  /* lent */);
+                                  struct sr_if* iface /* lent */);
 int sr_read_from_server_expect(struct sr_instance* sr /* borrowed */, int expected_cmd);
+static int sr_vns_tx_flush(struct sr_instance* sr, int wait);
+static int sr_vns_tx_credit(struct sr_instance* sr);
+static int sr_vns_shm_flush(struct sr_instance* sr);
+static unsigned int sr_vns_tx_pending(struct sr_instance* sr);
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_vns_tx_lock(..)
+ * Scope: Local
+ *
+ * tx_lock, unless one thread does everything (sr->one_thread).
+ *
+ *---------------------------------------------------------------------------*/
+
+static void sr_vns_tx_lock(struct sr_instance* sr /* borrowed */)
+{
+    if(!sr->one_thread)
+    { pthread_mutex_lock(&(sr->tx_lock)); }
+}
+
+static void sr_vns_tx_unlock(struct sr_instance* sr /* borrowed */)
+{
+    if(!sr->one_thread)
+    { pthread_mutex_unlock(&(sr->tx_lock)); }
+}
 
 /*-----------------------------------------------------------------------------
  * Method: sr_session_closed_help(..)
@@ -62,32 +105,17 @@ static void sr_session_closed_help()
 }
 
 /*-----------------------------------------------------------------------------
- * Method: sr_connect_to_server()
- * Scope: Global
- *
- * Connect to the virtual server
- *
- * RETURN VALUES:
+ * Method: sr_vns_connect_tcp(..)
+ * Scope: Local
  *
- *  0 on success
- *  something other than zero on error
+ * TCP connection to the VNS server at server:port.
  *
  *---------------------------------------------------------------------------*/
-int sr_connect_to_server(struct sr_instance* sr,unsigned short port,
-                         char* server)
+
+static int sr_vns_connect_tcp(struct sr_instance* sr, unsigned short port,
+                              char* server)
 {
     struct hostent *hp;
-    c_open command;
-    c_open_template ot;
-    char* buf;
-    uint32_t buf_len;
-
-    /* REQUIRES */
-    assert(sr);
-    assert(server);
-
-    /* purify UMR be gone ! */
-    memset((void*)&command,0,sizeof(c_open));
 
     /* zero out server address struct */
     memset(&(sr->sr_addr),0,sizeof(struct sockaddr_in));
@@ -120,6 +148,82 @@ int sr_connect_to_server(struct sr_instance* sr,unsigned short port,
         close(sr->sockfd);
         return -1;
     }
+    return 0;
+} /* -- sr_vns_connect_tcp -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_vns_connect_unix(..)
+ * Scope: Local
+ *
+ * AF_UNIX SOCK_SEQPACKET connection to a server on this host listening at
+ * 'path'.  Every record is one whole VNS message, length field included,
+ * so the receive side never has to reassemble one from a byte stream.
+ *
+ *---------------------------------------------------------------------------*/
+
+static int sr_vns_connect_unix(struct sr_instance* sr, const char* path)
+{
+    struct sockaddr_un sun;
+
+    if(strlen(path) >= sizeof(sun.sun_path))
+    {
+        fprintf(stderr, "%s: socket path too long\n", path);
+        return -1;
+    }
+    memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    strcpy(sun.sun_path, path);
+
+    if ((sr->sockfd = socket(AF_UNIX, SOCK_SEQPACKET, 0)) < 0)
+    {
+        perror("socket(..):sr_vns_comm.c::sr_vns_connect_unix(..)");
+        return -1;
+    }
+    if (connect(sr->sockfd, (struct sockaddr *)&sun, sizeof(sun)) < 0)
+    {
+        perror("connect(..):sr_vns_comm.c::sr_vns_connect_unix(..)");
+        close(sr->sockfd);
+        return -1;
+    }
+    sr->seqpacket = 1;
+    return 0;
+} /* -- sr_vns_connect_unix -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_connect_to_server()
+ * Scope: Global
+ *
+ * Connect to the virtual server.  A server name starting with '/' is the
+ * path of a local AF_UNIX socket, otherwise it is a host reached by TCP.
+ *
+ * RETURN VALUES:
+ *
+ *  0 on success
+ *  something other than zero on error
+ *
+ *---------------------------------------------------------------------------*/
+int sr_connect_to_server(struct sr_instance* sr,unsigned short port,
+                         char* server)
+{
+    c_open command;
+    c_open_template ot;
+    char* buf;
+    uint32_t buf_len;
+
+    /* REQUIRES */
+    assert(sr);
+    assert(server);
+
+    /* purify UMR be gone ! */
+    memset((void*)&command,0,sizeof(c_open));
+
+    if(server[0] == '/')
+    {
+        if(sr_vns_connect_unix(sr, server) != 0)
+        { return -1; }
+    }
+    else if(sr_vns_connect_tcp(sr, port, server) != 0)
+    { return -1; }
 
     /* wait for authentication to be completed (server sends the first message) */
     if(sr_read_from_server_expect(sr, VNS_AUTH_REQUEST)!= 1 ||
@@ -142,6 +246,9 @@ int sr_connect_to_server(struct sr_instance* sr,unsigned short port,
         command.mLen   = htonl(sizeof(c_open));
         command.mType  = htonl(VNSOPEN);
         command.topoID = htons(sr->topo_id);
+        command.flags  = htons(VNS_OPEN_PACKETS | VNS_OPEN_CREDIT |
+                               (sr->seqpacket && !sr->uring &&
+                                !sr->one_thread ? VNS_OPEN_SHM : 0));
         strncpy( command.mVirtualHostID, sr->host,  IDSIZE);
         strncpy( command.mUID, sr->user, IDSIZE);
 
@@ -201,6 +308,8 @@ int sr_handle_hwinfo(struct sr_instance* sr, c_hwinfo* hwinfo)
             case HWSPEED:
                 /* Debug("Speed: %d\n",
                         ntohl(*((unsigned int*)hwinfo->mHWInfo[i].value))); */
+                sr_set_ether_speed(sr,
+                        ntohl(*((uint32_t*)hwinfo->mHWInfo[i].value)));
                 break;
             case HWSUBNET:
                 /* Debug("Subnet: %s\n",inet_ntoa(
@@ -232,6 +341,155 @@ int sr_handle_hwinfo(struct sr_instance* sr, c_hwinfo* hwinfo)
     return num_entries;
 } /* -- sr_handle_hwinfo -- */
 
+/*-----------------------------------------------------------------------------
+ * Method: sr_apply_hwinfo(..)
+ * Scope: Local
+ *
+ * Set up the interfaces from a HWINFO message and check the routing table
+ * against them.  Interface addresses become local /32 routes.
+ *
+ *---------------------------------------------------------------------------*/
+
+static int sr_apply_hwinfo(struct sr_instance* sr, c_hwinfo* hwinfo)
+{
+    sr_handle_hwinfo(sr, hwinfo);
+    if(sr_verify_routing_table(sr) != 0)
+    {
+        fprintf(stderr,"Routing table not consistent with hardware\n");
+        return -1;
+    }
+    if(sr_rt_install_local(sr, sr->fib) != 0)
+    {
+        fprintf(stderr,"Error installing local routes\n");
+        return -1;
+    }
+    if(sr->dst_cache)
+    { sr_dst_cache_invalidate(sr->dst_cache); }
+    return 0;
+} /* -- sr_apply_hwinfo -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_load_hwinfo(..)
+ * Scope: Global
+ *
+ * Synthetic HWINFO for running without a VNS server.  Each line of the
+ * file is
+ *
+ *   name ip [mac [speed]]
+ *
+ * An IP_CONFIG file works as is: "sw0-ethN" names the router's ethN, as
+ * in the POX module, and names without "eth" (the hosts) are skipped.
+ * Interfaces without a MAC get the one of the link behind them if the
+ * data plane backend knows it, else 02:00:00:00:00:<n>, n counting from 1.
+ *
+ * RETURN VALUES:
+ *
+ *  0 on success, -1 on error
+ *
+ *---------------------------------------------------------------------------*/
+
+int sr_load_hwinfo(struct sr_instance* sr /* borrowed */, const char* file)
+{
+    c_hwinfo* hwinfo;
+    c_hw_entry* e;
+    FILE* fp;
+    char line[BUFSIZ];
+    char name[32], ip[32], mac[32];
+    unsigned int m[ETHER_ADDR_LEN];
+    unsigned int speed, n = 0, i;
+    struct in_addr addr;
+    int fields, ret = -1;
+
+    /* REQUIRES */
+    assert(sr);
+    assert(file);
+
+    if((fp = fopen(file, "r")) == 0)
+    {
+        fprintf(stderr,"Error opening interface file %s\n", file);
+        return -1;
+    }
+    hwinfo = (c_hwinfo*)calloc(1, sizeof(c_hwinfo));
+    assert(hwinfo);
+    e = hwinfo->mHWInfo;
+
+    while(fgets(line, sizeof(line), fp))
+    {
+        char* ifname = name;
+
+        speed = 0;
+        fields = sscanf(line, "%31s %31s %31s %u", name, ip, mac, &speed);
+        if(fields < 2 || name[0] == '#')
+        { continue; }
+        if(strncmp(ifname, "eth", 3) != 0)
+        {
+            if((ifname = strstr(name, "-eth")) == 0)
+            { continue; } /* -- a host, not an interface -- */
+            ifname++;
+        }
+        if(inet_aton(ip, &addr) == 0)
+        {
+            fprintf(stderr,"%s: bad address %s for %s\n", file, ip, name);
+            goto out;
+        }
+        if(fields < 3)
+        {
+            unsigned char hw[ETHER_ADDR_LEN];
+
+            memset(m, 0, sizeof(m));
+            m[0] = 0x02;
+            m[5] = n + 1;
+            if(sr->io && sr->io->hwaddr && sr->io->hwaddr(sr, ifname, hw) == 0)
+            {
+                for(i = 0; i < ETHER_ADDR_LEN; i++)
+                { m[i] = hw[i]; }
+            }
+        }
+        else if(sscanf(mac, "%x:%x:%x:%x:%x:%x", &m[0], &m[1], &m[2],
+                       &m[3], &m[4], &m[5]) != ETHER_ADDR_LEN)
+        {
+            fprintf(stderr,"%s: bad MAC address %s for %s\n", file, mac, name);
+            goto out;
+        }
+        if((e - hwinfo->mHWInfo) + 4 > MAXHWENTRIES)
+        {
+            fprintf(stderr,"%s: too many interfaces\n", file);
+            goto out;
+        }
+
+        /* -- the entries the server sends for an interface -- */
+        e->mKey = htonl(HWINTERFACE);
+        strncpy(e->value, ifname, sr_IFACE_NAMELEN - 1);
+        e++;
+        e->mKey = htonl(HWSPEED);
+        *((uint32_t*)e->value) = htonl(speed ? speed : 1000);
+        e++;
+        e->mKey = htonl(HWETHER);
+        for(i = 0; i < ETHER_ADDR_LEN; i++)
+        { e->value[i] = (char)m[i]; }
+        e++;
+        e->mKey = htonl(HWETHIP);
+        memcpy(e->value, &addr.s_addr, sizeof(uint32_t));
+        e++;
+        n++;
+    }
+
+    if(n == 0)
+    {
+        fprintf(stderr,"%s: no interfaces\n", file);
+        goto out;
+    }
+    hwinfo->mType = htonl(VNSHWINFO);
+    hwinfo->mLen = htonl(2 * sizeof(uint32_t) +
+                         (e - hwinfo->mHWInfo) * sizeof(c_hw_entry));
+    ret = sr_apply_hwinfo(sr, hwinfo);
+
+out:
+    fclose(fp);
+    free(hwinfo);
+    return ret;
+} /* -- sr_load_hwinfo -- */
+
 int sr_handle_rtable(struct sr_instance* sr, c_rtable* rtable) {
     char fn[7+IDSIZE+1];
     FILE* fp;
@@ -319,161 +577,531 @@ int sr_handle_auth_status(struct sr_instance* sr, c_auth_status* status) {
 }
 
 /*-----------------------------------------------------------------------------
- * Method: sr_read_from_server(..)
- * Scope: global
+ * Method: sr_vns_rx_wait(..)
+ * Scope: Local
  *
- * Houses main while loop for communicating with the virtual router server.
+ * Wait for input.  While frames are queued, wake every SR_VNS_TX_FLUSH_MS
+ * or when the socket has room, and write them; the receive loop would
+ * otherwise leave them queued until the next message arrives.
  *
  *---------------------------------------------------------------------------*/
 
-int sr_read_from_server(struct sr_instance* sr /* borrowed */)
-{
-    return sr_read_from_server_expect(sr, 0);
-}
-
-int sr_read_from_server_expect(struct sr_instance* sr /* borrowed */, int expected_cmd)
+static int sr_vns_rx_wait(struct sr_instance* sr /* borrowed */)
 {
-    int command, len;
-    unsigned char *buf = 0;
-    c_packet_ethernet_header* sr_pkt = 0;
-    int ret = 0, bytes_read = 0;
-
-    /* REQUIRES */
-    assert(sr);
-
-    /*---------------------------------------------------------------------------
-      Read a command from the server
-      -------------------------------------------------------------------------*/
+    struct pollfd pfd;
+    int ret;
 
-    bytes_read = 0;
-
-    /* attempt to read the size of the incoming packet */
-    while( bytes_read < 4)
+    while(sr_vns_tx_pending(sr))
     {
-        do
-        { /* -- just in case SIGALRM breaks recv -- */
-            errno = 0; /* -- hacky glibc workaround -- */
-            if((ret = recv(sr->sockfd,((uint8_t*)&len) + bytes_read,
-                            4 - bytes_read, 0)) == -1)
-            {
-                if ( errno == EINTR )
-                { continue; }
+        pfd.fd = sr->sockfd;
+        pfd.events = POLLIN | POLLOUT;
+        pfd.revents = 0;
+        if(poll(&pfd, 1, SR_VNS_TX_FLUSH_MS) == -1 && errno != EINTR)
+        {
+            perror("poll(..):sr_vns_comm.c::sr_vns_rx_wait");
+            return -1;
+        }
+        if(pfd.revents & POLLIN)
+        { break; }
+
+        sr_vns_tx_lock(sr);
+        ret = sr_vns_tx_flush(sr, 0);
+        sr_vns_tx_unlock(sr);
+        if(ret < 0)
+        { return -1; }
+    }
+    return 0;
+} /* -- sr_vns_rx_wait -- */
 
-                perror("recv(..):sr_client.c::sr_read_from_server");
-                return -1;
-            }
-            bytes_read += ret;
-        } while ( errno == EINTR); /* be mindful of signals */
+/*-----------------------------------------------------------------------------
+ * Method: sr_vns_rx_records(..)
+ * Scope: Local
+ *
+ * sr_vns_rx_fill() for a SEQPACKET socket: one recvmmsg() of up to
+ * SR_VNS_RX_MSGS records, each a whole message, into SR_VNS_MAX_MSG slots
+ * at the free end of the ring.  They are then slid together so the ring
+ * holds one message after another, as if read from a stream.  A record
+ * too short to hold a message header is dropped and counted (rx_short);
+ * if a read brings nothing else, it reads again.  'flags' is
+ * MSG_WAITFORONE to block for the first record, MSG_DONTWAIT not to.
+ *
+ *---------------------------------------------------------------------------*/
 
+static int sr_vns_rx_records(struct sr_instance* sr /* borrowed */,
+                             int flags)
+{
+    struct mmsghdr msgs[SR_VNS_RX_MSGS];
+    struct iovec iov[SR_VNS_RX_MSGS];
+    unsigned int slots = (SR_VNS_RX_RING - sr->rx_tail) / SR_VNS_MAX_MSG;
+    unsigned int i, len, tail;
+    uint32_t mlen;
+    int n;
+
+    if(slots > SR_VNS_RX_MSGS)
+    { slots = SR_VNS_RX_MSGS; }
+
+    memset(msgs, 0, sizeof(msgs));
+    for(i = 0; i < slots; i++)
+    {
+        iov[i].iov_base = sr->rx_buf + sr->rx_tail + i * SR_VNS_MAX_MSG;
+        iov[i].iov_len = SR_VNS_MAX_MSG;
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
     }
 
-    len = ntohl(len);
+again:
+    do
+    { /* -- block for the first record only, if at all -- */
+        n = recvmmsg(sr->sockfd, msgs, slots, flags, 0);
+    } while(n == -1 && errno == EINTR);
+    sr->rx_reads++;
 
-    if ( len > 10000 || len < 0 )
+    if(n == -1)
     {
-        fprintf(stderr,"Error: command length to large %d\n",len);
-        close(sr->sockfd);
+        if(errno == EAGAIN || errno == EWOULDBLOCK)
+        { return -1; }
+        perror("recvmmsg(..):sr_vns_comm.c::sr_vns_rx_records");
         return -1;
     }
+    if(n == 0 || msgs[0].msg_len == 0)
+    { return 0; } /* -- server closed the connection -- */
 
-    if((buf = malloc(len)) == 0)
+    tail = sr->rx_tail;
+    for(i = 0; i < (unsigned int)n; i++)
     {
-        fprintf(stderr,"Error: out of memory (sr_read_from_server)\n");
-        return -1;
+        len = msgs[i].msg_len;
+        if(len < 8)
+        { /* -- the rest of the batch is still good -- */
+            sr->rx_short++;
+            continue;
+        }
+        memcpy(&mlen, iov[i].iov_base, 4);
+        if((msgs[i].msg_hdr.msg_flags & MSG_TRUNC) || ntohl(mlen) != len)
+        {
+            fprintf(stderr,"Error: VNS record of %u bytes holds a message "
+                    "of %u\n", len, ntohl(mlen));
+            close(sr->sockfd);
+            return -1;
+        }
+        if(sr->rx_buf + tail != (uint8_t*)iov[i].iov_base)
+        { memmove(sr->rx_buf + tail, iov[i].iov_base, len); }
+        tail += len;
     }
 
-    /* set first field of command since we've already read it */
-    *((int *)buf) = htonl(len);
+    if(tail == sr->rx_tail)
+    { goto again; } /* -- 0 would mean the server closed -- */
 
-    bytes_read = 0;
+    n = tail - sr->rx_tail;
+    sr->rx_tail = tail;
+    return n;
+} /* -- sr_vns_rx_records -- */
 
-    /* read the rest of the command */
-    while ( bytes_read < len - 4)
-    {
-        do
-        {/* -- just in case SIGALRM breaks recv -- */
-            errno = 0; /* -- hacky glibc workaround -- */
-            if ((ret = read(sr->sockfd, buf+4+bytes_read, len - 4 - bytes_read)) ==
-                    -1)
-            {
-                if ( errno == EINTR )
-                { continue; }
-                fprintf(stderr,"Error: failed reading command body %d\n",ret);
-                close(sr->sockfd);
-                return -1;
-            }
-            bytes_read += ret;
-        } while (errno == EINTR); /* be mindful of signals */
-    }
+/*-----------------------------------------------------------------------------
+ * Method: sr_vns_rx_can_fill(..)
+ * Scope: Local
+ *
+ * Whether sr_vns_rx_room() can make room without waiting for frames sent
+ * in place to be written.
+ *
+ *---------------------------------------------------------------------------*/
 
-    /* My entry for most unreadable line of code - guido */
-    /* ... you win - mc                                  */
-    command = *(((int *)buf)+1) = ntohl(*(((int *)buf)+1));
+static int sr_vns_rx_can_fill(struct sr_instance* sr /* borrowed */)
+{
+    return !sr->tx_ring || SR_VNS_RX_RING - sr->rx_tail >= SR_VNS_MAX_MSG;
+} /* -- sr_vns_rx_can_fill -- */
 
-    /* make sure the command is what we expected if we were expecting something */
-    if(expected_cmd && command!=expected_cmd) {
-        if(command != VNSCLOSE) { /* VNSCLOSE is always ok */
-            fprintf(stderr, "Error: expected command %d but got %d\n", expected_cmd, command);
+/*-----------------------------------------------------------------------------
+ * Method: sr_vns_rx_room(..)
+ * Scope: Local
+ *
+ * See that the receive ring has SR_VNS_MAX_MSG free at its end.  A partial
+ * message left at the end of the ring is moved to its start, so messages
+ * split across reads are completed in place.  Frames sent in place keep
+ * the ring where it is until they are written; only a ring with no room
+ * left behind them waits for that (see sr_vns_rx_can_fill()).
+ *
+ *---------------------------------------------------------------------------*/
+
+static int sr_vns_rx_room(struct sr_instance* sr /* borrowed */)
+{
+    int ret;
+
+    if(sr->rx_buf == 0)
+    {
+        if((sr->rx_buf = (uint8_t*)malloc(SR_VNS_RX_RING)) == 0)
+        {
+            fprintf(stderr,"Error: out of memory (sr_vns_rx_room)\n");
             return -1;
         }
+        sr->rx_head = sr->rx_tail = 0;
     }
 
-    ret = 1;
-    switch (command)
+    if(!sr_vns_rx_can_fill(sr))
     {
-        /* -------------        VNSPACKET     -------------------- */
-
-        case VNSPACKET:
-            sr_pkt = (c_packet_ethernet_header *)buf;
-
-            /* -- check if it is an ARP to another router if so drop   -- */
-            if ( sr_arp_req_not_for_us(sr,
-                    (buf+sizeof(c_packet_header)),
-                    len - sizeof(c_packet_ethernet_header) +
-                    sizeof(struct sr_ethernet_hdr),
-                    (char*)(buf + sizeof(c_base))) )
-            { break; }
+        /* -- frames sent in place must be out before the ring is reused -- */
+        sr_vns_tx_lock(sr);
+        ret = sr->tx_ring ? sr_vns_tx_flush(sr, 1) : 1;
+        sr_vns_tx_unlock(sr);
+        if(ret < 0)
+        { return -1; }
+    }
 
-            /* -- log packet -- */
-            sr_log_packet(sr, buf + sizeof(c_packet_header),
-                    ntohl(sr_pkt->mLen) - sizeof(c_packet_header));
+    /* -- compact: keep only the unparsed bytes, at the start, unless
+          frames still queued from the ring hold it where it is -- */
+    if(sr->tx_ring)
+    { return 0; }
+    if(sr->rx_head == sr->rx_tail)
+    { sr->rx_head = sr->rx_tail = 0; }
+    else if(SR_VNS_RX_RING - sr->rx_tail < SR_VNS_MAX_MSG)
+    {
+        memmove(sr->rx_buf, sr->rx_buf + sr->rx_head,
+                sr->rx_tail - sr->rx_head);
+        sr->rx_tail -= sr->rx_head;
+        sr->rx_head = 0;
+    }
+    return 0;
+} /* -- sr_vns_rx_room -- */
 
-            /* -- pass to router, student's code should take over here -- */
-            sr_handlepacket(sr,
-                    (buf+sizeof(c_packet_header)),
-                    len - sizeof(c_packet_ethernet_header) +
-                    sizeof(struct sr_ethernet_hdr),
-                    (char*)(buf + sizeof(c_base)));
+/*-----------------------------------------------------------------------------
+ * Method: sr_vns_rx_read(..)
+ * Scope: Local
+ *
+ * One recv() of as much as the socket has into the free end of the receive
+ * ring, which sr_vns_rx_room() has made.  Without 'wait' it does not
+ * block.
+ *
+ * RETURN VALUES:
+ *
+ *  bytes read (> 0) on success, 0 if the server closed the connection,
+ *  -1 on error, or with errno EAGAIN if there was nothing to read
+ *
+ *---------------------------------------------------------------------------*/
 
-            break;
+static int sr_vns_rx_read(struct sr_instance* sr /* borrowed */, int wait)
+{
+    int ret;
 
-            /* -------------        VNSCLOSE      -------------------- */
+    if(sr->seqpacket)
+    { return sr_vns_rx_records(sr, wait ? MSG_WAITFORONE : MSG_DONTWAIT); }
 
-        case VNSCLOSE:
-            fprintf(stderr,"VNS server closed session.\n");
-            fprintf(stderr,"Reason: %s\n",((c_close*)buf)->mErrorMessage);
-            sr_session_closed_help();
+    do
+    { /* -- just in case SIGALRM breaks recv -- */
+        ret = recv(sr->sockfd, sr->rx_buf + sr->rx_tail,
+                   SR_VNS_RX_RING - sr->rx_tail, wait ? 0 : MSG_DONTWAIT);
+    } while(ret == -1 && errno == EINTR); /* be mindful of signals */
+    sr->rx_reads++;
 
-            if(buf)
-            { free(buf); }
-            return 0;
-            break;
+    if(ret == -1)
+    {
+        if(errno == EAGAIN || errno == EWOULDBLOCK)
+        { return -1; }
+        perror("recv(..):sr_client.c::sr_read_from_server");
+        return -1;
+    }
+    sr->rx_tail += ret;
+    return ret;
+} /* -- sr_vns_rx_read -- */
 
-            /* -------------        VNSBANNER      -------------------- */
+/*-----------------------------------------------------------------------------
+ * Method: sr_vns_rx_fill(..)
+ * Scope: Local
+ *
+ * Make room on the receive ring, wait for input while writing what is
+ * queued, and read it.  Returns as sr_vns_rx_read().
+ *
+ *---------------------------------------------------------------------------*/
 
-        case VNSBANNER:
-            fprintf(stderr,"%s",((c_banner*)buf)->mBannerMessage);
-            break;
+static int sr_vns_rx_fill(struct sr_instance* sr /* borrowed */)
+{
+    if(sr_vns_rx_room(sr) < 0 || sr_vns_rx_wait(sr) < 0)
+    { return -1; }
 
-            /* -------------     VNSHWINFO     -------------------- */
+    return sr_vns_rx_read(sr, 1);
+} /* -- sr_vns_rx_fill -- */
 
-        case VNSHWINFO:
-            sr_handle_hwinfo(sr,(c_hwinfo*)buf);
-            if(sr_verify_routing_table(sr) != 0)
-            {
-                fprintf(stderr,"Routing table not consistent with hardware\n");
-                return -1;
+/*-----------------------------------------------------------------------------
+ * Method: sr_vns_rx_next(..)
+ * Scope: Local
+ *
+ * Take the next complete message off the receive ring.  The message is
+ * left where it is; *msg points into the ring and stays valid until the
+ * next sr_vns_rx_fill().
+ *
+ * RETURN VALUES:
+ *
+ *  1 if a message was taken, 0 if the ring holds no complete message,
+ *  -1 if the stream is corrupt
+ *
+ *---------------------------------------------------------------------------*/
+
+static int sr_vns_rx_next(struct sr_instance* sr /* borrowed */,
+                          uint8_t** msg, int* msg_len)
+{
+    uint32_t len;
+    unsigned int avail = sr->rx_tail - sr->rx_head;
+
+    if(avail < 8)
+    { return 0; }
+
+    memcpy(&len, sr->rx_buf + sr->rx_head, 4);
+    len = ntohl(len);
+
+    if ( len > SR_VNS_MAX_MSG || len < 8 )
+    {
+        fprintf(stderr,"Error: command length to large %u\n",len);
+        close(sr->sockfd);
+        return -1;
+    }
+
+    if(avail < len)
+    { return 0; }
+
+    *msg = sr->rx_buf + sr->rx_head;
+    *msg_len = len;
+    sr->rx_head += len;
+    sr->rx_msgs++;
+    return 1;
+} /* -- sr_vns_rx_next -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_vns_rx_frame(..)
+ * Scope: Local
+ *
+ * Hand one frame from the server, received on 'iface', to the router.
+ * The frame sits in the receive ring with its message or frame header in
+ * front of it, which is where a reply sent in place puts its own, and
+ * 'room' bytes of its message from its start on, which is all a reply
+ * sent in place may use behind it.
+ *
+ *---------------------------------------------------------------------------*/
+
+static void sr_vns_rx_frame(struct sr_instance* sr /* borrowed */,
+                            uint8_t* frame /* lent */, unsigned int len,
+                            unsigned int room,
+                            struct sr_if* iface /* borrowed */)
+{
+    /* -- check if it is an ARP to another router if so drop   -- */
+    if ( sr_arp_req_not_for_us(sr, frame, len, iface) )
+    { return; }
+
+    /* -- log packet -- */
+    sr_log_packet(sr, frame, len);
+
+    /* -- pass to router, student's code should take over here -- */
+    sr_reload_enter(sr);
+    sr->rx_frame = frame;
+    sr->rx_frame_room = room;
+    sr_handlepacket_ifindex(sr, frame, len, iface->ifindex);
+    sr->rx_frame = 0;
+    sr_reload_exit(sr);
+} /* -- sr_vns_rx_frame -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_vns_shm_open(..)
+ * Scope: Local
+ *
+ * Map the rings the server offers in a VNS_SHM message.  The file is
+ * removed once mapped; the server removes it too if we never get here.
+ *
+ *---------------------------------------------------------------------------*/
+
+static int sr_vns_shm_open(struct sr_instance* sr /* borrowed */,
+                           c_shm* msg /* borrowed */)
+{
+    char path[sizeof(msg->mPath) + 1];
+    uint32_t size = ntohl(msg->mSize);
+    size_t len = 2 * (sizeof(c_shm_ring) + (size_t)size);
+    struct stat st;
+    uint8_t* base;
+    int fd;
+
+    memcpy(path, msg->mPath, sizeof(msg->mPath));
+    path[sizeof(msg->mPath)] = 0;
+
+    if(size < 4096 || (size & (size - 1)) != 0)
+    {
+        fprintf(stderr, "Error: VNS_SHM rings of %u bytes\n", size);
+        return -1;
+    }
+    if((fd = open(path, O_RDWR)) < 0)
+    {
+        perror("open(..):sr_vns_comm.c::sr_vns_shm_open");
+        return -1;
+    }
+    if(fstat(fd, &st) != 0 || (size_t)st.st_size != len)
+    {
+        fprintf(stderr, "Error: %s is not two rings of %u bytes\n", path, size);
+        close(fd);
+        return -1;
+    }
+    base = (uint8_t*)mmap(0, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if(base == MAP_FAILED)
+    {
+        perror("mmap(..):sr_vns_comm.c::sr_vns_shm_open");
+        return -1;
+    }
+    unlink(path);
+
+    sr_vns_tx_lock(sr);
+    sr->shm = base;
+    sr->shm_len = len;
+    sr->shm_size = size;
+    sr->shm_rx = (c_shm_ring*)base;
+    sr->shm_tx = (c_shm_ring*)(base + sizeof(c_shm_ring) + size);
+    sr->shm_tx_head = sr->shm_tx->head;
+    sr_vns_tx_unlock(sr);
+
+    printf("Frames through shared memory %s, %u bytes each way\n", path, size);
+    return 0;
+} /* -- sr_vns_shm_open -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_vns_shm_wake(..)
+ * Scope: Local
+ *
+ * After moving a ring's head: wake its consumer if it may be asleep.
+ *
+ *---------------------------------------------------------------------------*/
+
+static void sr_vns_shm_wake(c_shm_ring* ring /* borrowed */)
+{
+    /* -- head before 'sleeping', the consumer sets them the other way -- */
+    __sync_synchronize();
+    if(ring->sleeping)
+    {
+        __sync_fetch_and_add(&(ring->wake), 1);
+        syscall(SYS_futex, &(ring->wake), FUTEX_WAKE, 1, 0, 0, 0);
+    }
+} /* -- sr_vns_shm_wake -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_vns_dispatch(..)
+ * Scope: Local
+ *
+ * Handle one message from the server.  buf is the whole message, length
+ * field included, in the receive ring.
+ *
+ *---------------------------------------------------------------------------*/
+
+static int sr_vns_dispatch(struct sr_instance* sr /* borrowed */,
+                           uint8_t* buf /* lent */, int len,
+                           int expected_cmd)
+{
+    int command, ret;
+    c_packet_ethernet_header* sr_pkt = 0;
+    c_frame_header* fh = 0;
+    unsigned int off, hlen = 0, flen = 0;
+    struct sr_if* iface = 0;
+
+    /* My entry for most unreadable line of code - guido */
+    /* ... you win - mc                                  */
+    command = *(((int *)buf)+1) = ntohl(*(((int *)buf)+1));
+
+    /* make sure the command is what we expected if we were expecting something */
+    if(expected_cmd && command!=expected_cmd) {
+        if(command != VNSCLOSE) { /* VNSCLOSE is always ok */
+            fprintf(stderr, "Error: expected command %d but got %d\n", expected_cmd, command);
+            return -1;
+        }
+    }
+
+    ret = 1;
+    switch (command)
+    {
+        /* -------------        VNSPACKET     -------------------- */
+
+        case VNSPACKET:
+            sr_pkt = (c_packet_ethernet_header *)buf;
+
+            /* -- the one name lookup; the router works on the ifindex -- */
+            iface = sr_get_interface(sr, sr_pkt->mInterfaceName);
+            if ( iface == 0 )
+            {
+                fprintf(stderr, "** Error, packet on unknown interface %.16s\n",
+                        sr_pkt->mInterfaceName);
+                break;
+            }
+
+            sr_vns_rx_frame(sr, buf + sizeof(c_packet_header),
+                    len - sizeof(c_packet_header),
+                    len - sizeof(c_packet_header), iface);
+            break;
+
+            /* -------------        VNS_PACKETS   -------------------- */
+
+        case VNS_PACKETS:
+            /* -- the server takes them too: send ours batched -- */
+            if(!sr->vns_batch)
+            {
+                sr_vns_tx_lock(sr);
+                sr->vns_batch = 1;
+                sr_vns_tx_unlock(sr);
+            }
+
+            for(off = sizeof(c_base); off + sizeof(c_frame_header) <= len;
+                off += VNS_PACKETS_ALIGN(hlen + flen))
+            {
+                fh = (c_frame_header*)(buf + off);
+                flen = ntohs(fh->mLen);
+                hlen = sizeof(c_frame_header) +
+                    ((fh->mFlags & VNS_FRAME_TIMESTAMP) ? sizeof(uint64_t) : 0);
+                if(off + hlen + flen > (unsigned int)len)
+                {
+                    fprintf(stderr, "** Error, frame runs past the end of "
+                            "its batch\n");
+                    break;
+                }
+                iface = sr_get_interface_by_index(sr, fh->mIfIndex);
+                if(iface == 0)
+                {
+                    fprintf(stderr, "** Error, packet on unknown interface "
+                            "%u\n", fh->mIfIndex);
+                    continue;
+                }
+                sr->rx_batched++;
+                sr_vns_rx_frame(sr, buf + off + hlen, flen,
+                                len - off - hlen, iface);
             }
+            break;
+
+            /* -------------        VNS_SHM       -------------------- */
+
+        case VNS_SHM:
+            if(len < (int)sizeof(c_shm) || sr_vns_shm_open(sr, (c_shm*)buf) != 0)
+            { return -1; }
+            break;
+
+            /* -------------        VNS_CREDIT    -------------------- */
+
+        case VNS_CREDIT:
+            /* -- the server keeps to our grants: count from this one -- */
+            sr->vns_credit = 1;
+            sr->rx_credit_used = 0;
+            sr->rx_credit_limit = 0;
+            break;
+
+            /* -------------        VNSCLOSE      -------------------- */
+
+        case VNSCLOSE:
+            fprintf(stderr,"VNS server closed session.\n");
+            fprintf(stderr,"Reason: %s\n",((c_close*)buf)->mErrorMessage);
+            sr_session_closed_help();
+
+            return 0;
+            break;
+
+            /* -------------        VNSBANNER      -------------------- */
+
+        case VNSBANNER:
+            fprintf(stderr,"%s",((c_banner*)buf)->mBannerMessage);
+            break;
+
+            /* -------------     VNSHWINFO     -------------------- */
+
+        case VNSHWINFO:
+            if(sr_apply_hwinfo(sr,(c_hwinfo*)buf) != 0)
+            { return -1; }
             printf(" <-- Ready to process packets --> \n");
             break;
 
@@ -489,123 +1117,1140 @@ int sr_read_from_server_expect(struct sr_instance* sr /* borrowed */, int expect
                 ret = -1;
             break;
 
-            /* ------------- VNS_AUTH_STATUS -------------- */
-        case VNS_AUTH_STATUS:
-            if(!sr_handle_auth_status(sr, (c_auth_status*)buf))
-                ret = -1;
-            break;
+            /* ------------- VNS_AUTH_STATUS -------------- */
+        case VNS_AUTH_STATUS:
+            if(!sr_handle_auth_status(sr, (c_auth_status*)buf))
+                ret = -1;
+            break;
+
+        default:
+            Debug("unknown command: %d\n", command);
+            break;
+
+    }/* -- switch -- */
+
+    return ret;
+} /* -- sr_vns_dispatch -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_vns_shm_read(..)
+ * Scope: Local
+ *
+ * sr_read_from_server() once frames come through shared memory: handle
+ * up to SR_VNS_SHM_BATCH of them, freeing each as it is done with, and
+ * write what they produced.  With none waiting, sleep on the ring until
+ * the server wakes us or SR_VNS_SHM_IDLE_MS passes; the server's Python
+ * cannot order its own writes and reads, so a wakeup may be missed.
+ * Messages on the socket are left to the caller.
+ *
+ * RETURN VALUES:
+ *
+ *  1 if the socket has input, 0 if not, -1 on error
+ *
+ *---------------------------------------------------------------------------*/
+
+static int sr_vns_shm_read(struct sr_instance* sr /* borrowed */)
+{
+    c_shm_ring* rx = sr->shm_rx;
+    uint8_t* data = sr->shm + sizeof(c_shm_ring);
+    uint32_t tail = rx->tail, mask = sr->shm_size - 1;
+    uint32_t wake, off, hlen, flen;
+    c_frame_header* fh;
+    struct sr_if* iface;
+    struct pollfd pfd;
+    struct timespec ts;
+    unsigned int n;
+    int ret;
+
+    for(n = 0; n < SR_VNS_SHM_BATCH && rx->head != tail; n++)
+    {
+        __sync_synchronize(); /* -- the record after head -- */
+        off = tail & mask;
+        fh = (c_frame_header*)(data + off);
+        if(fh->mFlags & VNS_FRAME_WRAP)
+        {
+            rx->tail = tail += sr->shm_size - off;
+            continue;
+        }
+        flen = ntohs(fh->mLen);
+        hlen = sizeof(c_frame_header) +
+            ((fh->mFlags & VNS_FRAME_TIMESTAMP) ? sizeof(uint64_t) : 0);
+        if(hlen + flen > sr->shm_size - off)
+        {
+            fprintf(stderr, "Error: frame runs past the end of the ring\n");
+            return -1;
+        }
+        if((iface = sr_get_interface_by_index(sr, fh->mIfIndex)) != 0)
+        {
+            sr->shm_rx_frames++;
+            sr_vns_rx_frame(sr, data + off + hlen, flen,
+                            sr->shm_size - off - hlen, iface);
+        }
+        else
+        { fprintf(stderr, "** Error, packet on unknown interface %u\n",
+                  fh->mIfIndex); }
+        rx->tail = tail += VNS_PACKETS_ALIGN(hlen + flen);
+    }
+
+    sr_vns_tx_lock(sr);
+    ret = sr_vns_shm_flush(sr);
+    if(ret == 0)
+    { ret = sr_vns_tx_flush(sr, 0) < 0 ? -1 : 0; }
+    sr_vns_tx_unlock(sr);
+    if(ret < 0)
+    { return -1; }
+
+    pfd.fd = sr->sockfd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    if(n == 0)
+    {
+        wake = rx->wake;
+        rx->sleeping = 1;
+        __sync_synchronize();
+        if(rx->head == tail && poll(&pfd, 1, 0) == 0)
+        {
+            ts.tv_sec = 0;
+            ts.tv_nsec = SR_VNS_SHM_IDLE_MS * 1000000L;
+            syscall(SYS_futex, &(rx->wake), FUTEX_WAIT, wake, &ts, 0, 0);
+            sr->shm_sleeps++;
+        }
+        rx->sleeping = 0;
+    }
+    if(poll(&pfd, 1, 0) == -1 && errno != EINTR)
+    {
+        perror("poll(..):sr_vns_comm.c::sr_vns_shm_read");
+        return -1;
+    }
+    return pfd.revents != 0;
+} /* -- sr_vns_shm_read -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_vns_rx_handle(..)
+ * Scope: Local
+ *
+ * Handle msg, just taken off the receive ring, and every complete message
+ * after it; then write what they produced, and more credit.  Past
+ * SR_VNS_TX_HIWAT queued bytes, the threaded loop waits for the socket to
+ * take them; the event loop (sr -E) stops and leaves the rest of the
+ * messages on the ring for a round in which it has room.
+ *
+ * RETURN VALUES:
+ *
+ *  1 on success, 0 if the server closed the session, -1 on error
+ *
+ *---------------------------------------------------------------------------*/
+
+static int sr_vns_rx_handle(struct sr_instance* sr /* borrowed */,
+                            uint8_t* msg /* lent */, int len)
+{
+    int ret = 1;
+
+    while(ret == 1)
+    {
+        if((ret = sr_vns_dispatch(sr, msg, len, 0)) != 1)
+        { return ret; }
+        sr->rx_credit_used += len;
+
+        /* -- backpressure: no more input until the server takes output -- */
+        if(sr->one_thread && sr->tx_pending > SR_VNS_TX_HIWAT)
+        { break; }
+        sr_vns_tx_lock(sr);
+        if(sr->tx_pending > SR_VNS_TX_HIWAT)
+        { ret = sr_vns_tx_flush(sr, 1); }
+        sr_vns_tx_unlock(sr);
+        if(ret < 0)
+        { return -1; }
+
+        ret = sr_vns_rx_next(sr, &msg, &len);
+    }
+    if(ret < 0)
+    { return -1; }
+
+    /* -- end of the batch: write what it produced, and more credit -- */
+    sr_vns_tx_lock(sr);
+    ret = sr_vns_tx_credit(sr);
+    if(ret == 0)
+    { ret = sr_vns_tx_flush(sr, 0); }
+    sr_vns_tx_unlock(sr);
+
+    return ret < 0 ? -1 : 1;
+} /* -- sr_vns_rx_handle -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_read_from_server(..)
+ * Scope: global
+ *
+ * Houses main while loop for communicating with the virtual router server.
+ *
+ *---------------------------------------------------------------------------*/
+
+int sr_read_from_server(struct sr_instance* sr /* borrowed */)
+{
+    uint8_t* msg;
+    int len, ret;
+
+    /* REQUIRES */
+    assert(sr);
+
+    /* -- frames come through shared memory once we have interfaces, the
+          socket only if it has something; a partial message there is
+          waited for -- */
+    if(sr->shm && sr->if_list && sr->rx_head == sr->rx_tail &&
+       (ret = sr_vns_shm_read(sr)) != 1)
+    { return ret < 0 ? -1 : 1; }
+
+    /* -- one read for everything the socket has, then every complete
+          message in it -- */
+    while((ret = sr_vns_rx_next(sr, &msg, &len)) == 0)
+    {
+        if((ret = sr_vns_rx_fill(sr)) <= 0)
+        {
+            if(ret == 0)
+            { fprintf(stderr,"VNS server closed the connection.\n"); }
+            return -1;
+        }
+    }
+
+    if(ret < 0)
+    { return -1; }
+
+    return sr_vns_rx_handle(sr, msg, len);
+}
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_vns_epoll_run(..)
+ * Scope: Global
+ *
+ * The whole router in one thread (sr -E): the VNS socket, a timerfd for
+ * the ARP timers and a signalfd for SIGHUP, SIGINT and SIGTERM in one
+ * epoll set.  Each round handles every complete message on the receive
+ * ring, runs the ARP timers that are due, writes what was queued and
+ * moves the timerfd up if the next timer did; then it waits and takes
+ * what is ready: one read from the socket, a routing table reload, or the
+ * end.  sr_init() starts no thread for this, and nothing takes a lock.
+ *
+ * Nothing here blocks but epoll_wait().  Output the socket does not take
+ * waits for EPOLLOUT; past SR_VNS_TX_HIWAT queued bytes, or with the
+ * ring held by frames sent from it, the round handles and reads nothing
+ * until the socket takes more.
+ *
+ * RETURN VALUES:
+ *
+ *  0 if the server closed the session or a signal stopped the router,
+ *  -1 on error
+ *
+ *---------------------------------------------------------------------------*/
+
+int sr_vns_epoll_run(struct sr_instance* sr /* borrowed */)
+{
+    struct epoll_event ev, evs[3];
+    struct signalfd_siginfo si;
+    struct itimerspec its;
+    sigset_t set;
+    uint64_t next, armed = 0, expired;
+    uint32_t events = EPOLLIN, want;
+    unsigned long wakeups = 0, reloads = 0;
+    uint8_t* msg;
+    int ep = -1, tfd = -1, sfd = -1, len, n, i, ret = -1;
+
+    /* REQUIRES */
+    assert(sr);
+    assert(sr->one_thread);
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGHUP);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGTERM);
+    if(sigprocmask(SIG_BLOCK, &set, 0) != 0 ||
+       (sfd = signalfd(-1, &set, SFD_NONBLOCK | SFD_CLOEXEC)) < 0 ||
+       (tfd = timerfd_create(CLOCK_MONOTONIC,
+                             TFD_NONBLOCK | TFD_CLOEXEC)) < 0 ||
+       (ep = epoll_create1(EPOLL_CLOEXEC)) < 0)
+    {
+        perror("sr_vns_comm.c::sr_vns_epoll_run");
+        goto out;
+    }
+    ev.events = EPOLLIN;
+    ev.data.fd = sr->sockfd;
+    n = epoll_ctl(ep, EPOLL_CTL_ADD, sr->sockfd, &ev);
+    ev.data.fd = tfd;
+    n |= epoll_ctl(ep, EPOLL_CTL_ADD, tfd, &ev);
+    ev.data.fd = sfd;
+    n |= epoll_ctl(ep, EPOLL_CTL_ADD, sfd, &ev);
+    if(n != 0)
+    {
+        perror("epoll_ctl(..):sr_vns_comm.c::sr_vns_epoll_run");
+        goto out;
+    }
+
+    for(;;)
+    {
+        /* -- every complete message, the last read may have ended in
+              the middle of one; none while output is backed up -- */
+        if(sr_vns_tx_pending(sr) <= SR_VNS_TX_HIWAT &&
+           ((ret = sr_vns_rx_next(sr, &msg, &len)) < 0 ||
+            (ret == 1 && (ret = sr_vns_rx_handle(sr, msg, len)) != 1)))
+        { goto out; }
+
+        /* -- the ARP timers that are due, then write what the round
+              queued; wait for room if the socket is full, and read no
+              more while it stays backed up -- */
+        next = sr_arpcache_run_timers(sr);
+        sr_vns_tx_lock(sr);
+        ret = sr_vns_tx_credit(sr);
+        if(ret == 0)
+        { ret = sr_vns_tx_flush(sr, 0); }
+        sr_vns_tx_unlock(sr);
+        if(ret < 0)
+        { goto out; }
+
+        want = (ret == 0 ? EPOLLOUT : 0) |
+               (sr_vns_tx_pending(sr) > SR_VNS_TX_HIWAT ||
+                !sr_vns_rx_can_fill(sr) ? 0 : EPOLLIN);
+        if(want != events)
+        {
+            ev.events = events = want;
+            ev.data.fd = sr->sockfd;
+            epoll_ctl(ep, EPOLL_CTL_MOD, sr->sockfd, &ev);
+        }
+        /* -- a timer due later than the armed one costs a spare round -- */
+        if(next && (armed == 0 || next < armed))
+        {
+            memset(&its, 0, sizeof(its));
+            its.it_value.tv_sec = next / 1000;
+            its.it_value.tv_nsec = (next % 1000) * 1000000;
+            timerfd_settime(tfd, TFD_TIMER_ABSTIME, &its, 0);
+            armed = next;
+        }
+
+        if((n = epoll_wait(ep, evs, 3, -1)) < 0)
+        {
+            if(errno == EINTR)
+            { continue; }
+            perror("epoll_wait(..):sr_vns_comm.c::sr_vns_epoll_run");
+            ret = -1;
+            goto out;
+        }
+        wakeups++;
+
+        for(i = 0; i < n; i++)
+        {
+            if(evs[i].data.fd == tfd)
+            {
+                if(read(tfd, &expired, sizeof(expired)) > 0)
+                { armed = 0; }
+            }
+            else if(evs[i].data.fd == sfd)
+            {
+                while(read(sfd, &si, sizeof(si)) == sizeof(si))
+                {
+                    if(si.ssi_signo != SIGHUP)
+                    {
+                        fprintf(stderr, "%s, stopping\n",
+                                strsignal(si.ssi_signo));
+                        ret = 0;
+                        goto out;
+                    }
+                    printf("SIGHUP: reloading routing table\n");
+                    sr_reload_rt(sr);
+                    reloads++;
+                }
+            }
+            else if((events & EPOLLIN) &&
+                    (evs[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+            {
+                /* -- one read, its messages are handled next round -- */
+                if((ret = sr_vns_rx_room(sr)) < 0 ||
+                   (ret = sr_vns_rx_read(sr, 0)) <= 0)
+                {
+                    if(ret < 0 && errno == EAGAIN)
+                    { continue; }
+                    if(ret == 0)
+                    { fprintf(stderr,"VNS server closed the connection.\n"); }
+                    ret = -1;
+                    goto out;
+                }
+            }
+        }
+    }
+
+out:
+    fprintf(stderr, "Event loop: %lu wakeups, %lu routing table reloads\n",
+            wakeups, reloads);
+    if(ep >= 0)
+    { close(ep); }
+    if(tfd >= 0)
+    { close(tfd); }
+    if(sfd >= 0)
+    { close(sfd); }
+    return ret == 0 ? 0 : -1;
+} /* -- sr_vns_epoll_run -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_read_from_server_expect(..)
+ * Scope: Global
+ *
+ * Handle exactly one message, which must be expected_cmd (or VNSCLOSE).
+ * Used while the session is set up; later messages stay on the ring.
+ *
+ *---------------------------------------------------------------------------*/
+
+int sr_read_from_server_expect(struct sr_instance* sr /* borrowed */, int expected_cmd)
+{
+    uint8_t* msg;
+    int len, ret;
+
+    /* REQUIRES */
+    assert(sr);
+
+    while((ret = sr_vns_rx_next(sr, &msg, &len)) == 0)
+    {
+        if((ret = sr_vns_rx_fill(sr)) <= 0)
+        {
+            if(ret == 0)
+            { fprintf(stderr,"VNS server closed the connection.\n"); }
+            return -1;
+        }
+    }
+    if(ret < 0)
+    { return -1; }
+
+    return sr_vns_dispatch(sr, msg, len, expected_cmd);
+}/* -- sr_read_from_server -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_ether_addrs_match_interface(..)
+ * Scope: Local
+ *
+ * Make sure ethernet addresses are sane so we don't muck uo the system.
+ *
+ *----------------------------------------------------------------------------*/
+
+static int
+sr_ether_addrs_match_interface( struct sr_instance* sr, /* borrowed */
+                                uint8_t* buf, /* borrowed */
+                                struct sr_if* iface /* borrowed */ )
+{
+    struct sr_ethernet_hdr* ether_hdr = 0;
+
+    /* -- REQUIRES -- */
+    assert(sr);
+    assert(buf);
+    assert(iface);
+
+    ether_hdr = (struct sr_ethernet_hdr*)buf;
+
+    if ( memcmp( ether_hdr->ether_shost, iface->addr, ETHER_ADDR_LEN) != 0 ){
+        fprintf( stderr, "** Error, source address does not match interface\n");
+        return 0;
+    }
+
+    /* TODO */
+    /* Check destination, hardware address.  If it is private (i.e. destined
+     * to a virtual interface) ensure it is going to the correct topology
+     * Note: This check should really be done server side ...
+     */
+
+    return 1;
+
+} /* -- sr_ether_addrs_match_interface -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_vns_tx_write_records(..)
+ * Scope: Local
+ *
+ * sr_vns_tx_write() for a SEQPACKET socket: every message, from an entry
+ * marked as its start to the next, goes out as one record, as many as
+ * the socket takes in one sendmmsg().  A record is sent whole or not at
+ * all.  tx_lock held.
+ *
+ *---------------------------------------------------------------------------*/
+
+static int sr_vns_tx_write_records(struct sr_instance* sr /* borrowed */)
+{
+    unsigned int i, j, count;
+    int n;
+
+    while(sr->tx_first < sr->tx_niov)
+    {
+        /* -- a message runs from its start to the next one -- */
+        count = 0;
+        for(i = sr->tx_first; i < sr->tx_niov; i = j)
+        {
+            for(j = i + 1; j < sr->tx_niov && !sr->tx_start[j]; j++)
+                ;
+            memset(&(sr->tx_msgs[count]), 0, sizeof(struct mmsghdr));
+            sr->tx_msgs[count].msg_hdr.msg_iov = &(sr->tx_iov[i]);
+            sr->tx_msgs[count].msg_hdr.msg_iovlen = j - i;
+            count++;
+        }
+
+        n = sendmmsg(sr->sockfd, sr->tx_msgs, count, MSG_DONTWAIT);
+        if(n == -1)
+        {
+            if(errno == EINTR)
+            { continue; }
+            if(errno == EAGAIN || errno == EWOULDBLOCK)
+            { return 0; }
+            perror("sendmmsg(..):sr_vns_comm.c::sr_vns_tx_write_records");
+            return -1;
+        }
+        sr->tx_writes++;
+
+        for(i = 0; i < (unsigned int)n; i++)
+        {
+            for(j = 0; j < sr->tx_msgs[i].msg_hdr.msg_iovlen; j++)
+            {
+                sr->tx_pending -= sr->tx_iov[sr->tx_first].iov_len;
+                sr_pktbuf_free(sr->tx_owner[sr->tx_first]);
+                sr->tx_owner[sr->tx_first] = 0;
+                sr->tx_first++;
+            }
+        }
+    }
+
+    sr->tx_first = sr->tx_niov = 0;
+    sr->tx_used = 0;
+    sr->tx_ring = 0;
+    return 1;
+} /* -- sr_vns_tx_write_records -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_vns_tx_done(..)
+ * Scope: Local
+ *
+ * Drop n written bytes off the head of the transmit queue; the last frame
+ * may be cut short.  tx_lock held.
+ *
+ *---------------------------------------------------------------------------*/
+
+static void sr_vns_tx_done(struct sr_instance* sr /* borrowed */, size_t n)
+{
+    sr->tx_pending -= n;
+
+    while(n > 0)
+    {
+        struct iovec* iov = &(sr->tx_iov[sr->tx_first]);
+        if(n >= iov->iov_len)
+        {
+            n -= iov->iov_len;
+            /* -- written: a buffer handed over goes back -- */
+            sr_pktbuf_free(sr->tx_owner[sr->tx_first]);
+            sr->tx_owner[sr->tx_first] = 0;
+            sr->tx_first++;
+        }
+        else
+        {
+            iov->iov_base = (uint8_t*)iov->iov_base + n;
+            iov->iov_len -= n;
+            n = 0;
+        }
+    }
+} /* -- sr_vns_tx_done -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_vns_tx_write(..)
+ * Scope: Local
+ *
+ * Write as much of the transmit queue as the socket takes without
+ * blocking, in one sendmsg() per SR_VNS_TX_IOV frames.  A partial write
+ * leaves the rest of the frame at the head of the queue.  tx_lock held.
+ *
+ * RETURN VALUES:
+ *
+ *  1 if the queue is now empty, 0 if the socket is full, -1 on error
+ *
+ *---------------------------------------------------------------------------*/
+
+static int sr_vns_tx_write(struct sr_instance* sr /* borrowed */)
+{
+    struct msghdr msg;
+    ssize_t n;
+
+    /* -- a batch being written can take no more frames -- */
+    sr->tx_batch = 0;
+
+    if(sr->seqpacket)
+    { return sr_vns_tx_write_records(sr); }
+
+    while(sr->tx_first < sr->tx_niov)
+    {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = sr->tx_iov + sr->tx_first;
+        msg.msg_iovlen = sr->tx_niov - sr->tx_first;
+
+        n = sendmsg(sr->sockfd, &msg, MSG_DONTWAIT);
+        if(n == -1)
+        {
+            if(errno == EINTR)
+            { continue; }
+            if(errno == EAGAIN || errno == EWOULDBLOCK)
+            { return 0; }
+            perror("sendmsg(..):sr_vns_comm.c::sr_vns_tx_write");
+            return -1;
+        }
+        sr->tx_writes++;
+        sr_vns_tx_done(sr, n);
+    }
+
+    sr->tx_first = sr->tx_niov = 0;
+    sr->tx_used = 0;
+    sr->tx_ring = 0;
+    return 1;
+} /* -- sr_vns_tx_write -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_vns_tx_flush(..)
+ * Scope: Local
+ *
+ * Write the transmit queue.  With 'wait' set, poll until all of it is
+ * written; this is how a full queue holds up whoever is adding to it.
+ * tx_lock held.
+ *
+ *---------------------------------------------------------------------------*/
+
+static int sr_vns_tx_flush(struct sr_instance* sr /* borrowed */, int wait)
+{
+    struct pollfd pfd;
+    int ret;
+
+    while((ret = sr_vns_tx_write(sr)) == 0 && wait)
+    {
+        sr->tx_stalls++;
+        pfd.fd = sr->sockfd;
+        pfd.events = POLLOUT;
+        if(poll(&pfd, 1, -1) == -1 && errno != EINTR)
+        {
+            perror("poll(..):sr_vns_comm.c::sr_vns_tx_flush");
+            return -1;
+        }
+    }
+    return ret;
+} /* -- sr_vns_tx_flush -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_vns_tx_append(..)
+ * Scope: Local
+ *
+ * Queue len bytes at base, extending the last entry if they follow it
+ * (frames copied one after another, or handled one after another in the
+ * receive ring, go out as one) unless every message must be a record of
+ * its own.  'owner', if set, is the packet buffer
+ * holding them, freed once they are written.  tx_lock held, an entry free.
+ *
+ *---------------------------------------------------------------------------*/
+
+static void sr_vns_tx_append(struct sr_instance* sr /* borrowed */,
+                             uint8_t* base, unsigned int len,
+                             struct sr_pktbuf* owner /* owned */,
+                             int start)
+{
+    struct iovec* last = sr->tx_niov > sr->tx_first ?
+        &(sr->tx_iov[sr->tx_niov - 1]) : 0;
+
+    if(last && owner == 0 && !(start && sr->seqpacket) &&
+       sr->tx_owner[sr->tx_niov - 1] == 0 &&
+       (uint8_t*)last->iov_base + last->iov_len == base)
+    { last->iov_len += len; }
+    else
+    {
+        sr->tx_iov[sr->tx_niov].iov_base = base;
+        sr->tx_iov[sr->tx_niov].iov_len = len;
+        sr->tx_owner[sr->tx_niov] = owner;
+        sr->tx_start[sr->tx_niov] = start;
+        sr->tx_niov++;
+    }
+    sr->tx_pending += len;
+} /* -- sr_vns_tx_append -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_vns_tx_batch(..)
+ * Scope: Local
+ *
+ * See that the open VNS_PACKETS message can take a frame record of
+ * 'total' bytes, starting a new one in the arena if there is none or the
+ * record would take it past SR_VNS_MAX_MSG.  tx_lock held, room made.
+ *
+ *---------------------------------------------------------------------------*/
+
+static void sr_vns_tx_batch(struct sr_instance* sr /* borrowed */,
+                            unsigned int total)
+{
+    c_base* base;
+
+    if(sr->tx_batch == 0 || sr->tx_batch_len + total > SR_VNS_MAX_MSG)
+    {
+        base = (c_base*)(sr->tx_buf + sr->tx_used);
+        base->mType = htonl(VNS_PACKETS);
+        sr->tx_used += sizeof(c_base);
+        sr->tx_batch = (uint8_t*)base;
+        sr->tx_batch_len = sizeof(c_base);
+        ((c_base*)sr->tx_batch)->mLen = htonl(sr->tx_batch_len);
+        sr_vns_tx_append(sr, (uint8_t*)base, sizeof(c_base), 0, 1);
+    }
+} /* -- sr_vns_tx_batch -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_vns_tx_frame(..)
+ * Scope: Local
+ *
+ * Queue the frame at 'frame', writing its header into the bytes in front
+ * of it: a c_frame_header in the open batch if the server takes batches,
+ * a whole VNSPACKET header otherwise.  A batched frame is padded to
+ * VNS_PACKETS_ALIGN with zeroes, which must fit after it.  tx_lock held,
+ * room made.
+ *
+ *---------------------------------------------------------------------------*/
+
+static void sr_vns_tx_frame(struct sr_instance* sr /* borrowed */,
+                            uint8_t* frame, unsigned int len,
+                            struct sr_if* iface /* borrowed */,
+                            struct sr_pktbuf* owner /* owned */)
+{
+    c_packet_header* sr_pkt;
+    c_frame_header* fh;
+    unsigned int total;
+
+    if(sr->vns_batch)
+    {
+        total = VNS_PACKETS_ALIGN(sizeof(c_frame_header) + len);
+        sr_vns_tx_batch(sr, total);
+        fh = (c_frame_header*)(frame - sizeof(c_frame_header));
+        fh->mLen = htons(len);
+        fh->mIfIndex = iface->ifindex;
+        fh->mFlags = 0;
+        memset(frame + len, 0, total - sizeof(c_frame_header) - len);
+        sr->tx_batch_len += total;
+        ((c_base*)sr->tx_batch)->mLen = htonl(sr->tx_batch_len);
+        sr_vns_tx_append(sr, (uint8_t*)fh, total, owner, 0);
+    }
+    else
+    {
+        total = len + sizeof(c_packet_header);
+        sr_pkt = (c_packet_header*)(frame - sizeof(c_packet_header));
+        sr_pkt->mLen  = htonl(total);
+        sr_pkt->mType = htonl(VNSPACKET);
+        strncpy(sr_pkt->mInterfaceName,iface->name,16);
+        sr_vns_tx_append(sr, (uint8_t*)sr_pkt, total, owner, 1);
+    }
+    sr->tx_frames++;
+} /* -- sr_vns_tx_frame -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_vns_tx_pending(..)
+ * Scope: Local
+ *
+ *---------------------------------------------------------------------------*/
+
+static unsigned int sr_vns_tx_pending(struct sr_instance* sr /* borrowed */)
+{
+    unsigned int pending;
+
+    sr_vns_tx_lock(sr);
+    pending = sr->tx_pending;
+    sr_vns_tx_unlock(sr);
+    return pending;
+} /* -- sr_vns_tx_pending -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_vns_flush(..)
+ * Scope: Global
+ *
+ * Write out every queued frame, waiting for the socket if it is full.
+ * For senders outside the receive loop, which flushes on its own.
+ *
+ *---------------------------------------------------------------------------*/
+
+int sr_vns_flush(struct sr_instance* sr /* borrowed */)
+{
+    int ret;
+
+    /* REQUIRES */
+    assert(sr);
+
+    if(sr->io)
+    { return sr->io->flush ? sr->io->flush(sr) : 0; }
+
+    /* -- an event loop writes the queue at the end of its round -- */
+    if(sr->uring || sr->one_thread)
+    { return 0; }
+
+    sr_vns_tx_lock(sr);
+    sr_vns_shm_flush(sr);
+    ret = sr_vns_tx_flush(sr, 1);
+    sr_vns_tx_unlock(sr);
+    return ret < 0 ? -1 : 0;
+} /* -- sr_vns_flush -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_vns_tx_check(..)
+ * Scope: Local
+ *
+ * Checks and logging common to every frame sent.  Returns the outgoing
+ * interface, or 0 if the frame must not be sent.
+ *
+ *---------------------------------------------------------------------------*/
+
+static struct sr_if* sr_vns_tx_check(struct sr_instance* sr /* borrowed */,
+                                     uint8_t* buf /* borrowed */,
+                                     unsigned int len,
+                                     unsigned int ifindex)
+{
+    struct sr_if* iface = 0;
+
+    /* don't waste my time ... */
+    if ( len < sizeof(struct sr_ethernet_hdr) ){
+        fprintf(stderr , "** Error: packet is wayy to short \n");
+        return 0;
+    }
+
+    iface = sr_get_interface_by_index(sr, ifindex);
+    if ( iface == 0 ){
+        fprintf( stderr, "** Error, interface %u, does not exist\n", ifindex);
+        return 0;
+    }
+
+    /* -- log packet -- */
+    sr_log_packet(sr,buf,len);
+
+    if ( ! sr_ether_addrs_match_interface( sr, buf, iface) ){
+        fprintf( stderr, "*** Error: problem with ethernet header, check log\n");
+        return 0;
+    }
+
+    return iface;
+} /* -- sr_vns_tx_check -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_vns_tx_room(..)
+ * Scope: Local
+ *
+ * Make room in the transmit queue for one more frame and, if 'copy' is
+ * non-zero, for that many bytes in the arena, besides the header of a new
+ * batch.  Waits for the socket if the
+ * queue is full.  tx_lock held.
+ *
+ *---------------------------------------------------------------------------*/
+
+static int sr_vns_tx_room(struct sr_instance* sr /* borrowed */,
+                          unsigned int copy)
+{
+    if(sr->tx_buf == 0)
+    {
+        sr->tx_buf = (uint8_t*)malloc(SR_VNS_TX_BUF);
+        sr->tx_iov = (struct iovec*)malloc(SR_VNS_TX_IOV *
+                                           sizeof(struct iovec));
+        sr->tx_owner = (struct sr_pktbuf**)calloc(SR_VNS_TX_IOV,
+                                           sizeof(struct sr_pktbuf*));
+        sr->tx_start = (uint8_t*)malloc(SR_VNS_TX_IOV);
+        assert(sr->tx_buf && sr->tx_iov && sr->tx_owner && sr->tx_start);
+        if(sr->seqpacket)
+        {
+            sr->tx_msgs = (struct mmsghdr*)malloc(SR_VNS_TX_IOV *
+                                                  sizeof(struct mmsghdr));
+            assert(sr->tx_msgs);
+        }
+    }
+
+    /* -- a batched frame may need a new VNS_PACKETS header as well -- */
+    if(sr->vns_batch)
+    { copy += sizeof(c_base); }
+
+    if(sr->tx_niov + 2 > SR_VNS_TX_IOV ||
+       sr->tx_used + copy > SR_VNS_TX_BUF)
+    { return sr_vns_tx_flush(sr, 1) < 0 ? -1 : 0; }
+    return 0;
+} /* -- sr_vns_tx_room -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_vns_tx_credit(..)
+ * Scope: Local
+ *
+ * Queue a VNS_CREDIT grant if the server keeps to them and enough has
+ * been handled since the last.  The grant covers everything handled so
+ * far and a whole receive ring more, so what the server may have sent
+ * and we have not handled always fits in the ring.  tx_lock held.
+ *
+ *---------------------------------------------------------------------------*/
+
+static int sr_vns_tx_credit(struct sr_instance* sr /* borrowed */)
+{
+    c_credit* credit;
+    uint32_t limit = sr->rx_credit_used + SR_VNS_RX_RING;
+
+    if(!sr->vns_credit || limit - sr->rx_credit_limit < SR_VNS_CREDIT_STEP)
+    { return 0; }
+    if(sr_vns_tx_room(sr, sizeof(c_credit)) < 0)
+    { return -1; }
+
+    credit = (c_credit*)(sr->tx_buf + sr->tx_used);
+    credit->mLen = htonl(sizeof(c_credit));
+    credit->mType = htonl(VNS_CREDIT);
+    credit->mLimit = htonl(limit);
+    sr->tx_used += sizeof(c_credit);
+    sr->tx_batch = 0; /* -- frames after it start a batch of their own -- */
+    sr_vns_tx_append(sr, (uint8_t*)credit, sizeof(c_credit), 0, 1);
+
+    sr->rx_credit_limit = limit;
+    sr->rx_grants++;
+    return 0;
+} /* -- sr_vns_tx_credit -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_vns_shm_flush(..)
+ * Scope: Local
+ *
+ * Publish what was written to the transmit ring and wake the server if it
+ * sleeps.  tx_lock held.
+ *
+ *---------------------------------------------------------------------------*/
+
+static int sr_vns_shm_flush(struct sr_instance* sr /* borrowed */)
+{
+    if(sr->shm && sr->shm_tx->head != sr->shm_tx_head)
+    {
+        __sync_synchronize(); /* -- records before head -- */
+        sr->shm_tx->head = sr->shm_tx_head;
+        sr_vns_shm_wake(sr->shm_tx);
+    }
+    return 0;
+} /* -- sr_vns_shm_flush -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_vns_shm_send(..)
+ * Scope: Local
+ *
+ * Copy a frame into the transmit ring; it is published by the next
+ * sr_vns_shm_flush().  If the ring is full, publish and wait for the
+ * server to make room, as a full socket holds up the sender.
+ *
+ *---------------------------------------------------------------------------*/
+
+static int sr_vns_shm_send(struct sr_instance* sr /* borrowed */,
+                           uint8_t* buf /* borrowed */, unsigned int len,
+                           struct sr_if* iface /* borrowed */)
+{
+    uint8_t* data = sr->shm + 2 * sizeof(c_shm_ring) + sr->shm_size;
+    unsigned int total = VNS_PACKETS_ALIGN(sizeof(c_frame_header) + len);
+    uint32_t head, off, skip;
+    c_frame_header* fh;
+    struct pollfd pfd;
+    int ret = -1;
+
+    sr_vns_tx_lock(sr);
 
-        default:
-            Debug("unknown command: %d\n", command);
-            break;
+    if(total > sr->shm_size / 2)
+    { goto out; }
 
-    }/* -- switch -- */
+    for(;;)
+    {
+        head = sr->shm_tx_head;
+        off = head & (sr->shm_size - 1);
+        skip = sr->shm_size - off < total ? sr->shm_size - off : 0;
+        if(head - sr->shm_tx->tail + skip + total <= sr->shm_size)
+        { break; }
+
+        /* -- full: let the server see what is there, and wait -- */
+        sr->shm_full++;
+        sr_vns_shm_flush(sr);
+        pfd.fd = sr->sockfd;
+        pfd.events = 0;
+        pfd.revents = 0;
+        if(poll(&pfd, 1, 1) > 0)
+        {
+            fprintf(stderr, "VNS server went away with the ring full\n");
+            goto out;
+        }
+    }
 
-    if(buf)
-    { free(buf); }
+    if(skip)
+    {
+        /* -- no room before the end: the record goes at the start -- */
+        fh = (c_frame_header*)(data + off);
+        fh->mLen = 0;
+        fh->mIfIndex = 0;
+        fh->mFlags = VNS_FRAME_WRAP;
+        head += skip;
+        off = 0;
+    }
+    fh = (c_frame_header*)(data + off);
+    fh->mLen = htons(len);
+    fh->mIfIndex = iface->ifindex;
+    fh->mFlags = 0;
+    memcpy(data + off + sizeof(c_frame_header), buf, len);
+    memset(data + off + sizeof(c_frame_header) + len, 0,
+           total - sizeof(c_frame_header) - len);
+    sr->shm_tx_head = head + total;
+    sr->tx_frames++;
+    ret = 0;
+
+out:
+    sr_vns_tx_unlock(sr);
     return ret;
-}/* -- sr_read_from_server -- */
+} /* -- sr_vns_shm_send -- */
 
 /*-----------------------------------------------------------------------------
- * Method: sr_ether_addrs_match_interface(..)
- * Scope: Local
+ * Method: sr_send_packet_ifindex(..)
+ * Scope: Global
  *
- * Make sure ethernet addresses are sane so we don't muck uo the system.
+ * Queue a packet (ethernet header included!) of length 'len' for the
+ * server to inject onto the wire of interface 'ifindex'.  The frame the
+ * receive loop is handling is sent in place, its VNS header rewritten in
+ * front of it, if its batch padding stays inside the message it came in
+ * (a VNSPACKET is followed straight by the next message); any other
+ * buffer is copied and may be reused on return.
+ * Queued frames are written at the end of the receive batch or by
+ * sr_vns_flush().
+ * With a backend in sr->io the frame goes to it instead.
  *
- *----------------------------------------------------------------------------*/
+ *---------------------------------------------------------------------------*/
 
-static int
-sr_ether_addrs_match_interface( struct sr_instance* sr, /* borrowed */
-                                uint8_t* buf, /* borrowed */
-                                const char* name /* borrowed */ )
+int sr_send_packet_ifindex(struct sr_instance* sr /* borrowed */,
+                           uint8_t* buf /* borrowed */ ,
+                           unsigned int len,
+                           unsigned int ifindex)
 {
-    struct sr_ethernet_hdr* ether_hdr = 0;
+    unsigned int total_len =  len + (sizeof(c_packet_header));
     struct sr_if* iface = 0;
+    uint8_t* copy;
+    int in_place;
 
-    /* -- REQUIRES -- */
+    /* REQUIRES */
     assert(sr);
     assert(buf);
-    assert(name);
 
-    ether_hdr = (struct sr_ethernet_hdr*)buf;
-    iface = sr_get_interface(sr, name);
+    if((iface = sr_vns_tx_check(sr, buf, len, ifindex)) == 0)
+    { return -1; }
+    if(sr->io)
+    { return sr->io->send(sr, buf, len, ifindex); }
+    if(sr->shm)
+    { return sr_vns_shm_send(sr, buf, len, iface); }
 
-    if ( iface == 0 ){
-        fprintf( stderr, "** Error, interface %s, does not exist\n", name);
-        return 0;
-    }
+    sr_vns_tx_lock(sr);
 
-    if ( memcmp( ether_hdr->ether_shost, iface->addr, ETHER_ADDR_LEN) != 0 ){
-        fprintf( stderr, "** Error, source address does not match interface\n");
-        return 0;
+    in_place = (buf == sr->rx_frame &&
+                (!sr->vns_batch ||
+                 VNS_PACKETS_ALIGN(len) <= sr->rx_frame_room));
+    if(sr_vns_tx_room(sr, in_place ? 0 : total_len) < 0)
+    {
+        sr_vns_tx_unlock(sr);
+        return -1;
     }
 
-    /* TODO */
-    /* Check destination, hardware address.  If it is private (i.e. destined
-     * to a virtual interface) ensure it is going to the correct topology
-     * Note: This check should really be done server side ...
-     */
-
-    return 1;
+    if(in_place)
+    {
+        /* -- its own VNS header is the headroom -- */
+        sr->rx_frame = 0;
+        sr->tx_ring++;
+        sr_vns_tx_frame(sr, buf, len, iface, 0);
+    }
+    else
+    {
+        /* -- a new batch's header goes in the arena first -- */
+        if(sr->vns_batch)
+        {
+            total_len = VNS_PACKETS_ALIGN(sizeof(c_frame_header) + len);
+            sr_vns_tx_batch(sr, total_len);
+            copy = sr->tx_buf + sr->tx_used + sizeof(c_frame_header);
+            sr->tx_used += total_len;
+        }
+        else
+        {
+            copy = sr->tx_buf + sr->tx_used + sizeof(c_packet_header);
+            sr->tx_used += total_len;
+        }
+        memcpy(copy, buf, len);
+        sr_vns_tx_frame(sr, copy, len, iface, 0);
+    }
 
-} /* -- sr_ether_addrs_match_interface -- */
+    sr_vns_tx_unlock(sr);
+    return 0;
+} /* -- sr_send_packet_ifindex -- */
 
 /*-----------------------------------------------------------------------------
- * Method: sr_send_packet(..)
+ * Method: sr_send_pktbuf(..)
  * Scope: Global
  *
- * Send a packet (ethernet header included!) of length 'len' to the server
- * to be injected onto the wire.
+ * Queue the frame in 'pkt' for interface 'ifindex'.  The VNS header goes
+ * in the buffer's headroom and the buffer itself is queued, then freed
+ * once written; the caller gives it up either way.
  *
  *---------------------------------------------------------------------------*/
 
-int sr_send_packet(struct sr_instance* sr /* borrowed */,
-                         uint8_t* buf /* borrowed */ ,
-                         unsigned int len,
-                         const char* iface /* borrowed */)
+int sr_send_pktbuf(struct sr_instance* sr /* borrowed */,
+                   struct sr_pktbuf* pkt /* owned */,
+                   unsigned int ifindex)
 {
-    c_packet_header *sr_pkt;
-    unsigned int total_len =  len + (sizeof(c_packet_header));
+    struct sr_if* iface = 0;
+    int ret;
 
     /* REQUIRES */
     assert(sr);
-    assert(buf);
-    assert(iface);
+    assert(pkt);
 
-    /* don't waste my time ... */
-    if ( len < sizeof(struct sr_ethernet_hdr) ){
-        fprintf(stderr , "** Error: packet is wayy to short \n");
+    if((iface = sr_vns_tx_check(sr, pkt->data, pkt->len, ifindex)) == 0)
+    {
+        sr_pktbuf_free(pkt);
         return -1;
     }
+    if(sr->io || sr->shm)
+    {
+        ret = sr->io ? sr->io->send(sr, pkt->data, pkt->len, ifindex) :
+            sr_vns_shm_send(sr, pkt->data, pkt->len, iface);
+        sr_pktbuf_free(pkt);
+        return ret;
+    }
 
-    /* Create packet */
-    sr_pkt = (c_packet_header *)malloc(len +
-            sizeof(c_packet_header));
-    assert(sr_pkt);
-    sr_pkt->mLen  = htonl(total_len);
-    sr_pkt->mType = htonl(VNSPACKET);
-    strncpy(sr_pkt->mInterfaceName,iface,16);
-    memcpy(((uint8_t*)sr_pkt) + sizeof(c_packet_header),
-            buf,len);
+    /* -- no room for a batched frame's padding: send a copy -- */
+    if(sr->vns_batch && VNS_PACKETS_ALIGN(pkt->len) > pkt->room)
+    {
+        ret = sr_send_packet_ifindex(sr, pkt->data, pkt->len, ifindex);
+        sr_pktbuf_free(pkt);
+        return ret;
+    }
 
-    /* -- log packet -- */
-    sr_log_packet(sr,buf,len);
+    sr_vns_tx_lock(sr);
 
-    if ( ! sr_ether_addrs_match_interface( sr, buf, iface) ){
-        fprintf( stderr, "*** Error: problem with ethernet header, check log\n");
-        free ( sr_pkt );
+    if(sr_vns_tx_room(sr, 0) < 0)
+    {
+        sr_vns_tx_unlock(sr);
+        sr_pktbuf_free(pkt);
         return -1;
     }
 
-    if( write(sr->sockfd, sr_pkt, total_len) < total_len ){
-        fprintf(stderr, "Error writing packet\n");
-        free(sr_pkt);
+    sr_vns_tx_frame(sr, pkt->data, pkt->len, iface, pkt);
+
+    sr_vns_tx_unlock(sr);
+    return 0;
+} /* -- sr_send_pktbuf -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_send_packet(..)
+ * Scope: Global
+ *
+ * As sr_send_packet_ifindex, for an interface given by name.
+ *
+ *---------------------------------------------------------------------------*/
+
+int sr_send_packet(struct sr_instance* sr /* borrowed */,
+                         uint8_t* buf /* borrowed */ ,
+                         unsigned int len,
+                         const char* iface /* borrowed */)
+{
+    struct sr_if* if_rec = 0;
+
+    /* REQUIRES */
+    assert(sr);
+    assert(iface);
+
+    if_rec = sr_get_interface(sr, iface);
+    if ( if_rec == 0 ){
+        fprintf( stderr, "** Error, interface %s, does not exist\n", iface);
         return -1;
     }
 
-    free(sr_pkt);
-
-    return 0;
+    return sr_send_packet_ifindex(sr, buf, len, if_rec->ifindex);
 } /* -- sr_send_packet -- */
 
 /*-----------------------------------------------------------------------------
@@ -644,9 +2289,8 @@ void sr_log_packet(struct sr_instance* sr, uint8_t* buf, int len )
 int  sr_arp_req_not_for_us(struct sr_instance* sr,
                            uint8_t * packet /* lent */,
                            unsigned int len,
-                           char* interface  /* lent */)
+                           struct sr_if* iface /* lent */)
 {
-    struct sr_if* iface = sr_get_interface(sr, interface);
     struct sr_ethernet_hdr* e_hdr = 0;
     struct sr_arp_hdr*       a_hdr = 0;
 
@@ -665,3 +2309,405 @@ int  sr_arp_req_not_for_us(struct sr_instance* sr,
 
     return 0;
 } /* -- sr_arp_req_not_for_us -- */
+
+#ifdef SR_IO_URING
+
+/* -- user_data of each operation the loop submits -- */
+#define SR_URING_RECV    1
+#define SR_URING_SEND    2
+#define SR_URING_TIMEOUT 3
+#define SR_URING_UPDATE  4
+
+static struct
+{
+    struct sr_uring ring;
+    int multishot;                  /* a receive keeps going (Linux 6.0) */
+    int recv_armed;                 /* a receive is in the ring */
+    unsigned int sends;             /* send completions still to come */
+    uint64_t timeout_at;            /* deadline of the armed timeout, or 0 */
+    struct __kernel_timespec ts;
+    struct msghdr msg;              /* the one sendmsg on a stream */
+    struct { uint16_t bid; uint32_t len; } rx[SR_VNS_URING_BUFS];
+    unsigned int rx_first;          /* received, not yet in the ring: FIFO */
+    unsigned int rx_count;
+    unsigned long timeouts;
+} vu;
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_vns_uring_open(..)
+ * Scope: Global
+ *
+ * Set up the io_uring sr_vns_uring_run() works on.  Called before
+ * sr_connect_to_server(), which then does not ask for shared memory, and
+ * sr_init(), which then starts no ARP thread.
+ *
+ * RETURN VALUES:
+ *
+ *  0 on success, -1 with errno set if the kernel lacks io_uring or any
+ *  of the operations the loop uses
+ *
+ *---------------------------------------------------------------------------*/
+
+int sr_vns_uring_open(struct sr_instance* sr /* borrowed */)
+{
+    /* REQUIRES */
+    assert(sr);
+
+    memset(&vu, 0, sizeof(vu));
+    if(sr_uring_init(&(vu.ring), SR_VNS_URING_BUFS, SR_VNS_MAX_MSG) != 0)
+    { return -1; }
+    vu.multishot = 1;
+    sr->uring = &(vu.ring);
+    return 0;
+} /* -- sr_vns_uring_open -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_vns_uring_recv(..)
+ * Scope: Local
+ *
+ * Arm a receive on the socket into the provided buffers.  A multishot one
+ * stays armed until they run out.
+ *
+ *---------------------------------------------------------------------------*/
+
+static void sr_vns_uring_recv(struct sr_instance* sr /* borrowed */)
+{
+    struct io_uring_sqe* sqe = sr_uring_sqe(&(vu.ring));
+
+    if(sqe == 0)
+    { return; } /* -- the next round tries again -- */
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = sr->sockfd;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = SR_URING_BGID;
+    sqe->ioprio = vu.multishot ? IORING_RECV_MULTISHOT : 0;
+    sqe->user_data = SR_URING_RECV;
+    vu.recv_armed = 1;
+} /* -- sr_vns_uring_recv -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_vns_uring_timer(..)
+ * Scope: Local
+ *
+ * See that a timeout wakes the loop by 'next' (sr_timer_now() ms, 0 for
+ * never).  An armed timeout that is due later is moved up; one due
+ * earlier is left alone, since a round with nothing due costs little.
+ *
+ *---------------------------------------------------------------------------*/
+
+static void sr_vns_uring_timer(uint64_t next)
+{
+    struct io_uring_sqe* sqe;
+
+    if(next == 0 || (vu.timeout_at && vu.timeout_at <= next))
+    { return; }
+    if((sqe = sr_uring_sqe(&(vu.ring))) == 0)
+    { return; }
+
+    /* -- both clocks are CLOCK_MONOTONIC -- */
+    vu.ts.tv_sec = next / 1000;
+    vu.ts.tv_nsec = (next % 1000) * 1000000;
+    if(vu.timeout_at)
+    {
+        sqe->opcode = IORING_OP_TIMEOUT_REMOVE;
+        sqe->addr = SR_URING_TIMEOUT;
+        sqe->addr2 = (unsigned long)&(vu.ts);
+        sqe->timeout_flags = IORING_TIMEOUT_UPDATE | IORING_TIMEOUT_ABS;
+        sqe->user_data = SR_URING_UPDATE;
+    }
+    else
+    {
+        sqe->opcode = IORING_OP_TIMEOUT;
+        sqe->addr = (unsigned long)&(vu.ts);
+        sqe->len = 1;
+        sqe->timeout_flags = IORING_TIMEOUT_ABS;
+        sqe->user_data = SR_URING_TIMEOUT;
+    }
+    vu.timeout_at = next;
+} /* -- sr_vns_uring_timer -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_vns_uring_send(..)
+ * Scope: Local
+ *
+ * Submit the transmit queue: one sendmsg on a stream, or one per record on
+ * a SEQPACKET socket, linked so they go out in order, as many as the
+ * submission queue has room for besides a receive and a timeout.  The
+ * queue is left alone until every one of them completes.  tx_lock held.
+ *
+ *---------------------------------------------------------------------------*/
+
+static void sr_vns_uring_send(struct sr_instance* sr /* borrowed */)
+{
+    struct io_uring_sqe* sqe = 0;
+    struct msghdr* msg;
+    unsigned int i, j, room = sr_uring_sq_space(&(vu.ring));
+
+    /* -- a batch being written can take no more frames -- */
+    sr->tx_batch = 0;
+
+    room = room > 2 ? room - 2 : 0;
+    for(i = sr->tx_first; i < sr->tx_niov && vu.sends < room; i = j)
+    {
+        if(sr->seqpacket)
+        {
+            for(j = i + 1; j < sr->tx_niov && !sr->tx_start[j]; j++)
+                ;
+            msg = &(sr->tx_msgs[vu.sends].msg_hdr);
+        }
+        else
+        {
+            j = sr->tx_niov;
+            msg = &(vu.msg);
+        }
+        memset(msg, 0, sizeof(*msg));
+        msg->msg_iov = &(sr->tx_iov[i]);
+        msg->msg_iovlen = j - i;
+
+        sqe = sr_uring_sqe(&(vu.ring));
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->fd = sr->sockfd;
+        sqe->addr = (unsigned long)msg;
+        sqe->msg_flags = MSG_WAITALL;
+        sqe->flags = IOSQE_IO_LINK;
+        sqe->user_data = SR_URING_SEND;
+        vu.sends++;
+    }
+    if(sqe)
+    { sqe->flags = 0; } /* -- the last ends the chain -- */
+} /* -- sr_vns_uring_send -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_vns_uring_rx(..)
+ * Scope: Local
+ *
+ * Copy received buffers to the receive ring and hand them back, as many
+ * as fit.  With no send in flight, so the ring may be compacted.  A
+ * record too short to hold a message header is dropped and counted
+ * (rx_short), as sr_vns_rx_records() does.
+ *
+ * RETURN VALUES:
+ *
+ *  1 on success, -1 on error
+ *
+ *---------------------------------------------------------------------------*/
+
+static int sr_vns_uring_rx(struct sr_instance* sr /* borrowed */)
+{
+    unsigned int bid, len;
+    uint8_t* buf;
+    uint32_t mlen;
+
+    while(vu.rx_count)
+    {
+        bid = vu.rx[vu.rx_first].bid;
+        len = vu.rx[vu.rx_first].len;
+        buf = sr_uring_buf(&(vu.ring), bid);
+
+        if(sr->rx_buf == 0 || SR_VNS_RX_RING - sr->rx_tail < len)
+        {
+            if(sr_vns_rx_room(sr) < 0)
+            { return -1; }
+            if(SR_VNS_RX_RING - sr->rx_tail < len)
+            { break; }
+        }
+        if(sr->seqpacket)
+        {
+            if(len < 8)
+            { /* -- a close comes as res == 0, this is malformed -- */
+                sr->rx_short++;
+                sr_uring_buf_recycle(&(vu.ring), bid);
+                vu.rx_first = (vu.rx_first + 1) % SR_VNS_URING_BUFS;
+                vu.rx_count--;
+                continue;
+            }
+            memcpy(&mlen, buf, 4);
+            if(ntohl(mlen) != len)
+            {
+                fprintf(stderr,"Error: VNS record of %u bytes holds a message "
+                        "of %u\n", len, ntohl(mlen));
+                return -1;
+            }
+        }
+        memcpy(sr->rx_buf + sr->rx_tail, buf, len);
+        sr->rx_tail += len;
+
+        sr_uring_buf_recycle(&(vu.ring), bid);
+        vu.rx_first = (vu.rx_first + 1) % SR_VNS_URING_BUFS;
+        vu.rx_count--;
+    }
+    return 1;
+} /* -- sr_vns_uring_rx -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_vns_uring_complete(..)
+ * Scope: Local
+ *
+ * Take one completion.
+ *
+ * RETURN VALUES:
+ *
+ *  1 on success, -1 on error or if the server closed the connection
+ *
+ *---------------------------------------------------------------------------*/
+
+static int sr_vns_uring_complete(struct sr_instance* sr /* borrowed */,
+                                 struct io_uring_cqe* cqe /* borrowed */)
+{
+    int res = cqe->res;
+    unsigned int i;
+
+    switch(cqe->user_data)
+    {
+        case SR_URING_RECV:
+            if(!(cqe->flags & IORING_CQE_F_MORE))
+            { vu.recv_armed = 0; }
+            if(res > 0)
+            {
+                assert(cqe->flags & IORING_CQE_F_BUFFER);
+                i = (vu.rx_first + vu.rx_count++) % SR_VNS_URING_BUFS;
+                vu.rx[i].bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+                vu.rx[i].len = res;
+                sr->rx_reads++;
+            }
+            else if(res == 0)
+            {
+                fprintf(stderr,"VNS server closed the connection.\n");
+                return -1;
+            }
+            else if(res == -EINVAL && vu.multishot)
+            { vu.multishot = 0; } /* -- one receive per completion then -- */
+            else if(res != -ENOBUFS && res != -EINTR)
+            {
+                errno = -res;
+                perror("recv(..):sr_vns_comm.c::sr_vns_uring_complete");
+                return -1;
+            }
+            break;
+
+        case SR_URING_SEND:
+            vu.sends--;
+            if(res < 0 && res != -ECANCELED && res != -EINTR)
+            {
+                errno = -res;
+                perror("sendmsg(..):sr_vns_comm.c::sr_vns_uring_complete");
+                return -1;
+            }
+            sr_vns_tx_lock(sr);
+            if(res > 0)
+            {
+                sr->tx_writes++;
+                sr_vns_tx_done(sr, res);
+            }
+            if(vu.sends == 0 && sr->tx_first == sr->tx_niov)
+            {
+                sr->tx_first = sr->tx_niov = 0;
+                sr->tx_used = 0;
+                sr->tx_ring = 0;
+            }
+            sr_vns_tx_unlock(sr);
+            break;
+
+        case SR_URING_TIMEOUT:
+            vu.timeout_at = 0;
+            vu.timeouts++;
+            break;
+
+        default: /* -- SR_URING_UPDATE: the timeout completes on its own -- */
+            break;
+    }
+    return 1;
+} /* -- sr_vns_uring_complete -- */
+
+/*-----------------------------------------------------------------------------
+ * Method: sr_vns_uring_run(..)
+ * Scope: Global
+ *
+ * sr_read_from_server() and the ARP thread in one loop on the io_uring
+ * sr_vns_uring_open() set up.  Each round, with no send in flight, takes
+ * what was received, handles every complete message, runs the ARP timers
+ * that are due and submits what all of that queued; then one
+ * io_uring_enter() submits it with any receive or timeout to re-arm, and
+ * waits.  Prints what the ring did and closes it when the session ends.
+ *
+ * RETURN VALUES:
+ *
+ *  0 if the server closed the session, -1 on error
+ *
+ *---------------------------------------------------------------------------*/
+
+int sr_vns_uring_run(struct sr_instance* sr /* borrowed */)
+{
+    struct io_uring_cqe* cqe;
+    uint8_t* msg;
+    uint64_t next;
+    int len, ret;
+
+    /* REQUIRES */
+    assert(sr);
+    assert(sr->uring == &(vu.ring));
+
+    for(;;)
+    {
+        if(vu.sends == 0)
+        {
+            /* -- what came in, then every complete message in it -- */
+            if((ret = sr_vns_uring_rx(sr)) != 1)
+            { goto out; }
+            while((ret = sr_vns_rx_next(sr, &msg, &len)) == 1)
+            {
+                if((ret = sr_vns_dispatch(sr, msg, len, 0)) != 1)
+                { goto out; }
+                sr->rx_credit_used += len;
+
+                /* -- backpressure: no more input until this is written -- */
+                if(sr_vns_tx_pending(sr) > SR_VNS_TX_HIWAT)
+                { break; }
+            }
+            if(ret < 0)
+            { goto out; }
+
+            /* -- the ARP thread's work, then write the round's output
+                  and more credit -- */
+            next = sr_arpcache_run_timers(sr);
+            sr_vns_tx_lock(sr);
+            ret = sr_vns_tx_credit(sr);
+            if(ret == 0 && sr->tx_first < sr->tx_niov)
+            { sr_vns_uring_send(sr); }
+            sr_vns_tx_unlock(sr);
+            if(ret < 0)
+            { goto out; }
+
+            if(!vu.recv_armed && vu.rx_count == 0)
+            { sr_vns_uring_recv(sr); }
+            sr_vns_uring_timer(next);
+        }
+
+        /* -- buffers left over and nothing to wait for: next round -- */
+        if(sr_uring_enter(&(vu.ring),
+                          vu.sends == 0 && vu.rx_count ? 0 : 1) != 0 &&
+           errno != EINTR && errno != ETIME && errno != EBUSY)
+        {
+            perror("io_uring_enter(..):sr_vns_comm.c::sr_vns_uring_run");
+            ret = -1;
+            goto out;
+        }
+        while((cqe = sr_uring_cqe(&(vu.ring))) != 0)
+        {
+            ret = sr_vns_uring_complete(sr, cqe);
+            sr_uring_cqe_seen(&(vu.ring));
+            if(ret < 0)
+            { goto out; }
+        }
+    }
+
+out:
+    fprintf(stderr, "VNS io_uring: %lu enters, %lu submissions, "
+            "%lu completions, %lu timeouts\n", vu.ring.enters,
+            vu.ring.submitted, vu.ring.completed, vu.timeouts);
+    sr_uring_exit(&(vu.ring));
+    sr->uring = 0;
+    return ret == 0 ? 0 : -1;
+} /* -- sr_vns_uring_run -- */
+
+#endif /* SR_IO_URING */
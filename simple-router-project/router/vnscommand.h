@@ -40,7 +40,7 @@ typedef struct
     uint32_t mLen;
     uint32_t mType;        /* = VNSOPEN */
     uint16_t topoID;       /* Id of the topology we want to run on */
-    uint16_t pad;          /* unused */
+    uint16_t flags;        /* VNS_OPEN_*; was padding, old servers ignore it */
     char     mVirtualHostID[IDSIZE]; /* Id of the simulated router (e.g.
                                         'VNS-A'); */
     char     mUID[IDSIZE]; /* User id (e.g. "appenz"), for information only */
@@ -109,6 +109,97 @@ typedef struct
     char     mInterfaceName[16];
 }__attribute__ ((__packed__)) c_packet_header;
 
+/*-----------------------------------------------------------------------------
+                               PACKETS (batch)
+
+   Several frames in one message: the base header, then per frame a
+   c_frame_header, its timestamp if VNS_FRAME_TIMESTAMP is set, and the
+   frame, padded to VNS_PACKETS_ALIGN.  The interface is given by its
+   place in VNSHWINFO, from 0.  A client that takes batches says so with
+   VNS_OPEN_PACKETS; a server that agrees sends a VNS_PACKETS message (an
+   empty one will do) before VNSHWINFO, and from then on either side may
+   send them.  Nobody else ever sees one.
+  ---------------------------------------------------------------------------*/
+
+#define VNS_PACKETS         1024
+#define VNS_OPEN_PACKETS    0x0001 /* c_open.flags */
+#define VNS_FRAME_TIMESTAMP 0x01   /* c_frame_header.mFlags */
+
+#define VNS_PACKETS_ALIGN(n) (((n) + 3) & ~3)
+
+typedef struct
+{
+    uint16_t mLen;      /* frame bytes */
+    uint8_t  mIfIndex;  /* interface, by its place in VNSHWINFO */
+    uint8_t  mFlags;    /* VNS_FRAME_* */
+    /* uint64_t timestamp, ns since the epoch, if VNS_FRAME_TIMESTAMP */
+}__attribute__ ((__packed__)) c_frame_header;
+
+/*-----------------------------------------------------------------------------
+                               CREDIT
+
+   Receive credit: the server sends a client that asked with
+   VNS_OPEN_CREDIT nothing past mLimit, a count of message bytes (mod
+   2^32) from the server's own VNS_CREDIT on, that one included.  The
+   server sends that one, mLimit unused, before VNSHWINFO to say it
+   agrees; until the first grant only it and VNSHWINFO may be sent.
+  ---------------------------------------------------------------------------*/
+
+#define VNS_CREDIT          2048
+#define VNS_OPEN_CREDIT     0x0002 /* c_open.flags */
+
+typedef struct
+{
+    uint32_t mLen;
+    uint32_t mType;     /* = VNS_CREDIT */
+    uint32_t mLimit;
+}__attribute__ ((__packed__)) c_credit;
+
+/*-----------------------------------------------------------------------------
+                               SHM
+
+   Frames through shared memory instead of the socket, for a client and
+   server on one host.  A client that can map a file says so with
+   VNS_OPEN_SHM; a server that agrees creates a file of two rings, the
+   first to the client and the second from it, each a c_shm_ring and
+   mSize bytes of records, and sends its path in a VNS_SHM message before
+   VNSHWINFO.  From then on frames go through the rings only; every other
+   message still goes through the socket, and the server wakes the
+   client's ring after sending one.
+
+   A record is a c_frame_header (mLen in network order, as in a batch)
+   and the frame, padded to VNS_PACKETS_ALIGN, and is never split: one
+   that does not fit before the end of the ring is put at its start,
+   with a header flagged VNS_FRAME_WRAP left in its place.  head and tail
+   count bytes, free running, and are only written by the producer and
+   the consumer respectively.  A consumer about to sleep sets 'sleeping',
+   reads head again and waits on 'wake' with FUTEX_WAIT; a producer that
+   sees 'sleeping' after moving head bumps 'wake' and FUTEX_WAKEs it.
+  ---------------------------------------------------------------------------*/
+
+#define VNS_SHM             4096
+#define VNS_OPEN_SHM        0x0004 /* c_open.flags */
+#define VNS_FRAME_WRAP      0x80   /* c_frame_header.mFlags, in a ring */
+
+typedef struct
+{
+    uint32_t mLen;
+    uint32_t mType;     /* = VNS_SHM */
+    uint32_t mSize;     /* record bytes per ring, a power of two */
+    char     mPath[108];
+}__attribute__ ((__packed__)) c_shm;
+
+typedef struct c_shm_ring
+{
+    volatile uint32_t head;     /* bytes written, by the producer */
+    uint8_t  pad0[60];
+    volatile uint32_t tail;     /* bytes read, by the consumer */
+    uint8_t  pad1[60];
+    volatile uint32_t wake;     /* futex word */
+    volatile uint32_t sleeping; /* the consumer may be waiting on it */
+    uint8_t  pad2[56];
+}c_shm_ring; /* 192 bytes, then the records */
+
 /*-----------------------------------------------------------------------------
                                HWInfo 
   ----------------------------------------------------------------------------*/